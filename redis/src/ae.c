@@ -18,6 +18,7 @@ aeEventLoop *aeCreateEventLoop(void) {
     eventLoop->timeEventHead = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = false;
+    eventLoop->beforesleep = NULL;
     return eventLoop;
 }
 
@@ -362,10 +363,17 @@ int aeWait(int fd, int mask, long long milliseconds) {
 void aeMain(aeEventLoop *eventLoop) {
     eventLoop->stop = false;
     while (!eventLoop->stop) {
+        if (eventLoop->beforesleep != NULL) {
+            eventLoop->beforesleep(eventLoop);
+        }
         aeProcessEvents(eventLoop, AE_ALL_EVENTS);
     }
 }
 
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
+}
+
 /************************ for test ************************/
 static count = 0;
 void aeFileProcString(aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
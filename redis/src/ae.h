@@ -12,6 +12,7 @@ struct aeEventLoop;
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void *aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
 typedef struct aeFileEvent {
     int fd;
@@ -38,6 +39,7 @@ typedef struct aeEventLoop {
     aeTimeEvent *timeEventHead;
     // bool 本质上是一个 unsigned int, 在 redis 的代码中的类型是 int
     bool stop;
+    aeBeforeSleepProc *beforesleep; // 每次等待事件之前调用
 } aeEventLoop;
 
 
@@ -99,4 +101,9 @@ int aeWait(int fd, int mask, long long milliseconds);
  */
 void aeMain(aeEventLoop *eventLoop);
 
+/**
+ * 设置每轮事件循环等待事件之前调用的函数, 比如把这一轮积累的数据一次性写入文件
+ */
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+
 #endif
\ No newline at end of file
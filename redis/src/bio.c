@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "adlist.h"
+#include "zmalloc.h"
+#include "bio.h"
+
+#define BIO_THREAD_STACK_SIZE (1024 * 1024 * 4)
+
+typedef struct bioJob {
+    bioJobProc *proc;
+    void *arg1;
+    void *arg2;
+} bioJob;
+
+static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
+static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
+static list *bio_jobs[BIO_NUM_OPS];
+/** 受 bio_mutex 保护, 任务执行完之后才减一 */
+static unsigned long long bio_pending[BIO_NUM_OPS];
+
+static void *bioProcessBackgroundJobs(void *arg) {
+    int type = (int) (long) arg;
+    pthread_mutex_lock(&bio_mutex[type]);
+    while (1) {
+        if (listLength(bio_jobs[type]) == 0) {
+            pthread_cond_wait(&bio_newjob_cond[type], &bio_mutex[type]);
+            continue;
+        }
+        listNode *ln = listFirst(bio_jobs[type]);
+        bioJob *job = listNodeValue(ln);
+        listDelNode(bio_jobs[type], ln);
+
+        // 执行任务的时候不持有锁, 主线程可以继续提交任务
+        pthread_mutex_unlock(&bio_mutex[type]);
+        job->proc(job->arg1, job->arg2);
+        zfree(job);
+
+        pthread_mutex_lock(&bio_mutex[type]);
+        bio_pending[type]--;
+    }
+    return NULL;
+}
+
+void bioInit(void) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    size_t stacksize;
+    pthread_attr_getstacksize(&attr, &stacksize);
+    if (stacksize < BIO_THREAD_STACK_SIZE) {
+        stacksize = BIO_THREAD_STACK_SIZE;
+    }
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    for (int j = 0; j < BIO_NUM_OPS; j++) {
+        pthread_mutex_init(&bio_mutex[j], NULL);
+        pthread_cond_init(&bio_newjob_cond[j], NULL);
+        bio_jobs[j] = listCreate();
+        bio_pending[j] = 0;
+        if (bio_jobs[j] == NULL || pthread_create(&bio_threads[j], &attr, bioProcessBackgroundJobs, (void *) (long) j) != 0) {
+            fprintf(stderr, "Fatal: Can't initialize Background Jobs.\n");
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void bioCreateBackgroundJob(int type, bioJobProc *proc, void *arg1, void *arg2) {
+    bioJob *job = zmalloc(sizeof(*job));
+    if (job == NULL) {
+        fprintf(stderr, "bioCreateBackgroundJob: Out Of Memory\n");
+        abort();
+    }
+    job->proc = proc;
+    job->arg1 = arg1;
+    job->arg2 = arg2;
+
+    pthread_mutex_lock(&bio_mutex[type]);
+    if (listAddNodeTail(bio_jobs[type], job) == NULL) {
+        fprintf(stderr, "bioCreateBackgroundJob: Out Of Memory\n");
+        abort();
+    }
+    bio_pending[type]++;
+    pthread_cond_signal(&bio_newjob_cond[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
+unsigned long long bioPendingJobsOfType(int type) {
+    pthread_mutex_lock(&bio_mutex[type]);
+    unsigned long long val = bio_pending[type];
+    pthread_mutex_unlock(&bio_mutex[type]);
+    return val;
+}
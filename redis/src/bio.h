@@ -0,0 +1,31 @@
+#ifndef _BIO_H_
+#define _BIO_H_
+
+/**
+ * bio: background I/O. 把会阻塞事件循环的操作(释放大对象, fsync 等)交给后台线程执行.
+ * 每种任务一个线程, 同一种任务按提交的顺序执行
+ */
+
+/** 任务类型 */
+#define BIO_LAZY_FREE 0
+#define BIO_AOF_FSYNC 1
+#define BIO_NUM_OPS   2
+
+/**
+ * 任务在后台线程中执行, 不能访问 server 的任何状态
+ */
+typedef void bioJobProc(void *arg1, void *arg2);
+
+/**
+ * 创建所有的后台线程, 失败直接退出
+ */
+void bioInit(void);
+
+void bioCreateBackgroundJob(int type, bioJobProc *proc, void *arg1, void *arg2);
+
+/**
+ * 还没执行完的任务数, 包括正在执行的
+ */
+unsigned long long bioPendingJobsOfType(int type);
+
+#endif
@@ -0,0 +1,46 @@
+#include "crc64.h"
+
+/** 反射后的多项式 */
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL
+
+/**
+ * crc64Table[0] 是普通的逐字节查找表,
+ * crc64Table[k][b] 是字节 b 后面再跟 k 个 0 字节时的 crc
+ */
+static uint64_t crc64Table[8][256];
+
+void crc64Init(void) {
+    for (int b = 0; b < 256; b++) {
+        uint64_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        }
+        crc64Table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        uint64_t crc = crc64Table[0][b];
+        for (int k = 1; k < 8; k++) {
+            crc = crc64Table[0][crc & 0xff] ^ (crc >> 8);
+            crc64Table[k][b] = crc;
+        }
+    }
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, size_t len) {
+    // 按小端把 8 个字节合成一个整数, 和逐字节处理的结果一致
+    while (len >= 8) {
+        uint64_t v = (uint64_t) s[0] | ((uint64_t) s[1] << 8) | ((uint64_t) s[2] << 16) | ((uint64_t) s[3] << 24) |
+                     ((uint64_t) s[4] << 32) | ((uint64_t) s[5] << 40) | ((uint64_t) s[6] << 48) |
+                     ((uint64_t) s[7] << 56);
+        crc ^= v;
+        crc = crc64Table[7][crc & 0xff] ^ crc64Table[6][(crc >> 8) & 0xff] ^ crc64Table[5][(crc >> 16) & 0xff] ^
+              crc64Table[4][(crc >> 24) & 0xff] ^ crc64Table[3][(crc >> 32) & 0xff] ^
+              crc64Table[2][(crc >> 40) & 0xff] ^ crc64Table[1][(crc >> 48) & 0xff] ^ crc64Table[0][crc >> 56];
+        s += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc64Table[0][(crc ^ *s++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
@@ -0,0 +1,20 @@
+#ifndef _CRC64_H_
+#define _CRC64_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CRC-64/Jones (反射, poly 0xad93d23594c935a9), 用来校验 RDB 文件.
+ * slice-by-8: 每次查 8 张表处理 8 个字节, 比逐字节查表快几倍
+ *
+ * 可以增量计算: crc = crc64(crc64(0, a, alen), b, blen) 等于整段一起算的结果
+ */
+/**
+ * 生成查找表, 使用 crc64 之前调用一次
+ */
+void crc64Init(void);
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, size_t len);
+
+#endif
@@ -31,6 +31,9 @@ static void _dictFree(void *ptr) {
     zfree(ptr);
 }
 
+static bool dict_can_resize = true;
+static unsigned int dict_force_resize_ratio = 5;
+
 /* ----------------------- private prototypes ---------------- */
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned int _dictNextPower(unsigned int size);
@@ -278,7 +281,7 @@ dictEntry *dictNext(dictIterator *it) {
     while (true) {
         if (it->entry == NULL) {
             it->index++;
-            if (it->index >= (signed) it->ht->sizemask) {
+            if (it->index >= (signed) it->ht->size) {
                 break;
             }
             it->entry = it->ht->table[it->index];
@@ -300,7 +303,8 @@ void dictReleaseIterator(dictIterator *it) {
 }
 
 dictEntry *dictGetRandomKey(dict *ht) {
-    if (ht->size == 0) {
+    // 删空之后 size 不会变小, 必须用 used 判断, 否则下面会一直找不到非空的 slot
+    if (ht->used == 0) {
         return NULL;
     }
     dictEntry *entry;
@@ -330,6 +334,63 @@ void dictEmpty(dict *ht) {
     _dictClear(ht);
 }
 
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v);
+    unsigned long mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+unsigned long dictScan(dict *ht, unsigned long cursor, dictScanFunction *fn, void *privdata) {
+    if (ht->used == 0) {
+        return 0;
+    }
+    unsigned long mask = ht->sizemask;
+    dictEntry *de = ht->table[cursor & mask];
+    while (de != NULL) {
+        dictEntry *next = de->next;
+        fn(privdata, de);
+        de = next;
+    }
+
+    // 把不属于 mask 的高位全部置 1, 反转之后加一就是对高位加一
+    cursor |= ~mask;
+    cursor = rev(cursor);
+    cursor++;
+    cursor = rev(cursor);
+    return cursor;
+}
+
+unsigned int dictDefragScan(dict *ht, unsigned int cursor, dictDefragAllocFunction *allocfn,
+                            dictDefragEntryFunction *entryfn, void *privdata) {
+    if (cursor >= ht->size) {
+        return 0;
+    }
+    if (cursor == 0) {
+        dictEntry **newtable = allocfn(ht->table);
+        if (newtable != NULL) {
+            ht->table = newtable;
+        }
+    }
+
+    // prev 指向上一个 entry 的 next 字段(或者 bucket 本身), entry 挪动之后通过它修正链表
+    dictEntry **prev = &ht->table[cursor];
+    while (*prev != NULL) {
+        dictEntry *newde = allocfn(*prev);
+        if (newde != NULL) {
+            *prev = newde;
+        }
+        if (entryfn != NULL) {
+            entryfn(privdata, *prev);
+        }
+        prev = &(*prev)->next;
+    }
+    return cursor + 1 < ht->size ? cursor + 1 : 0;
+}
+
 
 /* ----------------------- private functions ----------------------- */
 
@@ -341,12 +402,20 @@ static int _dictExpandIfNeeded(dict *ht) {
         return dictExpand(ht, DICT_HT_INITIAL_SIZE);
     }
 
-    if (ht->used == ht->size) {
-        return dictExpand(ht, ht->size * 2);
+    if (ht->used >= ht->size && (dict_can_resize || ht->used / ht->size > dict_force_resize_ratio)) {
+        return dictExpand(ht, ht->used * 2);
     }
     return DICT_OK;
 }
 
+void dictEnableResize(void) {
+    dict_can_resize = true;
+}
+
+void dictDisableResize(void) {
+    dict_can_resize = false;
+}
+
 static unsigned int _dictNextPower(unsigned int size) {
     if (size >= 2147483648U) {
         return 2147483648U;
@@ -133,6 +133,36 @@ dictEntry * dictFind(dict *ht, const void *key);
  */
 int dictResize(dict *ht);
 
+/**
+ * 有子进程(BGSAVE)时禁止扩容: 扩容会改写所有 entry 的 next 指针, 子进程共享的内存页几乎全部被复制.
+ * 禁止期间负载因子超过 5 时仍然会扩容, 避免链表太长
+ */
+void dictEnableResize(void);
+void dictDisableResize(void);
+
+typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
+
+/**
+ * 增量遍历: 每次调用对一个 bucket 上的所有 entry 调用 fn, 返回下一次调用的 cursor, 返回 0 表示遍历完了.
+ * cursor 从高位开始加一(反转二进制位, 加一, 再反转回来), 两次调用之间 table 扩容或者缩容,
+ * 遍历开始时就存在且一直没被删除的 entry 也不会被漏掉, 但是可能会被返回多次
+ */
+unsigned long dictScan(dict *ht, unsigned long cursor, dictScanFunction *fn, void *privdata);
+
+/**
+ * 碎片整理时挪动一块内存, 返回新的地址, 不需要挪动时返回 NULL, 旧的地址已经被释放
+ */
+typedef void *(dictDefragAllocFunction)(void *ptr);
+typedef void (dictDefragEntryFunction)(void *privdata, dictEntry *de);
+
+/**
+ * 碎片整理: 用 allocfn 挪动第 cursor 个 bucket 上的 dictEntry 并修正链表, 再对每个 entry 调用 entryfn 挪动 key 和 value.
+ * cursor 为 0 时顺便挪动 bucket 数组. 两次调用之间 table 被 resize 的话, 有的 entry 会被跳过, 不影响正确性
+ * @return 下一次调用的 cursor, 0 表示遍历完了
+ */
+unsigned int dictDefragScan(dict *ht, unsigned int cursor, dictDefragAllocFunction *allocfn,
+                            dictDefragEntryFunction *entryfn, void *privdata);
+
 /** Iterator */
 dictIterator *dictGetIterator(dict *ht);
 dictEntry *dictNext(dictIterator *iter);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "zmalloc.h"
+#include "intset.h"
+
+/**
+ * encoding 直接用元素的字节数表示, 数值越大能表示的范围越大, 升级只需要比较大小
+ */
+#define INTSET_ENC_INT16 (sizeof(int16_t))
+#define INTSET_ENC_INT32 (sizeof(int32_t))
+#define INTSET_ENC_INT64 (sizeof(int64_t))
+
+/**
+ * 能存放 v 的最小宽度
+ */
+static uint8_t _intsetValueEncoding(int64_t v) {
+    if (v < INT32_MIN || v > INT32_MAX) {
+        return INTSET_ENC_INT64;
+    } else if (v < INT16_MIN || v > INT16_MAX) {
+        return INTSET_ENC_INT32;
+    }
+    return INTSET_ENC_INT16;
+}
+
+/**
+ * 按指定的宽度读取第 pos 个元素, 升级时需要按旧的宽度读
+ */
+static int64_t _intsetGetEncoded(intset *is, int pos, uint8_t enc) {
+    if (enc == INTSET_ENC_INT64) {
+        int64_t v64;
+        memcpy(&v64, ((int64_t *) is->contents) + pos, sizeof(v64));
+        return v64;
+    } else if (enc == INTSET_ENC_INT32) {
+        int32_t v32;
+        memcpy(&v32, ((int32_t *) is->contents) + pos, sizeof(v32));
+        return v32;
+    }
+    int16_t v16;
+    memcpy(&v16, ((int16_t *) is->contents) + pos, sizeof(v16));
+    return v16;
+}
+
+static int64_t _intsetGet(intset *is, int pos) {
+    return _intsetGetEncoded(is, pos, is->encoding);
+}
+
+static void _intsetSet(intset *is, int pos, int64_t value) {
+    uint32_t enc = is->encoding;
+    if (enc == INTSET_ENC_INT64) {
+        ((int64_t *) is->contents)[pos] = value;
+    } else if (enc == INTSET_ENC_INT32) {
+        ((int32_t *) is->contents)[pos] = value;
+    } else {
+        ((int16_t *) is->contents)[pos] = value;
+    }
+}
+
+intset *intsetNew(void) {
+    intset *is = zmalloc(sizeof(*is));
+    if (is == NULL) {
+        return NULL;
+    }
+    is->encoding = INTSET_ENC_INT16;
+    is->length = 0;
+    return is;
+}
+
+static intset *intsetResize(intset *is, uint32_t len) {
+    size_t size = (size_t) len * is->encoding;
+    return zrealloc(is, sizeof(*is) + size);
+}
+
+/**
+ * 二分查找 value.
+ * 找到时返回 true, *pos 是它的下标; 否则 *pos 是 value 应该插入的位置
+ */
+static bool intsetSearch(intset *is, int64_t value, uint32_t *pos) {
+    if (is->length == 0) {
+        if (pos) {
+            *pos = 0;
+        }
+        return false;
+    }
+
+    // 落在两端之外的值不需要二分, 追加到尾部是最常见的情况
+    if (value > _intsetGet(is, is->length - 1)) {
+        if (pos) {
+            *pos = is->length;
+        }
+        return false;
+    } else if (value < _intsetGet(is, 0)) {
+        if (pos) {
+            *pos = 0;
+        }
+        return false;
+    }
+
+    int min = 0, max = is->length - 1, mid = -1;
+    int64_t cur = -1;
+    while (max >= min) {
+        mid = ((unsigned int) min + (unsigned int) max) >> 1;
+        cur = _intsetGet(is, mid);
+        if (value > cur) {
+            min = mid + 1;
+        } else if (value < cur) {
+            max = mid - 1;
+        } else {
+            break;
+        }
+    }
+
+    if (value == cur) {
+        if (pos) {
+            *pos = mid;
+        }
+        return true;
+    }
+    if (pos) {
+        *pos = min;
+    }
+    return false;
+}
+
+/**
+ * 升级到 value 的宽度并加入 value.
+ * 需要升级说明 value 超出了当前所有元素的范围, 所以它一定在头部(负数)或尾部(正数)
+ */
+static intset *intsetUpgradeAndAdd(intset *is, int64_t value) {
+    uint8_t curenc = is->encoding;
+    uint8_t newenc = _intsetValueEncoding(value);
+    int length = is->length;
+    int prepend = value < 0 ? 1 : 0;
+
+    is->encoding = newenc;
+    is = intsetResize(is, is->length + 1);
+    if (is == NULL) {
+        return NULL;
+    }
+
+    // 从后往前搬, 新宽度更大, 不会覆盖还没读取的元素
+    while (length--) {
+        _intsetSet(is, length + prepend, _intsetGetEncoded(is, length, curenc));
+    }
+
+    if (prepend) {
+        _intsetSet(is, 0, value);
+    } else {
+        _intsetSet(is, is->length, value);
+    }
+    is->length++;
+    return is;
+}
+
+/**
+ * 把 from 开始到结尾的元素移动到 to 的位置
+ */
+static void intsetMoveTail(intset *is, uint32_t from, uint32_t to) {
+    uint32_t bytes = (is->length - from) * is->encoding;
+    void *src = is->contents + (size_t) from * is->encoding;
+    void *dst = is->contents + (size_t) to * is->encoding;
+    memmove(dst, src, bytes);
+}
+
+intset *intsetAdd(intset *is, int64_t value, bool *success) {
+    if (success) {
+        *success = true;
+    }
+
+    if (_intsetValueEncoding(value) > is->encoding) {
+        return intsetUpgradeAndAdd(is, value);
+    }
+
+    uint32_t pos;
+    if (intsetSearch(is, value, &pos)) {
+        if (success) {
+            *success = false;
+        }
+        return is;
+    }
+
+    is = intsetResize(is, is->length + 1);
+    if (is == NULL) {
+        return NULL;
+    }
+    if (pos < is->length) {
+        intsetMoveTail(is, pos, pos + 1);
+    }
+    _intsetSet(is, pos, value);
+    is->length++;
+    return is;
+}
+
+intset *intsetRemove(intset *is, int64_t value, bool *success) {
+    if (success) {
+        *success = false;
+    }
+
+    uint32_t pos;
+    if (_intsetValueEncoding(value) <= is->encoding && intsetSearch(is, value, &pos)) {
+        if (success) {
+            *success = true;
+        }
+        if (pos < is->length - 1) {
+            intsetMoveTail(is, pos + 1, pos);
+        }
+        // 缩小内存失败时旧的内存仍然可用
+        intset *newis = intsetResize(is, is->length - 1);
+        if (newis != NULL) {
+            is = newis;
+        }
+        is->length--;
+    }
+    return is;
+}
+
+bool intsetFind(intset *is, int64_t value) {
+    return _intsetValueEncoding(value) <= is->encoding && intsetSearch(is, value, NULL);
+}
+
+bool intsetGet(intset *is, uint32_t pos, int64_t *value) {
+    if (pos >= is->length) {
+        return false;
+    }
+    *value = _intsetGet(is, pos);
+    return true;
+}
+
+uint32_t intsetLen(intset *is) {
+    return is->length;
+}
+
+size_t intsetBlobLen(intset *is) {
+    return sizeof(intset) + (size_t) is->length * is->encoding;
+}
+
+static void intsetRepr(intset *is) {
+    printf("{encoding %u, length %u}", is->encoding, is->length);
+    for (uint32_t i = 0; i < is->length; i++) {
+        printf(" %lld", (long long) _intsetGet(is, i));
+    }
+    printf("\n");
+}
+
+int mainintset() {
+    intset *is = intsetNew();
+    bool success;
+    is = intsetAdd(is, 5, &success);
+    is = intsetAdd(is, 6, &success);
+    is = intsetAdd(is, 4, &success);
+    is = intsetAdd(is, 4, &success);
+    assert(!success);
+    intsetRepr(is);
+
+    // 升级到 int32, 再升级到 int64
+    is = intsetAdd(is, 65535, &success);
+    is = intsetAdd(is, -4294967295LL, &success);
+    intsetRepr(is);
+    assert(intsetFind(is, 65535) && intsetFind(is, -4294967295LL) && !intsetFind(is, 7));
+
+    is = intsetRemove(is, 5, &success);
+    assert(success && !intsetFind(is, 5));
+    is = intsetRemove(is, 5, &success);
+    assert(!success);
+    intsetRepr(is);
+    zfree(is);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef _INTSET_H_
+#define _INTSET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * intset: 有序的整数数组, 用来存放只包含整数的小集合.
+ * 所有元素使用同一个宽度(int16/int32/int64)存储, 加入一个当前宽度放不下的元素时整体升级,
+ * 查找是二分, 相比 dict 省掉了 dictEntry, robj 和 sds
+ */
+typedef struct intset {
+    uint32_t encoding; // 每个元素占用的字节数
+    uint32_t length;
+    int8_t contents[];
+} intset;
+
+intset *intsetNew(void);
+
+/**
+ * 添加 value, 已经存在时 *success 为 false
+ * @return 新的 intset, 旧的指针可能已经失效
+ */
+intset *intsetAdd(intset *is, int64_t value, bool *success);
+
+/**
+ * 删除 value, 不存在时 *success 为 false
+ */
+intset *intsetRemove(intset *is, int64_t value, bool *success);
+
+bool intsetFind(intset *is, int64_t value);
+
+/**
+ * 读取第 pos 个元素(按从小到大的顺序)
+ * @return false if out of range
+ */
+bool intsetGet(intset *is, uint32_t pos, int64_t *value);
+
+uint32_t intsetLen(intset *is);
+
+/**
+ * intset 占用的总字节数
+ */
+size_t intsetBlobLen(intset *is);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "lzf.h"
+
+#define LZF_HLOG    13
+#define LZF_HSIZE   (1 << LZF_HLOG)
+#define LZF_MAX_LIT (1 << 5)               // literal run 的最大长度
+#define LZF_MAX_OFF (1 << 13)              // back reference 最远能往前找多少
+#define LZF_MAX_REF ((1 << 8) + (1 << 3))  // back reference 的最大长度
+
+/** 前 3 个字节的 hash, 作为查找重复串的 key */
+#define LZF_HASH(p) (((((uint32_t) (p)[0] << 16) | ((p)[1] << 8) | (p)[2]) * 2654435761u) >> (32 - LZF_HLOG))
+
+/**
+ * 当前 literal run 结束, 回填控制字节. run 为空时回收为它预留的控制字节
+ */
+#define LZF_END_LITERAL_RUN(op, lit) { \
+    if ((lit) == 0) { \
+        (op)--; \
+    } else { \
+        (op)[-(lit) - 1] = (lit) - 1; \
+    } \
+}
+
+unsigned int lzf_compress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len) {
+    const uint8_t *in = in_data;
+    const uint8_t *ip = in;
+    const uint8_t *in_end = in + in_len;
+    uint8_t *op = out_data;
+    uint8_t *out_end = op + out_len;
+    // 保存的是位置 + 1, 0 表示空
+    uint32_t htab[LZF_HSIZE];
+    int lit = 0;
+
+    if (in_len == 0 || out_len == 0) {
+        return 0;
+    }
+    memset(htab, 0, sizeof(htab));
+
+    // 为第一个 literal run 预留控制字节
+    op++;
+    while (ip + 2 < in_end) {
+        uint32_t h = LZF_HASH(ip);
+        uint32_t pos = htab[h];
+        htab[h] = ip - in + 1;
+
+        if (pos != 0) {
+            const uint8_t *ref = in + pos - 1;
+            unsigned int off = ip - ref - 1;
+            if (off < LZF_MAX_OFF && ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+                unsigned int maxlen = in_end - ip;
+                if (maxlen > LZF_MAX_REF) {
+                    maxlen = LZF_MAX_REF;
+                }
+                unsigned int len = 3;
+                while (len < maxlen && ref[len] == ip[len]) {
+                    len++;
+                }
+
+                // back reference 最多 3 个字节, 再加上下一个 run 的控制字节
+                if (op + 3 + 1 > out_end) {
+                    return 0;
+                }
+                LZF_END_LITERAL_RUN(op, lit);
+                lit = 0;
+
+                unsigned int l = len - 2;
+                if (l < 7) {
+                    *op++ = (off >> 8) + (l << 5);
+                } else {
+                    *op++ = (off >> 8) + (7 << 5);
+                    *op++ = l - 7;
+                }
+                *op++ = off & 0xff;
+                op++;
+
+                // 匹配串中间的位置也放进 hash 表, 后面的数据更容易命中
+                const uint8_t *end = ip + len;
+                for (ip++; ip < end && ip + 2 < in_end; ip++) {
+                    htab[LZF_HASH(ip)] = ip - in + 1;
+                }
+                ip = end;
+                continue;
+            }
+        }
+
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == LZF_MAX_LIT) {
+            LZF_END_LITERAL_RUN(op, lit);
+            lit = 0;
+            op++;
+        }
+    }
+
+    // 最后不足 3 个字节的部分只能原样输出
+    while (ip < in_end) {
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == LZF_MAX_LIT) {
+            LZF_END_LITERAL_RUN(op, lit);
+            lit = 0;
+            op++;
+        }
+    }
+    LZF_END_LITERAL_RUN(op, lit);
+    return op - (uint8_t *) out_data;
+}
+
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len) {
+    const uint8_t *ip = in_data;
+    const uint8_t *in_end = ip + in_len;
+    uint8_t *op = out_data;
+    uint8_t *out_end = op + out_len;
+
+    while (ip < in_end) {
+        unsigned int ctrl = *ip++;
+
+        if (ctrl < LZF_MAX_LIT) {
+            ctrl++;
+            if (op + ctrl > out_end) {
+                errno = E2BIG;
+                return 0;
+            }
+            if (ip + ctrl > in_end) {
+                errno = EINVAL;
+                return 0;
+            }
+            memcpy(op, ip, ctrl);
+            op += ctrl;
+            ip += ctrl;
+            continue;
+        }
+
+        unsigned int len = ctrl >> 5;
+        if (ip >= in_end) {
+            errno = EINVAL;
+            return 0;
+        }
+        if (len == 7) {
+            len += *ip++;
+            if (ip >= in_end) {
+                errno = EINVAL;
+                return 0;
+            }
+        }
+        unsigned int off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        len += 2;
+
+        if (op + len > out_end) {
+            errno = E2BIG;
+            return 0;
+        }
+        if (off > (unsigned int) (op - (uint8_t *) out_data)) {
+            errno = EINVAL;
+            return 0;
+        }
+        // 源和目标可能重叠(比如连续重复的字节), 只能逐字节拷贝
+        const uint8_t *ref = op - off;
+        while (len--) {
+            *op++ = *ref++;
+        }
+    }
+    return op - (uint8_t *) out_data;
+}
@@ -0,0 +1,23 @@
+#ifndef _LZF_H_
+#define _LZF_H_
+
+/**
+ * LZF 格式的压缩/解压, 速度优先, 压缩率一般. 格式和 liblzf 兼容:
+ *     000LLLLL <L+1 个字节>               literal run, 1 ~ 32 个原样拷贝的字节
+ *     LLLooooo oooooooo                   back reference, 长度 L+2, 距离 o+1
+ *     111ooooo LLLLLLLL oooooooo          back reference, 长度 L+9, 距离 o+1
+ */
+
+/**
+ * 压缩 in_data 到 out_data
+ * @return 压缩后的字节数; out_len 放不下(压缩没有收益)时返回 0
+ */
+unsigned int lzf_compress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+
+/**
+ * 解压 in_data 到 out_data
+ * @return 解压后的字节数; out_len 放不下(errno = E2BIG)或者数据损坏(errno = EINVAL)时返回 0
+ */
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len, void *out_data, unsigned int out_len);
+
+#endif
@@ -0,0 +1,774 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "zmalloc.h"
+#include "ziplist.h"
+#include "lzf.h"
+#include "quicklist.h"
+
+/** fill 为负数时, 每个节点中 ziplist 的字节数上限 */
+static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
+
+/** fill 为正数时, 即使元素个数没到 fill, ziplist 也不要超过这么大 */
+#define SIZE_SAFETY_LIMIT 8192
+
+/** count 只有 16 bit */
+#define FILL_MAX (1 << 15)
+#define COMPRESS_MAX (1 << 16)
+
+/** 太小的节点不值得压缩, 压缩后至少要省下这么多字节才保留压缩结果 */
+#define MIN_COMPRESS_BYTES 48
+#define MIN_COMPRESS_IMPROVE 8
+
+static void quicklistOomAbort(void) {
+    fprintf(stderr, "quicklist: Out Of Memory\n");
+    abort();
+}
+
+static void *quicklistAlloc(size_t size) {
+    void *p = zmalloc(size);
+    if (p == NULL) {
+        quicklistOomAbort();
+    }
+    return p;
+}
+
+quicklist *quicklistCreate(void) {
+    quicklist *ql = quicklistAlloc(sizeof(*ql));
+    ql->head = ql->tail = NULL;
+    ql->len = 0;
+    ql->count = 0;
+    ql->compress = 0;
+    ql->fill = QUICKLIST_FILL_DEFAULT;
+    return ql;
+}
+
+void quicklistSetOptions(quicklist *ql, int fill, int depth) {
+    if (fill > FILL_MAX) {
+        fill = FILL_MAX;
+    } else if (fill < -5) {
+        fill = -5;
+    } else if (fill == 0) {
+        fill = 1;
+    }
+    ql->fill = fill;
+
+    if (depth > COMPRESS_MAX) {
+        depth = COMPRESS_MAX;
+    } else if (depth < 0) {
+        depth = 0;
+    }
+    ql->compress = depth;
+}
+
+quicklist *quicklistNew(int fill, int compress) {
+    quicklist *ql = quicklistCreate();
+    quicklistSetOptions(ql, fill, compress);
+    return ql;
+}
+
+static quicklistNode *quicklistCreateNode(void) {
+    quicklistNode *node = quicklistAlloc(sizeof(*node));
+    node->zl = NULL;
+    node->count = 0;
+    node->sz = 0;
+    node->next = node->prev = NULL;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    node->recompress = 0;
+    return node;
+}
+
+void quicklistRelease(quicklist *ql) {
+    quicklistNode *current = ql->head;
+    while (current != NULL) {
+        quicklistNode *next = current->next;
+        zfree(current->zl);
+        zfree(current);
+        current = next;
+    }
+    zfree(ql);
+}
+
+#define quicklistNodeUpdateSz(node) ((node)->sz = ziplistBlobLen((node)->zl))
+
+/**
+ * 把 node 的 ziplist 压缩成 quicklistLZF, 没有收益时保持原样
+ */
+static bool __quicklistCompressNode(quicklistNode *node) {
+    node->recompress = 0;
+    if (node->sz < MIN_COMPRESS_BYTES) {
+        return false;
+    }
+
+    quicklistLZF *lzf = quicklistAlloc(sizeof(*lzf) + node->sz);
+    lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed, node->sz);
+    if (lzf->sz == 0 || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        zfree(lzf);
+        return false;
+    }
+    lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
+    zfree(node->zl);
+    node->zl = (unsigned char *) lzf;
+    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    return true;
+}
+
+static bool __quicklistDecompressNode(quicklistNode *node) {
+    quicklistLZF *lzf = (quicklistLZF *) node->zl;
+    void *decompressed = quicklistAlloc(node->sz);
+    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+        zfree(decompressed);
+        return false;
+    }
+    zfree(lzf);
+    node->zl = decompressed;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    return true;
+}
+
+static void quicklistCompressNode(quicklistNode *node) {
+    if (node != NULL && node->encoding == QUICKLIST_NODE_ENCODING_RAW) {
+        __quicklistCompressNode(node);
+    }
+}
+
+static void quicklistDecompressNode(quicklistNode *node) {
+    if (node != NULL && node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        __quicklistDecompressNode(node);
+    }
+}
+
+/**
+ * 临时解压出来读写, 用完后由 quicklistCompress 重新压缩
+ */
+static void quicklistDecompressNodeForUse(quicklistNode *node) {
+    if (node != NULL && node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        __quicklistDecompressNode(node);
+        node->recompress = 1;
+    }
+}
+
+/**
+ * 保证两端各 compress 个节点是解压的, node 在这个范围之外就压缩它.
+ * 刚刚离开这个范围的两个节点也在这里压缩
+ */
+static void __quicklistCompress(const quicklist *ql, quicklistNode *node) {
+    if (ql->compress == 0 || ql->len < (unsigned int) (ql->compress * 2)) {
+        return;
+    }
+
+    quicklistNode *forward = ql->head;
+    quicklistNode *reverse = ql->tail;
+    unsigned int depth = 0;
+    bool in_depth = false;
+    while (depth++ < ql->compress) {
+        quicklistDecompressNode(forward);
+        quicklistDecompressNode(reverse);
+
+        if (forward == node || reverse == node) {
+            in_depth = true;
+        }
+        if (forward == reverse || forward->next == reverse) {
+            return;
+        }
+        forward = forward->next;
+        reverse = reverse->prev;
+    }
+
+    if (!in_depth) {
+        quicklistCompressNode(node);
+    }
+    quicklistCompressNode(forward);
+    quicklistCompressNode(reverse);
+}
+
+static void quicklistCompress(const quicklist *ql, quicklistNode *node) {
+    if (node->recompress) {
+        quicklistCompressNode(node);
+    } else {
+        __quicklistCompress(ql, node);
+    }
+}
+
+static void __quicklistInsertNode(quicklist *ql, quicklistNode *old_node, quicklistNode *new_node, bool after) {
+    if (after) {
+        new_node->prev = old_node;
+        if (old_node != NULL) {
+            new_node->next = old_node->next;
+            if (old_node->next != NULL) {
+                old_node->next->prev = new_node;
+            }
+            old_node->next = new_node;
+        }
+        if (ql->tail == old_node) {
+            ql->tail = new_node;
+        }
+    } else {
+        new_node->next = old_node;
+        if (old_node != NULL) {
+            new_node->prev = old_node->prev;
+            if (old_node->prev != NULL) {
+                old_node->prev->next = new_node;
+            }
+            old_node->prev = new_node;
+        }
+        if (ql->head == old_node) {
+            ql->head = new_node;
+        }
+    }
+
+    if (ql->len == 0) {
+        ql->head = ql->tail = new_node;
+    }
+    ql->len++;
+
+    // old_node 可能因为新节点的加入离开了两端的范围
+    if (old_node != NULL) {
+        quicklistCompress(ql, old_node);
+    }
+}
+
+static bool _quicklistNodeSizeMeetsOptimizationRequirement(const size_t sz, const int fill) {
+    if (fill >= 0) {
+        return false;
+    }
+    size_t offset = (-fill) - 1;
+    if (offset < sizeof(optimization_level) / sizeof(*optimization_level)) {
+        return sz <= optimization_level[offset];
+    }
+    return false;
+}
+
+/**
+ * node 中是否还能再放一个 sz 字节的元素
+ */
+static bool _quicklistNodeAllowInsert(const quicklistNode *node, const int fill, const size_t sz) {
+    if (node == NULL) {
+        return false;
+    }
+
+    // 估算新 entry 的 prevlen 和 encoding 占用的字节数
+    int ziplist_overhead = (sz < 254) ? 1 : 5;
+    if (sz < 64) {
+        ziplist_overhead += 1;
+    } else if (sz < 16384) {
+        ziplist_overhead += 2;
+    } else {
+        ziplist_overhead += 5;
+    }
+
+    size_t new_sz = node->sz + sz + ziplist_overhead;
+    if (_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)) {
+        return true;
+    }
+    if (new_sz > SIZE_SAFETY_LIMIT) {
+        return false;
+    }
+    return (int) node->count < fill;
+}
+
+void quicklistPushHead(quicklist *ql, void *value, size_t sz) {
+    if (_quicklistNodeAllowInsert(ql->head, ql->fill, sz)) {
+        ql->head->zl = ziplistPush(ql->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklistNodeUpdateSz(ql->head);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        quicklistNodeUpdateSz(node);
+        __quicklistInsertNode(ql, ql->head, node, false);
+    }
+    ql->count++;
+    ql->head->count++;
+}
+
+void quicklistPushTail(quicklist *ql, void *value, size_t sz) {
+    if (_quicklistNodeAllowInsert(ql->tail, ql->fill, sz)) {
+        ql->tail->zl = ziplistPush(ql->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklistNodeUpdateSz(ql->tail);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        quicklistNodeUpdateSz(node);
+        __quicklistInsertNode(ql, ql->tail, node, true);
+    }
+    ql->count++;
+    ql->tail->count++;
+}
+
+void quicklistPush(quicklist *ql, void *value, const size_t sz, int where) {
+    if (where == QUICKLIST_HEAD) {
+        quicklistPushHead(ql, value, sz);
+    } else {
+        quicklistPushTail(ql, value, sz);
+    }
+}
+
+quicklist *quicklistAppendValuesFromZiplist(quicklist *ql, unsigned char *zl) {
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    char longstr[32] = {0};
+
+    unsigned char *p = ziplistIndex(zl, 0);
+    while (ziplistGet(p, &value, &sz, &longval)) {
+        if (value == NULL) {
+            sz = snprintf(longstr, sizeof(longstr), "%lld", longval);
+            value = (unsigned char *) longstr;
+        }
+        quicklistPushTail(ql, value, sz);
+        p = ziplistNext(zl, p);
+    }
+    zfree(zl);
+    return ql;
+}
+
+static void __quicklistDelNode(quicklist *ql, quicklistNode *node) {
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    }
+    if (node == ql->tail) {
+        ql->tail = node->prev;
+    }
+    if (node == ql->head) {
+        ql->head = node->next;
+    }
+
+    // 先更新 len, __quicklistCompress 需要知道准确的节点数
+    ql->len--;
+    ql->count -= node->count;
+
+    // 有节点进入了两端的范围, 需要解压
+    __quicklistCompress(ql, NULL);
+
+    zfree(node->zl);
+    zfree(node);
+}
+
+/**
+ * 删除 node 中 *p 指向的 entry, node 空了就删除 node
+ * @return node 是否被删除
+ */
+static bool quicklistDelIndex(quicklist *ql, quicklistNode *node, unsigned char **p) {
+    bool gone = false;
+    node->zl = ziplistDelete(node->zl, p);
+    node->count--;
+    if (node->count == 0) {
+        gone = true;
+        __quicklistDelNode(ql, node);
+    } else {
+        quicklistNodeUpdateSz(node);
+    }
+    ql->count--;
+    return gone;
+}
+
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    quicklistNode *prev = entry->node->prev;
+    quicklistNode *next = entry->node->next;
+    bool deleted_node = quicklistDelIndex((quicklist *) entry->quicklist, entry->node, &entry->zi);
+
+    // ziplist 可能被 realloc 了, 下一次 quicklistNext 根据 offset 重新定位
+    iter->zi = NULL;
+
+    if (deleted_node) {
+        if (iter->direction == AL_START_HEAD) {
+            iter->current = next;
+            iter->offset = 0;
+        } else {
+            iter->current = prev;
+            iter->offset = -1;
+        }
+    }
+    // 没有删除节点时 offset 不用变: 从头往后删掉 offset 处的元素后, 下一个元素移到了 offset;
+    // 从尾往前时 offset 是负数, 前一个元素的负下标也不变
+}
+
+bool quicklistReplaceAtIndex(quicklist *ql, long index, void *data, int sz) {
+    quicklistEntry entry;
+    if (!quicklistIndex(ql, index, &entry)) {
+        return false;
+    }
+    entry.node->zl = ziplistReplace(entry.node->zl, entry.zi, data, sz);
+    quicklistNodeUpdateSz(entry.node);
+    quicklistCompress(ql, entry.node);
+    return true;
+}
+
+long quicklistDelRange(quicklist *ql, const long start, const long count) {
+    if (count <= 0) {
+        return 0;
+    }
+
+    unsigned long extent = count;
+    if (start >= 0 && extent > (ql->count - start)) {
+        extent = ql->count - start;
+    } else if (start < 0 && extent > (unsigned long) (-start)) {
+        extent = -start;
+    }
+
+    quicklistEntry entry;
+    if (!quicklistIndex(ql, start, &entry)) {
+        return 0;
+    }
+
+    long deleted = 0;
+    quicklistNode *node = entry.node;
+    while (extent > 0) {
+        quicklistNode *next = node->next;
+        unsigned long del;
+        bool delete_entire_node = false;
+
+        if (entry.offset == 0 && extent >= node->count) {
+            delete_entire_node = true;
+            del = node->count;
+        } else if (entry.offset >= 0 && extent + entry.offset >= node->count) {
+            // 从 offset 删到节点结尾
+            del = node->count - entry.offset;
+        } else if (entry.offset < 0) {
+            // 负的 offset 表示删到节点结尾还剩几个
+            del = -entry.offset;
+            if (del > extent) {
+                del = extent;
+            }
+        } else {
+            del = extent;
+        }
+
+        if (delete_entire_node) {
+            __quicklistDelNode(ql, node);
+        } else {
+            quicklistDecompressNodeForUse(node);
+            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            quicklistNodeUpdateSz(node);
+            node->count -= del;
+            ql->count -= del;
+            if (node->count == 0) {
+                __quicklistDelNode(ql, node);
+            } else {
+                quicklistCompress(ql, node);
+            }
+        }
+
+        extent -= del;
+        deleted += del;
+        node = next;
+        entry.offset = 0;
+    }
+    return deleted;
+}
+
+bool quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
+    return ziplistCompare(p1, p2, p2_len);
+}
+
+quicklistIter *quicklistGetIterator(const quicklist *ql, int direction) {
+    quicklistIter *iter = quicklistAlloc(sizeof(*iter));
+    if (direction == AL_START_HEAD) {
+        iter->current = ql->head;
+        iter->offset = 0;
+    } else {
+        iter->current = ql->tail;
+        iter->offset = -1;
+    }
+    iter->direction = direction;
+    iter->quicklist = ql;
+    iter->zi = NULL;
+    return iter;
+}
+
+quicklistIter *quicklistGetIteratorAtIdx(const quicklist *ql, const int direction, const long long idx) {
+    quicklistEntry entry;
+    if (!quicklistIndex(ql, idx, &entry)) {
+        return NULL;
+    }
+    quicklistIter *iter = quicklistGetIterator(ql, direction);
+    iter->zi = NULL;
+    iter->current = entry.node;
+    iter->offset = entry.offset;
+    return iter;
+}
+
+void quicklistReleaseIterator(quicklistIter *iter) {
+    if (iter->current != NULL) {
+        quicklistCompress(iter->quicklist, iter->current);
+    }
+    zfree(iter);
+}
+
+static void initEntry(quicklistEntry *entry) {
+    entry->quicklist = NULL;
+    entry->node = NULL;
+    entry->offset = 123456789;
+    entry->zi = NULL;
+    entry->value = NULL;
+    entry->sz = 0;
+    entry->longval = -123456789;
+}
+
+bool quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+    initEntry(entry);
+    entry->quicklist = iter->quicklist;
+
+    while (iter->current != NULL) {
+        entry->node = iter->current;
+        if (iter->zi == NULL) {
+            // 刚进入这个节点
+            quicklistDecompressNodeForUse(iter->current);
+            iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        } else if (iter->direction == AL_START_HEAD) {
+            iter->zi = ziplistNext(iter->current->zl, iter->zi);
+            iter->offset++;
+        } else {
+            iter->zi = ziplistPrev(iter->current->zl, iter->zi);
+            iter->offset--;
+        }
+
+        entry->zi = iter->zi;
+        entry->offset = iter->offset;
+        if (iter->zi != NULL) {
+            ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+            return true;
+        }
+
+        // 这个节点遍历完了
+        quicklistCompress(iter->quicklist, iter->current);
+        if (iter->direction == AL_START_HEAD) {
+            iter->current = iter->current->next;
+            iter->offset = 0;
+        } else {
+            iter->current = iter->current->prev;
+            iter->offset = -1;
+        }
+        iter->zi = NULL;
+    }
+    return false;
+}
+
+bool quicklistIndex(const quicklist *ql, const long long idx, quicklistEntry *entry) {
+    bool forward = idx >= 0;
+    unsigned long long index = forward ? idx : (-idx) - 1;
+    unsigned long long accum = 0;
+
+    initEntry(entry);
+    entry->quicklist = ql;
+    if (index >= ql->count) {
+        return false;
+    }
+
+    // 按节点的 count 整个跳过, 不用解压也不用遍历 ziplist
+    quicklistNode *n = forward ? ql->head : ql->tail;
+    while (n != NULL) {
+        if (accum + n->count > index) {
+            break;
+        }
+        accum += n->count;
+        n = forward ? n->next : n->prev;
+    }
+    if (n == NULL) {
+        return false;
+    }
+
+    entry->node = n;
+    if (forward) {
+        entry->offset = index - accum;
+    } else {
+        entry->offset = -((long long) index) - 1 + (long long) accum;
+    }
+
+    quicklistDecompressNodeForUse(entry->node);
+    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
+    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    return true;
+}
+
+void quicklistRecompressEntry(const quicklist *ql, quicklistEntry *entry) {
+    (void) ql;
+    if (entry->node != NULL && entry->node->recompress) {
+        quicklistCompressNode(entry->node);
+    }
+}
+
+static void *_quicklistSaver(unsigned char *data, unsigned int sz) {
+    unsigned char *vstr = NULL;
+    if (data != NULL) {
+        vstr = quicklistAlloc(sz);
+        memcpy(vstr, data, sz);
+    }
+    return vstr;
+}
+
+bool quicklistPopCustom(quicklist *ql, int where, void **data, unsigned int *sz, long long *sval,
+                        void *(*saver)(unsigned char *data, unsigned int sz)) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    if (ql->count == 0) {
+        return false;
+    }
+    if (data != NULL) {
+        *data = NULL;
+    }
+    if (sz != NULL) {
+        *sz = 0;
+    }
+
+    // 两端的节点永远不会被压缩
+    quicklistNode *node = (where == QUICKLIST_HEAD) ? ql->head : ql->tail;
+    unsigned char *p = ziplistIndex(node->zl, (where == QUICKLIST_HEAD) ? 0 : -1);
+    if (!ziplistGet(p, &vstr, &vlen, &vlong)) {
+        return false;
+    }
+
+    if (vstr != NULL) {
+        if (data != NULL) {
+            *data = saver(vstr, vlen);
+        }
+        if (sz != NULL) {
+            *sz = vlen;
+        }
+    } else if (sval != NULL) {
+        *sval = vlong;
+    }
+    quicklistDelIndex(ql, node, &p);
+    return true;
+}
+
+bool quicklistPop(quicklist *ql, int where, void **data, unsigned int *sz, long long *sval) {
+    return quicklistPopCustom(ql, where, data, sz, sval, _quicklistSaver);
+}
+
+size_t quicklistBlobLen(const quicklist *ql) {
+    size_t bytes = 0;
+    for (quicklistNode *node = ql->head; node != NULL; node = node->next) {
+        if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+            bytes += sizeof(quicklistLZF) + ((quicklistLZF *) node->zl)->sz;
+        } else {
+            bytes += node->sz;
+        }
+    }
+    return bytes;
+}
+
+unsigned long quicklistDefrag(quicklist *ql, unsigned long cursor, unsigned long count,
+                              void *(*allocfn)(void *ptr)) {
+    quicklistNode *node = ql->head;
+    for (unsigned long i = 0; i < cursor && node != NULL; i++) {
+        node = node->next;
+    }
+    for (; node != NULL && count > 0; node = node->next, count--, cursor++) {
+        quicklistNode *newnode = allocfn(node);
+        if (newnode != NULL) {
+            node = newnode;
+            if (node->prev != NULL) {
+                node->prev->next = node;
+            } else {
+                ql->head = node;
+            }
+            if (node->next != NULL) {
+                node->next->prev = node;
+            } else {
+                ql->tail = node;
+            }
+        }
+        void *newzl = allocfn(node->zl);
+        if (newzl != NULL) {
+            node->zl = newzl;
+        }
+    }
+    return node != NULL ? cursor : 0;
+}
+
+/********************************** for test ************************/
+#include "adlist.h"
+#include "sds.h"
+
+static long long benchUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/**
+ * 和 adlist(每个元素一个 listNode + sds) 对比内存占用和按下标访问的延迟.
+ * 模拟 1M 个元素的任务队列
+ */
+static void quicklistBenchmark(int fill, int compress) {
+    const int n = 1000000, lookups = 1000;
+    char buf[64];
+    long long start;
+    size_t base;
+
+    base = zmalloc_used_memory();
+    start = benchUstime();
+    list *l = listCreate();
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(buf, sizeof(buf), "job:%d:payload", i);
+        listAddNodeTail(l, sdsnewlen(buf, len));
+    }
+    printf("adlist                 push %d: %lld us, %zu bytes\n", n, benchUstime() - start, zmalloc_used_memory() - base);
+
+    base = zmalloc_used_memory();
+    start = benchUstime();
+    quicklist *ql = quicklistNew(fill, compress);
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(buf, sizeof(buf), "job:%d:payload", i);
+        quicklistPushTail(ql, buf, len);
+    }
+    printf("quicklist(%d, %d)     push %d: %lld us, %zu bytes, %lu nodes\n", fill, compress, n,
+           benchUstime() - start, zmalloc_used_memory() - base, ql->len);
+
+    srand(42);
+    start = benchUstime();
+    for (int i = 0; i < lookups; i++) {
+        listIndex(l, rand() % n);
+    }
+    printf("adlist                 %d random LINDEX: %lld us\n", lookups, benchUstime() - start);
+
+    srand(42);
+    start = benchUstime();
+    for (int i = 0; i < lookups; i++) {
+        quicklistEntry entry;
+        quicklistIndex(ql, rand() % n, &entry);
+        quicklistRecompressEntry(ql, &entry);
+    }
+    printf("quicklist(%d, %d)     %d random LINDEX: %lld us\n", fill, compress, lookups, benchUstime() - start);
+
+    // LRANGE key 500000 500099
+    start = benchUstime();
+    for (int i = 0; i < 100; i++) {
+        listNode *node = listIndex(l, n / 2);
+        for (int j = 0; j < 100 && node != NULL; j++) {
+            node = node->next;
+        }
+    }
+    printf("adlist                 100 x LRANGE mid 100: %lld us\n", benchUstime() - start);
+
+    start = benchUstime();
+    for (int i = 0; i < 100; i++) {
+        quicklistIter *iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, n / 2);
+        quicklistEntry entry;
+        for (int j = 0; j < 100 && quicklistNext(iter, &entry); j++);
+        quicklistReleaseIterator(iter);
+    }
+    printf("quicklist(%d, %d)     100 x LRANGE mid 100: %lld us\n", fill, compress, benchUstime() - start);
+
+    listNode *node = listFirst(l);
+    while (node != NULL) {
+        sdsfree(listNodeValue(node));
+        node = node->next;
+    }
+    listRelease(l);
+    quicklistRelease(ql);
+}
+
+int mainquicklist() {
+    quicklistBenchmark(QUICKLIST_FILL_DEFAULT, 0);
+    quicklistBenchmark(QUICKLIST_FILL_DEFAULT, 1);
+    quicklistBenchmark(128, 0);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#ifndef _QUICKLIST_H_
+#define _QUICKLIST_H_
+
+#include <stdbool.h>
+
+/**
+ * quicklist: 节点是 ziplist 的双向链表.
+ * 大 list 如果每个元素一个 listNode, 元素分散在堆上, 按下标访问只能一个一个的跳.
+ * quicklist 把连续的元素打包到一个 ziplist 中, 每个节点记录自己的元素个数,
+ * 按下标访问时可以整个节点整个节点的跳过.
+ *
+ * 两端之外的节点很少被访问, 可以用 LZF 压缩起来, 访问时再临时解压
+ */
+
+/**
+ * 节点
+ * sz:         ziplist 的字节数(未压缩时的大小)
+ * count:      ziplist 中的元素个数
+ * encoding:   RAW(zl 指向 ziplist) or LZF(zl 指向 quicklistLZF)
+ * recompress: 被临时解压出来使用, 用完后需要重新压缩
+ */
+typedef struct quicklistNode {
+    struct quicklistNode *prev;
+    struct quicklistNode *next;
+    unsigned char *zl;
+    unsigned int sz;
+    unsigned int count : 16;
+    unsigned int encoding : 2;
+    unsigned int recompress : 1;
+} quicklistNode;
+
+/**
+ * 压缩后的 ziplist, sz 是 compressed 的字节数
+ */
+typedef struct quicklistLZF {
+    unsigned int sz;
+    char compressed[];
+} quicklistLZF;
+
+/**
+ * count:    所有节点的元素总数
+ * len:      节点个数
+ * fill:     每个节点的容量, 正数表示最多多少个元素; -1 ~ -5 表示 ziplist 最多 4/8/16/32/64 KB
+ * compress: 两端各有多少个节点不压缩, 0 表示不压缩
+ */
+typedef struct quicklist {
+    quicklistNode *head;
+    quicklistNode *tail;
+    unsigned long count;
+    unsigned long len;
+    int fill;
+    unsigned int compress;
+} quicklist;
+
+typedef struct quicklistIter {
+    const quicklist *quicklist;
+    quicklistNode *current;
+    unsigned char *zi;  // current 中当前 entry 的位置, NULL 表示需要根据 offset 重新定位
+    long offset;        // 当前 entry 在 current 中的下标
+    int direction;
+} quicklistIter;
+
+/**
+ * 一个元素, 字符串时 value/sz 有效, 整数时 value 为 NULL, 值在 longval 中
+ */
+typedef struct quicklistEntry {
+    const quicklist *quicklist;
+    quicklistNode *node;
+    unsigned char *zi;
+    unsigned char *value;
+    long long longval;
+    unsigned int sz;
+    int offset;
+} quicklistEntry;
+
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL -1
+
+#define QUICKLIST_NODE_ENCODING_RAW 1
+#define QUICKLIST_NODE_ENCODING_LZF 2
+
+/** 迭代方向, 和 adlist 保持一致 */
+#ifndef AL_START_HEAD
+#define AL_START_HEAD 0
+#define AL_START_TAIL 1
+#endif
+
+#define QUICKLIST_FILL_DEFAULT -2
+#define QUICKLIST_COMPRESS_DEFAULT 0
+
+quicklist *quicklistCreate(void);
+quicklist *quicklistNew(int fill, int compress);
+void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
+void quicklistRelease(quicklist *quicklist);
+
+/**
+ * @param where QUICKLIST_HEAD or QUICKLIST_TAIL
+ */
+void quicklistPush(quicklist *quicklist, void *value, const size_t sz, int where);
+void quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
+void quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
+
+/**
+ * 把 zl 中的元素依次追加到尾部, zl 会被释放
+ */
+quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist, unsigned char *zl);
+
+/**
+ * 弹出头部或尾部的元素, 字符串元素通过 saver 拷贝出来保存到 *data, 整数元素保存到 *sval
+ * @return false if quicklist is empty
+ */
+bool quicklistPopCustom(quicklist *quicklist, int where, void **data, unsigned int *sz, long long *sval,
+                        void *(*saver)(unsigned char *data, unsigned int sz));
+
+/**
+ * saver 是 zmalloc + memcpy 的 quicklistPopCustom
+ */
+bool quicklistPop(quicklist *quicklist, int where, void **data, unsigned int *sz, long long *sval);
+
+/**
+ * 定位到第 index 个元素, index 为负数表示从尾部往前数.
+ * 压缩的节点会被解压出来, entry 用完之后调用 quicklistRecompressEntry
+ * @return false if out of range
+ */
+bool quicklistIndex(const quicklist *quicklist, const long long index, quicklistEntry *entry);
+void quicklistRecompressEntry(const quicklist *quicklist, quicklistEntry *entry);
+
+/**
+ * quicklist[index] = data
+ * @return false if out of range
+ */
+bool quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz);
+
+/**
+ * 从 start 开始删除 count 个元素, start 为负数表示从尾部往前数
+ * @return 实际删除的个数
+ */
+long quicklistDelRange(quicklist *quicklist, const long start, const long count);
+
+quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction);
+quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist, int direction, const long long idx);
+
+/**
+ * 读取下一个元素到 entry
+ * @return false 没有元素了
+ */
+bool quicklistNext(quicklistIter *iter, quicklistEntry *entry);
+void quicklistReleaseIterator(quicklistIter *iter);
+
+/**
+ * 删除迭代器刚刚返回的 entry, 之后的 quicklistNext 返回原来的下一个元素
+ */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry);
+
+bool quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
+
+#define quicklistCount(ql) ((ql)->count)
+
+/**
+ * 所有节点占用的字节数(压缩的节点按压缩后的大小算), 不包括节点结构本身
+ */
+size_t quicklistBlobLen(const quicklist *quicklist);
+
+/**
+ * 碎片整理: 用 allocfn 挪动节点以及节点中的 ziplist(或 quicklistLZF), 并修正前后节点和 head/tail 的指针.
+ * 从第 cursor 个节点开始, 最多整理 count 个节点, 大的 list 可以分多次整理.
+ * allocfn 返回新的地址, 不需要挪动时返回 NULL. quicklist 结构本身由调用者挪动
+ * @return 下一次开始的节点下标, 全部整理完返回 0
+ */
+unsigned long quicklistDefrag(quicklist *quicklist, unsigned long cursor, unsigned long count,
+                              void *(*allocfn)(void *ptr));
+
+#endif
@@ -0,0 +1,412 @@
+/**
+ * redis-check-rdb: 离线检查 RDB 文件.
+ * 按 redis.c 中 loadDb 的格式逐个解析所有的 key, 校验 LZF 解压后的长度和版本 2 的 CRC64,
+ * 出错时报告出错的位置以及正在读取的 key, 不需要启动 redis-server
+ *
+ * 用法: redis-check-rdb <dump.rdb>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include "lzf.h"
+#include "crc64.h"
+
+/** 和 redis.c 保持一致 */
+#define REDIS_STRING           0
+#define REDIS_LIST             1
+#define REDIS_SET              2
+#define REDIS_HASH             3
+#define REDIS_ZSET             4
+#define REDIS_EXPIRETIME       253
+#define REDIS_SELECTDB         254
+#define REDIS_EOF              255
+
+#define REDIS_RDB_VERSION      2
+
+#define REDIS_RDB_6BITLEN      0
+#define REDIS_RDB_14BITLEN     1
+#define REDIS_RDB_32BITLEN     2
+#define REDIS_RDB_ENCVAL       3
+
+#define REDIS_RDB_ENC_INT8     0
+#define REDIS_RDB_ENC_INT16    1
+#define REDIS_RDB_ENC_INT32    2
+#define REDIS_RDB_ENC_LZF      3
+
+#define CHECK_TYPE_NUM         5
+
+static char *typeNames[CHECK_TYPE_NUM] = {"string", "list", "set", "hash", "zset"};
+
+static struct check {
+    FILE *fp;
+    int rdbver;
+    long long offset;   // 已经读取的字节数
+    uint64_t cksum;     // 已经读取的内容的 CRC64
+    const char *error;  // 第一个错误, 之后不再继续解析
+    long long erroroffset;
+    int dbid;
+    long long keys;     // 当前 db 已经读完的 key 数
+    char *key;          // 正在读取的 key, 用于报告错误
+    int type;
+} check;
+
+static bool checkError(const char *error) {
+    if (check.error == NULL) {
+        check.error = error;
+        check.erroroffset = check.offset;
+    }
+    return false;
+}
+
+static bool readRaw(void *p, size_t len) {
+    if (len > 0 && fread(p, len, 1, check.fp) == 0) {
+        return checkError("Unexpected end of file");
+    }
+    check.cksum = crc64(check.cksum, p, len);
+    check.offset += len;
+    return true;
+}
+
+/**
+ * 同 loadLenFromFile
+ * @param isencoded 为 NULL 时不允许特殊编码的字符串
+ */
+static bool readLen(uint32_t *len, bool *isencoded) {
+    if (isencoded != NULL) {
+        *isencoded = false;
+    }
+    if (check.rdbver == 0) {
+        if (!readRaw(len, 4)) {
+            return false;
+        }
+        *len = ntohl(*len);
+        return true;
+    }
+
+    unsigned char buf[2];
+    if (!readRaw(buf, 1)) {
+        return false;
+    }
+    int type = (buf[0] & 0xC0) >> 6;
+    if (type == REDIS_RDB_6BITLEN) {
+        *len = buf[0] & 0x3F;
+    } else if (type == REDIS_RDB_ENCVAL) {
+        if (isencoded == NULL) {
+            return checkError("Encoded string found where a length was expected");
+        }
+        *isencoded = true;
+        *len = buf[0] & 0x3F;
+    } else if (type == REDIS_RDB_14BITLEN) {
+        if (!readRaw(buf + 1, 1)) {
+            return false;
+        }
+        *len = ((buf[0] & 0x3F) << 8) | buf[1];
+    } else {
+        if (!readRaw(len, 4)) {
+            return false;
+        }
+        *len = ntohl(*len);
+    }
+    return true;
+}
+
+/**
+ * 读取一个字符串, 整数编码的转成字符串, LZF 编码的解压
+ * @return malloc 的以 '\0' 结尾的内容, 出错返回 NULL
+ */
+static char *readString(void) {
+    bool isencoded;
+    uint32_t len;
+    if (!readLen(&len, &isencoded)) {
+        return NULL;
+    }
+    if (isencoded) {
+        unsigned char enc[4];
+        long long value;
+        char *buf;
+        switch (len) {
+        case REDIS_RDB_ENC_INT8:
+            if (!readRaw(enc, 1)) {
+                return NULL;
+            }
+            value = (signed char) enc[0];
+            break;
+        case REDIS_RDB_ENC_INT16:
+            if (!readRaw(enc, 2)) {
+                return NULL;
+            }
+            value = (int16_t) (enc[0] | (enc[1] << 8));
+            break;
+        case REDIS_RDB_ENC_INT32:
+            if (!readRaw(enc, 4)) {
+                return NULL;
+            }
+            value = (int32_t) ((uint32_t) enc[0] | ((uint32_t) enc[1] << 8) | ((uint32_t) enc[2] << 16) |
+                               ((uint32_t) enc[3] << 24));
+            break;
+        case REDIS_RDB_ENC_LZF: {
+            uint32_t comprlen;
+            if (!readLen(&comprlen, NULL) || !readLen(&len, NULL)) {
+                return NULL;
+            }
+            if (comprlen == 0) {
+                checkError("LZF compressed string with zero length");
+                return NULL;
+            }
+            void *compressed = malloc(comprlen);
+            buf = malloc((size_t) len + 1);
+            if (compressed == NULL || buf == NULL) {
+                free(compressed);
+                free(buf);
+                checkError("Out of memory reading LZF string (corrupted length?)");
+                return NULL;
+            }
+            if (!readRaw(compressed, comprlen)) {
+                free(compressed);
+                free(buf);
+                return NULL;
+            }
+            if (lzf_decompress(compressed, comprlen, buf, len) != len) {
+                free(compressed);
+                free(buf);
+                checkError("Invalid LZF compressed string");
+                return NULL;
+            }
+            free(compressed);
+            buf[len] = '\0';
+            return buf;
+        }
+        default:
+            checkError("Unknown string encoding");
+            return NULL;
+        }
+        buf = malloc(32);
+        if (buf == NULL) {
+            checkError("Out of memory");
+            return NULL;
+        }
+        snprintf(buf, 32, "%lld", value);
+        return buf;
+    }
+
+    char *buf = malloc((size_t) len + 1);
+    if (buf == NULL) {
+        checkError("Out of memory reading string (corrupted length?)");
+        return NULL;
+    }
+    if (!readRaw(buf, len)) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static bool skipString(void) {
+    char *s = readString();
+    free(s);
+    return s != NULL;
+}
+
+/**
+ * 读取 type 类型的 value, 聚合类型是 length 加上 length 个(hash/zset 是 2 * length 个)字符串
+ */
+static bool checkValue(int type) {
+    if (type == REDIS_STRING) {
+        return skipString();
+    }
+    uint32_t len;
+    if (!readLen(&len, NULL)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        if (!skipString()) {
+            return false;
+        }
+        if (type == REDIS_HASH && !skipString()) {
+            return false;
+        }
+        if (type == REDIS_ZSET) {
+            char *score = readString();
+            if (score == NULL) {
+                return false;
+            }
+            char *endptr;
+            strtod(score, &endptr);
+            bool valid = score[0] != '\0' && endptr[0] == '\0';
+            free(score);
+            if (!valid) {
+                return checkError("Invalid zset score");
+            }
+        }
+    }
+    return true;
+}
+
+static void reportError(void) {
+    printf("--- RDB ERROR DETECTED ---\n");
+    printf("[offset %lld] %s\n", check.erroroffset, check.error);
+    if (check.key != NULL) {
+        printf("[additional info] Reading %s key '%s' (key #%lld of db %d)\n",
+               (check.type >= 0 && check.type < CHECK_TYPE_NUM) ? typeNames[check.type] : "?", check.key,
+               check.keys + 1, check.dbid);
+    } else if (check.dbid >= 0) {
+        printf("[additional info] After %lld keys of db %d\n", check.keys, check.dbid);
+    }
+}
+
+/**
+ * @return 0 文件完好, 1 文件有错误
+ */
+static int checkRdb(char *filename) {
+    long long keysbytype[CHECK_TYPE_NUM] = {0};
+    long long expires = 0, totalkeys = 0;
+
+    memset(&check, 0, sizeof(check));
+    check.dbid = -1;
+    check.type = -1;
+    check.fp = fopen(filename, "r");
+    if (check.fp == NULL) {
+        printf("Can't open %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    char magic[10];
+    if (!readRaw(magic, 9)) {
+        goto err;
+    }
+    magic[9] = '\0';
+    if (memcmp(magic, "REDIS", 5) != 0) {
+        checkError("Wrong signature, not a RDB file");
+        goto err;
+    }
+    check.rdbver = atoi(magic + 5);
+    if (check.rdbver < 0 || check.rdbver > REDIS_RDB_VERSION) {
+        checkError("Unknown RDB format version");
+        goto err;
+    }
+    printf("[offset 0] Checking RDB file %s, format version %d\n", filename, check.rdbver);
+
+    while (true) {
+        uint8_t type;
+        if (!readRaw(&type, 1)) {
+            goto err;
+        }
+        bool hasexpire = false;
+        if (type == REDIS_EXPIRETIME) {
+            uint32_t when;
+            if (!readRaw(&when, 4) || !readRaw(&type, 1)) {
+                goto err;
+            }
+            hasexpire = true;
+        }
+        if (type == REDIS_EOF) {
+            if (hasexpire) {
+                checkError("Expire time followed by EOF");
+                goto err;
+            }
+            break;
+        }
+        if (type == REDIS_SELECTDB) {
+            if (hasexpire) {
+                checkError("Expire time followed by SELECTDB");
+                goto err;
+            }
+            if (check.dbid >= 0) {
+                printf("[offset %lld] db %d: %lld keys\n", check.offset - 1, check.dbid, check.keys);
+            }
+            uint32_t dbid;
+            if (!readLen(&dbid, NULL)) {
+                goto err;
+            }
+            if (dbid > INT_MAX) {
+                checkError("Invalid db number");
+                goto err;
+            }
+            check.dbid = dbid;
+            check.keys = 0;
+            continue;
+        }
+        if (check.dbid < 0) {
+            checkError("Key found before the first SELECTDB");
+            goto err;
+        }
+        if (type >= CHECK_TYPE_NUM) {
+            checkError("Unknown object type");
+            goto err;
+        }
+        check.type = type;
+        if ((check.key = readString()) == NULL || !checkValue(type)) {
+            goto err;
+        }
+        free(check.key);
+        check.key = NULL;
+        check.keys++;
+        totalkeys++;
+        keysbytype[type]++;
+        if (hasexpire) {
+            expires++;
+        }
+    }
+    if (check.dbid >= 0) {
+        printf("[offset %lld] db %d: %lld keys\n", check.offset - 1, check.dbid, check.keys);
+    }
+
+    if (check.rdbver >= 2) {
+        uint64_t expected = check.cksum;
+        unsigned char buf[8];
+        if (!readRaw(buf, 8)) {
+            goto err;
+        }
+        uint64_t stored = 0;
+        for (int i = 0; i < 8; i++) {
+            stored |= (uint64_t) buf[i] << (i * 8);
+        }
+        if (stored == 0) {
+            printf("[offset %lld] RDB file was saved with checksum disabled: no check performed\n", check.offset - 8);
+        } else if (stored != expected) {
+            check.offset -= 8;
+            checkError("Wrong RDB checksum");
+            reportError();
+            printf("[additional info] stored %016llx, computed %016llx\n", (unsigned long long) stored,
+                   (unsigned long long) expected);
+            fclose(check.fp);
+            return 1;
+        } else {
+            printf("[offset %lld] Checksum OK (%016llx)\n", check.offset - 8, (unsigned long long) stored);
+        }
+    }
+    int c = fgetc(check.fp);
+    if (c != EOF) {
+        checkError("Unexpected data after the end of the RDB file");
+        goto err;
+    }
+
+    printf("[offset %lld] \\o/ RDB looks OK! \\o/\n", check.offset);
+    printf("[info] %lld keys read, %lld with expire\n", totalkeys, expires);
+    for (int i = 0; i < CHECK_TYPE_NUM; i++) {
+        printf("[info] %s: %lld\n", typeNames[i], keysbytype[i]);
+    }
+    fclose(check.fp);
+    return 0;
+
+err:
+    reportError();
+    free(check.key);
+    fclose(check.fp);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <rdb-file-name>\n", argv[0]);
+        exit(1);
+    }
+    crc64Init();
+    return checkRdb(argv[1]);
+}
@@ -19,9 +19,16 @@
 
 #define REDIS_NOTUSED(V) ((void) V)
 
+/** --bigkeys/--hotkeys 每次 SCAN 的 COUNT, 以及报告前多少个 key */
+#define CLI_SCAN_COUNT 100
+#define CLI_TOP_KEYS 10
+
 static struct config {
     char *hostip;
     int hostport;
+    bool bigkeys;
+    bool hotkeys;
+    double interval; // --bigkeys/--hotkeys 每批 key 之间 sleep 的秒数, 降低对线上的影响
 } config;
 
 struct redisCommand {
@@ -75,6 +82,8 @@ static struct redisCommand cmdTable[] = {
     {"flushall",     1, REDIS_CMD_INLINE|REDIS_CMD_RETCODEREPLY},
     {"sort",        -2, REDIS_CMD_INLINE|REDIS_CMD_MULTIBULKREPLY},
     {"version",      1, REDIS_CMD_INLINE|REDIS_CMD_SINGLELINEREPLY},
+    {"scan",        -2, REDIS_CMD_INLINE|REDIS_CMD_MULTIBULKREPLY},
+    {"object",       3, REDIS_CMD_INLINE|REDIS_CMD_INTREPLY},
     {NULL,           0, 0}
 };
 
@@ -238,6 +247,230 @@ static int cliSendCommand(int argc, char **argv) {
     return 0;
 }
 
+/*------------------------------ --bigkeys / --hotkeys ------------------------------*/
+
+typedef struct topKey {
+    sds key;
+    sds type;
+    long long value;
+} topKey;
+
+/**
+ * 每种类型的 key 数和总字节数
+ */
+typedef struct typeStat {
+    char *name;
+    long long keys;
+    long long bytes;
+} typeStat;
+
+/**
+ * 读取一个 bulk 回复, nil 或者出错时返回 NULL
+ */
+static sds cliReadBulk(int fd) {
+    sds line = cliReadLine(fd);
+    if (line == NULL) {
+        return NULL;
+    }
+    if (!strcmp(line, "nil") || line[0] == '-') {
+        sdsfree(line);
+        return NULL;
+    }
+    int len = atoi(line);
+    sdsfree(line);
+    if (len < 0) {
+        return NULL;
+    }
+    sds bulk = sdsnewlen(NULL, len);
+    char crlf[2];
+    if (anetRead(fd, bulk, len) != len || anetRead(fd, crlf, 2) != 2) {
+        sdsfree(bulk);
+        return NULL;
+    }
+    return bulk;
+}
+
+/**
+ * 发送一个 inline 命令, 读取一行回复
+ */
+static sds cliInlineCommand(int fd, const char *cmd) {
+    sds buf = sdscatprintf(sdsempty(), "%s\r\n", cmd);
+    anetWrite(fd, buf, sdslen(buf));
+    sdsfree(buf);
+    return cliReadLine(fd);
+}
+
+/**
+ * SCAN 一批 key 追加到 keys 中, 并更新 cursor
+ * @return 0 成功, 1 出错
+ */
+static int cliScanKeys(int fd, unsigned long *cursor, list *keys) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "SCAN %lu COUNT %d", *cursor, CLI_SCAN_COUNT);
+    sds line = cliInlineCommand(fd, cmd);
+    if (line == NULL || line[0] == '-') {
+        fprintf(stderr, "SCAN failed: %s\n", line ? line : "connection lost");
+        sdsfree(line);
+        return 1;
+    }
+    int elements = atoi(line);
+    sdsfree(line);
+    for (int j = 0; j < elements; j++) {
+        sds bulk = cliReadBulk(fd);
+        if (bulk == NULL) {
+            fprintf(stderr, "SCAN failed: bad reply\n");
+            return 1;
+        }
+        if (j == 0) {
+            *cursor = strtoul(bulk, NULL, 10);
+            sdsfree(bulk);
+        } else if (!listAddNodeTail(keys, bulk)) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * 按 value 从大到小保留前 CLI_TOP_KEYS 个 key
+ * @return 新的 key 排在第几, 没有进入前 CLI_TOP_KEYS 返回 -1
+ */
+static int topKeysAdd(topKey *top, sds key, sds type, long long value) {
+    int i = CLI_TOP_KEYS - 1;
+    if (top[i].key != NULL && top[i].value >= value) {
+        return -1;
+    }
+    sdsfree(top[i].key);
+    sdsfree(top[i].type);
+    while (i > 0 && (top[i - 1].key == NULL || top[i - 1].value < value)) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i].key = sdsdup(key);
+    top[i].type = sdsdup(type);
+    top[i].value = value;
+    return i;
+}
+
+/**
+ * --bigkeys: 按 MEMORY USAGE 找出占用内存最多的 key
+ * --hotkeys: 按 OBJECT FREQ 找出访问最频繁的 key, 需要 server 使用 LFU 的 maxmemory-policy
+ *
+ * 用 SCAN 每次取 CLI_SCAN_COUNT 个 key, 每批 key 的 TYPE 和 MEMORY USAGE/OBJECT FREQ 一次性发出去再依次读回复,
+ * 批与批之间 sleep config.interval 秒. server 每次只做一小批的工作, 不会像 KEYS 一样阻塞.
+ * 这个版本的协议只能发送 inline 命令, 含有空格或换行的 key 会被跳过
+ */
+static int cliFindKeys(bool hot) {
+    int fd = cliConnect();
+    if (fd == -1) {
+        return 1;
+    }
+    sds reply = cliInlineCommand(fd, "DBSIZE");
+    long long dbsize = reply ? atoll(reply) : 0;
+    sdsfree(reply);
+
+    topKey top[CLI_TOP_KEYS];
+    memset(top, 0, sizeof(top));
+    typeStat types[] = {{"string", 0, 0}, {"list", 0, 0}, {"set", 0, 0}, {"hash", 0, 0}, {"zset", 0, 0}};
+    long long sampled = 0, skipped = 0;
+    unsigned long cursor = 0;
+    printf("# Scanning the entire keyspace to find %s keys\n", hot ? "hot" : "biggest");
+    if (config.interval > 0) {
+        printf("# %.2f seconds sleep between every %d keys\n", config.interval, CLI_SCAN_COUNT);
+    }
+    printf("\n");
+
+    do {
+        list *keys = listCreate();
+        listSetFreeMethod(keys, (void (*)(void *)) sdsfree);
+        if (cliScanKeys(fd, &cursor, keys)) {
+            close(fd);
+            return 1;
+        }
+
+        sds cmd = sdsempty();
+        listIter *it = listGetIterator(keys, AL_START_HEAD);
+        listNode *node;
+        while ((node = listNextElement(it)) != NULL) {
+            sds key = listNodeValue(node);
+            if (strpbrk(key, " \r\n") != NULL || sdslen(key) != strlen(key)) {
+                listDelNode(keys, node);
+                skipped++;
+                continue;
+            }
+            cmd = sdscatprintf(cmd, "TYPE %s\r\n%s %s\r\n", key, hot ? "OBJECT FREQ" : "MEMORY USAGE", key);
+        }
+        listReleaseIterator(it);
+        anetWrite(fd, cmd, sdslen(cmd));
+        sdsfree(cmd);
+
+        it = listGetIterator(keys, AL_START_HEAD);
+        while ((node = listNextElement(it)) != NULL) {
+            sds key = listNodeValue(node);
+            sds type = cliReadLine(fd);
+            sds value = cliReadLine(fd);
+            if (type == NULL || value == NULL) {
+                fprintf(stderr, "Connection lost\n");
+                exit(1);
+            }
+            if (value[0] == '-') {
+                fprintf(stderr, "%s\n", value + 1);
+                exit(1);
+            }
+            // 在 SCAN 和这里之间被删除或者过期了
+            if (!strcmp(value, "nil")) {
+                sdsfree(type);
+                sdsfree(value);
+                continue;
+            }
+            long long v = atoll(value);
+            sampled++;
+            for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+                if (!strcmp(type, types[t].name)) {
+                    types[t].keys++;
+                    types[t].bytes += v;
+                }
+            }
+            if (topKeysAdd(top, key, type, v) == 0) {
+                printf("[%05.2f%%] %s %s found so far '%s' with %lld %s\n",
+                       dbsize ? (double) sampled * 100 / dbsize : 100.0, hot ? "Hottest" : "Biggest",
+                       type, key, v, hot ? "frequency" : "bytes");
+            }
+            sdsfree(type);
+            sdsfree(value);
+        }
+        listReleaseIterator(it);
+        listRelease(keys);
+
+        if (config.interval > 0) {
+            usleep(config.interval * 1000000);
+        }
+    } while (cursor != 0);
+    close(fd);
+
+    printf("\n-------- summary -------\n\n");
+    printf("Sampled %lld keys in the keyspace", sampled);
+    if (skipped > 0) {
+        printf(", skipped %lld keys containing spaces or newlines", skipped);
+    }
+    printf("\n\nTop %d keys by %s:\n", CLI_TOP_KEYS, hot ? "access frequency" : "memory usage");
+    for (int i = 0; i < CLI_TOP_KEYS && top[i].key != NULL; i++) {
+        printf("%3d) %-6s '%s' %lld%s\n", i + 1, top[i].type, top[i].key, top[i].value, hot ? "" : " bytes");
+        sdsfree(top[i].key);
+        sdsfree(top[i].type);
+    }
+    if (!hot) {
+        printf("\n");
+        for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+            printf("%-6s %lld keys with %lld bytes (%.2f%% of keys, avg size %.2f)\n", types[t].name, types[t].keys,
+                   types[t].bytes, sampled ? (double) types[t].keys * 100 / sampled : 0,
+                   types[t].keys ? (double) types[t].bytes / types[t].keys : 0);
+        }
+    }
+    return 0;
+}
+
 /**
  * 解析 -h 和 -p 参数
  */
@@ -258,6 +491,13 @@ static int parseOptions(int argc, char **argv) {
         } else if (!strcmp(argv[i],"-p") && !lastarg) {
             config.hostport = atoi(argv[i+1]);
             i++;
+        } else if (!strcmp(argv[i],"-i") && !lastarg) {
+            config.interval = atof(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i],"--bigkeys")) {
+            config.bigkeys = true;
+        } else if (!strcmp(argv[i],"--hotkeys")) {
+            config.hotkeys = true;
         } else {
             break;
         }
@@ -292,11 +532,17 @@ int main(int argc, char **argv) {
 
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
+    config.bigkeys = config.hotkeys = false;
+    config.interval = 0;
 
     firstarg = parseOptions(argc,argv);
     printf("After parse -h and -p, first arg index: %d\n", firstarg);
     argc -= firstarg;
     argv += firstarg;
+
+    if (config.bigkeys || config.hotkeys) {
+        return cliFindKeys(config.hotkeys);
+    }
     
     /* Turn the plain C strings into Sds strings */
     argvcopy = zmalloc(sizeof(char*)*argc+1);
@@ -315,6 +561,7 @@ int main(int argc, char **argv) {
     if (argc < 1) {
         fprintf(stderr, "usage: redis-cli [-h host] [-p port] cmd arg1 arg2 arg3 ... argN\n");
         fprintf(stderr, "usage: echo \"argN\" | redis-cli [-h host] [-p port] cmd arg1 arg2 ... arg(N-1)\n");
+        fprintf(stderr, "usage: redis-cli [-h host] [-p port] [-i interval] --bigkeys | --hotkeys\n");
         fprintf(stderr, "\nIf a pipe from standard input is detected this data is used as last argument.\n\n");
         fprintf(stderr, "example: cat /etc/passwd | redis-cli set my_passwd\n");
         fprintf(stderr, "example: redis-cli get my_passwd\n");
@@ -29,6 +29,10 @@
 
 #define REDIS_VERSION "0.07"
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* sync_file_range */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +45,8 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -53,6 +59,12 @@
 #include "dict.h"   /* Hash tables */
 #include "adlist.h" /* Linked lists */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
+#include "ziplist.h" /* Compact list of small strings and integers */
+#include "quicklist.h" /* Linked list of ziplists, used by big lists */
+#include "intset.h"  /* Compact sorted array of integers, used by small sets */
+#include "bio.h"     /* Background jobs, used by lazy free */
+#include "lzf.h"     /* LZF compression, used by RDB */
+#include "crc64.h"   /* RDB checksum */
 
 #define REDIS_OK   0
 #define REDIS_ERR -1
@@ -61,11 +73,15 @@
 #define REDIS_SERVERPORT       6379
 #define REDIS_MAXIDLETIME      (60 * 5) // default client timeout
 #define REDIS_QUERYBUF_LEN     1024
+#define REDIS_REPLY_CHUNK_BYTES (16*1024) // client 输出缓冲区的大小，也是 reply list 中每个 chunk 的上限
+#define REDIS_SHARED_BULKHDR_LEN 32       // 预先创建 "0\r\n" ~ "31\r\n" 这些长度头
+#define REDIS_QUERYBUF_SHRINK_MIN (32*1024) // querybuf 超过这个大小且远大于峰值时回收
+#define REDIS_QUERYBUF_IDLE_TIME  2         // 空闲超过这么多秒的 client 回收 querybuf 的剩余空间
 #define REDIS_LOADBUF_LEN      1024
 #define REDIS_MAX_ARGS         16
 #define REDIS_DEFULT_DBNUM     16
 #define REDIS_CONFIGLINE_MAX   1024
-#define REDIS_OBJFREELIST_MAX  1000000 // Max number of object to cache
+#define REDIS_OBJFREELIST_MAX  65536 // Max number of object to cache
 #define REDIS_MAX_SYNC_TIME    60      // Slave can't take more to sync
 
 /** Hash table parameters */
@@ -75,15 +91,158 @@
 /** Command flags */
 #define REDIS_CMD_BULK         1
 #define REDIS_CMD_INLINE       2
+#define REDIS_CMD_DENYOOM      4    // 可能增加内存, 超过 maxmemory 且无法淘汰时拒绝执行
 
 /** Object types */
 #define REDIS_STRING           0
 #define REDIS_LIST             1
 #define REDIS_SET              2
 #define REDIS_HASH             3
+#define REDIS_ZSET             4
+#define REDIS_EXPIRETIME       253
 #define REDIS_SELECTDB         254
 #define REDIS_EOF              255
 
+/**
+ * RDB 文件的版本, 0 的长度都是 4 字节大端, 1 的长度是下面的变长编码,
+ * 2 在 REDIS_EOF 之后有 8 字节小端的 CRC64, 覆盖从 "REDIS" 到 REDIS_EOF 的所有内容, 0 表示保存时没有计算
+ */
+#define REDIS_RDB_VERSION      2
+
+/**
+ * RDB 中长度的编码, 第一个字节的高 2 位表示类型:
+ * 00|XXXXXX                 1 字节, 6 位的长度
+ * 01|XXXXXX XXXXXXXX        2 字节, 14 位的长度
+ * 10|000000 [4 字节大端]     5 字节, 32 位的长度
+ * 11|XXXXXX                 后面是特殊编码的字符串, 低 6 位是 REDIS_RDB_ENC_*
+ */
+#define REDIS_RDB_6BITLEN      0
+#define REDIS_RDB_14BITLEN     1
+#define REDIS_RDB_32BITLEN     2
+#define REDIS_RDB_ENCVAL       3
+#define REDIS_RDB_LENERR       UINT_MAX
+
+#define REDIS_RDB_ENC_INT8     0    // 1 字节的整数
+#define REDIS_RDB_ENC_INT16    1    // 2 字节的整数, 小端
+#define REDIS_RDB_ENC_INT32    2    // 4 字节的整数, 小端
+#define REDIS_RDB_ENC_LZF      3    // 压缩后的长度, 原始长度, LZF 压缩的内容
+
+/** 超过这个长度的字符串才尝试 LZF 压缩, 太短的压缩不了多少 */
+#define REDIS_RDB_COMPRESS_MIN_LEN 20
+
+/** saveDb 攒够这么多字节才 write 一次, 不再每个 type/长度都是一次 1~5 字节的 fwrite */
+#define REDIS_RDB_WRITE_BUF_LEN (1024 * 1024)
+
+/** saveDb 默认每写入这么多字节提交一次刷盘, 最后的 fsync 不用一次刷出整个文件的脏页 */
+#define REDIS_RDB_AUTOSYNC_BYTES (32 * 1024 * 1024)
+
+/** Object encodings, 同一种 type 可以有不同的内部表示 */
+#define REDIS_ENCODING_RAW     0    // ptr 指向 sds
+#define REDIS_ENCODING_INT     1    // ptr 中直接保存 long, 不再申请 sds
+#define REDIS_ENCODING_EMBSTR  2    // robj 和 sds 在同一块内存中，sds 不可修改
+#define REDIS_ENCODING_QUICKLIST 3  // ptr 指向 quicklist
+#define REDIS_ENCODING_ZIPLIST 4    // ptr 指向 ziplist
+#define REDIS_ENCODING_HT      5    // ptr 指向 dict
+#define REDIS_ENCODING_INTSET  6    // ptr 指向 intset
+#define REDIS_ENCODING_SKIPLIST 7   // ptr 指向 zset(skiplist + dict)
+
+/** 不超过这个长度的字符串使用 EMBSTR 编码: robj(16) + sdshdr8(3) + 44 + '\0' = 64 字节 */
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 44
+
+/** ptr 是否指向 sds */
+#define sdsEncodedObject(o) ((o)->encoding == REDIS_ENCODING_RAW || (o)->encoding == REDIS_ENCODING_EMBSTR)
+
+/** 小 list 使用 ziplist 编码的默认阈值, 可以在配置文件中修改 */
+#define REDIS_LIST_MAX_ZIPLIST_ENTRIES 128
+#define REDIS_LIST_MAX_ZIPLIST_VALUE   64
+
+/** 只包含整数的 set 在这个大小以内使用 intset 编码 */
+#define REDIS_SET_MAX_INTSET_ENTRIES   512
+
+/** 小 hash 使用 ziplist 编码的默认阈值 */
+#define REDIS_HASH_MAX_ZIPLIST_ENTRIES 128
+#define REDIS_HASH_MAX_ZIPLIST_VALUE   64
+
+/** 小 sorted set 使用 ziplist 编码的默认阈值 */
+#define REDIS_ZSET_MAX_ZIPLIST_ENTRIES 128
+#define REDIS_ZSET_MAX_ZIPLIST_VALUE   64
+
+/** hashTypeCurrentObject 取 field 还是 value */
+#define REDIS_HASH_KEY   1
+#define REDIS_HASH_VALUE 2
+
+/** robj.lru 的位数和 LRU 时钟的精度(毫秒), 精度和 serverCron 的周期一致 */
+#define REDIS_LRU_BITS             24
+#define REDIS_LRU_CLOCK_MAX        ((1 << REDIS_LRU_BITS) - 1)
+#define REDIS_LRU_CLOCK_RESOLUTION 1000
+
+/** maxmemory 淘汰策略 */
+#define REDIS_MAXMEMORY_NO_EVICTION    0
+#define REDIS_MAXMEMORY_ALLKEYS_LRU    1
+#define REDIS_MAXMEMORY_ALLKEYS_LFU    2
+#define REDIS_MAXMEMORY_ALLKEYS_RANDOM 3
+#define REDIS_MAXMEMORY_SAMPLES        5
+#define REDIS_EVPOOL_SIZE              16
+
+/** LFU 计数器: 新对象的初始值, 对数增长的因子, 每多少分钟衰减一次 */
+#define REDIS_LFU_INIT_VAL    5
+#define REDIS_LFU_LOG_FACTOR  10
+#define REDIS_LFU_DECAY_TIME  1
+
+/** 元素个数超过这个值的对象可以交给后台线程释放 */
+#define REDIS_LAZYFREE_THRESHOLD 64
+
+/** 共享对象的 refcount, incrRefCount/decrRefCount 不会修改它, 后台线程也可以安全的"释放" */
+#define REDIS_SHARED_REFCOUNT INT_MAX
+
+/** 主动过期: 每轮在每个 db 中采样的 key 数, 每次 serverCron 中最多花费的毫秒数 */
+#define REDIS_EXPIRE_LOOKUPS_PER_LOOP 20
+#define REDIS_EXPIRE_CYCLE_TIME_LIMIT 25
+
+/**
+ * 碎片整理: 碎片超过 IGNORE_BYTES 且碎片率超过 THRESHOLD_LOWER% 时开始,
+ * 每次 serverCron 花费周期的 CYCLE_MIN% ~ CYCLE_MAX%, 碎片率到 THRESHOLD_UPPER% 时用满 CYCLE_MAX
+ */
+#define REDIS_DEFRAG_IGNORE_BYTES     (100 * 1024 * 1024)
+#define REDIS_DEFRAG_THRESHOLD_LOWER  10
+#define REDIS_DEFRAG_THRESHOLD_UPPER  100
+#define REDIS_DEFRAG_CYCLE_MIN        1
+#define REDIS_DEFRAG_CYCLE_MAX        5
+#define REDIS_DEFRAG_BIG_VALUE        1000  // 元素(quicklist 按节点)超过这么多的 value 在之后的周期中分批整理
+#define REDIS_DEFRAG_CHECK_STEPS      64    // 每整理这么多个 bucket/元素/节点检查一次时间
+
+/** AOF 的 fsync 策略 */
+#define REDIS_APPENDFSYNC_NO        0   // 交给操作系统决定什么时候落盘
+#define REDIS_APPENDFSYNC_ALWAYS    1   // 每轮事件循环写完之后在主线程中 fsync
+#define REDIS_APPENDFSYNC_EVERYSEC  2   // 每秒一次, 在 bio 线程中 fsync
+
+/** everysec 时后台的 fsync 还没完成, write 最多推迟这么多秒 */
+#define REDIS_AOF_MAX_POSTPONE_SECONDS 2
+
+/** AOF 缓冲区小于这个值时写完后留着下一轮复用 */
+#define REDIS_AOFBUF_REUSE_MAX 4000
+
+/** BGREWRITEAOF 期间的写命令按块缓存, 不需要像一个大的 sds 那样扩容时整体拷贝 */
+#define REDIS_AOF_RW_BUF_BLOCK_SIZE (1024 * 1024 * 10)
+
+/** AOF 超过 MIN_SIZE 并且比上次 rewrite 之后增长了 PERC% 时自动 rewrite */
+#define REDIS_AUTO_AOF_REWRITE_PERC      100
+#define REDIS_AUTO_AOF_REWRITE_MIN_SIZE  (64 * 1024 * 1024)
+
+/** 自动 rewrite 失败之后至少等这么多秒再试, 连续失败时加倍, 最多加倍 REDIS_AOF_REWRITE_RETRY_MAX_SHIFT 次 */
+#define REDIS_AOF_REWRITE_RETRY_SECONDS   10
+#define REDIS_AOF_REWRITE_RETRY_MAX_SHIFT 6
+
+/** AOF 只需要数据落盘, 不需要同步 mtime 等元数据 */
+#ifdef __linux__
+#define aof_fsync fdatasync
+#else
+#define aof_fsync fsync
+#endif
+
+/** 预先创建好的共享整数对象 [0, REDIS_SHARED_INTEGERS) */
+#define REDIS_SHARED_INTEGERS  10000
+
 /** Server replication state */
 #define REDIS_REPL_NONE        0    // No active replication
 #define REDIS_REPL_CONNECT     1    // Must connect to master
@@ -118,10 +277,16 @@
 #define REDIS_NOTUSED(V) ((void) V)
 
 /*=========================== 数据结构定义 ======================== */
+/**
+ * type, encoding 和 lru 用位域压缩到 4 个字节，整个 robj 仍然是 16 字节.
+ * lru: LRU 策略下是最近一次访问时的 LRU 时钟; LFU 策略下高 16 位是分钟为单位的时间, 低 8 位是访问频率
+ */
 typedef struct redisObject {
-    int type;
-    void *ptr;
+    unsigned type:4;
+    unsigned encoding:4;
+    unsigned lru:REDIS_LRU_BITS;
     int refcount;
+    void *ptr;
 } robj;
 
 /**
@@ -132,16 +297,28 @@ typedef struct redisClient {
     dict *dict;
     int dictid;
     sds querybuf;
+    size_t querybuf_peak; // 最近一个 cron 周期内 querybuf 的最大长度
     robj *argv[REDIS_MAX_ARGS];
     int argc;
     int bulklen; // bulk read len. -1 if not in bulk read mode;
     list *reply;
-    int sentlen;
+    int sentlen; // buf 或者 reply 第一个对象中已经发送的字节数
+    /**
+     * 固定大小的输出缓冲区，小的回复直接拷贝到这里，不需要申请任何内存.
+     * 只有 reply list 为空的时候才能写 buf, 否则顺序会乱
+     */
+    int bufpos;
+    char buf[REDIS_REPLY_CHUNK_BYTES];
     time_t lastinteraction; // time of the last interaction, used for timeout
     int flags; // REDIS_CLOSE | REDIS_SLAVE
     int slaveseldb; // slave selected db, if this client is a slave
 } redisClient;
 
+typedef struct aofrwblock {
+    size_t used, free;
+    char buf[REDIS_AOF_RW_BUF_BLOCK_SIZE];
+} aofrwblock;
+
 /**
  * 多长时间内执行多少次更新操作需要执行保存
  */
@@ -155,20 +332,35 @@ struct redisServer {
     int port;
     int fd;
     dict **dict;
+    dict **expires; // 每个 db 中设置了过期时间的 key, 见 getExpire()
     long long dirty; // 上次保存后的修改次数
     list *clients;
     list *slaves;
     char neterr[ANET_ERR_LEN];
     aeEventLoop *el;
     int cronloops; // cron function 的运行次数
-    list *objfreelist; // free object, 避免 malloc()
+    /**
+     * 空闲 robj 的栈, 通过 ptr 串起来, 入栈出栈不需要额外申请内存.
+     * lowwater 是上次 trim 之后栈的最小长度, 这么多对象在这段时间里一直没被用到
+     */
+    robj *objfreelist;
+    unsigned long objfreelist_len;
+    unsigned long objfreelist_max;
+    unsigned long objfreelist_lowwater;
     time_t lastsave;  // 上次保存的时间，unix time
-    int usedmemory;  // 占用的内存，MB
+    size_t usedmemory;  // zmalloc 分配出去的字节数
+    unsigned int lruclock; // serverCron 中刷新的 LRU 时钟, 见 LRU_CLOCK()
 
     /* Fields used only for stats */
     time_t stat_starttime; // server start time
     long long stat_numcommands; // number of processed commands
     long long stat_numconnections; // number of connections received
+    long long stat_evictedkeys; // 因为 maxmemory 被淘汰的 key 数
+    long long stat_expiredkeys; // 过期删除的 key 数
+    size_t stat_rdb_cow_bytes;  // 上次 BGSAVE 子进程中被写时复制的字节数
+    long long stat_active_defrag_hits;   // 碎片整理挪动过的内存块数
+    long long stat_active_defrag_misses; // 碎片整理检查过但不需要挪动的内存块数
+    long long stat_aof_delayed_fsync;    // 等后台 fsync 超时, 不等它完成就 write 的次数
 
     /* Configuration */
     int verbosity;
@@ -177,12 +369,64 @@ struct redisServer {
     int dbnum;
     bool daemonize;
     bool bgsaveinprogress;
+    int child_info_pipe[2]; // BGSAVE 子进程把写时复制的字节数写到 [1], 父进程从 [0] 读
     struct saveparam *saveparams;
 
     int saveparamslen;
+    unsigned int list_max_ziplist_entries; // list 超过这么多元素就不再使用 ziplist
+    size_t list_max_ziplist_value;         // list 中有元素超过这个长度就不再使用 ziplist
+    int list_max_ziplist_size;             // quicklist 每个节点的容量, 见 quicklist.fill
+    int list_compress_depth;               // quicklist 两端不压缩的节点数, 0 表示不压缩
+    unsigned int set_max_intset_entries;   // set 超过这么多元素就不再使用 intset
+    unsigned int hash_max_ziplist_entries; // hash 超过这么多 field 就不再使用 ziplist
+    size_t hash_max_ziplist_value;         // hash 中有 field/value 超过这个长度就不再使用 ziplist
+    unsigned int zset_max_ziplist_entries; // sorted set 超过这么多元素就不再使用 ziplist
+    size_t zset_max_ziplist_value;         // sorted set 中有 member 超过这个长度就不再使用 ziplist
+    size_t maxmemory;                      // 0 表示不限制
+    int maxmemory_policy;
+    int maxmemory_samples;                 // 每次淘汰时采样的 key 数
+    int lfu_log_factor;
+    int lfu_decay_time;
+    int lazyfree_lazy_user_del;    // DEL 和 UNLINK 一样在后台释放大对象
+    int lazyfree_lazy_server_del;  // SET/RENAME 覆盖以及 SINTERSTORE 替换的旧值在后台释放
+    int lazyfree_lazy_expire;      // 过期的大对象在后台释放
+    int active_defrag_enabled;
+    size_t active_defrag_ignore_bytes;  // 碎片少于这么多字节时不整理
+    int active_defrag_threshold_lower;  // 碎片率(%)超过它时开始整理
+    int active_defrag_threshold_upper;  // 碎片率(%)超过它时用满 active_defrag_cycle_max
+    int active_defrag_cycle_min;        // 每次 serverCron 中整理花费的时间占周期的百分比
+    int active_defrag_cycle_max;
+    bool active_defrag_running;
     char *logfile;
     char *bindaddr;
     char *dbfilename;
+    int rdbcompression; // 保存 RDB 时用 LZF 压缩长字符串
+    int rdbchecksum;    // 保存 RDB 时计算 CRC64, 加载时总是校验
+    size_t rdb_autosync_bytes;   // saveDb 每写入这么多字节提交一次刷盘, 0 表示只在最后 fsync
+    size_t rdb_save_rate_limit;  // BGSAVE 每秒最多写入的字节数, 0 表示不限速
+
+    /* Append only file */
+    int appendonly;
+    char *appendfilename;
+    int appendfsync;
+    int appendfd;                     // -1 表示没有打开 AOF
+    int appendseldb;                  // AOF 中最后一次 SELECT 的 db, 命令的 db 不同时先写一条 SELECT
+    sds aofbuf;                       // 这一轮事件循环中的写命令, 在 beforeSleep 中一次性写入
+    off_t aof_current_size;
+    off_t aof_fsync_offset;           // 已经提交 fsync 的位置, 和 aof_current_size 不同说明还有数据没有 fsync
+    time_t aof_last_fsync;
+    time_t aof_flush_postponed_start; // 因为后台 fsync 没完成而推迟 write 的开始时间, 0 表示没有推迟
+    pid_t aof_child_pid;              // BGREWRITEAOF 的子进程, -1 表示没有在 rewrite
+    bool aof_rewrite_scheduled;       // BGSAVE 结束后再开始 rewrite
+    list *aof_rewrite_buf_blocks;     // rewrite 期间的写命令, aofrwblock 的链表
+    off_t aof_rewrite_base_size;      // 上次 rewrite 之后的大小, 用于计算增长率
+    int auto_aof_rewrite_perc;        // 0 表示不自动 rewrite
+    off_t auto_aof_rewrite_min_size;
+    long long aof_rewrite_time_start;
+    long long aof_rewrite_time_last;  // 上次 rewrite 花费的毫秒数, -1 表示还没有 rewrite 过
+    int aof_lastbgrewrite_status;     // REDIS_OK 或 REDIS_ERR
+    int aof_rewrite_failures;         // 连续失败的次数, 用于推迟下一次自动 rewrite
+    time_t aof_rewrite_failed_at;
 
     /* Replication related */
     bool isslave;
@@ -207,6 +451,62 @@ struct redisCommand {
     int flags;
 };
 
+/**
+ * list 的迭代器, 对 ziplist 和 quicklist 两种编码通用
+ */
+typedef struct listTypeIterator {
+    robj *subject;
+    unsigned char encoding;
+    unsigned char direction; // REDIS_HEAD or REDIS_TAIL, 往哪个方向走
+    unsigned char *zi;
+    quicklistIter *iter;
+} listTypeIterator;
+
+/**
+ * 迭代器当前指向的元素
+ */
+typedef struct listTypeEntry {
+    listTypeIterator *li;
+    unsigned char *zi;
+    quicklistEntry entry;
+} listTypeEntry;
+
+/**
+ * 跳表节点, level[i].span 是到 level[i].forward 之间跨过的节点数, 累加起来就是 rank
+ */
+typedef struct zskiplistNode {
+    robj *obj;
+    double score;
+    struct zskiplistNode *backward;
+    struct zskiplistLevel {
+        struct zskiplistNode *forward;
+        unsigned int span;
+    } level[];
+} zskiplistNode;
+
+typedef struct zskiplist {
+    zskiplistNode *header, *tail;
+    unsigned long length;
+    int level;
+} zskiplist;
+
+/**
+ * skiplist 编码的 sorted set: 跳表按 score 排序, dict 从 member 查 score,
+ * 两者共享同一个 member 对象, dict 的 value 指向节点中的 score
+ */
+typedef struct zset {
+    dict *dict;
+    zskiplist *zsl;
+} zset;
+
+/**
+ * score 区间, minex/maxex 表示不包含端点
+ */
+typedef struct zrangespec {
+    double min, max;
+    bool minex, maxex;
+} zrangespec;
+
 typedef struct _redisSortObject {
     robj *obj;
     union {
@@ -226,7 +526,10 @@ struct sharedObjectsStruct {
     *wrongtypeerr, *nokeyerr, *wrongtypeerrbulk, *nokeyerrbulk,
     *syntaxerr, *syntaxerrbulk,
     *select0, *select1, *select2, *select3, *select4,
-    *select5, *select6, *select7, *select8, *select9;
+    *select5, *select6, *select7, *select8, *select9,
+    *integers[REDIS_SHARED_INTEGERS],
+    *bulkhdr[REDIS_SHARED_BULKHDR_LEN]; // "<len>\r\n"
+
 } shared;
 
 /*================================ Prototypes =============================== */
@@ -239,12 +542,43 @@ static robj *createObject(int type, void *ptr);
 static void freeClient(redisClient *c);
 static int loadDb(char *filename);
 static void addReply(redisClient *c, robj *obj);
+static void addReplyByRef(redisClient *c, robj *obj);
 static void addReplySds(redisClient *c, sds s);
+static void addReplyLongLong(redisClient *c, long long ll);
+static void addReplyBulkLen(redisClient *c, robj *obj);
+static void addReplyBulk(redisClient *c, robj *obj);
+static void addReplyBulkCBuffer(redisClient *c, const void *p, size_t len);
+static void addReplyBulkLongLong(redisClient *c, long long ll);
+static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 static void incrRefCount(robj *o);
 static int saveDbBackground(char *filename);
+static bool hasActiveChildProcess(void);
+static void closeChildInfoPipe(void);
 static robj *createStringObject(char *ptr, size_t len);
+static robj *getDecodedObject(robj *o);
+static robj *dupStringObject(robj *o);
+static robj *makeObjectShared(robj *o);
+static robj *createStringObjectFromLongLong(long long value);
+static unsigned long listTypeLength(robj *subject);
+static void listTypePush(robj *subject, robj *value, int where);
+static unsigned long setTypeSize(robj *subject);
+static bool setTypeAdd(robj *subject, robj *value);
+static unsigned long hashTypeLength(robj *o);
+static void hashTypeConvert(robj *o);
+static bool hashTypeSet(robj *o, robj *field, robj *value);
+static zskiplist *zslCreate(void);
+static void zslFree(zskiplist *zsl);
+static unsigned long zsetLength(robj *zobj);
+static void zsetConvert(robj *zobj);
+static bool zsetAdd(robj *zobj, double score, robj *ele);
+static int d2string(char *buf, size_t len, double value);
 static void replicationFeedSlaves(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+static sds catAppendOnlyGenericCommand(sds buf, int argc, robj **argv);
+static struct redisCommand *lookupCommand(char *name);
 static int syncWithMaster(void);
+static void freeClientArgv(redisClient *c);
+static void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+static void aofRewriteBufferAppend(const char *s, size_t len);
 
 static void pingCommand(redisClient *c);
 static void echoCommand(redisClient *c);
@@ -252,6 +586,7 @@ static void setCommand(redisClient *c);
 static void setnxCommand(redisClient *c);
 static void getCommand(redisClient *c);
 static void delCommand(redisClient *c);
+static void unlinkCommand(redisClient *c);
 static void existsCommand(redisClient *c);
 static void incrCommand(redisClient *c);
 static void decrCommand(redisClient *c);
@@ -264,6 +599,7 @@ static void dbsizeCommand(redisClient *c);
 static void lastsaveCommand(redisClient *c);
 static void saveCommand(redisClient *c);
 static void bgsaveCommand(redisClient *c);
+static void bgrewriteaofCommand(redisClient *c);
 static void shutdownCommand(redisClient *c);
 static void moveCommand(redisClient *c);
 static void renameCommand(redisClient *c);
@@ -290,37 +626,69 @@ static void flushallCommand(redisClient *c);
 static void sortCommand(redisClient *c);
 static void lremCommand(redisClient *c);
 static void infoCommand(redisClient *c);
+static void hsetCommand(redisClient *c);
+static void hgetCommand(redisClient *c);
+static void hmgetCommand(redisClient *c);
+static void hdelCommand(redisClient *c);
+static void hgetallCommand(redisClient *c);
+static void hincrbyCommand(redisClient *c);
+static void zaddCommand(redisClient *c);
+static void zremCommand(redisClient *c);
+static void zscoreCommand(redisClient *c);
+static void zrankCommand(redisClient *c);
+static void zrangeCommand(redisClient *c);
+static void zrangebyscoreCommand(redisClient *c);
+static void expireCommand(redisClient *c);
+static void expireatCommand(redisClient *c);
+static void ttlCommand(redisClient *c);
+static void persistCommand(redisClient *c);
+static void memoryCommand(redisClient *c);
+static void scanCommand(redisClient *c);
+static void objectCommand(redisClient *c);
 
 /*=========================== 全局变量 ===========================*/
 
 static struct redisServer server;
 static struct redisCommand cmdTable[] = {
     {"get",        getCommand,          2, REDIS_CMD_INLINE},
-    {"set",        setCommand,          3, REDIS_CMD_BULK},
-    {"setnx",      setnxCommand,        3, REDIS_CMD_BULK},
+    {"set",        setCommand,          3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"setnx",      setnxCommand,        3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"del",        delCommand,          2, REDIS_CMD_INLINE},
+    {"unlink",     unlinkCommand,       2, REDIS_CMD_INLINE},
     {"exists",     existsCommand,       2, REDIS_CMD_INLINE},
-    {"incr",       incrCommand,         2, REDIS_CMD_INLINE},
-    {"decr",       decrCommand,         2, REDIS_CMD_INLINE},
-    {"rpush",      rpushCommand,        3, REDIS_CMD_BULK},
-    {"lpush",      lpushCommand,        3, REDIS_CMD_BULK},
+    {"incr",       incrCommand,         2, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"decr",       decrCommand,         2, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"rpush",      rpushCommand,        3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"lpush",      lpushCommand,        3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"rpop",       rpopCommand,         2, REDIS_CMD_INLINE},
     {"lpop",       lpopCommand,         2, REDIS_CMD_INLINE},
     {"llen",       llenCommand,         2, REDIS_CMD_INLINE},
     {"lindex",     lindexCommand,       3, REDIS_CMD_INLINE},
-    {"lset",       lsetCommand,         4, REDIS_CMD_BULK},
+    {"lset",       lsetCommand,         4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"lrange",     lrangeCommand,       4, REDIS_CMD_INLINE},
     {"ltrim",      ltrimCommand,        4, REDIS_CMD_INLINE},
     {"lrem",       lremCommand,         4, REDIS_CMD_BULK},
-    {"sadd",       saddCommand,         3, REDIS_CMD_BULK},
+    {"sadd",       saddCommand,         3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"srem",       sremCommand,         3, REDIS_CMD_BULK},
     {"sismember",  sismemberCommand,    3, REDIS_CMD_BULK},
     {"scard",      scardCommand,        2, REDIS_CMD_INLINE},
     {"sinter",     sinterCommand,      -2, REDIS_CMD_INLINE},
-    {"sinterstore",sinterstoreCommand, -3, REDIS_CMD_INLINE},
+    {"sinterstore",sinterstoreCommand, -3, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
     {"smembers",   sinterCommand,       2, REDIS_CMD_INLINE},
-    {"incrby",     incrbyCommand,       3, REDIS_CMD_INLINE},
-    {"decrby",     decrbyCommand,       3, REDIS_CMD_INLINE},
+    {"hset",       hsetCommand,         4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"hget",       hgetCommand,         3, REDIS_CMD_BULK},
+    {"hmget",      hmgetCommand,       -3, REDIS_CMD_INLINE},
+    {"hdel",       hdelCommand,         3, REDIS_CMD_BULK},
+    {"hgetall",    hgetallCommand,      2, REDIS_CMD_INLINE},
+    {"hincrby",    hincrbyCommand,      4, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"zadd",       zaddCommand,         4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"zrem",       zremCommand,         3, REDIS_CMD_BULK},
+    {"zscore",     zscoreCommand,       3, REDIS_CMD_BULK},
+    {"zrank",      zrankCommand,        3, REDIS_CMD_BULK},
+    {"zrange",     zrangeCommand,      -4, REDIS_CMD_INLINE},
+    {"zrangebyscore",zrangebyscoreCommand,-4, REDIS_CMD_INLINE},
+    {"incrby",     incrbyCommand,       3, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"decrby",     decrbyCommand,       3, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
     {"randomkey",  randomkeyCommand,    1, REDIS_CMD_INLINE},
     {"select",     selectCommand,       2, REDIS_CMD_INLINE},
     {"move",       moveCommand,         3, REDIS_CMD_INLINE},
@@ -332,17 +700,34 @@ static struct redisCommand cmdTable[] = {
     {"echo",       echoCommand,         2, REDIS_CMD_BULK},
     {"save",       saveCommand,         1, REDIS_CMD_INLINE},
     {"bgsave",     bgsaveCommand,       1, REDIS_CMD_INLINE},
+    {"bgrewriteaof",bgrewriteaofCommand, 1, REDIS_CMD_INLINE},
     {"shutdown",   shutdownCommand,     1, REDIS_CMD_INLINE},
     {"lastsave",   lastsaveCommand,     1, REDIS_CMD_INLINE},
     {"type",       typeCommand,         2, REDIS_CMD_INLINE},
     {"sync",       syncCommand,         1, REDIS_CMD_INLINE},
-    {"flushdb",    flushdbCommand,      1, REDIS_CMD_INLINE},
-    {"flushall",   flushallCommand,     1, REDIS_CMD_INLINE},
+    {"flushdb",    flushdbCommand,     -1, REDIS_CMD_INLINE},
+    {"flushall",   flushallCommand,    -1, REDIS_CMD_INLINE},
     {"sort",       sortCommand,        -2, REDIS_CMD_INLINE},
     {"info",       infoCommand,         1, REDIS_CMD_INLINE},
+    {"expire",     expireCommand,       3, REDIS_CMD_INLINE},
+    {"expireat",   expireatCommand,     3, REDIS_CMD_INLINE},
+    {"ttl",        ttlCommand,          2, REDIS_CMD_INLINE},
+    {"persist",    persistCommand,      2, REDIS_CMD_INLINE},
+    {"memory",     memoryCommand,      -2, REDIS_CMD_INLINE},
+    {"scan",       scanCommand,        -2, REDIS_CMD_INLINE},
+    {"object",     objectCommand,       3, REDIS_CMD_INLINE},
     {NULL,         NULL,                0, 0}
 };
 
+static struct redisCommand *lookupCommand(char *name) {
+    for (int j = 0; cmdTable[j].name != NULL; j++) {
+        if (!strcasecmp(name, cmdTable[j].name)) {
+            return &cmdTable[j];
+        }
+    }
+    return NULL;
+}
+
 static void oom(const char *msg) {
     fprintf(stderr, "%s: Out Of Memory\n", msg);
     fflush(stderr);
@@ -387,6 +772,28 @@ static void createSharedObjects(void) {
     shared.select7 = createStringObject("select 7\r\n",10);
     shared.select8 = createStringObject("select 8\r\n",10);
     shared.select9 = createStringObject("select 9\r\n",10);
+    // 共享整数放在一块连续的内存中, 不和短命的对象混在同一页上
+    robj *integers = zmalloc(sizeof(robj) * REDIS_SHARED_INTEGERS);
+    if (integers == NULL) {
+        oom("createSharedObjects");
+    }
+    for (int i = 0; i < REDIS_SHARED_INTEGERS; i++) {
+        shared.integers[i] = integers + i;
+        shared.integers[i]->type = REDIS_STRING;
+        shared.integers[i]->encoding = REDIS_ENCODING_INT;
+        shared.integers[i]->lru = 0;
+        shared.integers[i]->ptr = (void *)(long) i;
+    }
+    for (int i = 0; i < REDIS_SHARED_BULKHDR_LEN; i++) {
+        shared.bulkhdr[i] = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%d\r\n", i));
+    }
+
+    // 共享对象的 refcount 不再变化, 回复它们不会写这些对象所在的页, BGSAVE 时不会被复制.
+    // sharedObjectsStruct 中全部都是 robj 指针
+    robj **objs = (robj **) &shared;
+    for (size_t i = 0; i < sizeof(shared) / sizeof(robj *); i++) {
+        makeObjectShared(objs[i]);
+    }
 }
 
 /*============================ Utility functions ============================ */
@@ -514,6 +921,91 @@ int stringmatchlen(const char *pattern, int patternLen,
     return 0;
 }
 
+/**
+ * v 的十进制位数
+ */
+static uint32_t digits10(uint64_t v) {
+    if (v < 10) return 1;
+    if (v < 100) return 2;
+    if (v < 1000) return 3;
+    if (v < 1000000000000UL) {
+        if (v < 100000000UL) {
+            if (v < 1000000) {
+                if (v < 10000) return 4;
+                return 5 + (v >= 100000);
+            }
+            return 7 + (v >= 10000000UL);
+        }
+        if (v < 10000000000UL) {
+            return 9 + (v >= 1000000000UL);
+        }
+        return 11 + (v >= 100000000000UL);
+    }
+    return 12 + digits10(v / 1000000000000UL);
+}
+
+/**
+ * 有符号版本，负号也算一位
+ */
+static uint32_t sdigits10(int64_t v) {
+    if (v < 0) {
+        uint64_t uv = (v != LLONG_MIN) ? (uint64_t) -v : ((uint64_t) LLONG_MAX) + 1;
+        return digits10(uv) + 1;
+    }
+    return digits10(v);
+}
+
+/**
+ * 把 value 转成字符串写入 dst, dst 的大小是 dstlen.
+ * 先用 digits10 算出长度，然后从低位往高位每次写两位，查表代替一半的除法
+ * @return 写入的字符数(不包括 '\0'), 如果 dst 放不下则返回 0
+ */
+static int ull2string(char *dst, size_t dstlen, unsigned long long value) {
+    static const char digits[201] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    uint32_t length = digits10(value);
+    if (length >= dstlen) {
+        return 0;
+    }
+    uint32_t next = length - 1;
+    dst[length] = '\0';
+    while (value >= 100) {
+        int const i = (value % 100) * 2;
+        value /= 100;
+        dst[next] = digits[i + 1];
+        dst[next - 1] = digits[i];
+        next -= 2;
+    }
+
+    if (value < 10) {
+        dst[next] = '0' + (uint32_t) value;
+    } else {
+        int i = (uint32_t) value * 2;
+        dst[next] = digits[i + 1];
+        dst[next - 1] = digits[i];
+    }
+    return length;
+}
+
+static int ll2string(char *dst, size_t dstlen, long long svalue) {
+    if (svalue >= 0) {
+        return ull2string(dst, dstlen, svalue);
+    }
+    if (dstlen < 2) {
+        return 0;
+    }
+    // LLONG_MIN 取反会溢出，单独处理
+    unsigned long long value = (svalue != LLONG_MIN) ? (unsigned long long) -svalue : ((unsigned long long) LLONG_MAX) + 1;
+    dst[0] = '-';
+    int length = ull2string(dst + 1, dstlen - 1, value);
+    return length == 0 ? 0 : length + 1;
+}
+
 void redisLog(int level, const char *fmt, ...) {
     va_list ap;
     FILE *fp;
@@ -550,8 +1042,12 @@ static bool sdsDictKeyCompare(void *privdata, const void *key1, const void *key2
     return memcmp(key1, key2, l1) == 0;
 }
 
-static dictRedisObjectDestructor(void *privdata, void *val) {
+static void dictRedisObjectDestructor(void *privdata, void *val) {
     DICT_NOTUSED(privdata);
+    // value 已经被 lazyfreeDetachValue 交给后台线程了
+    if (val == NULL) {
+        return;
+    }
     decrRefCount(val);
 }
 
@@ -566,6 +1062,18 @@ static unsigned int dictSdsHash(const void *key) {
     return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
 }
 
+/**
+ * db 的 expires, key 和主 dict 共享, value 是过期时间, 不需要释放
+ */
+static dictType keyptrDictType = {
+    dictSdsHash,                 // hash function
+    NULL,                        // key dup
+    NULL,                        // val dup
+    dictSdsKeyCompare,           // key compare
+    dictRedisObjectDestructor,   // key destructor
+    NULL                         // val destructor
+};
+
 /**
  * set 使用 hashtable 来实现， value is null
  */
@@ -587,1610 +1095,5677 @@ static dictType hashDictType = {
     dictRedisObjectDestructor   // val destructor
 };
 
-/* ====================== Redis objects implmentation ============== */
-static robj *createObject(int type, void *ptr) {
-    robj *o;
-    if (listLength(server.objfreelist) > 0) {
-        listNode *head = listFirst(server.objfreelist);
-        o = listNodeValue(head);
-        listDelNode(server.objfreelist, head);
-    } else {
-        o = zmalloc(sizeof(*o));
-        if (o == NULL) {
-            oom("createObject");
-        }
-    }
+/**
+ * skiplist 编码的 sorted set 中 member -> score, value 指向跳表节点中的 score, 不需要释放
+ */
+static dictType zsetDictType = {
+    dictSdsHash,                // hash function
+    NULL,                       // key dup
+    NULL,                       // val dup
+    dictSdsKeyCompare,          // key compare
+    dictRedisObjectDestructor,  // key destructor
+    NULL                        // val destructor
+};
 
-    o->type = type;
-    o->ptr = ptr;
-    o->refcount = 1;
-    return o;
+/* ====================== LRU / LFU ============== */
+
+static void initObjectLRU(robj *o);
+
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
 }
 
-static robj *createStringObject(char *ptr, size_t len) {
-    return createObject(REDIS_STRING, sdsnewlen(ptr, len));
+static long long mstime(void) {
+    return ustime() / 1000;
 }
 
-static robj *createListObject(void) {
-    list *list = listCreate();
-    if (list == NULL) {
-        oom("listCreate");
-    }
-    listSetFreeMethod(list, decrRefCount);
-    return createObject(REDIS_LIST, list);
+static unsigned int getLRUClock(void) {
+    return (mstime() / REDIS_LRU_CLOCK_RESOLUTION) & REDIS_LRU_CLOCK_MAX;
 }
 
-static robj *createSetObject(void) {
-    dict *d = dictCreate(&setDictType, NULL);
-    if (d == NULL) {
-        oom("dictCreate");
+/**
+ * serverCron 每秒刷新一次 server.lruclock, 精度和 REDIS_LRU_CLOCK_RESOLUTION 相同,
+ * 访问对象时直接读缓存的值, 不需要每次都 gettimeofday
+ */
+#define LRU_CLOCK() (server.lruclock)
+
+/**
+ * 对象多久没被访问了(毫秒), 时钟 24 位, 大约 194 天回绕一次
+ */
+static unsigned long long estimateObjectIdleTime(robj *o) {
+    unsigned long long lruclock = LRU_CLOCK();
+    if (lruclock >= o->lru) {
+        return (lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
     }
-    return createObject(REDIS_SET, d);
+    return (lruclock + (REDIS_LRU_CLOCK_MAX - o->lru)) * REDIS_LRU_CLOCK_RESOLUTION;
 }
 
-#if 0
-static robj *createHashObject(void) {
-    dict *d = dictCreate(&hashDictType,NULL);
-    if (!d) oom("dictCreate");
-    return createObject(REDIS_SET,d);
+/**
+ * LFU 模式下 lru 的高 16 位是最近一次衰减的时间(分钟), 低 8 位是对数计数器
+ */
+static unsigned long LFUGetTimeInMinutes(void) {
+    return (time(NULL) / 60) & 65535;
 }
-#endif
 
-static void freeStringObject(robj *o) {
-    sdsfree(o->ptr);
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) {
+        return now - ldt;
+    }
+    return 65535 - ldt + now;
 }
 
-static void freeListObject(robj *o) {
-    listRelease((list*) o->ptr);
+/**
+ * 计数器越大, 再加一的概率越小, 8 位就可以区分百万级的访问次数
+ */
+static uint8_t LFULogIncr(uint8_t counter) {
+    if (counter == 255) {
+        return 255;
+    }
+    double r = (double) rand() / RAND_MAX;
+    double baseval = counter - REDIS_LFU_INIT_VAL;
+    if (baseval < 0) {
+        baseval = 0;
+    }
+    double p = 1.0 / (baseval * server.lfu_log_factor + 1);
+    if (r < p) {
+        counter++;
+    }
+    return counter;
 }
 
-static void freeSetObject(robj *o) {
-    dictRelease((dict *) o->ptr);
+/**
+ * 每过 lfu_decay_time 分钟计数器减一, 让很久以前的热 key 能被淘汰
+ */
+static unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long periods = server.lfu_decay_time ? LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+    if (periods > 0) {
+        counter = (periods > counter) ? 0 : counter - periods;
+    }
+    return counter;
 }
 
-static void freeHashObject(robj *o) {
-    dictRelease((dict *) o->ptr);
+static bool maxmemoryPolicyIsLFU(void) {
+    return server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LFU;
 }
 
-static void incrRefCount(robj *o) {
-    o->refcount++;
+/**
+ * 按 LRU/LFU 淘汰时每个 key 需要自己的 lru 字段, 不能使用共享整数对象
+ */
+static bool canUseSharedIntegers(void) {
+    return server.maxmemory == 0 ||
+           (server.maxmemory_policy != REDIS_MAXMEMORY_ALLKEYS_LRU && server.maxmemory_policy != REDIS_MAXMEMORY_ALLKEYS_LFU);
 }
 
-static void decrRefCount(void *obj) {
-    robj *o = obj;
-    if (--(o->refcount) == 0) {
-        switch (o->type) {
-        case REDIS_STRING:
-            freeStringObject(o);
-            break;
-        case REDIS_LIST:
-            freeListObject(o);
-            break;
-        case REDIS_SET:
-            freeSetObject(o);
-            break;
-        case REDIS_HASH:
-            freeHashObject(o);
-            break;
-        default:
-            assert(false);
-            break;
-        }
-
-        if (listLength(server.objfreelist) > REDIS_OBJFREELIST_MAX ||
-            listAddNodeHead(server.objfreelist, o) == NULL) {
-            zfree(o);
-        }
+static void initObjectLRU(robj *o) {
+    if (maxmemoryPolicyIsLFU()) {
+        o->lru = (LFUGetTimeInMinutes() << 8) | REDIS_LFU_INIT_VAL;
+    } else {
+        o->lru = LRU_CLOCK();
     }
 }
 
-/* ===================== Replication ========================= */
-
 /**
- * Send the whole output buffer syncronously to the slave
+ * 访问 key 时更新 value 的 lru. BGSAVE/BGREWRITEAOF 期间不更新, 否则子进程的内存页会因为这个被写时复制
  */
-static int flushClientOutput(redisClient *c) {
-    time_t start = time(NULL);
-    while (listLength(c->reply) > 0) {
-        if (time(NULL) - start > 5) {
-            return REDIS_ERR; // 5 seconds timeout
-        }
-        int retval = aeWait(c->fd, AE_WRITABLE, 1000);
-        if (retval == -1) {
-            return REDIS_ERR;
-        } else if (isWritable(retval)) {
-            sendReplyToClient(NULL, c->fd, c, AE_WRITABLE);
-        }
+static void touchObject(robj *o) {
+    if (hasActiveChildProcess()) {
+        return;
+    }
+    if (maxmemoryPolicyIsLFU()) {
+        unsigned long counter = LFULogIncr(LFUDecrAndReturn(o));
+        o->lru = (LFUGetTimeInMinutes() << 8) | counter;
+    } else {
+        o->lru = LRU_CLOCK();
     }
-    return REDIS_OK;
 }
 
+/* ====================== Lazy free ============== */
+
+/** 后台线程中为 true, 此时 decrRefCount 不能访问主线程的 objfreelist */
+static __thread bool lazyfreeThread = false;
+
+/** 主线程和 bio 线程都会修改, 用原子操作 */
+static size_t lazyfreePendingObjects = 0;
+static size_t lazyfreedObjects = 0;
 
 /**
- * 将 ptr 中的 size 个字节在 timeout 的时间内写入到 fd 中
+ * 释放 o 大约需要多少次 free, 字符串和紧凑编码的对象都只需要一次
  */
-static int syncWrite(int fd, void *ptr, ssize_t size, int timeout) {
-    ssize_t ret = size;
-    ssize_t nwritten;
-    time_t start = time(NULL);
+static size_t lazyfreeGetFreeEffort(robj *o) {
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_QUICKLIST) {
+        return ((quicklist *) o->ptr)->len;
+    } else if ((o->type == REDIS_SET || o->type == REDIS_HASH) && o->encoding == REDIS_ENCODING_HT) {
+        return dictGetHashTableUsed((dict *) o->ptr);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_SKIPLIST) {
+        return ((zset *) o->ptr)->zsl->length;
+    }
+    return 1;
+}
 
-    timeout++;
-    while (size != 0) {
-        if ((aeWait(fd, AE_WRITABLE, 1000) & AE_WRITABLE) != 0) {
-            nwritten = write(fd, ptr, size);
-            if (nwritten == -1) {
-                return -1;
-            }
-            ptr += nwritten;
-            size -= nwritten;
-        }
-        if ((time(NULL) - start) > timeout) {
-            errno = ETIMEDOUT;
-            return -1;
-        }
+static void lazyfreeFreeObjectFromBioThread(void *o, void *unused) {
+    REDIS_NOTUSED(unused);
+    lazyfreeThread = true;
+    decrRefCount(o);
+    __atomic_fetch_sub(&lazyfreePendingObjects, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lazyfreedObjects, 1, __ATOMIC_RELAXED);
+}
+
+static void lazyfreeFreeDbFromBioThread(void *d, void *expires) {
+    lazyfreeThread = true;
+    size_t numkeys = dictGetHashTableUsed((dict *) d);
+    // expires 的 key 和 d 共享, 先释放 expires
+    dictRelease(expires);
+    dictRelease(d);
+    __atomic_fetch_sub(&lazyfreePendingObjects, numkeys, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lazyfreedObjects, numkeys, __ATOMIC_RELAXED);
+}
+
+/**
+ * 把 de 的 value 交给后台线程释放, de 的 value 置为 NULL, 之后删除或者替换 de 时不会再释放它.
+ * 只需要检查 value 本身的 refcount: reply 链表不引用 db 中的对象(见 _addReplyObjectToList),
+ * 集合的成员也不会在 key 之间共享(见 sinterGenericCommand)
+ * @return false 对象太小或者还被别人引用, 调用方照常同步释放
+ */
+static bool lazyfreeDetachValue(dict *d, dictEntry *de) {
+    robj *val = dictGetEntryVal(de);
+    if (val->refcount != 1 || lazyfreeGetFreeEffort(val) <= REDIS_LAZYFREE_THRESHOLD) {
+        return false;
     }
-    return ret;
+    __atomic_fetch_add(&lazyfreePendingObjects, 1, __ATOMIC_RELAXED);
+    dictSetHashVal(d, de, NULL);
+    bioCreateBackgroundJob(BIO_LAZY_FREE, lazyfreeFreeObjectFromBioThread, val, NULL);
+    return true;
 }
 
-static int syncRead(int fd, void *ptr, ssize_t size, int timeout) {
-    ssize_t nread, totread = 0;
-    time_t start = time(NULL);
-    timeout++;
+/**
+ * 把 dbid 的 dict 和 expires 整个交给后台线程释放, 换上空的
+ */
+static void emptyDbAsync(int dbid) {
+    dict *d = server.dict[dbid];
+    dict *expires = server.expires[dbid];
+    if (dictGetHashTableUsed(d) == 0) {
+        return;
+    }
+    __atomic_fetch_add(&lazyfreePendingObjects, dictGetHashTableUsed(d), __ATOMIC_RELAXED);
+    server.dict[dbid] = dictCreate(&hashDictType, NULL);
+    server.expires[dbid] = dictCreate(&keyptrDictType, NULL);
+    if (server.dict[dbid] == NULL || server.expires[dbid] == NULL) {
+        oom("dictCreate");
+    }
+    bioCreateBackgroundJob(BIO_LAZY_FREE, lazyfreeFreeDbFromBioThread, d, expires);
 
-    while (size != 0) {
-        if (aeWait(fd, AE_READABLE, 1000) & AE_READABLE) {
-            nread = read(fd, ptr, size);
-            if (nread == -1) {
-                return -1;
-            }
-            ptr += nread;
-            size -= nread;
-            totread += nread;
-        }
-        if ((time(NULL) - start) > timeout) {
-            errno = ETIMEDOUT;
-            return -1;
+    // 选中这个 db 的 client 还指向旧的 dict
+    listIter *it = listGetIterator(server.clients, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    listNode *node;
+    while ((node = listNextElement(it)) != NULL) {
+        redisClient *c = listNodeValue(node);
+        if (c->dictid == dbid) {
+            c->dict = server.dict[dbid];
         }
     }
-    return totread;
+    listReleaseIterator(it);
 }
 
+/* ====================== Expire ============== */
+
 /**
- * 读一行，\n 和 \r\n 都算作 line end flag
- * @return char size of line
+ * 每个 db 有一个 expires dict: key -> 过期时间(unix time, 秒).
+ * key 和主 dict 共享同一个 robj, 过期时间直接存放在 value 指针中
  */
-static int syncReadLine(int fd, char *ptr, ssize_t size, int timeout) {
-    ssize_t nread = 0;
-    size--;
-    while (size != 0) {
-        char c;
-        if (syncRead(fd, &c, 1, timeout) == -1) {
-            return -1;
-        }
-        if (c == '\n') {
-            *ptr = '\0';
-            if (nread != 0 && *(ptr-1) == '\r') {
-                *(ptr-1) = '\0';
-            }
-            return nread;
-        } else {
-            *ptr++ = c;
-            *ptr = '\0';
-            nread++;
-        }
+
+/**
+ * @return -1 没有设置过期时间
+ */
+static time_t getExpire(int dbid, robj *key) {
+    dict *expires = server.expires[dbid];
+    dictEntry *de;
+    if (dictGetHashTableUsed(expires) == 0 || (de = dictFind(expires, key)) == NULL) {
+        return -1;
     }
-    return nread;
+    return (time_t) dictGetEntryVal(de);
 }
 
-static int writeFileToClient(int fileFd, int fileLen, int clientFd, int start) {
-    char sizebuf[32];
-    snprintf(sizebuf, "%d\r\n", fileLen);
-    // 1. 写文件大小
-    if (syncWrite(clientFd, sizebuf, strlen(sizebuf), 5) == -1) {
-        return REDIS_ERR;
+/**
+ * @param key 必须是主 dict 中的 key 对象
+ */
+static void setExpire(int dbid, robj *key, time_t when) {
+    dict *expires = server.expires[dbid];
+    dictEntry *de = dictFind(expires, key);
+    if (de != NULL) {
+        dictSetHashVal(expires, de, (void *) when);
+    } else {
+        dictAdd(expires, key, (void *) when);
+        incrRefCount(key);
     }
+}
 
-    // 2. 写文件内容
-    while (fileLen > 0) {
-       char buf[1024];
-        int nread;
-        if (time(NULL) - start > REDIS_MAX_SYNC_TIME) {
-            return REDIS_ERR;
-        }
-        nread = read(fileFd, buf, 1024);
-        if (nread == -1) {
-            return REDIS_ERR;
-        }
-        fileLen -= nread;
-        if (syncWrite(clientFd, buf, nread, 5) == -1) {
-            return REDIS_ERR;
-        } 
-    }
-    return syncWrite(fileFd, "\r\n", 2, 5) == -1 ? REDIS_ERR : REDIS_OK;
+static bool removeExpire(int dbid, robj *key) {
+    dict *expires = server.expires[dbid];
+    return dictGetHashTableUsed(expires) > 0 && dictDelete(expires, key) == DICT_OK;
 }
 
 /**
- * 将 dbfile 的内容同步到 client，如果同步成功 client 就是 slave 了, 否则标记为 close 状态
+ * 从 db 中删除 key, 同时删除它的过期时间
  */
-static void syncCommand(redisClient *c) {
-    time_t start = time(NULL);
-    int fd = -1;
-    redisLog(REDIS_NOTICE, "Slave ask for syncronization");
-    if (flushClientOutput(c) == REDIS_ERR || saveDb(server.dbfilename) != REDIS_OK) {
-        goto closeconn;
-    }
-
-    struct stat sb;
-    fd = open(server.dbfilename, O_RDONLY);
-    if (fd == -1 || fstat(fd, &sb) == -1) {
-        goto closeconn;
-    }
-    writeFileToClient(fd, sb.st_size, c->fd, start);
-    close(fd);
+static bool deleteKey(int dbid, robj *key) {
+    removeExpire(dbid, key);
+    return dictDelete(server.dict[dbid], key) == DICT_OK;
+}
 
-    c->flags |= REDIS_SLAVE;
-    c->slaveseldb = 0;
-    if (!listAddNodeTail(server.slaves, c)) {
-        oom("listAddNodeTail of slave");
+/**
+ * 和 deleteKey 一样, 但是大对象交给后台线程释放
+ */
+static bool unlinkKey(int dbid, robj *key) {
+    removeExpire(dbid, key);
+    dict *d = server.dict[dbid];
+    dictEntry *de = dictFind(d, key);
+    if (de == NULL) {
+        return false;
     }
-    redisLog(REDIS_NOTICE, "Syncronization with slave succeeded");
-    return;
+    lazyfreeDetachValue(d, de);
+    dictDelete(d, key);
+    return true;
+}
 
-    closeconn:
-        if (fd != -1) {
-            close(fd);
-        }
-        c->flags |= REDIS_CLOSE;
-        redisLog(REDIS_WARNING, "Syncronization with slave failed.");
-        return;
+static bool keyIsExpired(int dbid, robj *key) {
+    time_t when = getExpire(dbid, key);
+    return when != -1 && time(NULL) > when;
 }
 
 /**
- * 读取 master 上的 rdb 文件，替换掉自己的 dbfile
- * @param dumpsize master 上 rdb 文件的大小
- * @param fd master 连接
+ * 过期和淘汰都是 master 自己决定的, 以 DEL 的形式发给 slave 和 AOF, 保证 slave 和重放时删除同样的 key
  */
-static int dumpMasterRDB(int dumpsize, int fd) {
-    char tmpfile[256];
-    snprintf(tmpfile, 256, "temp-%d.%ld.rdb", (int)time(NULL), (long int)random());
-    int dfd = open(tmpfile, O_CREAT|O_WRONLY, 0644);
-    if (dfd == -1) {
-        redisLog(REDIS_WARNING, "Opening the temp file needed for MASTER <-> SLAVE syncrhonization: %s", strerror(errno));
-        return REDIS_ERR;
+static void propagateDel(int dbid, robj *key) {
+    if (listLength(server.slaves) == 0 && !server.appendonly) {
+        return;
     }
-
-    char buf[1024];
-    while (dumpsize > 0) {
-        int nread = read(fd, buf, (dumpsize < 1024 ? dumpsize : 1024));
-        if (nread == -1) {
-            redisLog(REDIS_WARNING, "I/O error trying to sync with MASTER: %s", strerror(errno));
-            close(dfd);
-            return REDIS_ERR;
-        }
-
-        int nwritten = write(dfd, buf, nread);
-        if (nwritten == -1) {
-            redisLog(REDIS_WARNING, "Write error writing to the DB dump file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
-            close(dfd);
-            return REDIS_ERR;
-        }
-
-        dumpsize -= nread;
+    robj *argv[2];
+    argv[0] = createStringObject("DEL", 3);
+    argv[1] = key;
+    incrRefCount(key);
+    struct redisCommand *delcmd = lookupCommand("del");
+    if (server.appendonly) {
+        feedAppendOnlyFile(delcmd, dbid, argv, 2);
     }
-    close(dfd);
-    if (rename(tmpfile, server.dbfilename) == -1) {
-        redisLog(REDIS_WARNING, "Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE syncrhonization: %s", strerror(errno));
-        unlink(tmpfile);
-        return REDIS_ERR;
+    if (listLength(server.slaves) > 0) {
+        replicationFeedSlaves(delcmd, dbid, argv, 2);
     }
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+}
 
+static void expireKey(int dbid, robj *key) {
+    propagateDel(dbid, key);
+    if (server.lazyfree_lazy_expire) {
+        unlinkKey(dbid, key);
+    } else {
+        deleteKey(dbid, key);
+    }
+    server.stat_expiredkeys++;
 }
 
-static int syncWithMaster() {
-    int fd = anetTcpConnect(NULL, server.masterhost, server.masterhost);
-    if (fd == -1) {
-        redisLog(REDIS_WARNING, "unable to connect to MASTER: %s", strerror(errno));
-        return REDIS_ERR;
+/**
+ * 惰性过期: 访问 key 时检查是否已经过期, 过期了就删除.
+ * slave 不自己删除, 等 master 发来的 DEL, 在这之前只是把 key 当作不存在
+ * @return true 如果 key 已经过期
+ */
+static bool expireIfNeeded(int dbid, robj *key) {
+    if (!keyIsExpired(dbid, key)) {
+        return false;
     }
+    if (server.masterhost == NULL) {
+        expireKey(dbid, key);
+    }
+    return true;
+}
 
-    // 1. 发送 SYNC 标记，准备同步
-    if (syncWrite(fd, "SYNC \r\n", 7, 5) == -1) {
-        close(fd);
-        redisLog(REDIS_WARNING, "I/O error writing to MASTER: %s", strerror(errno));
-        return REDIS_ERR;
+/**
+ * 主动过期: 过期后再也不被访问的 key 只靠惰性过期永远不会被删除.
+ * 每个 db 随机采样 REDIS_EXPIRE_LOOKUPS_PER_LOOP 个设置了过期时间的 key, 删除其中已经过期的,
+ * 过期的超过 1/4 说明还有很多, 继续采样. 总耗时不超过 REDIS_EXPIRE_CYCLE_TIME_LIMIT 毫秒, 避免阻塞太久
+ */
+static void activeExpireCycle(void) {
+    long long start = mstime();
+    time_t now = time(NULL);
+    int iteration = 0;
+    for (int j = 0; j < server.dbnum; j++) {
+        dict *expires = server.expires[j];
+        int expired;
+        do {
+            unsigned long num = dictGetHashTableUsed(expires);
+            if (num == 0) {
+                break;
+            }
+            if (num > REDIS_EXPIRE_LOOKUPS_PER_LOOP) {
+                num = REDIS_EXPIRE_LOOKUPS_PER_LOOP;
+            }
+            expired = 0;
+            while (num--) {
+                dictEntry *de = dictGetRandomKey(expires);
+                if (de == NULL) {
+                    break;
+                }
+                if (now > (time_t) dictGetEntryVal(de)) {
+                    expireKey(j, dictGetEntryKey(de));
+                    expired++;
+                }
+            }
+            if ((++iteration & 15) == 0 && mstime() - start > REDIS_EXPIRE_CYCLE_TIME_LIMIT) {
+                return;
+            }
+        } while (expired > REDIS_EXPIRE_LOOKUPS_PER_LOOP / 4);
     }
+}
 
-    // 2. 读取 master 的 rdb
-    char buf[1024];
-    if (syncRead(fd, buf, 1024, 5) == -1) {
-        close(fd);
-        redisLog(REDIS_WARNING, "I/O error reading bulk count from MASTER: %s", strerror(errno));
-        return REDIS_ERR;
+/**
+ * 命令查找 key 都走这里, 已经过期的 key 当作不存在, 没过期的记录一次访问
+ */
+static dictEntry *lookupKeyEntry(redisClient *c, robj *key) {
+    if (expireIfNeeded(c->dictid, key)) {
+        return NULL;
     }
-    int dumpsize = atoi(buf);
-    redisLog(REDIS_NOTICE, "Receiving %d bytes data dump from MASTER", dumpsize);
-    if (dumpMasterRDB(dumpsize, fd) != REDIS_OK) {
-        close(fd);
-        return REDIS_ERR;
+    dictEntry *de = dictFind(c->dict, key);
+    if (de != NULL) {
+        touchObject(dictGetEntryVal(de));
     }
-    
-    emptyDb();
-    if (loadDb(server.dbfilename) != REDIS_OK) {
-        redisLog(REDIS_WARNING, "Failed tring to load the MASTER synchronization DB from disk");
-        close(fd);
-        return REDIS_ERR;
+    return de;
+}
+
+/* ====================== Redis objects implmentation ============== */
+static robj *createObject(int type, void *ptr) {
+    robj *o;
+    if (server.objfreelist != NULL) {
+        o = server.objfreelist;
+        server.objfreelist = o->ptr;
+        if (--server.objfreelist_len < server.objfreelist_lowwater) {
+            server.objfreelist_lowwater = server.objfreelist_len;
+        }
+    } else {
+        o = zmalloc(sizeof(*o));
+        if (o == NULL) {
+            oom("createObject");
+        }
     }
 
-    server.master = createClient(fd);
-    server.master->flags |= REDIS_MASTER;
-    server.replstate = REDIS_REPL_CONNECTED;
-    return REDIS_OK;
+    o->type = type;
+    o->encoding = REDIS_ENCODING_RAW;
+    o->ptr = ptr;
+    o->refcount = 1;
+    initObjectLRU(o);
+    return o;
 }
 
-/* =========================== RDB save ===================== */
+static robj *createRawStringObject(char *ptr, size_t len) {
+    return createObject(REDIS_STRING, sdsnewlen(ptr, len));
+}
 
 /**
- * 格式: sds length, sds content
+ * robj, sdshdr8, buf 只申请一次内存:
+ * +------+---------+---------------+
+ * | robj | sdshdr8 | buf[len] '\0' |
+ * +------+---------+---------------+
+ * 这块内存直接 zfree, 不会进入 objfreelist; sds 也不能再 resize, 需要修改的话只能新建对象
  */
-static int writeSdsToFile(sds sval, FILE *fp) {
-    size_t valsize = sdslen(sval);
-    uint32_t len = htonl(valsize);
-    if (fwrite(&len, 4, 1, fp) == 0 || (valsize > 0 && fwrite(sval, valsize, 1, fp) == 0)) {
-        return REDIS_ERR;
+static robj *createEmbeddedStringObject(char *ptr, size_t len) {
+    robj *o = zmalloc(sizeof(robj) + sizeof(struct sdshdr8) + len + 1);
+    if (o == NULL) {
+        oom("createEmbeddedStringObject");
+    }
+    struct sdshdr8 *sh = (void *)(o + 1);
+    sh->len = len;
+    sh->alloc = len;
+    sh->flags = SDS_TYPE_8;
+    if (ptr != NULL) {
+        memcpy(sh->buf, ptr, len);
     } else {
-        return REDIS_OK;
+        memset(sh->buf, 0, len);
     }
+    sh->buf[len] = '\0';
+
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sh->buf;
+    o->refcount = 1;
+    initObjectLRU(o);
+    return o;
 }
 
 /**
- * 格式: list size, [entry length, entry content, ...]
+ * 短字符串使用 EMBSTR 编码，分配次数减半；长字符串仍然是 robj + sds 两次分配
  */
-static int writeListToFile(list *list, FILE *fp) {
-    listNode *node = list->head;
-    uint32_t len = htonl(listLength(list));
-    if (fwrite(&len, 4, 1, fp) == 0) {
-        return REDIS_ERR;
-    }
-    while (node != NULL) {
-        robj *eleobj = listNodeValue(node);
-        size_t valsize = sdslen(eleobj->ptr);
-        len = htonl(valsize);
-        if (fwrite(&len, 4, 1, fp) == 0 || (valsize > 0 && fwrite(eleobj->ptr, valsize, 1, fp) == 0)) {
-            return REDIS_ERR;
-        }
-        node = node->next;
+static robj *createStringObject(char *ptr, size_t len) {
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        return createEmbeddedStringObject(ptr, len);
     }
-    return REDIS_OK;
+    return createRawStringObject(ptr, len);
 }
 
 /**
- * 格式: set size, [entry length, entry content, ...]
+ * [0, REDIS_SHARED_INTEGERS) 直接返回共享对象，能放进 long 的用整数编码，其余的退化成 sds
  */
-static int writeSetToFile(dict *set, FILE *fp) {
-    dictIterator *it = dictGetIterator(set);
-    if (it == NULL) {
-        oom("dictGetIterator");
-    }
-    uint32_t len = htonl(dictGetHashTableUsed(set));
-    if (fwrite(&len, 4, 1, fp) == 0) {
-        return REDIS_ERR;
-    }
-    dictEntry *entry;
-    while ((entry = dictNext(it)) != NULL) {
-        robj *eleobj = dictGetEntryKey(entry);
-        size_t keylen = sdslen(eleobj->ptr);
-        len = htonl(keylen);
-        if (fwrite(&len, 4, 1, fp) == 0 || (keylen > 0 && fwrite(eleobj->ptr, keylen, 1, fp) == 0)) {
-            return REDIS_ERR;
-        }
-    }
-    dictReleaseIterator(it);
-    return REDIS_OK;
+static robj *createStringObjectFromLongLong(long long value) {
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS && canUseSharedIntegers()) {
+        incrRefCount(shared.integers[value]);
+        return shared.integers[value];
+    }
+    if (value >= LONG_MIN && value <= LONG_MAX) {
+        robj *o = createObject(REDIS_STRING, (void *)((long) value));
+        o->encoding = REDIS_ENCODING_INT;
+        return o;
+    }
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    return createStringObject(buf, len);
 }
 
 /**
- * @param it 一个 redis db 对应一个 dict, 这里的it就是该 dict 的 iterator
- * 格式: [type, key length, key content, value], vaulue 可能是: sds, list, set; key 一定是 sds
+ * s 是否是一个规范的整数表示：不能有前导0、空格、'+' 之类，转回字符串后必须和 s 完全一样
  */
-static int writeOneDBToFile(dictIterator *it, FILE *fp) {
-    dictEntry *entry;
-    while ((entry = dictNext(it)) != NULL) {
-        robj *key = dictGetEntryKey(entry);
-        robj *o = dictGetEntryVal(entry);
-        uint8_t type = o->type; 
-        if (fwrite(&type, 1, 1, fp) == 0) {
-            return REDIS_ERR;
-        }
-
-        uint32_t len = htonl(sdslen(key->ptr));
-        if (fwrite(&len, 4, 1, fp) == 0 || fwrite(key->ptr, sdslen(key->ptr), 1, fp) == 0) {
-            return REDIS_ERR;
-        }
+static bool isStringRepresentableAsLong(sds s, long *longval) {
+    size_t slen = sdslen(s);
+    if (slen == 0 || slen > 20) {
+        return false;
+    }
 
-        int status = REDIS_ERR;
-        switch (type) {
-        case REDIS_STRING:
-            status = writeSdsToFile(o->ptr, fp); 
-            break;
-        case REDIS_LIST:
-            status = writeListToFile(o->ptr, fp);
-            break;
-        case REDIS_SET:
-            status = writeSetToFile(o->ptr, fp);
-            break;
-        default:
-            assert(false);
-        }
-        if (status != REDIS_OK) {
-            return REDIS_ERR;
-        }
+    char *endptr;
+    errno = 0;
+    long value = strtol(s, &endptr, 10);
+    if (errno == ERANGE || endptr[0] != '\0') {
+        return false;
     }
 
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    if ((size_t) len != slen || memcmp(buf, s, len) != 0) {
+        return false;
+    }
+    *longval = value;
+    return true;
 }
 
 /**
- * 先写 temp file, 写成功后再原子的 rename 成 filename
- * 格式：
- *     REDIS0000
- *     [254, db_no, db content, ...] // 1. 254 REDIS_SELECTDB; 2. 无数据的DB忽略掉
- *     255 // REDIS_EOF
- *      
- * 
+ * 尝试把 string object 转成整数编码，用来节省内存.
+ * 小整数会直接替换成共享对象，此时 o 会被 decrRefCount, 调用方要使用返回值.
+ * 只有独占(refcount == 1)的对象才能被转换，否则其他持有者看到的 ptr 会变掉
  */
-static int saveDb(char *filename) {
-    char tmpfile[256];
-    snprintf(tmpfile, 256, "temp-%d.%ld.rdb", (int) time(NULL), (long int) random());
-    FILE *fp = fopen(tmpfile, "w");
-    if (fp == NULL) {
-        redisLog(REDIS_WARNING, "Failed saving the DB: %s", strerror(errno));
-        return REDIS_ERR;
+static robj *tryObjectEncoding(robj *o) {
+    if (o->type != REDIS_STRING || !sdsEncodedObject(o) || o->refcount > 1) {
+        return o;
     }
 
-    /**
-     * fwrite(ptr, size, nsize, stream)
-     * ptr: 要写入的内容
-     * size: 每个元素的大小，单位是字节
-     * nsize: 写入的元素个数
-     */
-    if (fwrite("REDIS0000", 9, 1, fp) == 0) {
-        goto werr;
+    long value;
+    if (!isStringRepresentableAsLong(o->ptr, &value)) {
+        return o;
     }
 
-    dictIterator *dictIt = NULL;
-    for (int i = 0; i < server.dbnum; i++) {
-        dict *d = server.dict[i];
-        if (dictGetHashTableUsed(d) == 0) {
-            continue;
-        }
-
-        uint8_t type = REDIS_SELECTDB;
-        uint32_t len = htonl(i);
-        if (fwrite(&type, 1, 1, fp) == 0) { goto werr; }
-        if (fwrite(&len, 4, 1, fp) == 0) { goto werr; }
-
-        dictIt = dictGetIterator(d);
-        if (dictIt == NULL) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
-        int status = writeOneDBToFile(dictIt, fp);
-        if (status != REDIS_OK) {
-            goto werr;
-        }
-        dictReleaseIterator(dictIt);
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS && canUseSharedIntegers()) {
+        decrRefCount(o);
+        incrRefCount(shared.integers[value]);
+        return shared.integers[value];
     }
-    uint8_t type = REDIS_EOF;
-    if (fwrite(&type, 1, 1, fp) == 0) { goto werr; }
-    fflush(fp);
-    // flush file data and metadata
-    fsync(fileno(fp));
-    fclose(fp);
+    if (o->encoding == REDIS_ENCODING_EMBSTR) {
+        // EMBSTR 的 sds 不能单独释放，换成一个新的整数对象
+        decrRefCount(o);
+        return createStringObjectFromLongLong(value);
+    }
+    sdsfree(o->ptr);
+    o->encoding = REDIS_ENCODING_INT;
+    o->ptr = (void *) value;
+    return o;
+}
 
-    // 如果 DB file 生成成功了，原子的切换
-    if (rename(tmpfile, filename) == -1) {
-        redisLog(REDIS_WARNING, "Error moving temp DB file on the final destionation: %s", strerror(errno));
-        unlink(tmpfile);
-        return REDIS_ERR;
-    } else {
-        redisLog(REDIS_NOTICE, "DB saved on disk");
-        server.dirty = 0;
-        server.lastsave = time(NULL);
-        return REDIS_OK;
+/**
+ * 返回 o 的 sds 表示，调用方用完后需要 decrRefCount.
+ * raw/embstr 编码直接增加引用计数返回 o 本身，整数编码则新建一个 string object
+ */
+static robj *getDecodedObject(robj *o) {
+    if (sdsEncodedObject(o)) {
+        incrRefCount(o);
+        return o;
     }
 
-    werr:
-        flose(fp);
-        unlink(tmpfile);
-        redisLog(REDIS_WARNING, "Write error saving DB on disk: %s", strerror(errno));
-        if (dictIt != NULL) {
-            dictReleaseIterator(dictIt);
-        }
-        return REDIS_ERR;
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), (long) o->ptr);
+    return createStringObject(buf, len);
 }
 
 /**
- * @return REDIS_OK on success, or REDIS_ERR
+ * 拷贝一个 string object, 新对象的 refcount 为 1
  */
-static int saveDbBackground(char *filename) {
-    if (server.bgsaveinprogress) {
-        return REDIS_ERR;
+static robj *dupStringObject(robj *o) {
+    if (sdsEncodedObject(o)) {
+        return createStringObject(o->ptr, sdslen(o->ptr));
     }
+    robj *d = createObject(REDIS_STRING, o->ptr);
+    d->encoding = REDIS_ENCODING_INT;
+    return d;
+}
 
-    pid_t childpid = fork();
-    if (childpid == 0) {
-        // todo: why close server.fd ?
-        close(server.fd);
-        if (saveDb(filename) == REDIS_OK) {
-            exit(0);
-        } else {
-            exit(1);
-        }
-    } else {
-        redisLog(REDIS_NOTICE, "Background saving started by pid %d", childpid);
-        server.bgsaveinprogress = true;
-        return REDIS_OK;
+/**
+ * string object 的字符串长度，整数编码不需要 decode
+ */
+static size_t stringObjectLen(robj *o) {
+    if (sdsEncodedObject(o)) {
+        return sdslen(o->ptr);
     }
-    return REDIS_OK;
+    return sdigits10((long) o->ptr);
 }
 
-static void waitBgsaveFinish() {
-    int statloc;
-    if (wait4(-1, &statloc, WNOHANG, NULL)) {
-        int exitcode = WEXITSTATUS(statloc);
-        if (exitcode == 0) {
-            redisLog(REDIS_NOTICE, "Background saving terminated with success");
-            server.dirty = 0;
-            server.lastsave = time(NULL);
-        } else {
-            redisLog(REDIS_WARNING, "Background saving error");
-        }
-        server.bgsaveinprogress = false;
+static robj *createQuicklistObject(void) {
+    quicklist *l = quicklistNew(server.list_max_ziplist_size, server.list_compress_depth);
+    robj *o = createObject(REDIS_LIST, l);
+    o->encoding = REDIS_ENCODING_QUICKLIST;
+    return o;
+}
+
+static robj *createZiplistObject(void) {
+    unsigned char *zl = ziplistNew();
+    if (zl == NULL) {
+        oom("ziplistNew");
     }
+    robj *o = createObject(REDIS_LIST, zl);
+    o->encoding = REDIS_ENCODING_ZIPLIST;
+    return o;
 }
 
-static void bgsaveIfNeed() {
-    time_t now = time(NULL);
-    for (int i = 0; i < server.saveparamslen; i++) {
-        struct saveparam *sp = server.saveparams + i;
-        if (server.dirty >= sp->changes && (now - server.lastsave) > sp->seconds) {
-            redisLog(REDIS_NOTICE, "%d changes in %d seconds, Saving...", sp->changes, sp->seconds);
-            saveDbBackground(server.dbfilename);
-            break;
-        }
+static robj *createSetObject(void) {
+    dict *d = dictCreate(&setDictType, NULL);
+    if (d == NULL) {
+        oom("dictCreate");
+    }
+    robj *o = createObject(REDIS_SET, d);
+    o->encoding = REDIS_ENCODING_HT;
+    return o;
+}
+
+static robj *createIntsetObject(void) {
+    intset *is = intsetNew();
+    if (is == NULL) {
+        oom("intsetNew");
     }
+    robj *o = createObject(REDIS_SET, is);
+    o->encoding = REDIS_ENCODING_INTSET;
+    return o;
 }
 
 /**
- * 从文件中读取出一个 string object，格式: lengh, content
- * @param preallocateLoadBuf 大小为REDIS_LOADBUF_LEN，如果要读取的 length 小于这个值可以不用再申请内存了
- * @return string object if success, otherwise NULL
+ * 新建的 hash 都是 ziplist 编码, 见 hashTypeConvert
  */
-static robj *deserializeStringObject(int fp, char *preallocLoadBuf) {
-    uint32_t len;
-    if (fread(&len, 4, 1, fp) == 0) {
-        return NULL;
+static robj *createHashObject(void) {
+    unsigned char *zl = ziplistNew();
+    if (zl == NULL) {
+        oom("ziplistNew");
     }
-    len = ntohl(len);
+    robj *o = createObject(REDIS_HASH, zl);
+    o->encoding = REDIS_ENCODING_ZIPLIST;
+    return o;
+}
 
-    char *buf = preallocLoadBuf;
-    if (len > REDIS_LOADBUF_LEN) {
-        buf = zmalloc(len);
-        if (buf == NULL) {
-            oom("Loading DB from file.");
-        }
+static void freeStringObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        sdsfree(o->ptr);
     }
+}
 
-    if (len > 0 && fread(buf, len, 1, fp) == 0) {
-        if (buf != preallocLoadBuf) {
-            zfree(buf);
-        }
-        return NULL;
+static void freeListObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        zfree(o->ptr);
+    } else {
+        quicklistRelease(o->ptr);
     }
+}
 
-    robj *o = createStringObject(buf, len);
-    if (buf != preallocLoadBuf) {
-        zfree(buf);
+static void freeSetObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        zfree(o->ptr);
+    } else {
+        dictRelease((dict *) o->ptr);
     }
-    return o;
 }
 
-static robj *deserializeList(int fp, char *preallocateLoadBuf) {
-    uint32_t listlen;
-    if (fread(&listlen, 4, 1, fp) == 0) {
-        return NULL;
+static robj *createZsetObject(void) {
+    zset *zs = zmalloc(sizeof(*zs));
+    if (zs == NULL) {
+        oom("createZsetObject");
     }
-    listlen = ntohl(listlen);
-    robj *o = createListObject();
-    while (listlen-- > 0) {
-        robj *ele = deserializeStringObject(fp, preallocateLoadBuf);
-        if (ele == NULL) {
-            // todo: 不需要 free o
-            return NULL;
-        }
-        if (listAddNodeTail((list *)o->ptr, ele) == NULL) {
-            oom("listAddNodeTail");
-        }
+    zs->dict = dictCreate(&zsetDictType, NULL);
+    if (zs->dict == NULL) {
+        oom("dictCreate");
     }
+    zs->zsl = zslCreate();
+    robj *o = createObject(REDIS_ZSET, zs);
+    o->encoding = REDIS_ENCODING_SKIPLIST;
     return o;
 }
 
-static robj *deserializeSet(int fp, char *preallocateLoadBuf) {
-    uint32_t setlen;
-    if (fread(&setlen, 4, 1, fp) == 0) {
-        return NULL;
+static robj *createZsetZiplistObject(void) {
+    unsigned char *zl = ziplistNew();
+    if (zl == NULL) {
+        oom("ziplistNew");
     }
-    setlen = ntohl(setlen);
-    robj *set = createSetObject();
-    while (setlen-- > 0) {
-        robj *ele = deserializeStringObject(fp, preallocateLoadBuf);
-        if (ele == NULL) {
-            return NULL;
-        }
-        if (dictAdd((dict *) set->ptr, ele, NULL) == NULL) {
-            oom("dictAdd");
-        }
+    robj *o = createObject(REDIS_ZSET, zl);
+    o->encoding = REDIS_ENCODING_ZIPLIST;
+    return o;
+}
+
+static void freeZsetObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        zfree(o->ptr);
+    } else {
+        zset *zs = o->ptr;
+        dictRelease(zs->dict);
+        zslFree(zs->zsl);
+        zfree(zs);
     }
-    return set;
 }
 
-/**
- * @return REDIS_ERR if any error occur
- *         REDIS_SELECTDB this db is finished
- *         REDIS_EOF      the dbfile is reach end
- */
-static int loadOneDbFromFile(int fp) {
-    uint32_t dbid;
-    if (fread(&dbid, 4, 1, fp) == 0) {
-        return REDIS_ERR;
+static void freeHashObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        zfree(o->ptr);
+    } else {
+        dictRelease((dict *) o->ptr);
     }
-    dbid = ntohl(dbid);
-    if (dbid >= (unsigned) server.dbnum) {
-        redisLog(REDIS_WARNING,"FATAL: Data file was created with a Redis server compiled to handle more than %d databases. Exiting\n", server.dbnum);
-        exit(1);
+}
+
+static void incrRefCount(robj *o) {
+    if (o->refcount != REDIS_SHARED_REFCOUNT) {
+        o->refcount++;
     }
-    dict *d = server.dict[dbid];
+}
 
-    // 预先分配的内存，如果要读取的数据可以放下则可以减少内存申请
-    char buf[REDIS_LOADBUF_LEN]; 
+/**
+ * 共享整数会出现在 set/hash/zset 的元素中, 标记成共享之后后台线程释放这些容器时不会修改它的 refcount
+ */
+static robj *makeObjectShared(robj *o) {
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
+}
 
-    while (true) {
-        uint8_t type;
-        if (fread(&type, 1, 1, fp) == 0) {
-            return REDIS_ERR;
-        }
-        // 当前db结束了
-        if (type == REDIS_SELECTDB || type == REDIS_EOF) {
-            return type;
+static void decrRefCount(void *obj) {
+    robj *o = obj;
+    if (o->refcount == REDIS_SHARED_REFCOUNT) {
+        return;
+    }
+    if (--(o->refcount) == 0) {
+        switch (o->type) {
+        case REDIS_STRING:
+            freeStringObject(o);
+            break;
+        case REDIS_LIST:
+            freeListObject(o);
+            break;
+        case REDIS_SET:
+            freeSetObject(o);
+            break;
+        case REDIS_HASH:
+            freeHashObject(o);
+            break;
+        case REDIS_ZSET:
+            freeZsetObject(o);
+            break;
+        default:
+            assert(false);
+            break;
         }
 
-        robj *key = deserializeStringObject(fp, buf);
-        if (key == NULL) {
-            return REDIS_ERR;
+        // EMBSTR 对象的大小和普通 robj 不同，不能放到 objfreelist 中复用; objfreelist 只能在主线程中访问
+        if (o->encoding == REDIS_ENCODING_EMBSTR || lazyfreeThread || server.objfreelist_len >= server.objfreelist_max) {
+            zfree(o);
+            return;
         }
+        o->ptr = server.objfreelist;
+        server.objfreelist = o;
+        server.objfreelist_len++;
+    }
+}
 
-        robj *value = NULL;
-        switch (type) {
-            case REDIS_STRING:
-                value = deserializeStringObject(fp, buf);
-                break;
-            case REDIS_LIST:
-                value = deserializeList(fp, buf);
-                break;
-            case REDIS_SET:
-                value = deserializeSet(fp, buf);
-                break;
-            default:
-                assert(false);
+/**
+ * serverCron 中调用, 释放上个周期中一直没被用到的空闲对象的一半, 流量下去之后缓存会逐渐缩小
+ */
+static void trimObjectFreeList(void) {
+    unsigned long excess = server.objfreelist_lowwater / 2;
+    while (excess--) {
+        robj *o = server.objfreelist;
+        server.objfreelist = o->ptr;
+        server.objfreelist_len--;
+        zfree(o);
+    }
+    server.objfreelist_lowwater = server.objfreelist_len;
+}
+
+/* ===================== Replication ========================= */
+
+/**
+ * Send the whole output buffer syncronously to the slave
+ */
+static int flushClientOutput(redisClient *c) {
+    time_t start = time(NULL);
+    while (c->bufpos > 0 || listLength(c->reply) > 0) {
+        if (time(NULL) - start > 5) {
+            return REDIS_ERR; // 5 seconds timeout
         }
-        if (value == NULL) {
+        int retval = aeWait(c->fd, AE_WRITABLE, 1000);
+        if (retval == -1) {
             return REDIS_ERR;
-        }
-        if (dictAdd(d, key, value) == DICT_ERR) {
-            redisLog(REDIS_WARNING, "Loading DB, duplicated key found! Unrecoverable error, exiting now.");
-            exit(1);
+        } else if (isWritable(retval)) {
+            sendReplyToClient(NULL, c->fd, c, AE_WRITABLE);
         }
     }
-    // actuall unreach
     return REDIS_OK;
 }
 
+
 /**
- * 读 rdb 文件，重构所有db
- * REDIS0000
- * [254, db_no, db content, ...] // 1. 254 REDIS_SELECTDB; 2. 无数据的DB忽略掉
- *    db content: [type, key length, key content, value, ...] value需要根据type来解析
- * 255 // REDIS_EOF
- * @return REDIS_OK if success, otherwise REDIS_ERR
+ * 将 ptr 中的 size 个字节在 timeout 的时间内写入到 fd 中
  */
-static int loadDb(char *filename) {
-    char *fp = fopen(filename, "r");
-    if (fp == NULL) {
+static int syncWrite(int fd, void *ptr, ssize_t size, int timeout) {
+    ssize_t ret = size;
+    ssize_t nwritten;
+    time_t start = time(NULL);
+
+    timeout++;
+    while (size != 0) {
+        if ((aeWait(fd, AE_WRITABLE, 1000) & AE_WRITABLE) != 0) {
+            nwritten = write(fd, ptr, size);
+            if (nwritten == -1) {
+                return -1;
+            }
+            ptr += nwritten;
+            size -= nwritten;
+        }
+        if ((time(NULL) - start) > timeout) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return ret;
+}
+
+static int syncRead(int fd, void *ptr, ssize_t size, int timeout) {
+    ssize_t nread, totread = 0;
+    time_t start = time(NULL);
+    timeout++;
+
+    while (size != 0) {
+        if (aeWait(fd, AE_READABLE, 1000) & AE_READABLE) {
+            nread = read(fd, ptr, size);
+            if (nread == -1) {
+                return -1;
+            }
+            ptr += nread;
+            size -= nread;
+            totread += nread;
+        }
+        if ((time(NULL) - start) > timeout) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return totread;
+}
+
+/**
+ * 读一行，\n 和 \r\n 都算作 line end flag
+ * @return char size of line
+ */
+static int syncReadLine(int fd, char *ptr, ssize_t size, int timeout) {
+    ssize_t nread = 0;
+    size--;
+    while (size != 0) {
+        char c;
+        if (syncRead(fd, &c, 1, timeout) == -1) {
+            return -1;
+        }
+        if (c == '\n') {
+            *ptr = '\0';
+            if (nread != 0 && *(ptr-1) == '\r') {
+                *(ptr-1) = '\0';
+            }
+            return nread;
+        } else {
+            *ptr++ = c;
+            *ptr = '\0';
+            nread++;
+        }
+    }
+    return nread;
+}
+
+static int writeFileToClient(int fileFd, int fileLen, int clientFd, int start) {
+    char sizebuf[32];
+    snprintf(sizebuf, sizeof(sizebuf), "%d\r\n", fileLen);
+    // 1. 写文件大小
+    if (syncWrite(clientFd, sizebuf, strlen(sizebuf), 5) == -1) {
         return REDIS_ERR;
     }
-    char buf[9];
-    if (fread(buf, 9, 1, fp) == 0) {
-        goto eoferr;
+
+    // 2. 写文件内容
+    while (fileLen > 0) {
+       char buf[1024];
+        int nread;
+        if (time(NULL) - start > REDIS_MAX_SYNC_TIME) {
+            return REDIS_ERR;
+        }
+        nread = read(fileFd, buf, 1024);
+        if (nread == -1) {
+            return REDIS_ERR;
+        }
+        fileLen -= nread;
+        if (syncWrite(clientFd, buf, nread, 5) == -1) {
+            return REDIS_ERR;
+        } 
     }
-    if (memcmp(buf, "REDIS0000", 9) != 0) {
-        fclose(fp);
-        redisLog(REDIS_WARNING, "Wrong signature trying to load DB from file");
+    return syncWrite(clientFd, "\r\n", 2, 5) == -1 ? REDIS_ERR : REDIS_OK;
+}
+
+/**
+ * 把写命令以 multibulk 的格式(和 AOF 相同)追加到每个 slave 的回复中,
+ * slave 上次选中的 db 和命令的 db 不同时先发一条 SELECT. 命令不属于 keyspace, 用 addReplyByRef,
+ * 大的命令所有 slave 共享同一个对象, 不会每个 slave 拷贝一份
+ */
+static void replicationFeedSlaves(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    REDIS_NOTUSED(cmd);
+    robj *cmdobj = createObject(REDIS_STRING, catAppendOnlyGenericCommand(sdsempty(), argc, argv));
+    robj *selectobj = NULL;
+    listIter *it = listGetIterator(server.slaves, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    listNode *ln;
+    while ((ln = listNextElement(it)) != NULL) {
+        redisClient *slave = listNodeValue(ln);
+        if (slave->slaveseldb != dictid) {
+            if (selectobj == NULL) {
+                char buf[32];
+                int len = ll2string(buf, sizeof(buf), dictid);
+                selectobj = createObject(REDIS_STRING,
+                                         sdscatprintf(sdsempty(), "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n", len, buf));
+            }
+            addReplyByRef(slave, selectobj);
+            slave->slaveseldb = dictid;
+        }
+        addReplyByRef(slave, cmdobj);
+    }
+    listReleaseIterator(it);
+    decrRefCount(cmdobj);
+    if (selectobj != NULL) {
+        decrRefCount(selectobj);
+    }
+}
+
+/**
+ * 将 dbfile 的内容同步到 client，如果同步成功 client 就是 slave 了, 否则标记为 close 状态
+ */
+static void syncCommand(redisClient *c) {
+    time_t start = time(NULL);
+    int fd = -1;
+    redisLog(REDIS_NOTICE, "Slave ask for syncronization");
+    if (flushClientOutput(c) == REDIS_ERR || saveDb(server.dbfilename) != REDIS_OK) {
+        goto closeconn;
+    }
+
+    struct stat sb;
+    fd = open(server.dbfilename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        goto closeconn;
+    }
+    writeFileToClient(fd, sb.st_size, c->fd, start);
+    close(fd);
+
+    c->flags |= REDIS_SLAVE;
+    c->slaveseldb = 0;
+    if (!listAddNodeTail(server.slaves, c)) {
+        oom("listAddNodeTail of slave");
+    }
+    redisLog(REDIS_NOTICE, "Syncronization with slave succeeded");
+    return;
+
+    closeconn:
+        if (fd != -1) {
+            close(fd);
+        }
+        c->flags |= REDIS_CLOSE;
+        redisLog(REDIS_WARNING, "Syncronization with slave failed.");
+        return;
+}
+
+/**
+ * 读取 master 上的 rdb 文件，替换掉自己的 dbfile
+ * @param dumpsize master 上 rdb 文件的大小
+ * @param fd master 连接
+ */
+static int dumpMasterRDB(int dumpsize, int fd) {
+    char tmpfile[256];
+    snprintf(tmpfile, 256, "temp-%d.%ld.rdb", (int)time(NULL), (long int)random());
+    int dfd = open(tmpfile, O_CREAT|O_WRONLY, 0644);
+    if (dfd == -1) {
+        redisLog(REDIS_WARNING, "Opening the temp file needed for MASTER <-> SLAVE syncrhonization: %s", strerror(errno));
         return REDIS_ERR;
     }
 
-    uint8_t type;
-    if (fread(&type, 1, 1, fp) == 0) {
-        goto eoferr;
+    char buf[1024];
+    while (dumpsize > 0) {
+        int nread = read(fd, buf, (dumpsize < 1024 ? dumpsize : 1024));
+        if (nread == -1) {
+            redisLog(REDIS_WARNING, "I/O error trying to sync with MASTER: %s", strerror(errno));
+            close(dfd);
+            return REDIS_ERR;
+        }
+
+        int nwritten = write(dfd, buf, nread);
+        if (nwritten == -1) {
+            redisLog(REDIS_WARNING, "Write error writing to the DB dump file needed for MASTER <-> SLAVE synchronization: %s", strerror(errno));
+            close(dfd);
+            return REDIS_ERR;
+        }
+
+        dumpsize -= nread;
     }
-    while (type == REDIS_SELECTDB) {
-        type = loadOneDbFromFile(fp);
+    close(dfd);
+    if (rename(tmpfile, server.dbfilename) == -1) {
+        redisLog(REDIS_WARNING, "Failed trying to rename the temp DB into dump.rdb in MASTER <-> SLAVE syncrhonization: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
     }
-    if (type != REDIS_EOF) {
-        goto eoferr;
+
+}
+
+static int syncWithMaster() {
+    int fd = anetTcpConnect(NULL, server.masterhost, server.masterhost);
+    if (fd == -1) {
+        redisLog(REDIS_WARNING, "unable to connect to MASTER: %s", strerror(errno));
+        return REDIS_ERR;
     }
 
-    fclose(fp);
+    // 1. 发送 SYNC 标记，准备同步
+    if (syncWrite(fd, "SYNC \r\n", 7, 5) == -1) {
+        close(fd);
+        redisLog(REDIS_WARNING, "I/O error writing to MASTER: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+
+    // 2. 读取 master 的 rdb
+    char buf[1024];
+    if (syncRead(fd, buf, 1024, 5) == -1) {
+        close(fd);
+        redisLog(REDIS_WARNING, "I/O error reading bulk count from MASTER: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    int dumpsize = atoi(buf);
+    redisLog(REDIS_NOTICE, "Receiving %d bytes data dump from MASTER", dumpsize);
+    if (dumpMasterRDB(dumpsize, fd) != REDIS_OK) {
+        close(fd);
+        return REDIS_ERR;
+    }
+    
+    emptyDb();
+    if (loadDb(server.dbfilename) != REDIS_OK) {
+        redisLog(REDIS_WARNING, "Failed tring to load the MASTER synchronization DB from disk");
+        close(fd);
+        return REDIS_ERR;
+    }
+
+    server.master = createClient(fd);
+    server.master->flags |= REDIS_MASTER;
+    server.replstate = REDIS_REPL_CONNECTED;
     return REDIS_OK;
+}
+
+/* =========================== RDB save ===================== */
+
+/**
+ * saveDb/loadDb 读写的内容都经过 rdbWrite/rdbRead, 顺便增量计算 CRC64, 不需要再读一遍文件
+ */
+static uint64_t rdbChecksum;
+
+/**
+ * saveDb 的写缓冲. rdbWrite 先拷贝到 buf 中, 攒满 REDIS_RDB_WRITE_BUF_LEN 再整块计算 CRC64 并写入,
+ * 文件本身是无缓冲的 FILE, 不会再被 stdio 拷贝一次.
+ * 每写入 server.rdb_autosync_bytes 提交一次刷盘; BGSAVE 的子进程按 server.rdb_save_rate_limit 限速
+ */
+static struct rdbWriteState {
+    unsigned char *buf;
+    size_t used;
+    off_t written;     // 已经写入文件的字节数
+    off_t synced;      // [0, synced) 已经提交刷盘
+    off_t prevsynced;  // [prevsynced, synced) 是最近一次提交的, 可能还没写完
+    long long start;   // 开始写入的时间(us), 用于限速
+    bool ratelimit;    // 只在 BGSAVE 的子进程中设置, SAVE 限速会阻塞整个 server
+} rdbWriteState;
+
+/**
+ * 提交刷盘. linux 上用 sync_file_range 异步写出新的一段, 同时等待上一段写完:
+ * 脏页最多积压两段, 又不用每次都同步等待磁盘. 失败了也没关系, 最后还有一次 fsync
+ */
+static void rdbSyncWritten(FILE *fp) {
+    struct rdbWriteState *st = &rdbWriteState;
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+    int fd = fileno(fp);
+    sync_file_range(fd, st->synced, st->written - st->synced, SYNC_FILE_RANGE_WRITE);
+    if (st->synced > st->prevsynced) {
+        sync_file_range(fd, st->prevsynced, st->synced - st->prevsynced,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    aof_fsync(fileno(fp));
+#endif
+    st->prevsynced = st->synced;
+    st->synced = st->written;
+}
+
+static int rdbFlushWriteBuffer(FILE *fp) {
+    struct rdbWriteState *st = &rdbWriteState;
+    if (st->used == 0) {
+        return REDIS_OK;
+    }
+    if (server.rdbchecksum) {
+        rdbChecksum = crc64(rdbChecksum, st->buf, st->used);
+    }
+    if (fwrite(st->buf, st->used, 1, fp) == 0) {
+        return REDIS_ERR;
+    }
+    st->written += st->used;
+    st->used = 0;
+
+    if (server.rdb_autosync_bytes > 0 && st->written - st->synced >= (off_t) server.rdb_autosync_bytes) {
+        rdbSyncWritten(fp);
+    }
+    if (st->ratelimit && server.rdb_save_rate_limit > 0) {
+        // 按限速写完这么多字节应该花费的时间, 写快了就睡一会儿
+        long long expected = (long long) st->written * 1000000 / (long long) server.rdb_save_rate_limit;
+        long long elapsed = ustime() - st->start;
+        if (expected > elapsed) {
+            usleep(expected - elapsed);
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * @return 同 fwrite(p, len, 1, fp)
+ */
+static size_t rdbWrite(const void *p, size_t len, FILE *fp) {
+    struct rdbWriteState *st = &rdbWriteState;
+    const unsigned char *s = p;
+    while (len > 0) {
+        size_t n = REDIS_RDB_WRITE_BUF_LEN - st->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(st->buf + st->used, s, n);
+        st->used += n;
+        s += n;
+        len -= n;
+        if (st->used == REDIS_RDB_WRITE_BUF_LEN && rdbFlushWriteBuffer(fp) == REDIS_ERR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @return 同 fread(p, len, 1, fp)
+ */
+static size_t rdbRead(void *p, size_t len, FILE *fp) {
+    size_t nread = fread(p, len, 1, fp);
+    if (nread > 0) {
+        rdbChecksum = crc64(rdbChecksum, p, len);
+    }
+    return nread;
+}
+
+/**
+ * 变长编码的长度, 见 REDIS_RDB_6BITLEN
+ */
+static int writeLenToFile(uint32_t len, FILE *fp) {
+    unsigned char buf[5];
+    size_t nbytes;
+    if (len < (1 << 6)) {
+        buf[0] = (len & 0xFF) | (REDIS_RDB_6BITLEN << 6);
+        nbytes = 1;
+    } else if (len < (1 << 14)) {
+        buf[0] = ((len >> 8) & 0xFF) | (REDIS_RDB_14BITLEN << 6);
+        buf[1] = len & 0xFF;
+        nbytes = 2;
+    } else {
+        buf[0] = (REDIS_RDB_32BITLEN << 6);
+        uint32_t be = htonl(len);
+        memcpy(buf + 1, &be, 4);
+        nbytes = 5;
+    }
+    return rdbWrite(buf, nbytes, fp) == 0 ? REDIS_ERR : REDIS_OK;
+}
+
+/**
+ * 能放进 32 位的整数编码到 enc 中
+ * @return 编码后的字节数, 0 表示放不下
+ */
+static int encodeIntegerForRdb(long long value, unsigned char *enc) {
+    if (value >= -(1 << 7) && value <= (1 << 7) - 1) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT8;
+        enc[1] = value & 0xFF;
+        return 2;
+    } else if (value >= -(1 << 15) && value <= (1 << 15) - 1) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT16;
+        enc[1] = value & 0xFF;
+        enc[2] = (value >> 8) & 0xFF;
+        return 3;
+    } else if (value >= -((long long) 1 << 31) && value <= ((long long) 1 << 31) - 1) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT32;
+        enc[1] = value & 0xFF;
+        enc[2] = (value >> 8) & 0xFF;
+        enc[3] = (value >> 16) & 0xFF;
+        enc[4] = (value >> 24) & 0xFF;
+        return 5;
+    }
+    return 0;
+}
+
+/**
+ * s 是规范的整数表示(转回字符串后和 s 完全一样)时按整数编码, 加载后还是同一个字符串
+ * @return 编码后的字节数, 0 表示不能按整数编码
+ */
+static int tryIntegerEncodingForRdb(const char *s, size_t len, unsigned char *enc) {
+    // 32 位整数最长 11 个字符
+    if (len == 0 || len > 11) {
+        return 0;
+    }
+    char buf[32];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *endptr;
+    long long value = strtoll(buf, &endptr, 10);
+    if (endptr[0] != '\0') {
+        return 0;
+    }
+    char buf2[32];
+    int len2 = ll2string(buf2, sizeof(buf2), value);
+    if ((size_t) len2 != len || memcmp(buf, buf2, len) != 0) {
+        return 0;
+    }
+    return encodeIntegerForRdb(value, enc);
+}
+
+/**
+ * 格式: 11|REDIS_RDB_ENC_LZF, 压缩后的长度, 原始长度, 压缩后的内容
+ * @return 写入的字节数, 0 表示压缩后没有变小, 没有写入; -1 表示写入出错
+ */
+static ssize_t writeLzfStringToFile(const void *s, size_t len, FILE *fp) {
+    // 至少要省下 4 个字节才值得
+    if (len <= 4) {
+        return 0;
+    }
+    size_t outlen = len - 4;
+    void *out = zmalloc(outlen + 1);
+    if (out == NULL) {
+        oom("writeLzfStringToFile");
+    }
+    size_t comprlen = lzf_compress(s, len, out, outlen);
+    if (comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    unsigned char type = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_LZF;
+    if (rdbWrite(&type, 1, fp) == 0 || writeLenToFile(comprlen, fp) == REDIS_ERR ||
+        writeLenToFile(len, fp) == REDIS_ERR || rdbWrite(out, comprlen, fp) == 0) {
+        zfree(out);
+        return -1;
+    }
+    zfree(out);
+    return comprlen;
+}
+
+/**
+ * 格式: length, content. 可以解析成整数的短字符串按整数编码, 长字符串尝试 LZF 压缩
+ */
+static int writeBufferToFile(const void *buf, size_t valsize, FILE *fp) {
+    if (valsize <= 11) {
+        unsigned char enc[5];
+        int enclen = tryIntegerEncodingForRdb(buf, valsize, enc);
+        if (enclen > 0) {
+            return rdbWrite(enc, enclen, fp) == 0 ? REDIS_ERR : REDIS_OK;
+        }
+    }
+    if (server.rdbcompression && valsize > REDIS_RDB_COMPRESS_MIN_LEN) {
+        ssize_t nwritten = writeLzfStringToFile(buf, valsize, fp);
+        if (nwritten == -1) {
+            return REDIS_ERR;
+        } else if (nwritten > 0) {
+            return REDIS_OK;
+        }
+    }
+    if (writeLenToFile(valsize, fp) == REDIS_ERR || (valsize > 0 && rdbWrite(buf, valsize, fp) == 0)) {
+        return REDIS_ERR;
+    } else {
+        return REDIS_OK;
+    }
+}
+
+static int writeSdsToFile(sds sval, FILE *fp) {
+    return writeBufferToFile(sval, sdslen(sval), fp);
+}
+
+/**
+ * 整数直接按整数编码写入, 超过 32 位的临时转成字符串, 加载后都是它的字符串表示
+ */
+static int writeLongLongToFile(long long value, FILE *fp) {
+    unsigned char enc[5];
+    int enclen = encodeIntegerForRdb(value, enc);
+    if (enclen > 0) {
+        return rdbWrite(enc, enclen, fp) == 0 ? REDIS_ERR : REDIS_OK;
+    }
+    char buf[32];
+    int valsize = ll2string(buf, sizeof(buf), value);
+    return writeBufferToFile(buf, valsize, fp);
+}
+
+/**
+ * 格式同 writeSdsToFile, 整数编码的对象按整数写入
+ */
+static int writeStringObjectToFile(robj *o, FILE *fp) {
+    if (sdsEncodedObject(o)) {
+        return writeSdsToFile(o->ptr, fp);
+    }
+    return writeLongLongToFile((long) o->ptr, fp);
+}
+
+/**
+ * 格式: list size, [entry length, entry content, ...]
+ * 两种编码都直接从 ziplist 的 entry 中读出内容写入, 文件格式和以前每个元素一个对象时相同
+ */
+static int writeListToFile(robj *o, FILE *fp) {
+    if (writeLenToFile(listTypeLength(o), fp) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, 0);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        while (ziplistGet(p, &vstr, &vlen, &vlong)) {
+            if (vstr == NULL) {
+                if (writeLongLongToFile(vlong, fp) == REDIS_ERR) {
+                    return REDIS_ERR;
+                }
+            } else if (writeBufferToFile(vstr, vlen, fp) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+            p = ziplistNext(o->ptr, p);
+        }
+        return REDIS_OK;
+    }
+
+    quicklistIter *iter = quicklistGetIterator(o->ptr, AL_START_HEAD);
+    quicklistEntry entry;
+    int status = REDIS_OK;
+    while (status == REDIS_OK && quicklistNext(iter, &entry)) {
+        if (entry.value != NULL) {
+            status = writeBufferToFile(entry.value, entry.sz, fp);
+        } else {
+            status = writeLongLongToFile(entry.longval, fp);
+        }
+    }
+    quicklistReleaseIterator(iter);
+    return status;
+}
+
+/**
+ * 依次写入 ziplist 中所有的 entry, 格式同 writeSdsToFile
+ */
+static int writeZiplistEntriesToFile(unsigned char *zl, FILE *fp) {
+    unsigned char *p = ziplistIndex(zl, 0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    while (ziplistGet(p, &vstr, &vlen, &vlong)) {
+        int status = vstr == NULL ? writeLongLongToFile(vlong, fp) : writeBufferToFile(vstr, vlen, fp);
+        if (status == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        p = ziplistNext(zl, p);
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 格式: hash size, [field length, field content, value length, value content, ...]
+ */
+static int writeHashToFile(robj *o, FILE *fp) {
+    if (writeLenToFile(hashTypeLength(o), fp) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        return writeZiplistEntriesToFile(o->ptr, fp);
+    }
+
+    dictIterator *it = dictGetIterator(o->ptr);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+    int status = REDIS_OK;
+    dictEntry *entry;
+    while (status == REDIS_OK && (entry = dictNext(it)) != NULL) {
+        robj *field = dictGetEntryKey(entry);
+        status = writeSdsToFile(field->ptr, fp);
+        if (status == REDIS_OK) {
+            status = writeStringObjectToFile(dictGetEntryVal(entry), fp);
+        }
+    }
+    dictReleaseIterator(it);
+    return status;
+}
+
+/**
+ * 格式: zset size, [member length, member content, score length, score content, ...]
+ * score 按 %.17g 写成字符串, 按 score 从小到大的顺序写入
+ */
+static int writeZsetToFile(robj *o, FILE *fp) {
+    if (writeLenToFile(zsetLength(o), fp) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        return writeZiplistEntriesToFile(o->ptr, fp);
+    }
+
+    zskiplistNode *ln = ((zset *) o->ptr)->zsl->header->level[0].forward;
+    for (; ln != NULL; ln = ln->level[0].forward) {
+        char buf[128];
+        int scorelen = d2string(buf, sizeof(buf), ln->score);
+        if (writeSdsToFile(ln->obj->ptr, fp) == REDIS_ERR || writeBufferToFile(buf, scorelen, fp) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 格式: set size, [entry length, entry content, ...]
+ * intset 的元素按字符串写入, 和 hashtable 编码的格式一样
+ */
+static int writeSetToFile(robj *set, FILE *fp) {
+    if (writeLenToFile(setTypeSize(set), fp) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+
+    if (set->encoding == REDIS_ENCODING_INTSET) {
+        int64_t intele;
+        for (uint32_t i = 0; intsetGet(set->ptr, i, &intele); i++) {
+            if (writeLongLongToFile(intele, fp) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+        }
+        return REDIS_OK;
+    }
+
+    dictIterator *it = dictGetIterator(set->ptr);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+    int status = REDIS_OK;
+    dictEntry *entry;
+    while (status == REDIS_OK && (entry = dictNext(it)) != NULL) {
+        robj *eleobj = dictGetEntryKey(entry);
+        status = writeSdsToFile(eleobj->ptr, fp);
+    }
+    dictReleaseIterator(it);
+    return status;
+}
+
+/**
+ * @param it 一个 redis db 对应一个 dict, 这里的it就是该 dict 的 iterator
+ * 格式: [[253, expire time], type, key length, key content, value], vaulue 可能是: sds, list, set; key 一定是 sds.
+ * 设置了过期时间的 key 前面有 REDIS_EXPIRETIME 和 4 字节的 unix time
+ */
+static int writeOneDBToFile(int dbid, dictIterator *it, FILE *fp) {
+    dictEntry *entry;
+    while ((entry = dictNext(it)) != NULL) {
+        robj *key = dictGetEntryKey(entry);
+        robj *o = dictGetEntryVal(entry);
+        time_t expire = getExpire(dbid, key);
+        if (expire != -1) {
+            uint8_t optype = REDIS_EXPIRETIME;
+            uint32_t when = htonl((uint32_t) expire);
+            if (rdbWrite(&optype, 1, fp) == 0 || rdbWrite(&when, 4, fp) == 0) {
+                return REDIS_ERR;
+            }
+        }
+        uint8_t type = o->type; 
+        if (rdbWrite(&type, 1, fp) == 0) {
+            return REDIS_ERR;
+        }
+
+        if (writeSdsToFile(key->ptr, fp) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+
+        int status = REDIS_ERR;
+        switch (type) {
+        case REDIS_STRING:
+            status = writeStringObjectToFile(o, fp);
+            break;
+        case REDIS_LIST:
+            status = writeListToFile(o, fp);
+            break;
+        case REDIS_SET:
+            status = writeSetToFile(o, fp);
+            break;
+        case REDIS_HASH:
+            status = writeHashToFile(o, fp);
+            break;
+        case REDIS_ZSET:
+            status = writeZsetToFile(o, fp);
+            break;
+        default:
+            assert(false);
+        }
+        if (status != REDIS_OK) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 先写 temp file, 写成功后再原子的 rename 成 filename
+ * 格式：
+ *     REDIS0002 // 版本号见 REDIS_RDB_VERSION, 所有的长度都是变长编码
+ *     [254, db_no, db content, ...] // 1. 254 REDIS_SELECTDB; 2. 无数据的DB忽略掉
+ *     255 // REDIS_EOF
+ *     CRC64 // 8 字节小端, rdbchecksum no 时为 0
+ *      
+ * 
+ */
+static int saveDb(char *filename) {
+    char tmpfile[256];
+    snprintf(tmpfile, 256, "temp-%d.%ld.rdb", (int) time(NULL), (long int) random());
+    FILE *fp = fopen(tmpfile, "w");
+    if (fp == NULL) {
+        redisLog(REDIS_WARNING, "Failed saving the DB: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+
+    /**
+     * fwrite(ptr, size, nsize, stream)
+     * ptr: 要写入的内容
+     * size: 每个元素的大小，单位是字节
+     * nsize: 写入的元素个数
+     */
+    // 所有的写入都先经过 rdbWriteState.buf, 不需要 stdio 再缓冲一次
+    setvbuf(fp, NULL, _IONBF, 0);
+    struct rdbWriteState *st = &rdbWriteState;
+    st->buf = zmalloc(REDIS_RDB_WRITE_BUF_LEN);
+    if (st->buf == NULL) {
+        oom("saveDb");
+    }
+    st->used = 0;
+    st->written = st->synced = st->prevsynced = 0;
+    st->start = ustime();
+    rdbChecksum = 0;
+    dictIterator *dictIt = NULL;
+    char magic[10];
+    snprintf(magic, sizeof(magic), "REDIS%04d", REDIS_RDB_VERSION);
+    if (rdbWrite(magic, 9, fp) == 0) {
+        goto werr;
+    }
+
+    for (int i = 0; i < server.dbnum; i++) {
+        dict *d = server.dict[i];
+        if (dictGetHashTableUsed(d) == 0) {
+            continue;
+        }
+
+        uint8_t type = REDIS_SELECTDB;
+        if (rdbWrite(&type, 1, fp) == 0) { goto werr; }
+        if (writeLenToFile(i, fp) == REDIS_ERR) { goto werr; }
+
+        dictIt = dictGetIterator(d);
+        if (dictIt == NULL) {
+            goto werr;
+        }
+        int status = writeOneDBToFile(i, dictIt, fp);
+        if (status != REDIS_OK) {
+            goto werr;
+        }
+        dictReleaseIterator(dictIt);
+        dictIt = NULL;
+    }
+    uint8_t type = REDIS_EOF;
+    if (rdbWrite(&type, 1, fp) == 0) { goto werr; }
+    // CRC64 在写入整块时才计算, 先把剩下的写完
+    if (rdbFlushWriteBuffer(fp) == REDIS_ERR) { goto werr; }
+    unsigned char cksum[8];
+    for (int i = 0; i < 8; i++) {
+        cksum[i] = (rdbChecksum >> (i * 8)) & 0xFF;
+    }
+    if (fwrite(cksum, 8, 1, fp) == 0) { goto werr; }
+    // flush file data and metadata, 之前已经增量刷过盘的话这里只剩最后一段.
+    // 任何一步失败都不能 rename, 否则会用不完整的文件替换掉上一次好的快照
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+        goto werr;
+    }
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto werr;
+    }
+    zfree(st->buf);
+    st->buf = NULL;
+
+    // 如果 DB file 生成成功了，原子的切换
+    if (rename(tmpfile, filename) == -1) {
+        redisLog(REDIS_WARNING, "Error moving temp DB file on the final destionation: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
+    } else {
+        redisLog(REDIS_NOTICE, "DB saved on disk");
+        server.dirty = 0;
+        server.lastsave = time(NULL);
+        return REDIS_OK;
+    }
+
+    werr:
+        redisLog(REDIS_WARNING, "Write error saving DB on disk: %s", strerror(errno));
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        unlink(tmpfile);
+        zfree(st->buf);
+        st->buf = NULL;
+        if (dictIt != NULL) {
+            dictReleaseIterator(dictIt);
+        }
+        return REDIS_ERR;
+}
+
+/**
+ * @return REDIS_OK on success, or REDIS_ERR
+ */
+/**
+ * 同一时间只有一个 BGSAVE 或 BGREWRITEAOF 的子进程
+ */
+static bool hasActiveChildProcess(void) {
+    return server.bgsaveinprogress || server.aof_child_pid != -1;
+}
+
+static int saveDbBackground(char *filename) {
+    if (hasActiveChildProcess()) {
+        return REDIS_ERR;
+    }
+
+    // 子进程通过这个 pipe 把写时复制的字节数告诉父进程
+    if (pipe(server.child_info_pipe) == -1) {
+        server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
+    }
+    pid_t childpid = fork();
+    if (childpid == 0) {
+        // todo: why close server.fd ?
+        close(server.fd);
+        rdbWriteState.ratelimit = true;
+        if (saveDb(filename) == REDIS_OK) {
+            size_t cow = zmalloc_get_private_dirty(-1);
+            if (cow > 0) {
+                redisLog(REDIS_NOTICE, "DB: %zu MB of memory used by copy-on-write", cow / (1024 * 1024));
+            }
+            if (server.child_info_pipe[1] != -1) {
+                // 写失败只是父进程拿不到 COW 的大小, 不影响保存的结果
+                ssize_t nwritten = write(server.child_info_pipe[1], &cow, sizeof(cow));
+                REDIS_NOTUSED(nwritten);
+            }
+            exit(0);
+        } else {
+            exit(1);
+        }
+    } else if (childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't save in background: fork: %s", strerror(errno));
+        closeChildInfoPipe();
+        return REDIS_ERR;
+    } else {
+        redisLog(REDIS_NOTICE, "Background saving started by pid %d", childpid);
+        server.bgsaveinprogress = true;
+        // 子进程和父进程共享内存页, 父进程中扩容 dict 会复制大量的页
+        dictDisableResize();
+        return REDIS_OK;
+    }
+    return REDIS_OK;
+}
+
+static void closeChildInfoPipe(void) {
+    if (server.child_info_pipe[0] != -1) {
+        close(server.child_info_pipe[0]);
+        close(server.child_info_pipe[1]);
+    }
+    server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
+}
+
+static void waitBgsaveFinish() {
+    int statloc;
+    if (wait4(-1, &statloc, WNOHANG, NULL)) {
+        int exitcode = WEXITSTATUS(statloc);
+        if (exitcode == 0) {
+            redisLog(REDIS_NOTICE, "Background saving terminated with success");
+            server.dirty = 0;
+            server.lastsave = time(NULL);
+            // 子进程已经退出, 数据都在 pipe 的缓冲区中, 不会阻塞
+            size_t cow;
+            if (server.child_info_pipe[0] != -1 && read(server.child_info_pipe[0], &cow, sizeof(cow)) == sizeof(cow)) {
+                server.stat_rdb_cow_bytes = cow;
+            }
+        } else {
+            redisLog(REDIS_WARNING, "Background saving error");
+        }
+        closeChildInfoPipe();
+        server.bgsaveinprogress = false;
+        dictEnableResize();
+    }
+}
+
+static void bgsaveIfNeed() {
+    time_t now = time(NULL);
+    for (int i = 0; i < server.saveparamslen; i++) {
+        struct saveparam *sp = server.saveparams + i;
+        if (server.dirty >= sp->changes && (now - server.lastsave) > sp->seconds) {
+            redisLog(REDIS_NOTICE, "%d changes in %d seconds, Saving...", sp->changes, sp->seconds);
+            saveDbBackground(server.dbfilename);
+            break;
+        }
+    }
+}
+
+/**
+ * 读取一个长度, 版本 0 是 4 字节大端, 之后是变长编码, 见 REDIS_RDB_6BITLEN
+ * @param isencoded 不为 NULL 时, 遇到特殊编码的字符串设置为 true, 此时返回值是 REDIS_RDB_ENC_*
+ * @return REDIS_RDB_LENERR if read error
+ */
+static uint32_t loadLenFromFile(FILE *fp, int rdbver, bool *isencoded) {
+    if (isencoded != NULL) {
+        *isencoded = false;
+    }
+    uint32_t len;
+    if (rdbver == 0) {
+        if (rdbRead(&len, 4, fp) == 0) {
+            return REDIS_RDB_LENERR;
+        }
+        return ntohl(len);
+    }
+
+    unsigned char buf[2];
+    if (rdbRead(buf, 1, fp) == 0) {
+        return REDIS_RDB_LENERR;
+    }
+    int type = (buf[0] & 0xC0) >> 6;
+    if (type == REDIS_RDB_6BITLEN) {
+        return buf[0] & 0x3F;
+    } else if (type == REDIS_RDB_ENCVAL) {
+        if (isencoded != NULL) {
+            *isencoded = true;
+        }
+        return buf[0] & 0x3F;
+    } else if (type == REDIS_RDB_14BITLEN) {
+        if (rdbRead(buf + 1, 1, fp) == 0) {
+            return REDIS_RDB_LENERR;
+        }
+        return ((buf[0] & 0x3F) << 8) | buf[1];
+    }
+    if (rdbRead(&len, 4, fp) == 0) {
+        return REDIS_RDB_LENERR;
+    }
+    return ntohl(len);
+}
+
+/**
+ * 整数编码的字符串, 还原成它的字符串表示
+ */
+static robj *loadIntegerObjectFromFile(FILE *fp, int enctype) {
+    unsigned char enc[4];
+    long long value;
+    if (enctype == REDIS_RDB_ENC_INT8) {
+        if (rdbRead(enc, 1, fp) == 0) {
+            return NULL;
+        }
+        value = (signed char) enc[0];
+    } else if (enctype == REDIS_RDB_ENC_INT16) {
+        if (rdbRead(enc, 2, fp) == 0) {
+            return NULL;
+        }
+        value = (int16_t) (enc[0] | (enc[1] << 8));
+    } else {
+        if (rdbRead(enc, 4, fp) == 0) {
+            return NULL;
+        }
+        value = (int32_t) ((uint32_t) enc[0] | ((uint32_t) enc[1] << 8) | ((uint32_t) enc[2] << 16) | ((uint32_t) enc[3] << 24));
+    }
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    return createStringObject(buf, len);
+}
+
+static robj *loadLzfStringObjectFromFile(FILE *fp, int rdbver) {
+    uint32_t comprlen = loadLenFromFile(fp, rdbver, NULL);
+    uint32_t len = loadLenFromFile(fp, rdbver, NULL);
+    if (comprlen == REDIS_RDB_LENERR || len == REDIS_RDB_LENERR || comprlen == 0) {
+        return NULL;
+    }
+    void *compressed = zmalloc(comprlen);
+    if (compressed == NULL) {
+        oom("Loading DB from file.");
+    }
+    sds val = sdsnewlen(NULL, len);
+    if (rdbRead(compressed, comprlen, fp) == 0 || lzf_decompress(compressed, comprlen, val, len) != len) {
+        zfree(compressed);
+        sdsfree(val);
+        return NULL;
+    }
+    zfree(compressed);
+    return createObject(REDIS_STRING, val);
+}
+
+/**
+ * 从文件中读取出一个 string object，格式: lengh, content; 版本 1 开始也可能是整数或者 LZF 编码的
+ * @param preallocateLoadBuf 大小为REDIS_LOADBUF_LEN，如果要读取的 length 小于这个值可以不用再申请内存了
+ * @return string object if success, otherwise NULL
+ */
+static robj *deserializeStringObject(FILE *fp, int rdbver, char *preallocLoadBuf) {
+    bool isencoded;
+    uint32_t len = loadLenFromFile(fp, rdbver, &isencoded);
+    if (isencoded) {
+        switch (len) {
+        case REDIS_RDB_ENC_INT8:
+        case REDIS_RDB_ENC_INT16:
+        case REDIS_RDB_ENC_INT32:
+            return loadIntegerObjectFromFile(fp, len);
+        case REDIS_RDB_ENC_LZF:
+            return loadLzfStringObjectFromFile(fp, rdbver);
+        default:
+            return NULL;
+        }
+    }
+    if (len == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+
+    char *buf = preallocLoadBuf;
+    if (len > REDIS_LOADBUF_LEN) {
+        buf = zmalloc(len);
+        if (buf == NULL) {
+            oom("Loading DB from file.");
+        }
+    }
+
+    if (len > 0 && rdbRead(buf, len, fp) == 0) {
+        if (buf != preallocLoadBuf) {
+            zfree(buf);
+        }
+        return NULL;
+    }
+
+    robj *o = createStringObject(buf, len);
+    if (buf != preallocLoadBuf) {
+        zfree(buf);
+    }
+    return o;
+}
+
+static robj *deserializeList(FILE *fp, int rdbver, char *preallocateLoadBuf) {
+    uint32_t listlen = loadLenFromFile(fp, rdbver, NULL);
+    if (listlen == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+    // 元素个数在阈值以内的直接构造成 ziplist, 有元素太长时 listTypePush 会自动转换
+    robj *o = (listlen <= server.list_max_ziplist_entries) ? createZiplistObject() : createQuicklistObject();
+    while (listlen-- > 0) {
+        robj *ele = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (ele == NULL) {
+            // todo: 不需要 free o
+            return NULL;
+        }
+        listTypePush(o, ele, REDIS_TAIL);
+        decrRefCount(ele);
+    }
+    return o;
+}
+
+static robj *deserializeHash(FILE *fp, int rdbver, char *preallocateLoadBuf) {
+    uint32_t hashlen = loadLenFromFile(fp, rdbver, NULL);
+    if (hashlen == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+    robj *o = createHashObject();
+    if (hashlen > server.hash_max_ziplist_entries) {
+        hashTypeConvert(o);
+    }
+    while (hashlen-- > 0) {
+        robj *field = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (field == NULL) {
+            return NULL;
+        }
+        robj *value = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (value == NULL) {
+            return NULL;
+        }
+        if (o->encoding == REDIS_ENCODING_ZIPLIST &&
+            (sdslen(field->ptr) > server.hash_max_ziplist_value || sdslen(value->ptr) > server.hash_max_ziplist_value)) {
+            hashTypeConvert(o);
+        }
+        hashTypeSet(o, field, value);
+        decrRefCount(field);
+        decrRefCount(value);
+    }
+    return o;
+}
+
+static robj *deserializeZset(FILE *fp, int rdbver, char *preallocateLoadBuf) {
+    uint32_t zsetlen = loadLenFromFile(fp, rdbver, NULL);
+    if (zsetlen == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+    robj *o = (zsetlen <= server.zset_max_ziplist_entries) ? createZsetZiplistObject() : createZsetObject();
+    while (zsetlen-- > 0) {
+        robj *ele = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (ele == NULL) {
+            return NULL;
+        }
+        robj *scoreobj = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (scoreobj == NULL) {
+            return NULL;
+        }
+        double score = strtod(scoreobj->ptr, NULL);
+        decrRefCount(scoreobj);
+        zsetAdd(o, score, ele);
+        decrRefCount(ele);
+    }
+    return o;
+}
+
+static robj *deserializeSet(FILE *fp, int rdbver, char *preallocateLoadBuf) {
+    uint32_t setlen = loadLenFromFile(fp, rdbver, NULL);
+    if (setlen == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+    // 元素个数在阈值以内的先按 intset 构造, 遇到非整数元素时 setTypeAdd 会自动转换
+    robj *set = (setlen <= server.set_max_intset_entries) ? createIntsetObject() : createSetObject();
+    while (setlen-- > 0) {
+        robj *ele = deserializeStringObject(fp, rdbver, preallocateLoadBuf);
+        if (ele == NULL) {
+            return NULL;
+        }
+        setTypeAdd(set, ele);
+        decrRefCount(ele);
+    }
+    return set;
+}
+
+/**
+ * @return REDIS_ERR if any error occur
+ *         REDIS_SELECTDB this db is finished
+ *         REDIS_EOF      the dbfile is reach end
+ */
+static int loadOneDbFromFile(FILE *fp, int rdbver) {
+    uint32_t dbid = loadLenFromFile(fp, rdbver, NULL);
+    if (dbid == REDIS_RDB_LENERR) {
+        return REDIS_ERR;
+    }
+    if (dbid >= (unsigned) server.dbnum) {
+        redisLog(REDIS_WARNING,"FATAL: Data file was created with a Redis server compiled to handle more than %d databases. Exiting\n", server.dbnum);
+        exit(1);
+    }
+    dict *d = server.dict[dbid];
+    time_t now = time(NULL);
+
+    // 预先分配的内存，如果要读取的数据可以放下则可以减少内存申请
+    char buf[REDIS_LOADBUF_LEN]; 
+
+    while (true) {
+        uint8_t type;
+        if (rdbRead(&type, 1, fp) == 0) {
+            return REDIS_ERR;
+        }
+        time_t expire = -1;
+        if (type == REDIS_EXPIRETIME) {
+            uint32_t when;
+            if (rdbRead(&when, 4, fp) == 0 || rdbRead(&type, 1, fp) == 0) {
+                return REDIS_ERR;
+            }
+            expire = ntohl(when);
+        }
+        // 当前db结束了
+        if (type == REDIS_SELECTDB || type == REDIS_EOF) {
+            return type;
+        }
+
+        robj *key = deserializeStringObject(fp, rdbver, buf);
+        if (key == NULL) {
+            return REDIS_ERR;
+        }
+
+        robj *value = NULL;
+        switch (type) {
+            case REDIS_STRING:
+                value = deserializeStringObject(fp, rdbver, buf);
+                if (value != NULL) {
+                    value = tryObjectEncoding(value);
+                }
+                break;
+            case REDIS_LIST:
+                value = deserializeList(fp, rdbver, buf);
+                break;
+            case REDIS_SET:
+                value = deserializeSet(fp, rdbver, buf);
+                break;
+            case REDIS_HASH:
+                value = deserializeHash(fp, rdbver, buf);
+                break;
+            case REDIS_ZSET:
+                value = deserializeZset(fp, rdbver, buf);
+                break;
+            default:
+                redisLog(REDIS_WARNING, "Unknown object type %d loading DB, the file is corrupted", type);
+                decrRefCount(key);
+                return REDIS_ERR;
+        }
+        if (value == NULL) {
+            return REDIS_ERR;
+        }
+        // 已经过期的 key 不用加载, slave 要和 master 保持一致, 等 master 的 DEL
+        if (expire != -1 && now > expire && server.masterhost == NULL) {
+            decrRefCount(key);
+            decrRefCount(value);
+            continue;
+        }
+        if (dictAdd(d, key, value) == DICT_ERR) {
+            redisLog(REDIS_WARNING, "Loading DB, duplicated key found! Unrecoverable error, exiting now.");
+            exit(1);
+        }
+        if (expire != -1) {
+            setExpire(dbid, key, expire);
+        }
+    }
+    // actuall unreach
+    return REDIS_OK;
+}
+
+/**
+ * 读 rdb 文件，重构所有db, 版本 0 到 REDIS_RDB_VERSION 都可以读, 版本 2 开始校验 CRC64.
+ * 校验失败时已经加载的数据由调用者处理
+ * REDIS0002
+ * [254, db_no, db content, ...] // 1. 254 REDIS_SELECTDB; 2. 无数据的DB忽略掉
+ *    db content: [[253, expire time], type, key length, key content, value, ...] value需要根据type来解析
+ * 255 // REDIS_EOF
+ * @return REDIS_OK if success, otherwise REDIS_ERR
+ */
+static int loadDb(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return REDIS_ERR;
+    }
+    rdbChecksum = 0;
+    char buf[10];
+    if (rdbRead(buf, 9, fp) == 0) {
+        goto eoferr;
+    }
+    buf[9] = '\0';
+    if (memcmp(buf, "REDIS", 5) != 0) {
+        fclose(fp);
+        redisLog(REDIS_WARNING, "Wrong signature trying to load DB from file");
+        return REDIS_ERR;
+    }
+    int rdbver = atoi(buf + 5);
+    if (rdbver < 0 || rdbver > REDIS_RDB_VERSION) {
+        fclose(fp);
+        redisLog(REDIS_WARNING, "Can't handle RDB format version %d", rdbver);
+        return REDIS_ERR;
+    }
+
+    // loadOneDbFromFile 出错时返回 REDIS_ERR, 不能用 uint8_t 接, 否则 -1 会变成 REDIS_EOF
+    uint8_t optype;
+    if (rdbRead(&optype, 1, fp) == 0) {
+        goto eoferr;
+    }
+    int type = optype;
+    while (type == REDIS_SELECTDB) {
+        type = loadOneDbFromFile(fp, rdbver);
+    }
+    if (type != REDIS_EOF) {
+        goto eoferr;
+    }
+    if (rdbver >= 2) {
+        uint64_t expected = rdbChecksum;
+        unsigned char cksum[8];
+        if (fread(cksum, 8, 1, fp) == 0) {
+            goto eoferr;
+        }
+        uint64_t stored = 0;
+        for (int i = 0; i < 8; i++) {
+            stored |= (uint64_t) cksum[i] << (i * 8);
+        }
+        if (stored != 0 && stored != expected) {
+            fclose(fp);
+            redisLog(REDIS_WARNING, "Wrong RDB checksum (stored %016llx, computed %016llx), the file is corrupted. "
+                                    "Run redis-check-rdb to inspect it. Exiting now.",
+                     (unsigned long long) stored, (unsigned long long) expected);
+            exit(1);
+        }
+    }
+
+    fclose(fp);
+    return REDIS_OK;
+
+    eoferr: 
+        fclose(fp);
+        redisLog(REDIS_WARNING, "Short read loading DB, Unrecoverable error, exiting now.");
+        exit(1);
+        return REDIS_ERR; // avoid compile warning
+}
+
+/* =========================== Append only file ===================== */
+
+/**
+ * 把命令以 multibulk 的格式追加到 buf: *<argc>\r\n, 每个参数 $<len>\r\n<arg>\r\n
+ */
+static sds catAppendOnlyGenericCommand(sds buf, int argc, robj **argv) {
+    buf = sdscatprintf(buf, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++) {
+        robj *o = getDecodedObject(argv[i]);
+        buf = sdscatprintf(buf, "$%zu\r\n", sdslen(o->ptr));
+        buf = sdscatlen(buf, o->ptr, sdslen(o->ptr));
+        buf = sdscatlen(buf, "\r\n", 2);
+        decrRefCount(o);
+    }
+    return buf;
+}
+
+/**
+ * 写命令先追加到 server.aofbuf, 在回复 client 之前由 flushAppendOnlyFile 写入文件.
+ * 相对时间的 EXPIRE 重放时已经不对了, 转成 EXPIREAT
+ */
+static void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    // 加载 AOF 时执行的命令不需要再写回去
+    if (server.appendfd == -1) {
+        return;
+    }
+    size_t start = sdslen(server.aofbuf);
+    if (dictid != server.appendseldb) {
+        char seldb[32];
+        int len = ll2string(seldb, sizeof(seldb), dictid);
+        server.aofbuf = sdscatprintf(server.aofbuf, "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n", len, seldb);
+        server.appendseldb = dictid;
+    }
+
+    if (cmd->proc == expireCommand) {
+        robj *tmpargv[3];
+        tmpargv[0] = createStringObject("EXPIREAT", 8);
+        tmpargv[1] = argv[1];
+        tmpargv[2] = createStringObjectFromLongLong(time(NULL) + strtoll(argv[2]->ptr, NULL, 10));
+        server.aofbuf = catAppendOnlyGenericCommand(server.aofbuf, 3, tmpargv);
+        decrRefCount(tmpargv[0]);
+        decrRefCount(tmpargv[2]);
+    } else {
+        server.aofbuf = catAppendOnlyGenericCommand(server.aofbuf, argc, argv);
+    }
+
+    // rewrite 期间的命令子进程看不到, 另外存一份, 子进程完成后追加到新文件
+    if (server.aof_child_pid != -1) {
+        aofRewriteBufferAppend(server.aofbuf + start, sdslen(server.aofbuf) - start);
+    }
+}
+
+static void aofFsyncFromBioThread(void *fd, void *unused) {
+    REDIS_NOTUSED(unused);
+    aof_fsync((int) (long) fd);
+}
+
+/**
+ * 把 aofbuf 写入文件, 然后按 appendfsync 的策略 fsync.
+ * everysec 时 bio 线程的 fsync 还没完成的话 write 也会被阻塞, 先推迟最多 REDIS_AOF_MAX_POSTPONE_SECONDS 秒.
+ * @param force 不管后台的 fsync, 直接写入, 比如 shutdown 时
+ */
+static void flushAppendOnlyFile(bool force) {
+    if (server.appendfd == -1) {
+        return;
+    }
+    time_t now = time(NULL);
+    bool sync_in_progress = false;
+    if (server.appendfsync == REDIS_APPENDFSYNC_EVERYSEC) {
+        sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
+    }
+
+    if (sdslen(server.aofbuf) == 0) {
+        // 没有新的命令, 但之前写入的数据可能因为一秒内已经 fsync 过而还没有 fsync
+        if (server.appendfsync == REDIS_APPENDFSYNC_EVERYSEC && server.aof_fsync_offset != server.aof_current_size &&
+            now > server.aof_last_fsync && !sync_in_progress) {
+            goto try_fsync;
+        }
+        return;
+    }
+
+    if (server.appendfsync == REDIS_APPENDFSYNC_EVERYSEC && sync_in_progress && !force) {
+        if (server.aof_flush_postponed_start == 0) {
+            server.aof_flush_postponed_start = now;
+            return;
+        } else if (now - server.aof_flush_postponed_start < REDIS_AOF_MAX_POSTPONE_SECONDS) {
+            return;
+        }
+        server.stat_aof_delayed_fsync++;
+        redisLog(REDIS_NOTICE, "Asynchronous AOF fsync is taking too long (disk is busy?). "
+                               "Writing the AOF buffer without waiting for fsync to complete");
+    }
+    server.aof_flush_postponed_start = 0;
+
+    ssize_t nwritten = write(server.appendfd, server.aofbuf, sdslen(server.aofbuf));
+    if (nwritten != (ssize_t) sdslen(server.aofbuf)) {
+        if (nwritten == -1) {
+            redisLog(REDIS_WARNING, "Error writing to the AOF file: %s", strerror(errno));
+        } else {
+            redisLog(REDIS_WARNING, "Short write while writing to the AOF file: %zd of %zu bytes",
+                     nwritten, sdslen(server.aofbuf));
+        }
+        // always 时这些命令已经执行了, 马上就要回复 client, 不能假装它们已经持久化
+        if (server.appendfsync == REDIS_APPENDFSYNC_ALWAYS) {
+            redisLog(REDIS_WARNING, "Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        // 其他策略下保留没写进去的部分, 下一轮再试
+        if (nwritten > 0) {
+            server.aof_current_size += nwritten;
+            server.aofbuf = sdsrange(server.aofbuf, nwritten, -1);
+        }
+        return;
+    }
+    server.aof_current_size += nwritten;
+    if (sdsAllocSize(server.aofbuf) < REDIS_AOFBUF_REUSE_MAX) {
+        server.aofbuf = sdsrange(server.aofbuf, nwritten, -1);
+    } else {
+        sdsfree(server.aofbuf);
+        server.aofbuf = sdsempty();
+    }
+
+try_fsync:
+    if (server.appendfsync == REDIS_APPENDFSYNC_ALWAYS) {
+        if (aof_fsync(server.appendfd) == -1) {
+            redisLog(REDIS_WARNING, "Can't persist AOF for fsync error when the AOF fsync policy is 'always': %s. Exiting...",
+                     strerror(errno));
+            exit(1);
+        }
+        server.aof_fsync_offset = server.aof_current_size;
+        server.aof_last_fsync = now;
+    } else if (server.appendfsync == REDIS_APPENDFSYNC_EVERYSEC && now > server.aof_last_fsync) {
+        // 上一次的 fsync 还没完成时跳过这一次, 没 fsync 的数据由下一次补上
+        if (!sync_in_progress) {
+            bioCreateBackgroundJob(BIO_AOF_FSYNC, aofFsyncFromBioThread, (void *) (long) server.appendfd, NULL);
+            server.aof_fsync_offset = server.aof_current_size;
+        }
+        server.aof_last_fsync = now;
+    }
+}
+
+/**
+ * 以追加模式打开 AOF, 打不开直接退出, 否则之后的写命令都无法持久化
+ */
+static void openAppendOnlyFile(void) {
+    server.appendfd = open(server.appendfilename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (server.appendfd == -1) {
+        redisLog(REDIS_WARNING, "Can't open the append-only file %s: %s", server.appendfilename, strerror(errno));
+        exit(1);
+    }
+    struct stat sb;
+    if (fstat(server.appendfd, &sb) == -1) {
+        redisLog(REDIS_WARNING, "Can't stat the append-only file %s: %s", server.appendfilename, strerror(errno));
+        exit(1);
+    }
+    server.aof_current_size = sb.st_size;
+    server.aof_fsync_offset = sb.st_size;
+    server.aof_rewrite_base_size = sb.st_size;
+    server.appendseldb = -1;
+}
+
+/**
+ * 用一个没有连接的 client 依次执行 AOF 中的命令.
+ * 最后一条命令只写了一半(比如写的时候宕机了)时丢掉它, 并把文件截断到最后一条完整的命令, 否则之后追加的命令会接在半条命令后面
+ * @return REDIS_ERR 文件不存在
+ */
+static int loadAppendOnlyFile(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return REDIS_ERR;
+        }
+        redisLog(REDIS_WARNING, "Fatal error: can't open the append log file for reading: %s", strerror(errno));
+        exit(1);
+    }
+
+    redisClient *fakeClient = zmalloc(sizeof(*fakeClient));
+    if (fakeClient == NULL) {
+        oom("loadAppendOnlyFile");
+    }
+    fakeClient->fd = -1;
+    fakeClient->dict = server.dict[0];
+    fakeClient->dictid = 0;
+    fakeClient->querybuf = NULL;
+    fakeClient->argc = 0;
+    fakeClient->bulklen = -1;
+    fakeClient->sentlen = 0;
+    fakeClient->bufpos = 0;
+    fakeClient->flags = 0;
+    fakeClient->reply = NULL;
+
+    char buf[128];
+    off_t valid_up_to = 0;
+    long long loaded = 0;
+    while (true) {
+        if (fgets(buf, sizeof(buf), fp) == NULL) {
+            if (feof(fp)) {
+                break;
+            }
+            goto readerr;
+        }
+        if (buf[0] != '*') {
+            goto fmterr;
+        }
+        int argc = atoi(buf + 1);
+        if (argc < 1 || argc > REDIS_MAX_ARGS) {
+            goto fmterr;
+        }
+        for (int j = 0; j < argc; j++) {
+            if (fgets(buf, sizeof(buf), fp) == NULL) {
+                goto readerr;
+            }
+            if (buf[0] != '$') {
+                goto fmterr;
+            }
+            long len = strtol(buf + 1, NULL, 10);
+            if (len < 0) {
+                goto fmterr;
+            }
+            sds arg = sdsnewlen(NULL, len);
+            if (len > 0 && fread(arg, len, 1, fp) == 0) {
+                sdsfree(arg);
+                goto readerr;
+            }
+            fakeClient->argv[fakeClient->argc++] = createObject(REDIS_STRING, arg);
+            if (fread(buf, 2, 1, fp) == 0) {
+                goto readerr;
+            }
+        }
+
+        struct redisCommand *cmd = lookupCommand(fakeClient->argv[0]->ptr);
+        if (cmd == NULL) {
+            redisLog(REDIS_WARNING, "Unknown command '%s' reading the append only file", (char *) fakeClient->argv[0]->ptr);
+            exit(1);
+        }
+        // 和 processCommand 一样检查参数个数, 否则损坏的文件会让命令读到 argv 之外
+        if ((cmd->arity > 0 && cmd->arity != fakeClient->argc) || (fakeClient->argc < -cmd->arity)) {
+            redisLog(REDIS_WARNING, "Wrong number of arguments for '%s' reading the append only file", cmd->name);
+            goto fmterr;
+        }
+        cmd->proc(fakeClient);
+        freeClientArgv(fakeClient);
+        valid_up_to = ftello(fp);
+        loaded++;
+    }
+    fclose(fp);
+    zfree(fakeClient);
+    // 数据都来自 AOF, 不需要马上再保存一次
+    server.dirty = 0;
+    redisLog(REDIS_NOTICE, "%lld commands loaded from the append only file", loaded);
+    return REDIS_OK;
+
+readerr:
+    if (!feof(fp)) {
+        redisLog(REDIS_WARNING, "Unrecoverable error reading the append only file: %s", strerror(errno));
+        exit(1);
+    }
+    freeClientArgv(fakeClient);
+    zfree(fakeClient);
+    fclose(fp);
+    redisLog(REDIS_WARNING, "The append only file is truncated, the last incomplete command is discarded "
+                            "and the file is truncated to %lld bytes", (long long) valid_up_to);
+    if (truncate(filename, valid_up_to) == -1) {
+        redisLog(REDIS_WARNING, "Error truncating the append only file: %s", strerror(errno));
+        exit(1);
+    }
+    server.dirty = 0;
+    return REDIS_OK;
+
+fmterr:
+    redisLog(REDIS_WARNING, "Bad file format reading the append only file at offset %lld", (long long) valid_up_to);
+    exit(1);
+}
+
+/* =========================== AOF rewrite ===================== */
+
+/**
+ * 写入一个 multibulk 参数: $<len>\r\n<data>\r\n
+ */
+static int aofWriteBulkBuffer(FILE *fp, const void *buf, size_t len) {
+    char hdr[32];
+    int hdrlen = snprintf(hdr, sizeof(hdr), "$%zu\r\n", len);
+    if (fwrite(hdr, hdrlen, 1, fp) == 0 || (len > 0 && fwrite(buf, len, 1, fp) == 0) || fwrite("\r\n", 2, 1, fp) == 0) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static int aofWriteBulkLongLong(FILE *fp, long long value) {
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    return aofWriteBulkBuffer(fp, buf, len);
+}
+
+/**
+ * 整数编码的对象在这里临时转成字符串写入
+ */
+static int aofWriteBulkObject(FILE *fp, robj *o) {
+    if (sdsEncodedObject(o)) {
+        return aofWriteBulkBuffer(fp, o->ptr, sdslen(o->ptr));
+    }
+    return aofWriteBulkLongLong(fp, (long) o->ptr);
+}
+
+/**
+ * ziplist 中的整数 entry 转成字符串写入
+ */
+static int aofWriteBulkZiplistEntry(FILE *fp, unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    ziplistGet(p, &vstr, &vlen, &vlong);
+    if (vstr == NULL) {
+        return aofWriteBulkLongLong(fp, vlong);
+    }
+    return aofWriteBulkBuffer(fp, vstr, vlen);
+}
+
+/**
+ * 写入命令的开头: *<argc>\r\n, 命令名和 key
+ */
+static int aofWriteCommandHeader(FILE *fp, int argc, const char *cmdname, robj *key) {
+    char hdr[32];
+    int hdrlen = snprintf(hdr, sizeof(hdr), "*%d\r\n", argc);
+    if (fwrite(hdr, hdrlen, 1, fp) == 0 || aofWriteBulkBuffer(fp, cmdname, strlen(cmdname)) == REDIS_ERR ||
+        aofWriteBulkObject(fp, key) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * RPUSH 每次只能添加一个元素, 每个元素一条命令
+ */
+static int rewriteListObject(FILE *fp, robj *key, robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        for (unsigned char *p = ziplistIndex(o->ptr, 0); p != NULL; p = ziplistNext(o->ptr, p)) {
+            if (aofWriteCommandHeader(fp, 3, "RPUSH", key) == REDIS_ERR || aofWriteBulkZiplistEntry(fp, p) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+        }
+        return REDIS_OK;
+    }
+
+    quicklistIter *iter = quicklistGetIterator(o->ptr, AL_START_HEAD);
+    quicklistEntry entry;
+    int status = REDIS_OK;
+    while (status == REDIS_OK && quicklistNext(iter, &entry)) {
+        status = aofWriteCommandHeader(fp, 3, "RPUSH", key);
+        if (status == REDIS_OK) {
+            if (entry.value != NULL) {
+                status = aofWriteBulkBuffer(fp, entry.value, entry.sz);
+            } else {
+                status = aofWriteBulkLongLong(fp, entry.longval);
+            }
+        }
+    }
+    quicklistReleaseIterator(iter);
+    return status;
+}
+
+static int rewriteSetObject(FILE *fp, robj *key, robj *o) {
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        int64_t intele;
+        for (uint32_t i = 0; intsetGet(o->ptr, i, &intele); i++) {
+            if (aofWriteCommandHeader(fp, 3, "SADD", key) == REDIS_ERR || aofWriteBulkLongLong(fp, intele) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+        }
+        return REDIS_OK;
+    }
+
+    dictIterator *it = dictGetIterator(o->ptr);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+    int status = REDIS_OK;
+    dictEntry *entry;
+    while (status == REDIS_OK && (entry = dictNext(it)) != NULL) {
+        status = aofWriteCommandHeader(fp, 3, "SADD", key);
+        if (status == REDIS_OK) {
+            status = aofWriteBulkObject(fp, dictGetEntryKey(entry));
+        }
+    }
+    dictReleaseIterator(it);
+    return status;
+}
+
+/**
+ * ziplist 中 field 和 value 交替存放
+ */
+static int rewriteHashObject(FILE *fp, robj *key, robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, 0);
+        while (p != NULL) {
+            unsigned char *vp = ziplistNext(o->ptr, p);
+            if (aofWriteCommandHeader(fp, 4, "HSET", key) == REDIS_ERR || aofWriteBulkZiplistEntry(fp, p) == REDIS_ERR ||
+                aofWriteBulkZiplistEntry(fp, vp) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+            p = ziplistNext(o->ptr, vp);
+        }
+        return REDIS_OK;
+    }
+
+    dictIterator *it = dictGetIterator(o->ptr);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+    int status = REDIS_OK;
+    dictEntry *entry;
+    while (status == REDIS_OK && (entry = dictNext(it)) != NULL) {
+        status = aofWriteCommandHeader(fp, 4, "HSET", key);
+        if (status == REDIS_OK) {
+            status = aofWriteBulkObject(fp, dictGetEntryKey(entry));
+        }
+        if (status == REDIS_OK) {
+            status = aofWriteBulkObject(fp, dictGetEntryVal(entry));
+        }
+    }
+    dictReleaseIterator(it);
+    return status;
+}
+
+/**
+ * ziplist 中 member 和 score 交替存放, ZADD 的参数顺序是 score member
+ */
+static int rewriteZsetObject(FILE *fp, robj *key, robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, 0);
+        while (p != NULL) {
+            unsigned char *sp = ziplistNext(o->ptr, p);
+            if (aofWriteCommandHeader(fp, 4, "ZADD", key) == REDIS_ERR || aofWriteBulkZiplistEntry(fp, sp) == REDIS_ERR ||
+                aofWriteBulkZiplistEntry(fp, p) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+            p = ziplistNext(o->ptr, sp);
+        }
+        return REDIS_OK;
+    }
+
+    zskiplistNode *ln = ((zset *) o->ptr)->zsl->header->level[0].forward;
+    for (; ln != NULL; ln = ln->level[0].forward) {
+        char buf[128];
+        int scorelen = d2string(buf, sizeof(buf), ln->score);
+        if (aofWriteCommandHeader(fp, 4, "ZADD", key) == REDIS_ERR || aofWriteBulkBuffer(fp, buf, scorelen) == REDIS_ERR ||
+            aofWriteBulkObject(fp, ln->obj) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 在子进程中根据当前的数据生成最少的命令, 重放后得到同样的数据. 已经过期的 key 直接跳过.
+ * 先写 temp file, 写成功后再原子的 rename 成 filename
+ */
+static int rewriteAppendOnlyFile(char *filename) {
+    char tmpfile[256];
+    snprintf(tmpfile, 256, "temp-rewriteaof-%d.aof", (int) getpid());
+    FILE *fp = fopen(tmpfile, "w");
+    if (fp == NULL) {
+        redisLog(REDIS_WARNING, "Failed rewriting the append only file: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+
+    dictIterator *dictIt = NULL;
+    for (int i = 0; i < server.dbnum; i++) {
+        dict *d = server.dict[i];
+        if (dictGetHashTableUsed(d) == 0) {
+            continue;
+        }
+        if (fwrite("*2\r\n$6\r\nSELECT\r\n", 16, 1, fp) == 0 || aofWriteBulkLongLong(fp, i) == REDIS_ERR) {
+            goto werr;
+        }
+
+        dictIt = dictGetIterator(d);
+        if (dictIt == NULL) {
+            oom("dictGetIterator");
+        }
+        dictEntry *entry;
+        while ((entry = dictNext(dictIt)) != NULL) {
+            robj *key = dictGetEntryKey(entry);
+            robj *o = dictGetEntryVal(entry);
+            time_t expire = getExpire(i, key);
+            if (expire != -1 && time(NULL) > expire) {
+                continue;
+            }
+
+            int status = REDIS_ERR;
+            switch (o->type) {
+            case REDIS_STRING:
+                status = aofWriteCommandHeader(fp, 3, "SET", key);
+                if (status == REDIS_OK) {
+                    status = aofWriteBulkObject(fp, o);
+                }
+                break;
+            case REDIS_LIST:
+                status = rewriteListObject(fp, key, o);
+                break;
+            case REDIS_SET:
+                status = rewriteSetObject(fp, key, o);
+                break;
+            case REDIS_HASH:
+                status = rewriteHashObject(fp, key, o);
+                break;
+            case REDIS_ZSET:
+                status = rewriteZsetObject(fp, key, o);
+                break;
+            default:
+                assert(false);
+            }
+            if (status == REDIS_OK && expire != -1) {
+                status = aofWriteCommandHeader(fp, 3, "EXPIREAT", key);
+                if (status == REDIS_OK) {
+                    status = aofWriteBulkLongLong(fp, expire);
+                }
+            }
+            if (status != REDIS_OK) {
+                goto werr;
+            }
+        }
+        dictReleaseIterator(dictIt);
+        dictIt = NULL;
+    }
+
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+        goto werr;
+    }
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto werr;
+    }
+    if (rename(tmpfile, filename) == -1) {
+        redisLog(REDIS_WARNING, "Error moving temp append only file on the final destination: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "SYNC append only file rewrite performed");
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Write error writing append only file on disk: %s", strerror(errno));
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    unlink(tmpfile);
+    if (dictIt != NULL) {
+        dictReleaseIterator(dictIt);
+    }
+    return REDIS_ERR;
+}
+
+/**
+ * 子进程完成后父进程要追加的文件名, 和子进程的 pid 对应
+ */
+static void backgroundRewriteTempFileName(char *buf, size_t len, pid_t childpid) {
+    snprintf(buf, len, "temp-rewriteaof-bg-%d.aof", (int) childpid);
+}
+
+static void aofRewriteBufferReset(void) {
+    listRelease(server.aof_rewrite_buf_blocks);
+    if ((server.aof_rewrite_buf_blocks = listCreate()) == NULL) {
+        oom("listCreate");
+    }
+    listSetFreeMethod(server.aof_rewrite_buf_blocks, zfree);
+}
+
+static size_t aofRewriteBufferSize(void) {
+    size_t size = 0;
+    for (listNode *ln = listFirst(server.aof_rewrite_buf_blocks); ln != NULL; ln = listNextNode(ln)) {
+        aofrwblock *block = listNodeValue(ln);
+        size += block->used;
+    }
+    return size;
+}
+
+/**
+ * 追加到最后一个块, 放不下的部分放到新的块中
+ */
+static void aofRewriteBufferAppend(const char *s, size_t len) {
+    while (len > 0) {
+        listNode *ln = listLast(server.aof_rewrite_buf_blocks);
+        aofrwblock *block = ln != NULL ? listNodeValue(ln) : NULL;
+        if (block != NULL && block->free > 0) {
+            size_t thislen = block->free < len ? block->free : len;
+            memcpy(block->buf + block->used, s, thislen);
+            block->used += thislen;
+            block->free -= thislen;
+            s += thislen;
+            len -= thislen;
+        }
+        if (len > 0) {
+            block = zmalloc(sizeof(*block));
+            if (block == NULL) {
+                oom("aofRewriteBufferAppend");
+            }
+            block->used = 0;
+            block->free = REDIS_AOF_RW_BUF_BLOCK_SIZE;
+            if (listAddNodeTail(server.aof_rewrite_buf_blocks, block) == NULL) {
+                oom("listAddNodeTail");
+            }
+        }
+    }
+}
+
+/**
+ * @return 写入的字节数, -1 表示出错
+ */
+static ssize_t aofRewriteBufferWrite(int fd) {
+    ssize_t count = 0;
+    for (listNode *ln = listFirst(server.aof_rewrite_buf_blocks); ln != NULL; ln = listNextNode(ln)) {
+        aofrwblock *block = listNodeValue(ln);
+        if (block->used == 0) {
+            continue;
+        }
+        ssize_t nwritten = write(fd, block->buf, block->used);
+        if (nwritten != (ssize_t) block->used) {
+            if (nwritten >= 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        count += nwritten;
+    }
+    return count;
+}
+
+/**
+ * 记录 rewrite 失败, 自动 rewrite 会推迟一段时间再试, 否则 serverCron 每秒都会 fork 一个注定失败的子进程
+ */
+static void aofRewriteFailed(void) {
+    server.aof_lastbgrewrite_status = REDIS_ERR;
+    server.aof_rewrite_failures++;
+    server.aof_rewrite_failed_at = time(NULL);
+}
+
+/**
+ * fork 一个子进程写新的 AOF, 父进程把这之后的写命令同时追加到 rewrite 缓冲区, 子进程完成后再追加到新文件中
+ */
+static int rewriteAppendOnlyFileBackground(void) {
+    if (hasActiveChildProcess()) {
+        return REDIS_ERR;
+    }
+
+    long long start = mstime();
+    pid_t childpid = fork();
+    if (childpid == 0) {
+        close(server.fd);
+        char tmpfile[256];
+        backgroundRewriteTempFileName(tmpfile, sizeof(tmpfile), getpid());
+        exit(rewriteAppendOnlyFile(tmpfile) == REDIS_OK ? 0 : 1);
+    } else if (childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't rewrite append only file in background: fork: %s", strerror(errno));
+        aofRewriteFailed();
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "Background append only file rewriting started by pid %d", childpid);
+    server.aof_child_pid = childpid;
+    server.aof_rewrite_scheduled = false;
+    server.aof_rewrite_time_start = start;
+    // 子进程和父进程共享内存页, 同 BGSAVE
+    dictDisableResize();
+    // 让 rewrite 缓冲区中的第一条命令前面有 SELECT, 追加到新文件之后 db 是对的
+    server.appendseldb = -1;
+    return REDIS_OK;
+}
+
+static void aofCloseFromBioThread(void *fd, void *unused) {
+    REDIS_NOTUSED(unused);
+    close((int) (long) fd);
+}
+
+/**
+ * 把 rewrite 缓冲区追加到子进程写好的文件, 然后原子的 rename 成 appendfilename, 之后的命令都写入新文件
+ */
+static void backgroundRewriteDoneHandler(int exitcode) {
+    int status = REDIS_ERR;
+    char tmpfile[256];
+    backgroundRewriteTempFileName(tmpfile, sizeof(tmpfile), server.aof_child_pid);
+    if (exitcode != 0) {
+        redisLog(REDIS_WARNING, "Background append only file rewriting error");
+        goto cleanup;
+    }
+
+    long long start = mstime();
+    int newfd = open(tmpfile, O_WRONLY | O_APPEND);
+    if (newfd == -1) {
+        redisLog(REDIS_WARNING, "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
+        goto cleanup;
+    }
+    ssize_t nwritten = aofRewriteBufferWrite(newfd);
+    if (nwritten == -1) {
+        redisLog(REDIS_WARNING, "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
+        close(newfd);
+        goto cleanup;
+    }
+    redisLog(REDIS_NOTICE, "Parent diff successfully flushed to the rewritten AOF (%zd bytes)", nwritten);
+
+    // rename 覆盖旧文件时, 如果没有其他 fd 引用它, 会在主线程中同步的删除, 大文件可能要很久.
+    // 先打开它, 最后一个引用由 bio 线程关闭
+    int oldfd = -1;
+    if (server.appendfd == -1) {
+        oldfd = open(server.appendfilename, O_RDONLY | O_NONBLOCK);
+    }
+    if (rename(tmpfile, server.appendfilename) == -1) {
+        redisLog(REDIS_WARNING, "Error trying to rename the temporary AOF: %s", strerror(errno));
+        close(newfd);
+        if (oldfd != -1) {
+            close(oldfd);
+        }
+        goto cleanup;
+    }
+
+    if (server.appendfd == -1) {
+        // 没有开启 AOF, 只是生成一个新的文件
+        close(newfd);
+    } else {
+        oldfd = server.appendfd;
+        server.appendfd = newfd;
+        if (server.appendfsync == REDIS_APPENDFSYNC_ALWAYS) {
+            aof_fsync(newfd);
+        } else if (server.appendfsync == REDIS_APPENDFSYNC_EVERYSEC) {
+            bioCreateBackgroundJob(BIO_AOF_FSYNC, aofFsyncFromBioThread, (void *) (long) newfd, NULL);
+        }
+        struct stat sb;
+        if (fstat(newfd, &sb) != -1) {
+            server.aof_current_size = sb.st_size;
+        }
+        server.aof_rewrite_base_size = server.aof_current_size;
+        server.aof_fsync_offset = server.aof_current_size;
+        // aofbuf 中的命令同样在 rewrite 缓冲区中, 已经写入新文件了
+        sdsfree(server.aofbuf);
+        server.aofbuf = sdsempty();
+    }
+    // 和 fsync 在同一个线程中, 保证排在旧文件还没完成的 fsync 之后
+    if (oldfd != -1) {
+        bioCreateBackgroundJob(BIO_AOF_FSYNC, aofCloseFromBioThread, (void *) (long) oldfd, NULL);
+    }
+    redisLog(REDIS_NOTICE, "Background AOF rewrite finished successfully, parent spent %lld ms on the diff",
+             mstime() - start);
+    status = REDIS_OK;
+
+cleanup:
+    if (status == REDIS_OK) {
+        server.aof_lastbgrewrite_status = REDIS_OK;
+        server.aof_rewrite_failures = 0;
+    } else {
+        aofRewriteFailed();
+    }
+    unlink(tmpfile);
+    aofRewriteBufferReset();
+    server.aof_rewrite_time_last = mstime() - server.aof_rewrite_time_start;
+    server.aof_child_pid = -1;
+    dictEnableResize();
+}
+
+static void waitRewriteAppendOnlyFileFinish(void) {
+    int statloc;
+    if (waitpid(server.aof_child_pid, &statloc, WNOHANG) > 0) {
+        backgroundRewriteDoneHandler(WIFEXITED(statloc) ? WEXITSTATUS(statloc) : 1);
+    }
+}
+
+/**
+ * AOF 比上次 rewrite 之后的大小增长了 auto_aof_rewrite_perc% 时自动 rewrite.
+ * 上次失败了的话, 推迟 REDIS_AOF_REWRITE_RETRY_SECONDS 秒, 连续失败时每次加倍
+ */
+static void rewriteAppendOnlyFileIfNeed(void) {
+    if (!server.appendonly || server.auto_aof_rewrite_perc == 0 ||
+        server.aof_current_size < server.auto_aof_rewrite_min_size) {
+        return;
+    }
+    if (server.aof_rewrite_failures > 0) {
+        int shift = server.aof_rewrite_failures - 1;
+        if (shift > REDIS_AOF_REWRITE_RETRY_MAX_SHIFT) {
+            shift = REDIS_AOF_REWRITE_RETRY_MAX_SHIFT;
+        }
+        if (time(NULL) - server.aof_rewrite_failed_at < (REDIS_AOF_REWRITE_RETRY_SECONDS << shift)) {
+            return;
+        }
+    }
+    off_t base = server.aof_rewrite_base_size ? server.aof_rewrite_base_size : 1;
+    long long growth = (server.aof_current_size * 100 / base) - 100;
+    if (growth >= server.auto_aof_rewrite_perc) {
+        redisLog(REDIS_NOTICE, "Starting automatic rewriting of AOF on %lld%% growth", growth);
+        rewriteAppendOnlyFileBackground();
+    }
+}
+
+/* ========================= Comands ========================== */
+static void pingCommand(redisClient *c) {
+    addReply(c, shared.pong);
+}
+
+static void echoCommand(redisClient *c) {
+    addReplyBulk(c, c->argv[1]);
+}
+
+/* ===================== Strings ======================== */
+/**
+ * c->argv: 0: set; 1: key; 2: value
+ * @param nx is not exist, if true only key not exist will add
+ */
+static void setGenericCommand(redisClient *c, bool nx) {
+    // 已经过期的 key 对 SETNX 来说不存在
+    expireIfNeeded(c->dictid, c->argv[1]);
+    c->argv[2] = tryObjectEncoding(c->argv[2]);
+    int retval = dictAdd(c->dict, c->argv[1], c->argv[2]);
+    if (retval == DICT_ERR) {
+        if (nx) {
+            // key 存在，不做任何操作
+            addReply(c, shared.zero);
+            return;
+        } else {
+            // todo: 是不是应该把这个判断提前，如果不是nx，直接使用replace
+            if (server.lazyfree_lazy_server_del) {
+                lazyfreeDetachValue(c->dict, dictFind(c->dict, c->argv[1]));
+            }
+            dictReplace(c->dict, c->argv[1], c->argv[2]);
+            incrRefCount(c->argv[2]);
+            // SET 会清除原来的过期时间
+            removeExpire(c->dictid, c->argv[1]);
+        }
+    } else {
+        incrRefCount(c->argv[1]);
+        incrRefCount(c->argv[2]);
+    }
+    server.dirty++;
+    addReply(c, nx ? shared.one : shared.ok);
+}
+
+static void setCommand(redisClient *c) {
+    return setGenericCommand(c, false);
+}
+
+static void setnxCommand(redisClient *c) {
+    return setGenericCommand(c, true);
+}
+
+static void getCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de != NULL) {
+        robj *o = dictGetEntryVal(de);
+        if (o->type != REDIS_STRING) {
+            addReply(c, shared.wrongtypeerrbulk);
+        } else {
+            addReplyBulk(c, o);
+        }
+    } else {
+        addReply(c, shared.nil);
+    }
+}
+
+/**
+ * 不存在或者类型不对的 key 当作 0
+ */
+static long long stringObjectToLL(robj *o) {
+    if (o == NULL || o->type != REDIS_STRING) {
+        return 0;
+    }
+    if (o->encoding == REDIS_ENCODING_INT) {
+        return (long) o->ptr;
+    }
+    char *eptr;
+    return strtoll(o->ptr, &eptr, 10);
+}
+
+/**
+ * 严格解析: 整个字符串都必须是整数并且不超出 long long 的范围
+ * @return false if s is not a valid long long
+ */
+static bool parseLongLong(const char *s, long long *value) {
+    if (s[0] == '\0') {
+        return false;
+    }
+    char *eptr;
+    errno = 0;
+    long long v = strtoll(s, &eptr, 10);
+    if (eptr[0] != '\0' || errno == ERANGE) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+/**
+ * @param delta 加/减数，负数表示减
+ */
+static void incrDecrCommand(redisClient *c, long long delta) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    robj *o = (de != NULL) ? dictGetEntryVal(de) : NULL;
+    long long value = stringObjectToLL(o);
+
+    // 有符号数溢出是未定义行为, 先检查再加
+    if ((delta < 0 && value < LLONG_MIN - delta) || (delta > 0 && value > LLONG_MAX - delta)) {
+        addReplySds(c, sdsnew("-ERR increment or decrement would overflow\r\n"));
+        return;
+    }
+    value += delta;
+
+    // 独占的整数编码对象直接原地修改，不需要申请新的 robj 和 sds
+    if (o != NULL && o->type == REDIS_STRING && o->encoding == REDIS_ENCODING_INT && o->refcount == 1 &&
+        (value < 0 || value >= REDIS_SHARED_INTEGERS) && value >= LONG_MIN && value <= LONG_MAX) {
+        o->ptr = (void *)((long) value);
+    } else {
+        o = createStringObjectFromLongLong(value);
+        int retval = dictAdd(c->dict, c->argv[1], o);
+        if (retval != DICT_ERR) {
+            incrRefCount(c->argv[1]);
+        } else {
+            dictReplace(c->dict, c->argv[1], o);
+        }
+    }
+    server.dirty++;
+    addReplyLongLong(c, value);
+}
+
+static void incrCommand(redisClient *c) {
+    return incrDecrCommand(c, 1);
+}
+
+static void incrbyCommand(redisClient *c) {
+    long long incr;
+    if (!parseLongLong(c->argv[2]->ptr, &incr)) {
+        addReplySds(c, sdsnew("-ERR value is not an integer or out of range\r\n"));
+        return;
+    }
+    return incrDecrCommand(c, incr);
+}
+
+static void decrCommand(redisClient *c) {
+    return incrDecrCommand(c, -1);
+}
+
+static void decrbyCommand(redisClient *c) {
+    long long incr;
+    if (!parseLongLong(c->argv[2]->ptr, &incr)) {
+        addReplySds(c, sdsnew("-ERR value is not an integer or out of range\r\n"));
+        return;
+    }
+    // -LLONG_MIN 放不下
+    if (incr == LLONG_MIN) {
+        addReplySds(c, sdsnew("-ERR increment or decrement would overflow\r\n"));
+        return;
+    }
+    return incrDecrCommand(c, -incr);
+}
+
+/* ==================== Type agnostic commands ====================== */
+/**
+ * @param lazy 大对象只从 db 中摘掉, 交给后台线程释放
+ */
+static void delGenericCommand(redisClient *c, bool lazy) {
+    if (expireIfNeeded(c->dictid, c->argv[1])) {
+        addReply(c, shared.zero);
+        return;
+    }
+    bool deleted = lazy ? unlinkKey(c->dictid, c->argv[1]) : deleteKey(c->dictid, c->argv[1]);
+    if (deleted) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+static void delCommand(redisClient *c) {
+    delGenericCommand(c, server.lazyfree_lazy_user_del);
+}
+
+static void unlinkCommand(redisClient *c) {
+    delGenericCommand(c, true);
+}
+
+static void existCommand(redisClient *c) {
+    dictEntry *de = dictFind(c, c->argv[1]);
+    addReply(c, de != NULL ? shared.one : shared.zero);
+}
+
+static void selectCommand(redisClient *c) {
+    int id = atoi(c->argv[1]->ptr);
+    if (selectDb(c, id) != REDIS_ERR) {
+        addReply(c, shared.ok);
+    } else {
+        addReplySds(c, "-ERR invalid DB index\r\n");
+    }
+}
+
+static void randomkeyCommand(redisClient *c) {
+    // 随机到的 key 可能已经过期了, 最多重试这么多次, slave 上的过期 key 不会被删除
+    int maxtries = 100;
+    dictEntry *de;
+    while ((de = dictGetRandomKey(c->dict)) != NULL && maxtries-- > 0 && expireIfNeeded(c->dictid, dictGetEntryKey(de))) {
+    }
+    if (de != NULL) {
+        addReply(c, dictGetEntryKey(de));
+        addReply(c, shared.crlf);
+    } else {
+        addReply(c, shared.crlf);
+    }
+}
+
+static void keysCommand(redisClient *c) {
+    sds pattern = c->argv[1]->ptr;
+    int plen = sdslen(pattern);
+
+    dictIterator *it = dictGetIterator(c->dict);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+
+    robj *lenobj = createObject(REDIS_STRING, NULL);
+    addReply(c, lenobj);
+    decrRefCount(lenobj);
+
+    int keyslen = 0;
+    int numkeys = 0;
+    dictEntry *de;
+    while ((de = dictNext(it)) != NULL) {
+        robj *keyobj = dictGetEntryKey(de);
+        sds key = keyobj->ptr;
+        if (keyIsExpired(c->dictid, keyobj)) {
+            continue;
+        }
+        if ((pattern[0] == '*' && pattern[1] == '\0') || stringmatchlen(pattern, plen, key, sdslen(key), 0)) {
+            if (numkeys != 0) {
+                addReply(c, shared.space);
+            }
+            addReply(c, keyobj);
+            numkeys++;
+            keyslen += sdslen(key);
+        }
+    }
+    dictReleaseIterator(it);
+    // numkeys-1 表示空格的数量?
+    // todo: 这个值什么时候发送呢
+    lenobj->ptr = sdscatprintf(sdsempty(), "%lu\r\n", keyslen + (numkeys ? numkeys-1 : 0));
+    addReply(c, shared.crlf);
+}
+
+/** SCAN 每次最多访问 COUNT * REDIS_SCAN_MAX_BUCKETS_PER_KEY 个 bucket, 避免在很空的 table 上扫太久 */
+#define REDIS_SCAN_DEFAULT_COUNT 10
+#define REDIS_SCAN_MAX_BUCKETS_PER_KEY 10
+
+static void scanCallback(void *privdata, const dictEntry *de) {
+    list *keys = privdata;
+    if (!listAddNodeTail(keys, dictGetEntryKey(de))) {
+        oom("listAddNodeTail");
+    }
+}
+
+/**
+ * SCAN cursor [COUNT count]
+ * 增量遍历 keyspace, 每次只做 COUNT 量级的工作, 不会像 KEYS 一样阻塞整个 server.
+ * 回复是 multi bulk, 第一个元素是下一次调用的 cursor, 为 0 表示遍历完了, 后面是这一批 key
+ */
+static void scanCommand(redisClient *c) {
+    char *eptr;
+    unsigned long cursor = strtoul(c->argv[1]->ptr, &eptr, 10);
+    if (*eptr != '\0' || ((char *) c->argv[1]->ptr)[0] == '-') {
+        addReplySds(c, sdsnew("-ERR invalid cursor\r\n"));
+        return;
+    }
+    long count = REDIS_SCAN_DEFAULT_COUNT;
+    if (c->argc == 4 && !strcasecmp(c->argv[2]->ptr, "count")) {
+        count = strtol(c->argv[3]->ptr, &eptr, 10);
+        if (*eptr != '\0' || count < 1) {
+            addReplySds(c, sdsnew("-ERR count must be a positive integer\r\n"));
+            return;
+        }
+    } else if (c->argc != 2) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
+    list *keys = listCreate();
+    if (keys == NULL) {
+        oom("listCreate");
+    }
+    long maxbuckets = count * REDIS_SCAN_MAX_BUCKETS_PER_KEY;
+    do {
+        cursor = dictScan(c->dict, cursor, scanCallback, keys);
+    } while (cursor != 0 && --maxbuckets > 0 && (long) listLength(keys) < count);
+
+    // 过期的 key 当作不存在, 这里只跳过, 留给主动过期删除
+    listIter *it = listGetIterator(keys, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    listNode *node;
+    while ((node = listNextElement(it)) != NULL) {
+        if (keyIsExpired(c->dictid, listNodeValue(node))) {
+            listDelNode(keys, node);
+        }
+    }
+    listReleaseIterator(it);
+
+    addReplyLongLong(c, listLength(keys) + 1);
+    addReplyBulkLongLong(c, cursor);
+    it = listGetIterator(keys, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    while ((node = listNextElement(it)) != NULL) {
+        addReplyBulk(c, listNodeValue(node));
+    }
+    listReleaseIterator(it);
+    listRelease(keys);
+}
+
+/**
+ * OBJECT FREQ <key>:     LFU 的访问频率计数器(对数), 只有 maxmemory-policy 是 LFU 时才有
+ * OBJECT IDLETIME <key>: 多少秒没被访问了, 只有不是 LFU 时才有
+ * 只查看, 不算一次访问
+ */
+static void objectCommand(redisClient *c) {
+    dictEntry *de = dictFind(c->dict, c->argv[2]);
+    if (de == NULL || keyIsExpired(c->dictid, c->argv[2])) {
+        addReply(c, shared.nil);
+        return;
+    }
+    robj *o = dictGetEntryVal(de);
+    if (!strcasecmp(c->argv[1]->ptr, "freq")) {
+        if (!maxmemoryPolicyIsLFU()) {
+            addReplySds(c, sdsnew("-ERR an LFU maxmemory policy is not selected, access frequency not tracked\r\n"));
+            return;
+        }
+        addReplyLongLong(c, LFUDecrAndReturn(o));
+    } else if (!strcasecmp(c->argv[1]->ptr, "idletime")) {
+        if (maxmemoryPolicyIsLFU()) {
+            addReplySds(c, sdsnew("-ERR an LFU maxmemory policy is selected, idle time not tracked\r\n"));
+            return;
+        }
+        addReplyLongLong(c, estimateObjectIdleTime(o) / 1000);
+    } else {
+        addReply(c, shared.syntaxerr);
+    }
+}
+
+static void dbsizeCommand(redisClient *c) {
+    addReplyLongLong(c, dictGetHashTableUsed(c->dict));
+}
+
+static void lastsaveCommand(redisClient *c) {
+    addReplyLongLong(c, server.lastsave);
+}
+
+static void typeCommand(redisClient *c) {
+    dictEntry *entry = dictFind(c->dict, c->argv[1]);
+    char *type;
+    if (entry != NULL) {
+        robj *o = dictGetEntryVal(entry);
+        if (o->type == REDIS_STRING) {
+            type = "string";
+        } else if (o->type == REDIS_LIST) {
+            type = "list";
+        } else if (o->type == REDIS_SET) {
+            type = "set";
+        } else if (o->type == REDIS_HASH) {
+            type = "hash";
+        } else if (o->type == REDIS_ZSET) {
+            type = "zset";
+        } else {
+            type = "unknow";
+        }
+    } else {
+        type = "none";
+    }
+    addReplySds(c, sdsnew(type));
+    addReply(c, shared.crlf);
+}
+
+static void saveCommand(redisClient *c) {
+    if (saveDb(server.dbfilename) == REDIS_OK) {
+        addReply(c, shared.ok);
+    } else {
+        addReply(c, shared.err);
+    }
+}
+
+static void bgsaveCommand(redisClient *c) {
+    if (server.bgsaveinprogress) {
+        addReplySds(c, sdsnew("-ERR background save already in progress\r\n"));
+        return;
+    }
+    if (server.aof_child_pid != -1) {
+        addReplySds(c, sdsnew("-ERR background append only file rewriting in progress\r\n"));
+        return;
+    }
+    if (saveDbBackground(server.dbfilename) == REDIS_OK) {
+        addReply(c, shared.ok);
+    } else {
+        addReply(c, shared.err);
+    }
+}
+
+/**
+ * BGSAVE 期间先记下来, BGSAVE 结束后由 serverCron 开始
+ */
+static void bgrewriteaofCommand(redisClient *c) {
+    if (server.aof_child_pid != -1) {
+        addReplySds(c, sdsnew("-ERR background append only file rewriting already in progress\r\n"));
+    } else if (server.bgsaveinprogress) {
+        server.aof_rewrite_scheduled = true;
+        addReplySds(c, sdsnew("+Background append only file rewriting scheduled\r\n"));
+    } else if (rewriteAppendOnlyFileBackground() == REDIS_OK) {
+        addReplySds(c, sdsnew("+Background append only file rewriting started\r\n"));
+    } else {
+        addReply(c, shared.err);
+    }
+}
+
+static void shutdownCommand(redisClient *c) {
+    if (server.aof_child_pid != -1) {
+        redisLog(REDIS_WARNING, "There is a child rewriting the AOF. Killing it!");
+        char tmpfile[256];
+        backgroundRewriteTempFileName(tmpfile, sizeof(tmpfile), server.aof_child_pid);
+        kill(server.aof_child_pid, SIGKILL);
+        unlink(tmpfile);
+    }
+    if (server.appendonly) {
+        redisLog(REDIS_WARNING, "Calling fsync() on the AOF file.");
+        flushAppendOnlyFile(true);
+        aof_fsync(server.appendfd);
+    }
+    redisLog(REDIS_WARNING, "User requested shutdown, saving DB...");
+    if (saveDb(server.dbfilename) == REDIS_OK) {
+        redisLog(REDIS_WARNING, "Server exit now, bye bye...");
+        exit(1);
+    } else {
+        redisLog(REDIS_WARNING, "Error trying to save the db, can't exit");
+        addReplySds(c, sdsnew("-RR can't quit, problems saving the DB\r\n"));
+    }
+}
+
+/**
+ * @param nx is not exist. if nx is true and the new key is exist, will not rename
+ */
+static void renameGenericCommand(redisClient *c, bool nx) {
+    if (sdscmp(c->argv[1]->ptr, c->argv[2]->ptr) == 0) {
+        if (nx) {
+            addReply(c, shared.minus3);
+        } else {
+            addReplySds(c, sdsnew("-ERR src and dest are the same\r\n"));
+        }
+    }
+
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, nx ? shared.minus1 : shared.nokeyerr);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    time_t expire = getExpire(c->dictid, c->argv[1]);
+    expireIfNeeded(c->dictid, c->argv[2]);
+    // todo: 这里为什么要增加引用次数?
+    incrRefCount(o);
+    if (dictAdd(c->dict, c->argv[2], o) == DICT_ERR) {
+        // the new key is exist, rename failed
+        if (nx) {
+            decrRefCount(o);
+            addReply(c, shared.zero);
+            return;
+        } else {
+            if (server.lazyfree_lazy_server_del) {
+                lazyfreeDetachValue(c->dict, dictFind(c->dict, c->argv[2]));
+            }
+            dictReplace(c->dict, c->argv[2], o);
+            removeExpire(c->dictid, c->argv[2]);
+        }
+    } else {
+        incrRefCount(c->argv[2]);
+    }
+    deleteKey(c->dictid, c->argv[1]);
+    // 过期时间跟着 value 走
+    if (expire != -1) {
+        setExpire(c->dictid, dictGetEntryKey(dictFind(c->dict, c->argv[2])), expire);
+    }
+    server.dirty++;
+    addReply(c, nx ? shared.one : shared.ok);
+}
+
+static void renameCommand(redisClient *c) {
+    renameGenericCommand(c, false);
+}
+
+static void renamenxCommand(redisClient *c) {
+    renameGenericCommand(c, true);
+}
+
+static void moveCommand(redisClient *c) {
+    dict *src = c->dict;
+    int srcid = c->dictid;
+
+    if (selectDb(c, atoi(c->argv[2]->ptr)) == REDIS_ERR) {
+        addReply(c, shared.minus4);
+        return;
+    }
+    dict *dst = c->dict;
+    int dstid = c->dictid;
+    c->dict = src;
+    c->dictid = srcid;
+    if (src == dst) {
+        addReply(c, shared.minus3);
+        return;
+    }
+
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    robj *key = dictGetEntryKey(de);
+    robj *o = dictGetEntryVal(de);
+    expireIfNeeded(dstid, key);
+    if (dictAdd(dst, key, o) == DICT_ERR) {
+        addReply(c, shared.zero);
+        return;
+    }
+    incrRefCount(key);
+    incrRefCount(o);
+    time_t expire = getExpire(srcid, key);
+    if (expire != -1) {
+        setExpire(dstid, key, expire);
+    }
+
+    // move 成功，从原来的 db 中删除
+    deleteKey(srcid, c->argv[1]);
+    server.dirty++;
+    addReply(c, shared.one);
+}
+
+/**
+ * 过期时间为 basetime + argv[2], 不晚于当前时间时直接删除 key
+ */
+static void expireGenericCommand(redisClient *c, time_t basetime) {
+    char *eptr;
+    long long when = strtoll(c->argv[2]->ptr, &eptr, 10);
+    if (*eptr != '\0' || eptr == c->argv[2]->ptr) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+    when += basetime;
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    if (when <= time(NULL)) {
+        deleteKey(c->dictid, c->argv[1]);
+    } else {
+        setExpire(c->dictid, dictGetEntryKey(de), when);
+    }
+    server.dirty++;
+    addReply(c, shared.one);
+}
+
+/**
+ * EXPIRE key seconds, seconds <= 0 时直接删除 key
+ */
+static void expireCommand(redisClient *c) {
+    expireGenericCommand(c, time(NULL));
+}
+
+/**
+ * EXPIREAT key unixtime, AOF 中的 EXPIRE 都会转成 EXPIREAT, 重放时不会因为重启而推迟过期
+ */
+static void expireatCommand(redisClient *c) {
+    expireGenericCommand(c, 0);
+}
+
+/**
+ * @return 剩余的秒数, -1 表示 key 不存在或者没有设置过期时间
+ */
+static void ttlCommand(redisClient *c) {
+    if (lookupKeyEntry(c, c->argv[1]) == NULL) {
+        addReply(c, shared.minus1);
+        return;
+    }
+    time_t expire = getExpire(c->dictid, c->argv[1]);
+    if (expire == -1) {
+        addReply(c, shared.minus1);
+        return;
+    }
+    time_t ttl = expire - time(NULL);
+    addReplyLongLong(c, ttl > 0 ? ttl : 0);
+}
+
+static void persistCommand(redisClient *c) {
+    if (lookupKeyEntry(c, c->argv[1]) == NULL || !removeExpire(c->dictid, c->argv[1])) {
+        addReply(c, shared.zero);
+        return;
+    }
+    server.dirty++;
+    addReply(c, shared.one);
+}
+
+/* =========================== Lists ========================== */
+
+/**
+ * list 有两种编码: ziplist 和 quicklist. 新建的 list 都是 ziplist,
+ * 元素个数超过 list_max_ziplist_entries 或者某个元素长度超过 list_max_ziplist_value 时
+ * 转换成 quicklist, 之后不会再转换回来. 下面的 listType* 函数屏蔽了两种编码的差异
+ */
+
+static unsigned long listTypeLength(robj *subject) {
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        return ziplistLen(subject->ptr);
+    }
+    return quicklistCount((quicklist *) subject->ptr);
+}
+
+/**
+ * 把 ziplist 的 entry 转成字符串对象, 整数 entry 使用整数编码
+ */
+static robj *createObjectFromZiplistEntry(unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    if (!ziplistGet(p, &vstr, &vlen, &vlong)) {
+        return NULL;
+    }
+    if (vstr != NULL) {
+        return createStringObject((char *) vstr, vlen);
+    }
+    return createStringObjectFromLongLong(vlong);
+}
+
+/**
+ * ziplist -> quicklist
+ */
+static void listTypeConvert(robj *subject) {
+    assert(subject->type == REDIS_LIST && subject->encoding == REDIS_ENCODING_ZIPLIST);
+    quicklist *ql = quicklistNew(server.list_max_ziplist_size, server.list_compress_depth);
+    subject->ptr = quicklistAppendValuesFromZiplist(ql, subject->ptr);
+    subject->encoding = REDIS_ENCODING_QUICKLIST;
+}
+
+/**
+ * value 太长时放不进 ziplist, 先转换编码
+ */
+static void listTypeTryConversion(robj *subject, robj *value) {
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST && sdsEncodedObject(value) &&
+        sdslen(value->ptr) > server.list_max_ziplist_value) {
+        listTypeConvert(subject);
+    }
+}
+
+/**
+ * 两种编码保存的都是 value 内容的拷贝
+ */
+static void listTypePush(robj *subject, robj *value, int where) {
+    listTypeTryConversion(subject, value);
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
+        ziplistLen(subject->ptr) >= server.list_max_ziplist_entries) {
+        listTypeConvert(subject);
+    }
+
+    value = getDecodedObject(value);
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+        subject->ptr = ziplistPush(subject->ptr, value->ptr, sdslen(value->ptr), pos);
+    } else {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        quicklistPush(subject->ptr, value->ptr, sdslen(value->ptr), pos);
+    }
+    decrRefCount(value);
+}
+
+static void *listPopSaver(unsigned char *data, unsigned int sz) {
+    return createStringObject((char *) data, sz);
+}
+
+/**
+ * @return 被删除的元素, 调用方负责 decrRefCount; list 为空时返回 NULL
+ */
+static robj *listTypePop(robj *subject, int where) {
+    robj *value = NULL;
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(subject->ptr, (where == REDIS_HEAD) ? 0 : -1);
+        if (p != NULL) {
+            value = createObjectFromZiplistEntry(p);
+            subject->ptr = ziplistDelete(subject->ptr, &p);
+        }
+    } else {
+        long long vlong;
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        if (quicklistPopCustom(subject->ptr, pos, (void **) &value, NULL, &vlong, listPopSaver) && value == NULL) {
+            value = createStringObjectFromLongLong(vlong);
+        }
+    }
+    return value;
+}
+
+/**
+ * 从 index 开始, 沿 direction(REDIS_HEAD/REDIS_TAIL) 方向遍历.
+ * 遍历过程中只能通过 listTypeDelete 修改 list
+ */
+static listTypeIterator *listTypeInitIterator(robj *subject, int index, unsigned char direction) {
+    listTypeIterator *li = zmalloc(sizeof(listTypeIterator));
+    if (li == NULL) {
+        oom("listTypeInitIterator");
+    }
+    li->subject = subject;
+    li->encoding = subject->encoding;
+    li->direction = direction;
+    li->zi = NULL;
+    li->iter = NULL;
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        li->zi = ziplistIndex(subject->ptr, index);
+    } else {
+        int qdirection = (direction == REDIS_TAIL) ? AL_START_HEAD : AL_START_TAIL;
+        li->iter = quicklistGetIteratorAtIdx(subject->ptr, qdirection, index);
+    }
+    return li;
+}
+
+static void listTypeReleaseIterator(listTypeIterator *li) {
+    if (li->iter != NULL) {
+        quicklistReleaseIterator(li->iter);
+    }
+    zfree(li);
+}
+
+/**
+ * 把当前元素放入 entry, 并把迭代器移动到下一个元素
+ * @return false 没有元素了
+ */
+static bool listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
+    // 遍历过程中不能发生编码转换
+    assert(li->subject->encoding == li->encoding);
+
+    entry->li = li;
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        entry->zi = li->zi;
+        if (entry->zi == NULL) {
+            return false;
+        }
+        li->zi = (li->direction == REDIS_TAIL) ? ziplistNext(li->subject->ptr, li->zi) : ziplistPrev(li->subject->ptr, li->zi);
+        return true;
+    }
+
+    return li->iter != NULL && quicklistNext(li->iter, &entry->entry);
+}
+
+/**
+ * @return entry 对应的对象, 调用方负责 decrRefCount
+ */
+static robj *listTypeGet(listTypeEntry *entry) {
+    if (entry->li->encoding == REDIS_ENCODING_ZIPLIST) {
+        return createObjectFromZiplistEntry(entry->zi);
+    }
+    if (entry->entry.value != NULL) {
+        return createStringObject((char *) entry->entry.value, entry->entry.sz);
+    }
+    return createStringObjectFromLongLong(entry->entry.longval);
+}
+
+static bool listTypeEqual(listTypeEntry *entry, robj *o) {
+    o = getDecodedObject(o);
+    bool equal;
+    if (entry->li->encoding == REDIS_ENCODING_ZIPLIST) {
+        equal = ziplistCompare(entry->zi, o->ptr, sdslen(o->ptr));
+    } else {
+        equal = quicklistCompare(entry->entry.zi, o->ptr, sdslen(o->ptr));
+    }
+    decrRefCount(o);
+    return equal;
+}
+
+/**
+ * 删除 entry, 迭代器仍然指向原来的下一个元素
+ */
+static void listTypeDelete(listTypeEntry *entry) {
+    listTypeIterator *li = entry->li;
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = entry->zi;
+        li->subject->ptr = ziplistDelete(li->subject->ptr, &p);
+        // 删除后 p 指向原来的下一个 entry(可能是结尾)
+        if (li->direction == REDIS_TAIL) {
+            li->zi = ziplistGet(p, NULL, NULL, NULL) ? p : NULL;
+        } else {
+            li->zi = ziplistPrev(li->subject->ptr, p);
+        }
+    } else {
+        quicklistDelEntry(li->iter, &entry->entry);
+    }
+}
+
+/**
+ * list name: argv[1]
+ * element:   argv[2]
+ */
+static void pushGenericCommand(redisClient *c, int where) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    robj *lobj;
+    if (de == NULL) {
+        lobj = createZiplistObject();
+        dictAdd(c->dict, c->argv[1], lobj);
+        incrRefCount(c->argv[1]);
+    } else {
+        lobj = dictGetEntryVal(de);
+        if (lobj->type != REDIS_LIST) {
+            addReply(c, shared.wrongtypeerr);
+            return;
+        }
+    }
+    listTypePush(lobj, c->argv[2], where);
+    server.dirty++;
+    addReply(c, shared.ok);
+}
+
+static void lpushCommand(redisClient *c) {
+    pushGenericCommand(c, REDIS_HEAD);
+}
+
+static void rpushCommand(redisClient *c) {
+    pushGenericCommand(c, REDIS_TAIL);
+}
+
+static void llenCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.minus2);
+    } else {
+        addReplyLongLong(c, listTypeLength(o));
+    }
+}
+
+/**
+ * ziplist 的 entry 直接写到输出缓冲区，不创建中间对象
+ */
+static void addReplyZiplistEntry(redisClient *c, unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    ziplistGet(p, &vstr, &vlen, &vlong);
+    if (vstr != NULL) {
+        addReplyBulkCBuffer(c, vstr, vlen);
+    } else {
+        addReplyBulkLongLong(c, vlong);
+    }
+}
+
+/**
+ * argv[1]: list name
+ * argv[2]: index
+ * @return 返回 index 处的元素
+ */
+static void lindexCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongtypeerr);
+        return;
+    }
+
+    int index = atoi(c->argv[2]->ptr);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, index);
+        if (p != NULL) {
+            addReplyZiplistEntry(c, p);
+        } else {
+            addReply(c, shared.nil);
+        }
+        return;
+    }
+
+    quicklistEntry entry;
+    if (quicklistIndex(o->ptr, index, &entry)) {
+        if (entry.value != NULL) {
+            addReplyBulkCBuffer(c, entry.value, entry.sz);
+        } else {
+            addReplyBulkLongLong(c, entry.longval);
+        }
+        quicklistRecompressEntry(o->ptr, &entry);
+    } else {
+        addReply(c, shared.nil);
+    }
+}
+
+/**
+ * argv[1]: list name
+ * argv[2]: index
+ * argv[3]: value
+ * 
+ * 功能: list[index] = value
+ */
+static void lsetCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nokeyerr);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongtypeerr);
+        return;
+    }
+
+    int index = atoi(c->argv[2]->ptr);
+    listTypeTryConversion(o, c->argv[3]);
+    robj *value = getDecodedObject(c->argv[3]);
+    bool replaced;
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, index);
+        replaced = (p != NULL);
+        if (replaced) {
+            o->ptr = ziplistReplace(o->ptr, p, value->ptr, sdslen(value->ptr));
+        }
+    } else {
+        replaced = quicklistReplaceAtIndex(o->ptr, index, value->ptr, sdslen(value->ptr));
+    }
+    decrRefCount(value);
+
+    if (replaced) {
+        addReply(c, shared.ok);
+        server.dirty++;
+    } else {
+        addReplySds(c, sdsnew("-ERR index out of range\r\n"));
+    }
+}
+
+/**
+ * 删除一个元素
+ * @param where 指明从队头还是队尾删除
+ */
+static void popGenericCommand(redisClient *c, int where) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongtypeerrbulk);
+        return;
+    }
+
+    robj *ele = listTypePop(o, where);
+    if (ele != NULL) {
+        addReplyBulk(c, ele);
+        decrRefCount(ele);
+        server.dirty++;
+    } else {
+        addReply(c, shared.nil);
+    }
+}
+
+static void lpopCommand(redisClient *c) {
+    popGenericCommand(c, REDIS_HEAD);
+}
+
+static void rpopCommand(redisClient *c) {
+    popGenericCommand(c, REDIS_TAIL);
+}
+
+/**
+ * start 和 end 可能为负数，表示尾部往前数
+ */
+static void lindexToPositive(int *start, int *end, int llen) {
+    if (*start < 0) {
+        *start = *start + llen;
+    }
+    if (*end < 0) {
+        *end = *end + llen;
+    }
+    if (*start < 0) {
+        *start = 0;
+    }
+    if (*end < 0) {
+        *end = 0;
+    }
+}
+
+/**
+ * 返回 list[start, end] 范围内的元素
+ * argv[1]: list name
+ * argv[2]: start include
+ * argv[3]: end include
+ */
+static void lrangeCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongtypeerrbulk);
+        return;
+    }
+
+    int llen = listTypeLength(o);
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    lindexToPositive(&start, &end, llen);
+
+    if (start > end || start >= llen) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    if (end >= llen) {
+        end = llen - 1;
+    }
+
+    int rangelen = (end - start) + 1;
+    addReplyLongLong(c, rangelen);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, start);
+        for (int i = 0; i < rangelen; i++) {
+            addReplyZiplistEntry(c, p);
+            p = ziplistNext(o->ptr, p);
+        }
+        return;
+    }
+
+    // 按节点的元素个数跳到 start, 之后顺序遍历
+    quicklistIter *iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_HEAD, start);
+    quicklistEntry entry;
+    for (int i = 0; i < rangelen && quicklistNext(iter, &entry); i++) {
+        if (entry.value != NULL) {
+            addReplyBulkCBuffer(c, entry.value, entry.sz);
+        } else {
+            addReplyBulkLongLong(c, entry.longval);
+        }
+    }
+    quicklistReleaseIterator(iter);
+}
+
+/**
+ * 仅保留list[start, end]，其他元素删除
+ * argv[1]: list name
+ * argv[2]: start
+ * argv[3]: end
+ */
+static void ltrimCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nokeyerr);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongtypeerr);
+        return;
+    }
+
+    int llen = listTypeLength(o);
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    lindexToPositive(&start, &end, llen);
+    int ltrim = start;
+    int rtrim = llen - end - 1;
+    if (start > end || start >= llen) {
+        ltrim = llen;
+        rtrim = 0;
+    } else if (rtrim < 0) {
+        rtrim = 0;
+    }
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        o->ptr = ziplistDeleteRange(o->ptr, 0, ltrim);
+        o->ptr = ziplistDeleteRange(o->ptr, -rtrim, rtrim);
+    } else {
+        quicklistDelRange(o->ptr, 0, ltrim);
+        quicklistDelRange(o->ptr, -rtrim, rtrim);
+    }
+    addReply(c, shared.ok);
+    server.dirty++;
+}
+
+/**
+ * argv[1]: list name
+ * argv[2]: count 
+ * argv[3]: target
+ * 
+ * count > 0: 从头开始，删除 count 个等于 target 的元素
+ * count < 0: 从尾部开始，删除 count 个等于 target 的元素
+ * count = 0: 删除所有等于 target 的元素
+ */
+static void lremCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.minus1);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.minus2);
+        return;
+    }
+
+    int count = atoi(c->argv[2]->ptr);
+    listTypeIterator *li;
+    if (count < 0) {
+        count = -count;
+        li = listTypeInitIterator(o, -1, REDIS_HEAD);
+    } else {
+        li = listTypeInitIterator(o, 0, REDIS_TAIL);
+    }
+
+    int removed = 0;
+    listTypeEntry entry;
+    while (listTypeNext(li, &entry)) {
+        if (listTypeEqual(&entry, c->argv[3])) {
+            listTypeDelete(&entry);
+            server.dirty++;
+            removed++;
+            if (count > 0 && removed == count) {
+                break;
+            }
+        }
+    }
+    listTypeReleaseIterator(li);
+    addReplyLongLong(c, removed);
+}
+
+/* =========================== Sets command ======================= */
+
+/**
+ * set 有两种编码: intset 和 hashtable. 新建的 set 如果第一个元素是整数就使用 intset,
+ * 加入非整数元素或者元素个数超过 set_max_intset_entries 时转换成 hashtable, 之后不会再转换回来.
+ * hashtable 中的元素都是 sds 编码的字符串对象, 因为 setDictType 直接对 ptr 做 hash.
+ * 下面的 setType* 函数屏蔽了两种编码的差异
+ */
+
+/**
+ * o 是否能表示成整数, 能的话通过 *llval 返回
+ */
+static bool isObjectRepresentableAsLongLong(robj *o, long long *llval) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *llval = (long) o->ptr;
+        return true;
+    }
+    long value;
+    if (!isStringRepresentableAsLong(o->ptr, &value)) {
+        return false;
+    }
+    *llval = value;
+    return true;
+}
+
+/**
+ * 根据第一个要加入的元素选择编码
+ */
+static robj *setTypeCreate(robj *value) {
+    long long llval;
+    if (isObjectRepresentableAsLongLong(value, &llval)) {
+        return createIntsetObject();
+    }
+    return createSetObject();
+}
+
+static unsigned long setTypeSize(robj *subject) {
+    if (subject->encoding == REDIS_ENCODING_INTSET) {
+        return intsetLen(subject->ptr);
+    }
+    return dictGetHashTableUsed((dict *) subject->ptr);
+}
+
+/**
+ * 把 intset 转成 hashtable, 整数元素转成 sds 编码的字符串对象
+ */
+static void setTypeConvert(robj *subject) {
+    assert(subject->type == REDIS_SET && subject->encoding == REDIS_ENCODING_INTSET);
+    intset *is = subject->ptr;
+    dict *d = dictCreate(&setDictType, NULL);
+    if (d == NULL) {
+        oom("dictCreate");
+    }
+    int64_t intele;
+    for (uint32_t i = 0; intsetGet(is, i, &intele); i++) {
+        char buf[32];
+        int len = ll2string(buf, sizeof(buf), intele);
+        if (dictAdd(d, createStringObject(buf, len), NULL) != DICT_OK) {
+            oom("dictAdd");
+        }
+    }
+    zfree(is);
+    subject->ptr = d;
+    subject->encoding = REDIS_ENCODING_HT;
+}
+
+/**
+ * @return false if value already exists
+ */
+static bool setTypeAdd(robj *subject, robj *value) {
+    long long llval;
+    if (subject->encoding == REDIS_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value, &llval)) {
+            bool success;
+            subject->ptr = intsetAdd(subject->ptr, llval, &success);
+            if (subject->ptr == NULL) {
+                oom("intsetAdd");
+            }
+            if (success && intsetLen(subject->ptr) > server.set_max_intset_entries) {
+                setTypeConvert(subject);
+            }
+            return success;
+        }
+        setTypeConvert(subject);
+    }
+
+    // 整数编码的对象要先转回 sds, 原因见上面的说明
+    value = getDecodedObject(value);
+    if (dictAdd(subject->ptr, value, NULL) == DICT_OK) {
+        return true;
+    }
+    decrRefCount(value);
+    return false;
+}
+
+/**
+ * @return false if value not exists
+ */
+static bool setTypeRemove(robj *subject, robj *value) {
+    long long llval;
+    if (subject->encoding == REDIS_ENCODING_INTSET) {
+        if (!isObjectRepresentableAsLongLong(value, &llval)) {
+            return false;
+        }
+        bool success;
+        subject->ptr = intsetRemove(subject->ptr, llval, &success);
+        return success;
+    }
+
+    value = getDecodedObject(value);
+    bool deleted = dictDelete(subject->ptr, value) == DICT_OK;
+    decrRefCount(value);
+    return deleted;
+}
+
+static bool setTypeIsMember(robj *subject, robj *value) {
+    long long llval;
+    if (subject->encoding == REDIS_ENCODING_INTSET) {
+        return isObjectRepresentableAsLongLong(value, &llval) && intsetFind(subject->ptr, llval);
+    }
+
+    value = getDecodedObject(value);
+    bool found = dictFind(subject->ptr, value) != NULL;
+    decrRefCount(value);
+    return found;
+}
+
+/**
+ * intset 按从小到大的顺序遍历, hashtable 的顺序不确定
+ */
+typedef struct setTypeIterator {
+    robj *subject;
+    int encoding;
+    uint32_t ii;        // intset 中下一个元素的下标
+    dictIterator *di;
+} setTypeIterator;
+
+static setTypeIterator *setTypeInitIterator(robj *subject) {
+    setTypeIterator *si = zmalloc(sizeof(*si));
+    if (si == NULL) {
+        oom("setTypeInitIterator");
+    }
+    si->subject = subject;
+    si->encoding = subject->encoding;
+    si->ii = 0;
+    si->di = NULL;
+    if (si->encoding == REDIS_ENCODING_HT) {
+        si->di = dictGetIterator(subject->ptr);
+        if (si->di == NULL) {
+            oom("dictGetIterator");
+        }
+    }
+    return si;
+}
+
+static void setTypeReleaseIterator(setTypeIterator *si) {
+    if (si->di != NULL) {
+        dictReleaseIterator(si->di);
+    }
+    zfree(si);
+}
+
+/**
+ * 读取下一个元素, hashtable 编码时通过 *objele 返回(不增加引用计数), intset 编码时通过 *llele 返回
+ * @return false 没有元素了
+ */
+static bool setTypeNext(setTypeIterator *si, robj **objele, int64_t *llele) {
+    if (si->encoding == REDIS_ENCODING_INTSET) {
+        return intsetGet(si->subject->ptr, si->ii++, llele);
+    }
+    dictEntry *de = dictNext(si->di);
+    if (de == NULL) {
+        return false;
+    }
+    *objele = dictGetEntryKey(de);
+    return true;
+}
+
+/**
+ * 和 setTypeNext 一样, 但总是返回一个调用方持有的字符串对象
+ * @return NULL 没有元素了
+ */
+static robj *setTypeNextObject(setTypeIterator *si) {
+    robj *objele;
+    int64_t intele;
+    if (!setTypeNext(si, &objele, &intele)) {
+        return NULL;
+    }
+    if (si->encoding == REDIS_ENCODING_INTSET) {
+        char buf[32];
+        int len = ll2string(buf, sizeof(buf), intele);
+        return createStringObject(buf, len);
+    }
+    incrRefCount(objele);
+    return objele;
+}
+
+/**
+ * argv[1]: set name
+ * argv[2]: element will added
+ */
+static void saddCommand(redisClient *c) {
+    robj *set;
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        set = setTypeCreate(c->argv[2]);
+        dictAdd(c->dict, c->argv[1], set);
+        incrRefCount(c->argv[1]);
+    } else {
+        set = dictGetEntryVal(de);
+        if (set->type != REDIS_SET) {
+            addReply(c, shared.minus2);
+            return;
+        }
+    }
+
+    if (setTypeAdd(set, c->argv[2])) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * argv[1]: set name
+ * argv[2]: element will be removed
+ */
+static void sremCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    robj *set = dictGetEntryVal(de);
+    if (set->type != REDIS_SET) {
+        addReply(c, shared.minus2);
+        return;
+    }
+
+    if (setTypeRemove(set, c->argv[2])) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * argv[1]: set name
+ * argv[2]: element
+ */
+static void sismemberCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    robj *set = dictGetEntryVal(de);
+    if (set->type != REDIS_SET) {
+        addReply(c, shared.minus2);
+        return;
+    }
+
+    if (setTypeIsMember(set, c->argv[2])) {
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * 返回 set 的大小
+ */
+static void scardCommand(redisClient *c) {
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_SET) {
+        addReply(c, shared.minus2);
+        return;
+    }
+
+    addReplyLongLong(c, setTypeSize(o));
+}
+
+static int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
+    robj **o1 = (void *) s1;
+    robj **o2 = (void *) s2;
+    unsigned long size1 = setTypeSize(*o1), size2 = setTypeSize(*o2);
+    return (size1 > size2) - (size1 < size2);
+}
+
+/**
+ * 所有输入都是 intset 时, 它们都是有序数组, 每个 set 维护一个游标做归并:
+ * 以最小的 set 的元素为准, 其他 set 的游标只会往前走, 总的代价是 O(所有 set 的大小之和),
+ * 不需要对每个元素做 setsnum - 1 次查找. 结果本身也是有序的, 可以直接追加到 intset 尾部
+ * @param sets 已经按大小排好序
+ * @return 交集的元素个数
+ */
+static int sinterIntsets(redisClient *c, robj **sets, int setsnum, robj *dstset) {
+    uint32_t *cursors = zmalloc(sizeof(uint32_t) * setsnum);
+    if (cursors == NULL) {
+        oom("sinterIntsets");
+    }
+    memset(cursors, 0, sizeof(uint32_t) * setsnum);
+
+    int cardinality = 0;
+    int64_t value;
+    while (intsetGet(sets[0]->ptr, cursors[0]++, &value)) {
+        bool inall = true;
+        for (int j = 1; j < setsnum && inall; j++) {
+            int64_t other;
+            while (intsetGet(sets[j]->ptr, cursors[j], &other) && other < value) {
+                cursors[j]++;
+            }
+            if (cursors[j] == intsetLen(sets[j]->ptr)) {
+                // 有一个 set 已经走完了, 后面不会再有交集
+                zfree(cursors);
+                return cardinality;
+            }
+            inall = other == value;
+        }
+        if (!inall) {
+            continue;
+        }
+        if (dstset == NULL) {
+            addReplyBulkLongLong(c, value);
+        } else {
+            dstset->ptr = intsetAdd(dstset->ptr, value, NULL);
+            if (dstset->ptr == NULL) {
+                oom("intsetAdd");
+            }
+        }
+        cardinality++;
+    }
+    zfree(cursors);
+    return cardinality;
+}
+
+static void sinterGenericCommand(redisClient *c, robj **setskeys, int setsnum, robj *dstkey) {
+    robj **sets = zmalloc(sizeof(robj *) * setsnum);
+    robj *lenobj = NULL, *dstset = NULL;
+    int j, cardinality = 0;
+    bool allintset = true;
+
+    if (!sets) oom("sinterCommand");
+    for (j = 0; j < setsnum; j++) {
+        robj *setobj;
+        dictEntry *de;
+        
+        de = lookupKeyEntry(c, setskeys[j]);
+        if (!de) {
+            zfree(sets);
+            addReply(c,dstkey ? shared.nokeyerr : shared.nil);
+            return;
+        }
+        setobj = dictGetEntryVal(de);
+        if (setobj->type != REDIS_SET) {
+            zfree(sets);
+            addReply(c,dstkey ? shared.wrongtypeerr : shared.wrongtypeerrbulk);
+            return;
+        }
+        sets[j] = setobj;
+        if (setobj->encoding != REDIS_ENCODING_INTSET) {
+            allintset = false;
+        }
+    }
+    /* Sort sets from the smallest to largest, this will improve our
+     * algorithm's performace */
+    qsort(sets,setsnum,sizeof(robj*),qsortCompareSetsByCardinality);
+
+    /* The first thing we should output is the total number of elements...
+     * since this is a multi-bulk write, but at this stage we don't know
+     * the intersection set size, so we use a trick, append an empty object
+     * to the output list and save the pointer to later modify it with the
+     * right length */
+    if (!dstkey) {
+        lenobj = createObject(REDIS_STRING,NULL);
+        addReply(c,lenobj);
+        decrRefCount(lenobj);
+    } else {
+        /* If we have a target key where to store the resulting set
+         * create this key with an empty set inside. Intersection of
+         * intsets is an intset as well, and is never bigger than the
+         * smallest input. */
+        dstset = allintset ? createIntsetObject() : createSetObject();
+    }
+
+    if (allintset) {
+        cardinality = sinterIntsets(c, sets, setsnum, dstset);
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        setTypeIterator *si = setTypeInitIterator(sets[0]);
+        robj *ele;
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            for (j = 1; j < setsnum; j++)
+                if (!setTypeIsMember(sets[j],ele)) break;
+            if (j == setsnum) {
+                if (!dstkey) {
+                    addReplyBulk(c,ele);
+                } else {
+                    // ele 是源集合里的成员, 拷贝一份再加入, 避免两个 key 共享成员对象,
+                    // 否则其中一个被后台线程释放时会和主线程同时修改成员的 refcount
+                    robj *copy = dupStringObject(ele);
+                    setTypeAdd(dstset,copy);
+                    decrRefCount(copy);
+                }
+                cardinality++;
+            }
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+    }
 
-    eoferr: 
-        fclose(fp);
-        redisLog(REDIS_WARNING, "Short read loading DB, Unrecoverable error, exiting now.");
-        exit(1);
-        return REDIS_ERR; // avoid compile warning
+    if (!dstkey) {
+        lenobj->ptr = sdscatprintf(sdsempty(),"%d\r\n",cardinality);
+    } else {
+        /* The destination may be one of the sources, so replace it only
+         * once the intersection is computed */
+        if (server.lazyfree_lazy_server_del) {
+            unlinkKey(c->dictid,dstkey);
+        } else {
+            deleteKey(c->dictid,dstkey);
+        }
+        dictAdd(c->dict,dstkey,dstset);
+        incrRefCount(dstkey);
+        addReply(c,shared.ok);
+    }
+    zfree(sets);
 }
 
-/* ========================= Comands ========================== */
-static void pingCommand(redisClient *c) {
-    addReply(c, shared.pong);
+static void sinterCommand(redisClient *c) {
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
 }
 
-static void echoCommand(redisClient *c) {
-    addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(c->argv[1]->ptr)));
-    addReply(c, c->argv[1]);
-    addReply(c, shared.crlf);
+static void sinterstoreCommand(redisClient *c) {
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
 }
 
-/* ===================== Strings ======================== */
+/* =========================== Hashes ========================== */
+
 /**
- * c->argv: 0: set; 1: key; 2: value
- * @param nx is not exist, if true only key not exist will add
+ * hash 有两种编码: ziplist 和 hashtable. ziplist 中 field 和 value 交替存放,
+ * field 个数超过 hash_max_ziplist_entries 或者 field/value 长度超过 hash_max_ziplist_value 时
+ * 转换成 hashtable, 之后不会再转换回来. 下面的 hashType* 函数屏蔽了两种编码的差异
  */
-static void setGenericCommand(redisClient *c, bool nx) {
-    int retval = dictAdd(c->dict, c->argv[1], c->argv[2]);
-    if (retval == DICT_ERR) {
-        if (nx) {
-            // key 存在，不做任何操作
-            addReply(c, shared.zero);
-            return;
-        } else {
-            // todo: 是不是应该把这个判断提前，如果不是nx，直接使用replace
-            dictReplace(c->dict, c->argv[1], c->argv[2]);
-            incrRefCount(c->argv[2]);
-        }
-    } else {
-        incrRefCount(c->argv[1]);
-        incrRefCount(c->argv[2]);
-    }
-    server.dirty++;
-    addReply(c, nx ? shared.one : shared.ok);
-}
-
-static void setCommand(redisClient *c) {
-    return setGenericCommand(c, false);
-}
 
-static void setnxCommand(redisClient *c) {
-    return setGenericCommand(c, true);
+static unsigned long hashTypeLength(robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        return ziplistLen(o->ptr) / 2;
+    }
+    return dictGetHashTableUsed((dict *) o->ptr);
 }
 
-static void getCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de != NULL) {
-        robj *o = dictGetEntryVal(de);
-        if (o->type != REDIS_STRING) {
-            addReply(c, shared.wrongtypeerrbulk);
-        } else {
-            addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", (int) sdslen(o->ptr)));
-            addReply(c, o);
-            addReply(c, shared.crlf);
+/**
+ * ziplist -> hashtable
+ */
+static void hashTypeConvert(robj *o) {
+    assert(o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_ZIPLIST);
+    unsigned char *zl = o->ptr;
+    dict *d = dictCreate(&hashDictType, NULL);
+    if (d == NULL) {
+        oom("dictCreate");
+    }
+    unsigned char *fptr = ziplistIndex(zl, 0);
+    while (fptr != NULL) {
+        unsigned char *vptr = ziplistNext(zl, fptr);
+        // field 是 dict 的 key, 必须是 sds 编码, 原因见 setDictType
+        robj *raw = createObjectFromZiplistEntry(fptr);
+        robj *field = getDecodedObject(raw);
+        decrRefCount(raw);
+        robj *value = createObjectFromZiplistEntry(vptr);
+        if (dictAdd(d, field, value) != DICT_OK) {
+            oom("dictAdd");
         }
-    } else {
-        addReply(c, shared.nil);
+        fptr = ziplistNext(zl, vptr);
     }
+    zfree(zl);
+    o->ptr = d;
+    o->encoding = REDIS_ENCODING_HT;
 }
 
-static long long dictEntryStringValueToLL(dictEntry *de) {
-    if (de == NULL) {
-        return 0;
+/**
+ * 要写入的参数中有太长的字符串时先转换成 hashtable
+ */
+static void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
+    if (o->encoding != REDIS_ENCODING_ZIPLIST) {
+        return;
     }
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_STRING) {
-        return 0;
-    } else {
-        char *eptr;
-        return strtoll(o->ptr, &eptr, 10);
+    for (int i = start; i <= end; i++) {
+        if (sdsEncodedObject(argv[i]) && sdslen(argv[i]->ptr) > server.hash_max_ziplist_value) {
+            hashTypeConvert(o);
+            return;
+        }
     }
 }
+
 /**
- * @param delta 加/减数，负数表示减
+ * 在 ziplist 中查找 field
+ * @return field 对应的 value entry, NULL if not found
  */
-static void incrDecrCommand(redisClient *c, int delta) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    long long value = dictEntryStringValueToLL(de);
-
-    value += delta;
-
-    robj *o = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%lld", value));
-    int retval = dictAdd(c->dict, c->argv[1], o);
-    if (retval != DICT_ERR) {
-        incrRefCount(c->argv[1]);
-    } else {
-        dictReplace(c->dict, c->argv[1], o);
+static unsigned char *hashZiplistFindValue(unsigned char *zl, robj *field) {
+    unsigned char *fptr = ziplistIndex(zl, 0);
+    if (fptr == NULL) {
+        return NULL;
     }
-    server.dirty++;
-    addReply(c, o);
-    addReply(c, shared.crlf);
+    field = getDecodedObject(field);
+    fptr = ziplistFind(fptr, field->ptr, sdslen(field->ptr), 1);
+    decrRefCount(field);
+    return fptr == NULL ? NULL : ziplistNext(zl, fptr);
 }
 
-static void incrCommand(redisClient *c) {
-    return incrDecrCommand(c, 1);
-}
+/**
+ * @return field 对应的 value(调用方持有一份引用), NULL if not found
+ */
+static robj *hashTypeGetObject(robj *o, robj *field) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *vptr = hashZiplistFindValue(o->ptr, field);
+        return vptr == NULL ? NULL : createObjectFromZiplistEntry(vptr);
+    }
 
-static void incrbyCommand(redisClient *c) {
-    int incr = atoi(c->argv[2]->ptr);
-    return incrDecrCommand(c, incr);
+    field = getDecodedObject(field);
+    dictEntry *de = dictFind(o->ptr, field);
+    decrRefCount(field);
+    if (de == NULL) {
+        return NULL;
+    }
+    robj *value = dictGetEntryVal(de);
+    incrRefCount(value);
+    return value;
 }
 
-static void decrCommand(redisClient *c) {
-    return incrDecrCommand(c, -1);
-}
+/**
+ * 设置 field 的值, 已存在的 field 覆盖原来的 value
+ * @return true 新增了一个 field, false 是更新
+ */
+static bool hashTypeSet(robj *o, robj *field, robj *value) {
+    bool inserted;
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr;
+        field = getDecodedObject(field);
+        value = getDecodedObject(value);
+        unsigned char *vptr = hashZiplistFindValue(zl, field);
+        if (vptr != NULL) {
+            zl = ziplistReplace(zl, vptr, value->ptr, sdslen(value->ptr));
+            inserted = false;
+        } else {
+            zl = ziplistPush(zl, field->ptr, sdslen(field->ptr), ZIPLIST_TAIL);
+            zl = ziplistPush(zl, value->ptr, sdslen(value->ptr), ZIPLIST_TAIL);
+            inserted = true;
+        }
+        o->ptr = zl;
+        decrRefCount(field);
+        decrRefCount(value);
+        if (hashTypeLength(o) > server.hash_max_ziplist_entries) {
+            hashTypeConvert(o);
+        }
+        return inserted;
+    }
 
-static void decrbyCommand(redisClient *c) {
-    int incr = atoi(c->argv[2]->ptr);
-    return incrDecrCommand(c, -incr);
+    field = getDecodedObject(field);
+    incrRefCount(value);
+    inserted = dictAdd(o->ptr, field, value) == DICT_OK;
+    if (!inserted) {
+        // dictReplace 会释放旧的 value, field 沿用 dict 中原来的那个
+        dictReplace(o->ptr, field, value);
+        decrRefCount(field);
+    }
+    return inserted;
 }
 
-/* ==================== Type agnostic commands ====================== */
-static void delCommand(redisClient *c) {
-    if (dictDelete(c->dict, c->argv[1]) == DICT_OK) {
-        server.dirty++;
-        addReply(c, shared.one);
-    } else {
-        addReply(c, shared.zero);
+/**
+ * @return false if field not exists
+ */
+static bool hashTypeDelete(robj *o, robj *field) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr;
+        unsigned char *vptr = hashZiplistFindValue(zl, field);
+        if (vptr == NULL) {
+            return false;
+        }
+        unsigned char *fptr = ziplistPrev(zl, vptr);
+        zl = ziplistDelete(zl, &fptr);
+        zl = ziplistDelete(zl, &fptr);
+        o->ptr = zl;
+        return true;
     }
-}
 
-static void existCommand(redisClient *c) {
-    dictEntry *de = dictFind(c, c->argv[1]);
-    addReply(c, de != NULL ? shared.one : shared.zero);
+    field = getDecodedObject(field);
+    bool deleted = dictDelete(o->ptr, field) == DICT_OK;
+    decrRefCount(field);
+    return deleted;
 }
 
-static void selectCommand(redisClient *c) {
-    int id = atoi(c->argv[1]->ptr);
-    if (selectDb(c, id) != REDIS_ERR) {
-        addReply(c, shared.ok);
-    } else {
-        addReplySds(c, "-ERR invalid DB index\r\n");
+/**
+ * 按存储的顺序遍历所有 field/value
+ */
+typedef struct hashTypeIterator {
+    robj *subject;
+    int encoding;
+    unsigned char *fptr, *vptr;
+    dictIterator *di;
+    dictEntry *de;
+} hashTypeIterator;
+
+static hashTypeIterator *hashTypeInitIterator(robj *subject) {
+    hashTypeIterator *hi = zmalloc(sizeof(*hi));
+    if (hi == NULL) {
+        oom("hashTypeInitIterator");
+    }
+    hi->subject = subject;
+    hi->encoding = subject->encoding;
+    hi->fptr = NULL;
+    hi->vptr = NULL;
+    hi->di = NULL;
+    hi->de = NULL;
+    if (hi->encoding == REDIS_ENCODING_HT) {
+        hi->di = dictGetIterator(subject->ptr);
+        if (hi->di == NULL) {
+            oom("dictGetIterator");
+        }
     }
+    return hi;
 }
 
-static void randomkeyCommand(redisClient *c) {
-    dictEntry *de = dictGetRandomKey(c->dict);
-    if (de != NULL) {
-        addReply(c, dictGetEntryKey(de));
-        addReply(c, shared.crlf);
-    } else {
-        addReply(c, shared.crlf);
+static void hashTypeReleaseIterator(hashTypeIterator *hi) {
+    if (hi->di != NULL) {
+        dictReleaseIterator(hi->di);
     }
+    zfree(hi);
 }
 
-static void keysCommand(redisClient *c) {
-    sds pattern = c->argv[1]->ptr;
-    int plen = sdslen(pattern);
-
-    dictIterator *it = dictGetIterator(c->dict);
-    if (it == NULL) {
-        oom("dictGetIterator");
-    }
-
-    robj *lenobj = createObject(REDIS_STRING, NULL);
-    addReply(c, lenobj);
-    decrRefCount(lenobj);
-
-    int keyslen = 0;
-    int numkeys = 0;
-    dictEntry *de;
-    while ((de = dictNext(it)) != NULL) {
-        robj *keyobj = dictGetEntryKey(de);
-        sds key = keyobj->ptr;
-        if ((pattern[0] == '*' && pattern[1] == '\0') || stringmatchlen(pattern, plen, key, sdslen(key), 0)) {
-            if (numkeys != 0) {
-                addReply(c, shared.space);
-            }
-            addReply(c, keyobj);
-            numkeys++;
-            keyslen += sdslen(key);
+/**
+ * @return false 没有元素了
+ */
+static bool hashTypeNext(hashTypeIterator *hi) {
+    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = hi->subject->ptr;
+        hi->fptr = (hi->vptr == NULL) ? ziplistIndex(zl, 0) : ziplistNext(zl, hi->vptr);
+        if (hi->fptr == NULL) {
+            return false;
         }
+        hi->vptr = ziplistNext(zl, hi->fptr);
+        return true;
     }
-    dictReleaseIterator(it);
-    // numkeys-1 表示空格的数量?
-    // todo: 这个值什么时候发送呢
-    lenobj->ptr = sdscatprintf(sdsempty(), "%lu\r\n", keyslen + (numkeys ? numkeys-1 : 0));
-    addReply(c, shared.crlf);
-}
-
-static void dbsizeCommand(redisClient *c) {
-    sds size = sdscatprintf(sdsempty(), "%lu\r\n", dictGetHashTableUsed(c->dict));
-    addReply(c, size);
+    hi->de = dictNext(hi->di);
+    return hi->de != NULL;
 }
 
-static void lastsaveCommand(redisClient *c) {
-    addReply(c, sdscatprintf(sdsempty(), "%lu\r\n", server.lastsave));
+/**
+ * 当前的 field(what == REDIS_HASH_KEY) 或者 value(REDIS_HASH_VALUE), 调用方持有一份引用
+ */
+static robj *hashTypeCurrentObject(hashTypeIterator *hi, int what) {
+    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+        return createObjectFromZiplistEntry(what == REDIS_HASH_KEY ? hi->fptr : hi->vptr);
+    }
+    robj *o = (what == REDIS_HASH_KEY) ? dictGetEntryKey(hi->de) : dictGetEntryVal(hi->de);
+    incrRefCount(o);
+    return o;
 }
 
-static void typeCommand(redisClient *c) {
-    dictEntry *entry = dictFind(c->dict, c->argv[1]);
-    char *type;
-    if (entry != NULL) {
-        robj *o = dictGetEntryVal(entry);
-        if (o->type == REDIS_STRING) {
-            type = "string";
-        } else if (o->type == REDIS_LIST) {
-            type = "list";
-        } else if (o->type == REDIS_SET) {
-            type = "set";
-        } else {
-            type = "unknow";
-        }
-    } else {
-        type = "none";
+/**
+ * 不存在时创建一个空的 hash
+ * @return NULL 类型不对, 已经回复了错误
+ */
+static robj *hashTypeLookupWriteOrCreate(redisClient *c, robj *key, robj *wrongtypereply) {
+    dictEntry *de = lookupKeyEntry(c, key);
+    if (de == NULL) {
+        robj *o = createHashObject();
+        dictAdd(c->dict, key, o);
+        incrRefCount(key);
+        return o;
     }
-    addReplySds(c, sdsnew(type));
-    addReply(c, shared.crlf);
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_HASH) {
+        addReply(c, wrongtypereply);
+        return NULL;
+    }
+    return o;
 }
 
-static void saveCommand(redisClient *c) {
-    if (saveDb(server.dbfilename) == REDIS_OK) {
-        addReply(c, shared.ok);
-    } else {
-        addReply(c, shared.err);
+/**
+ * @return NULL key 不存在(replyIfMissing)或者类型不对(wrongtypereply), 都已经回复过了
+ */
+static robj *hashTypeLookupRead(redisClient *c, robj *key, robj *replyIfMissing, robj *wrongtypereply) {
+    dictEntry *de = lookupKeyEntry(c, key);
+    if (de == NULL) {
+        addReply(c, replyIfMissing);
+        return NULL;
+    }
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_HASH) {
+        addReply(c, wrongtypereply);
+        return NULL;
     }
+    return o;
 }
 
-static void bgsaveCommand(redisClient *c) {
-    if (server.bgsaveinprogress) {
-        addReplySds(c, sdsnew("-ERR background save already in progress\r\n"));
+/**
+ * HSET key field value
+ * @return 1 新增了 field, 0 覆盖了原来的值
+ */
+static void hsetCommand(redisClient *c) {
+    robj *o = hashTypeLookupWriteOrCreate(c, c->argv[1], shared.minus2);
+    if (o == NULL) {
         return;
     }
-    if (saveDbBackground(server.dbfilename) == REDIS_OK) {
-        addReply(c, shared.ok);
-    } else {
-        addReply(c, shared.err);
-    }
+    hashTypeTryConversion(o, c->argv, 2, 3);
+    bool inserted = hashTypeSet(o, c->argv[2], c->argv[3]);
+    server.dirty++;
+    addReply(c, inserted ? shared.one : shared.zero);
 }
 
-static void shutdownCommand(redisClient *c) {
-    redisLog(REDIS_WARNING, "User requested shutdown, saving DB...");
-    if (saveDb(server.dbfilename) == REDIS_OK) {
-        redisLog(REDIS_WARNING, "Server exit now, bye bye...");
-        exit(1);
-    } else {
-        redisLog(REDIS_WARNING, "Error trying to save the db, can't exit");
-        addReplySds(c, sdsnew("-RR can't quit, problems saving the DB\r\n"));
+/**
+ * HGET key field
+ */
+static void hgetCommand(redisClient *c) {
+    robj *o = hashTypeLookupRead(c, c->argv[1], shared.nil, shared.wrongtypeerrbulk);
+    if (o == NULL) {
+        return;
     }
+    robj *value = hashTypeGetObject(o, c->argv[2]);
+    if (value == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+    addReplyBulk(c, value);
+    decrRefCount(value);
 }
 
 /**
- * @param nx is not exist. if nx is true and the new key is exist, will not rename
+ * HMGET key field [field ...], 不存在的 field 回复 nil
  */
-static void renameGenericCommand(redisClient *c, bool nx) {
-    if (sdscmp(c->argv[1]->ptr, c->argv[2]->ptr) == 0) {
-        if (nx) {
-            addReply(c, shared.minus3);
+static void hmgetCommand(redisClient *c) {
+    robj *o = NULL;
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    if (de != NULL) {
+        o = dictGetEntryVal(de);
+        if (o->type != REDIS_HASH) {
+            addReply(c, shared.wrongtypeerrbulk);
+            return;
+        }
+    }
+
+    addReplyLongLong(c, c->argc - 2);
+    for (int j = 2; j < c->argc; j++) {
+        robj *value = (o != NULL) ? hashTypeGetObject(o, c->argv[j]) : NULL;
+        if (value == NULL) {
+            addReply(c, shared.nil);
         } else {
-            addReplySds(c, sdsnew("-ERR src and dest are the same\r\n"));
+            addReplyBulk(c, value);
+            decrRefCount(value);
         }
     }
+}
 
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, nx ? shared.minus1 : shared.nokeyerr);
+/**
+ * HDEL key field, 删除最后一个 field 时 key 也被删除
+ */
+static void hdelCommand(redisClient *c) {
+    robj *o = hashTypeLookupRead(c, c->argv[1], shared.zero, shared.minus2);
+    if (o == NULL) {
         return;
     }
-
-    robj *o = dictGetEntryVal(de);
-    // todo: 这里为什么要增加引用次数?
-    incrRefCount(o);
-    if (dictAdd(c->dict, c->argv[2], o) == DICT_ERR) {
-        // the new key is exist, rename failed
-        if (nx) {
-            decrRefCount(o);
-            addReply(c, shared.zero);
-            return;
-        } else {
-            dictReplace(c->dict, c->argv[2], o);
-        }
-    } else {
-        incrRefCount(c->argv[2]);
+    if (!hashTypeDelete(o, c->argv[2])) {
+        addReply(c, shared.zero);
+        return;
+    }
+    if (hashTypeLength(o) == 0) {
+        deleteKey(c->dictid, c->argv[1]);
     }
-    dictDelete(c->dict, c->argv[1]);
     server.dirty++;
-    addReply(c, nx ? shared.one : shared.ok);
+    addReply(c, shared.one);
 }
 
-static void renameCommand(redisClient *c) {
-    renameGenericCommand(c, false);
-}
+/**
+ * HGETALL key, 依次回复 field, value
+ */
+static void hgetallCommand(redisClient *c) {
+    robj *o = hashTypeLookupRead(c, c->argv[1], shared.nil, shared.wrongtypeerrbulk);
+    if (o == NULL) {
+        return;
+    }
 
-static void renamenxCommand(redisClient *c) {
-    renameGenericCommand(c, true);
+    addReplyLongLong(c, hashTypeLength(o) * 2);
+    hashTypeIterator *hi = hashTypeInitIterator(o);
+    while (hashTypeNext(hi)) {
+        robj *field = hashTypeCurrentObject(hi, REDIS_HASH_KEY);
+        robj *value = hashTypeCurrentObject(hi, REDIS_HASH_VALUE);
+        addReplyBulk(c, field);
+        addReplyBulk(c, value);
+        decrRefCount(field);
+        decrRefCount(value);
+    }
+    hashTypeReleaseIterator(hi);
 }
 
-static void moveCommand(redisClient *c) {
-    dict *src = c->dict;
-    int srcid = c->dictid;
-
-    if (selectDb(c, atoi(c->argv[2]->ptr)) == REDIS_ERR) {
-        addReply(c, shared.minus4);
+/**
+ * HINCRBY key field increment, 不存在的 field 当作 0
+ */
+static void hincrbyCommand(redisClient *c) {
+    // 先检查参数, 否则 key 不存在时会留下一个空的 hash
+    long long incr;
+    if (!parseLongLong(c->argv[3]->ptr, &incr)) {
+        addReplySds(c, sdsnew("-ERR value is not an integer or out of range\r\n"));
         return;
     }
-    dict *dst = c->dict;
-    c->dict = src;
-    c->dictid = srcid;
-    if (src == dst) {
-        addReply(c, shared.minus3);
+    robj *o = hashTypeLookupWriteOrCreate(c, c->argv[1], shared.wrongtypeerr);
+    if (o == NULL) {
         return;
     }
 
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.zero);
-        return;
+    long long value = 0;
+    robj *current = hashTypeGetObject(o, c->argv[2]);
+    if (current != NULL) {
+        bool isint = isObjectRepresentableAsLongLong(current, &value);
+        decrRefCount(current);
+        if (!isint) {
+            addReplySds(c, sdsnew("-ERR hash value is not an integer\r\n"));
+            return;
+        }
     }
-    robj *key = dictGetEntryKey(de);
-    robj *o = dictGetEntryVal(de);
-    if (dictAdd(dst, key, o) == DICT_ERR) {
-        addReply(c, shared.zero);
+
+    // 有符号数溢出是未定义行为, 同 incrDecrCommand
+    if ((incr < 0 && value < LLONG_MIN - incr) || (incr > 0 && value > LLONG_MAX - incr)) {
+        addReplySds(c, sdsnew("-ERR increment or decrement would overflow\r\n"));
         return;
     }
-    incrRefCount(key);
-    incrRefCount(o);
-
-    // move 成功，从原来的 db 中删除
-    dictDelete(src, c->argv[1]);
+    value += incr;
+    hashTypeTryConversion(o, c->argv, 2, 2);
+    robj *newobj = createStringObjectFromLongLong(value);
+    hashTypeSet(o, c->argv[2], newobj);
+    decrRefCount(newobj);
     server.dirty++;
-    addReply(c, shared.one);
+    addReplyLongLong(c, value);
 }
 
-/* =========================== Lists ========================== */
+/* =========================== Sorted sets ========================== */
 
-static void addToList(list *list, robj *ele, int where) {
-    if (where == REDIS_HEAD) {
-        if (listAddNodeHead(list, ele)) {
-            oom("listAddNodeHead");
-        }
-    } else {
-        if (!listAddNodeTail(list, ele)) {
-            oom("listAddNodeTail");
-        }
-    }
+/**
+ * sorted set 有两种编码: ziplist 和 skiplist. ziplist 中 member 和 score 交替存放, 按 score 排序,
+ * score 相同时按 member 排序. 元素个数超过 zset_max_ziplist_entries 或者 member 长度超过
+ * zset_max_ziplist_value 时转换成 skiplist, 之后不会再转换回来.
+ * skiplist 中的 member 同时是 dict 的 key, 都是 sds 编码的字符串对象
+ */
+
+#define ZSKIPLIST_MAXLEVEL 32
+#define ZSKIPLIST_P 0.25
+
+/**
+ * score 转成字符串, 保留足够的精度使得 strtod 可以还原
+ */
+static int d2string(char *buf, size_t len, double value) {
+    return snprintf(buf, len, "%.17g", value);
+}
+
+static void addReplyDouble(redisClient *c, double d) {
+    char buf[128];
+    int len = d2string(buf, sizeof(buf), d);
+    addReplyBulkCBuffer(c, buf, len);
 }
+
 /**
- * list name: argv[1]
- * element:   argv[2]
+ * 严格解析 double, 不允许多余的字符和 nan
  */
-static void pushGenericCommand(redisClient *c, int where) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        robj *lobj = createListObject();
-        list *list = lobj->ptr;
-        addToList(list, c->argv[2], where);
-        dictAdd(c->dict, c->argv[1], lobj);
-        incrRefCount(c->argv[1]);
-        incrRefCount(c->argv[2]);
-    } else {
-        robj *lobj = dictGetEntryVal(de);
-        if (lobj->type != REDIS_LIST) {
-            addReply(c, shared.wrongtypeerr);
-            return;
-        }
-        list *list = lobj->ptr;
-        addToList(list, c->argv[2], where);
-        incrRefCount(c->argv[2]);
+static bool parseDouble(sds s, double *value) {
+    char *eptr;
+    errno = 0;
+    double d = strtod(s, &eptr);
+    if (sdslen(s) == 0 || eptr[0] != '\0' || errno == ERANGE || isnan(d)) {
+        return false;
     }
-    server.dirty++;
-    addReply(c, shared.ok);
+    *value = d;
+    return true;
 }
 
-static void lpushCommand(redisClient *c) {
-    pushGenericCommand(c, REDIS_HEAD);
+static zskiplistNode *zslCreateNode(int level, double score, robj *obj) {
+    zskiplistNode *zn = zmalloc(sizeof(*zn) + level * sizeof(struct zskiplistLevel));
+    if (zn == NULL) {
+        oom("zslCreateNode");
+    }
+    zn->score = score;
+    zn->obj = obj;
+    return zn;
 }
 
-static void rpushCommand(redisClient *c) {
-    pushGenericCommand(c, REDIS_TAIL);
+static zskiplist *zslCreate(void) {
+    zskiplist *zsl = zmalloc(sizeof(*zsl));
+    if (zsl == NULL) {
+        oom("zslCreate");
+    }
+    zsl->level = 1;
+    zsl->length = 0;
+    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL, 0, NULL);
+    for (int j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
+        zsl->header->level[j].forward = NULL;
+        zsl->header->level[j].span = 0;
+    }
+    zsl->header->backward = NULL;
+    zsl->tail = NULL;
+    return zsl;
 }
 
-static void llenCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.zero);
-        return;
+static void zslFreeNode(zskiplistNode *node) {
+    decrRefCount(node->obj);
+    zfree(node);
+}
+
+static void zslFree(zskiplist *zsl) {
+    zskiplistNode *node = zsl->header->level[0].forward;
+    zfree(zsl->header);
+    while (node != NULL) {
+        zskiplistNode *next = node->level[0].forward;
+        zslFreeNode(node);
+        node = next;
     }
+    zfree(zsl);
+}
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.minus2);
-    } else {
-        list *l = o->ptr;
-        addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", listLength(l)));
+/**
+ * 每多一层的概率是 ZSKIPLIST_P
+ */
+static int zslRandomLevel(void) {
+    int level = 1;
+    while ((random() & 0xFFFF) < (ZSKIPLIST_P * 0xFFFF)) {
+        level++;
     }
+    return (level < ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
 /**
- * argv[1]: list name
- * argv[2]: index
- * @return 返回 index 处的元素
+ * (score, obj) 是否排在 x 之后
  */
-static void lindexCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.nil);
-        return;
+static bool zslNodeBefore(zskiplistNode *x, double score, robj *obj) {
+    return x->score < score || (x->score == score && sdscmp(x->obj->ptr, obj->ptr) < 0);
+}
+
+/**
+ * 插入新节点, 调用方保证 obj 不在跳表中. 跳表接管调用方的一份引用
+ */
+static zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    unsigned int rank[ZSKIPLIST_MAXLEVEL]; // 每一层 update[i] 的 rank
+
+    zskiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        rank[i] = (i == zsl->level - 1) ? 0 : rank[i + 1];
+        while (x->level[i].forward != NULL && zslNodeBefore(x->level[i].forward, score, obj)) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
     }
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.wrongtypeerr);
-        return;
+    int level = zslRandomLevel();
+    if (level > zsl->level) {
+        for (int i = zsl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = zsl->header;
+            update[i]->level[i].span = zsl->length;
+        }
+        zsl->level = level;
     }
 
-    int index = atoi(c->argv[2]->ptr);
-    list *list = o->ptr;
-    listNode *node = listIndex(list, index);
-    if (node != NULL) {
-        robj *ele = listNodeValue(node);
-        addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", (int) sdslen(ele->ptr)));
-        addReply(c, ele);
-        addReply(c, shared.crlf);
+    x = zslCreateNode(level, score, obj);
+    for (int i = 0; i < level; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+        // update[i] 原来的 span 被 x 分成两段
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+    // 比 x 高的层跨过了 x
+    for (int i = level; i < zsl->level; i++) {
+        update[i]->level[i].span++;
+    }
+
+    x->backward = (update[0] == zsl->header) ? NULL : update[0];
+    if (x->level[0].forward != NULL) {
+        x->level[0].forward->backward = x;
     } else {
-        addReply(c, shared.nil);
+        zsl->tail = x;
     }
+    zsl->length++;
+    return x;
 }
 
-/**
- * argv[1]: list name
- * argv[2]: index
- * argv[3]: value
- * 
- * 功能: list[index] = value
- */
-static void lsetCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.nokeyerr);
-        return;
+static void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
+    for (int i = 0; i < zsl->level; i++) {
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
+        } else {
+            update[i]->level[i].span -= 1;
+        }
+    }
+    if (x->level[0].forward != NULL) {
+        x->level[0].forward->backward = x->backward;
+    } else {
+        zsl->tail = x->backward;
     }
+    while (zsl->level > 1 && zsl->header->level[zsl->level - 1].forward == NULL) {
+        zsl->level--;
+    }
+    zsl->length--;
+}
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.wrongtypeerr);
-        return;
+/**
+ * @return false if (score, obj) not found
+ */
+static bool zslDelete(zskiplist *zsl, double score, robj *obj) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    zskiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && zslNodeBefore(x->level[i].forward, score, obj)) {
+            x = x->level[i].forward;
+        }
+        update[i] = x;
     }
 
-    list *list = o->ptr;
-    int index = atoi(c->argv[2]);
-    listNode *node = listIndex(list, index);
-    if (node != NULL) {
-        robj *ele = listNodeValue(node);
-        decrRefCount(ele);
-        listNodeValue(node) = c->argv[3];
-        incrRefCount(c->argv[3]);
-        addReply(c, shared.ok);
-        server.dirty++;
-    } else {
-        addReplySds(c, sdsnew("-ERR index out of range\r\n"));
+    x = x->level[0].forward;
+    if (x != NULL && x->score == score && sdscmp(x->obj->ptr, obj->ptr) == 0) {
+        zslDeleteNode(zsl, x, update);
+        zslFreeNode(x);
+        return true;
     }
+    return false;
 }
 
 /**
- * 删除一个元素
- * @param where 指明从队头还是队尾删除
+ * @return 从 1 开始的 rank, 0 表示不存在
  */
-static void popGenericCommand(redisClient *c, int where) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.nil);
-        return;
+static unsigned long zslGetRank(zskiplist *zsl, double score, robj *obj) {
+    unsigned long rank = 0;
+    zskiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score && sdscmp(x->level[i].forward->obj->ptr, obj->ptr) <= 0))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (x->obj != NULL && sdscmp(x->obj->ptr, obj->ptr) == 0) {
+            return rank;
+        }
     }
+    return 0;
+}
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.wrongtypeerrbulk);
-        return;
-    }
-    
-    list *list = o->ptr;
-    listNode *node = (where == REDIS_HEAD) ? listFirst(list) : listLast(list);
-    if (node != NULL) {
-        robj *ele = listNodeValue(node);
-        addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", (int) sdslen(ele->ptr)));
-        addReply(c, ele);
-        addReply(c, shared.crlf);
-        // todo: 不需要decrRefCount吗
-        listDelNode(list, node);
-        server.dirty++;
-    } else {
-        addReply(c, shared.nil);
+/**
+ * 按 span 往前跳, O(log n) 找到第 rank 个节点(从 1 开始)
+ */
+static zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
+    unsigned long traversed = 0;
+    zskiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && traversed + x->level[i].span <= rank) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) {
+            return x;
+        }
     }
+    return NULL;
 }
 
-static void lpopCommand(redisClient *c) {
-    popGenericCommand(c, REDIS_HEAD);
+static bool zslValueGteMin(double value, zrangespec *spec) {
+    return spec->minex ? (value > spec->min) : (value >= spec->min);
 }
 
-static void rpopCommand(redisClient *c) {
-    popGenericCommand(c, REDIS_TAIL);
+static bool zslValueLteMax(double value, zrangespec *spec) {
+    return spec->maxex ? (value < spec->max) : (value <= spec->max);
 }
 
 /**
- * start 和 end 可能为负数，表示尾部往前数
+ * @return 第一个落在 range 中的节点, NULL if none
  */
-static void lindexToPositive(int *start, int *end, int llen) {
-    if (*start < 0) {
-        *start = *start + llen;
-    }
-    if (*end < 0) {
-        *end = *end + llen;
+static zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
+    zskiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && !zslValueGteMin(x->level[i].forward->score, range)) {
+            x = x->level[i].forward;
+        }
     }
-    if (*start < 0) {
-        *start = 0;
+    x = x->level[0].forward;
+    return (x != NULL && zslValueLteMax(x->score, range)) ? x : NULL;
+}
+
+/**
+ * min/max 前面加 '(' 表示不包含端点, 支持 -inf/+inf
+ */
+static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
+    sds smin = min->ptr, smax = max->ptr;
+    spec->minex = smin[0] == '(';
+    spec->maxex = smax[0] == '(';
+    sds tmin = sdsnew(smin + spec->minex);
+    sds tmax = sdsnew(smax + spec->maxex);
+    bool ok = parseDouble(tmin, &spec->min) && parseDouble(tmax, &spec->max);
+    sdsfree(tmin);
+    sdsfree(tmax);
+    return ok ? REDIS_OK : REDIS_ERR;
+}
+
+/* ---------------------- ziplist 编码 ---------------------- */
+
+static double zzlGetScore(unsigned char *sptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    bool found = ziplistGet(sptr, &vstr, &vlen, &vlong);
+    assert(found);
+    if (vstr == NULL) {
+        return (double) vlong;
     }
-    if (*end < 0) {
-        *end = 0;
+    char buf[128];
+    if (vlen >= sizeof(buf)) {
+        vlen = sizeof(buf) - 1;
     }
+    memcpy(buf, vstr, vlen);
+    buf[vlen] = '\0';
+    return strtod(buf, NULL);
 }
 
 /**
- * 返回 list[start, end] 范围内的元素
- * argv[1]: list name
- * argv[2]: start include
- * argv[3]: end include
+ * 按字典序比较 eptr 指向的 member 和 cstr
  */
-static void lrangeCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.nil);
-        return;
-    }
+static int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int clen) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[32];
+    ziplistGet(eptr, &vstr, &vlen, &vlong);
+    if (vstr == NULL) {
+        vlen = ll2string(buf, sizeof(buf), vlong);
+        vstr = (unsigned char *) buf;
+    }
+    unsigned int minlen = (vlen < clen) ? vlen : clen;
+    int cmp = memcmp(vstr, cstr, minlen);
+    if (cmp == 0) {
+        return (int) vlen - (int) clen;
+    }
+    return cmp;
+}
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.wrongtypeerrbulk);
-        return;
+static unsigned long zzlLength(unsigned char *zl) {
+    return ziplistLen(zl) / 2;
+}
+
+/**
+ * @return ele 对应的 member entry, score 通过 *score 返回, NULL if not found
+ */
+static unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score) {
+    ele = getDecodedObject(ele);
+    unsigned char *eptr = ziplistIndex(zl, 0);
+    while (eptr != NULL) {
+        unsigned char *sptr = ziplistNext(zl, eptr);
+        if (ziplistCompare(eptr, ele->ptr, sdslen(ele->ptr))) {
+            *score = zzlGetScore(sptr);
+            break;
+        }
+        eptr = ziplistNext(zl, sptr);
     }
+    decrRefCount(ele);
+    return eptr;
+}
 
-    list *list = o->ptr;
-    int llen = listLength(list);
-    int start = atoi(c->argv[2]->ptr);
-    int end = atoi(c->argv[3]->ptr);
-    lindexToPositive(&start, &end, llen);
+/**
+ * 删除 eptr 指向的 member 和它后面的 score
+ */
+static unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
+    unsigned char *p = eptr;
+    zl = ziplistDelete(zl, &p);
+    zl = ziplistDelete(zl, &p);
+    return zl;
+}
 
-    if (start > end || start >= llen) {
-        addReply(c, shared.zero);
-        return;
-    }
+/**
+ * 在 eptr 之前插入 (ele, score), eptr 为 NULL 时追加到尾部. ele 必须是 sds 编码
+ */
+static unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, double score) {
+    char scorebuf[128];
+    int scorelen = d2string(scorebuf, sizeof(scorebuf), score);
+    if (eptr == NULL) {
+        zl = ziplistPush(zl, ele->ptr, sdslen(ele->ptr), ZIPLIST_TAIL);
+        zl = ziplistPush(zl, (unsigned char *) scorebuf, scorelen, ZIPLIST_TAIL);
+        return zl;
+    }
+    size_t offset = eptr - zl;
+    zl = ziplistInsert(zl, eptr, ele->ptr, sdslen(ele->ptr));
+    // 插入之后 eptr 指向新的 member, score 插在它后面
+    unsigned char *sptr = ziplistNext(zl, zl + offset);
+    return ziplistInsert(zl, sptr, (unsigned char *) scorebuf, scorelen);
+}
 
-    if (end >= llen) {
-        end = llen - 1;
+/**
+ * 按 (score, member) 的顺序插入, 调用方保证 ele 不在 zl 中
+ */
+static unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score) {
+    ele = getDecodedObject(ele);
+    unsigned char *eptr = ziplistIndex(zl, 0);
+    while (eptr != NULL) {
+        unsigned char *sptr = ziplistNext(zl, eptr);
+        double s = zzlGetScore(sptr);
+        if (s > score || (s == score && zzlCompareElements(eptr, ele->ptr, sdslen(ele->ptr)) > 0)) {
+            break;
+        }
+        eptr = ziplistNext(zl, sptr);
     }
+    zl = zzlInsertAt(zl, eptr, ele, score);
+    decrRefCount(ele);
+    return zl;
+}
 
-    int rangelen = (end - start) + 1;
-    listNode *node = listIndex(list, start);
-    addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", rangelen));
-    for (int i = 0; i < rangelen; i++) {
-        robj *ele = listNodeValue(node);
-        addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", (int) sdslen(ele->ptr)));
-        addReply(c, ele);
-        addReply(c, shared.crlf);
-        node = node->next;
+/* ---------------------- 两种编码通用 ---------------------- */
+
+static unsigned long zsetLength(robj *zobj) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        return zzlLength(zobj->ptr);
     }
+    return ((zset *) zobj->ptr)->zsl->length;
 }
 
 /**
- * 仅保留list[start, end]，其他元素删除
- * argv[1]: list name
- * argv[2]: start
- * argv[3]: end
+ * ziplist -> skiplist
  */
-static void ltrimCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.nokeyerr);
-        return;
+static void zsetConvert(robj *zobj) {
+    assert(zobj->type == REDIS_ZSET && zobj->encoding == REDIS_ENCODING_ZIPLIST);
+    unsigned char *zl = zobj->ptr;
+    zset *zs = zmalloc(sizeof(*zs));
+    if (zs == NULL) {
+        oom("zsetConvert");
+    }
+    zs->dict = dictCreate(&zsetDictType, NULL);
+    if (zs->dict == NULL) {
+        oom("dictCreate");
     }
-
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.wrongtypeerr);
-        return;
+    zs->zsl = zslCreate();
+
+    unsigned char *eptr = ziplistIndex(zl, 0);
+    while (eptr != NULL) {
+        unsigned char *sptr = ziplistNext(zl, eptr);
+        robj *raw = createObjectFromZiplistEntry(eptr);
+        robj *ele = getDecodedObject(raw);
+        decrRefCount(raw);
+        // ziplist 本身是有序的, 每次都插在跳表尾部
+        zskiplistNode *node = zslInsert(zs->zsl, zzlGetScore(sptr), ele);
+        if (dictAdd(zs->dict, ele, &node->score) != DICT_OK) {
+            oom("dictAdd");
+        }
+        incrRefCount(ele);
+        eptr = ziplistNext(zl, sptr);
     }
+    zfree(zl);
+    zobj->ptr = zs;
+    zobj->encoding = REDIS_ENCODING_SKIPLIST;
+}
 
-    list *list = o->ptr;
-    int llen = listLength(list);
-    int start = atoi(c->argv[2]->ptr);
-    int end = atoi(c->argv[3]->ptr);
-    lindexToPositive(&start, &end, llen);
-    int ltrim = start;
-    int rtrim = llen - end - 1;
-    if (start > end || start >= llen) {
-        ltrim = llen;
-        rtrim = 0;
+/**
+ * 设置 ele 的 score, 需要时转换编码
+ * @return true 新增了一个元素, false 是更新
+ */
+static bool zsetAdd(robj *zobj, double score, robj *ele) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        double curscore;
+        unsigned char *eptr = zzlFind(zobj->ptr, ele, &curscore);
+        if (eptr != NULL) {
+            if (curscore != score) {
+                zobj->ptr = zzlDelete(zobj->ptr, eptr);
+                zobj->ptr = zzlInsert(zobj->ptr, ele, score);
+            }
+            return false;
+        }
+        zobj->ptr = zzlInsert(zobj->ptr, ele, score);
+        if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
+            stringObjectLen(ele) > server.zset_max_ziplist_value) {
+            zsetConvert(zobj);
+        }
+        return true;
     }
 
-    for (int i = 0; i < ltrim; i++) {
-        listNode *node = listFirst(list);
-        listDelNode(list, node);
+    zset *zs = zobj->ptr;
+    ele = getDecodedObject(ele);
+    dictEntry *de = dictFind(zs->dict, ele);
+    if (de != NULL) {
+        robj *curobj = dictGetEntryKey(de);
+        double curscore = *(double *) dictGetEntryVal(de);
+        decrRefCount(ele);
+        if (curscore != score) {
+            // 先删后插, 节点的位置会变, dict 中的 score 指针也要跟着更新
+            bool deleted = zslDelete(zs->zsl, curscore, curobj);
+            assert(deleted);
+            incrRefCount(curobj);
+            zskiplistNode *node = zslInsert(zs->zsl, score, curobj);
+            de->val = &node->score;
+        }
+        return false;
     }
-    for (int i = 0; i < rtrim; i++) {
-        listNode *node = listLast(list);
-        listDelNode(list, node);
+    zskiplistNode *node = zslInsert(zs->zsl, score, ele);
+    incrRefCount(ele);
+    if (dictAdd(zs->dict, ele, &node->score) != DICT_OK) {
+        oom("dictAdd");
     }
-    addReply(c, shared.ok);
-    server.dirty++;
+    return true;
 }
 
 /**
- * argv[1]: list name
- * argv[2]: count 
- * argv[3]: target
- * 
- * count > 0: 从头开始，删除 count 个等于 target 的元素
- * count < 0: 从尾部开始，删除 count 个等于 target 的元素
- * count = 0: 删除所有等于 target 的元素
+ * @return false if ele not exists
  */
-static void lremCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.minus1);
-        return;
+static bool zsetDel(robj *zobj, robj *ele) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        double score;
+        unsigned char *eptr = zzlFind(zobj->ptr, ele, &score);
+        if (eptr == NULL) {
+            return false;
+        }
+        zobj->ptr = zzlDelete(zobj->ptr, eptr);
+        return true;
     }
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_LIST) {
-        addReply(c, shared.minus2);
-        return;
+    zset *zs = zobj->ptr;
+    ele = getDecodedObject(ele);
+    dictEntry *de = dictFind(zs->dict, ele);
+    decrRefCount(ele);
+    if (de == NULL) {
+        return false;
     }
+    double score = *(double *) dictGetEntryVal(de);
+    bool deleted = zslDelete(zs->zsl, score, dictGetEntryKey(de));
+    assert(deleted);
+    dictDelete(zs->dict, dictGetEntryKey(de));
+    return true;
+}
 
-    list *list = o->ptr;
-    int count = atoi(c->argv[2]->ptr);
-    bool fromtail = false;
-    if (count < 0) {
-        count = -count;
-        fromtail = true;
+/**
+ * @return false if ele not exists
+ */
+static bool zsetScore(robj *zobj, robj *ele, double *score) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        return zzlFind(zobj->ptr, ele, score) != NULL;
+    }
+    zset *zs = zobj->ptr;
+    ele = getDecodedObject(ele);
+    dictEntry *de = dictFind(zs->dict, ele);
+    decrRefCount(ele);
+    if (de == NULL) {
+        return false;
     }
+    *score = *(double *) dictGetEntryVal(de);
+    return true;
+}
 
-    int removed = 0;
-    listNode *node = fromtail ? list->tail : list->head;
-    while (node != NULL) {
-        listNode *next = fromtail ? node->prev : node->next;
-        robj *ele = listNodeValue(node);
-        if (sdscmp(ele->ptr, c->argv[3]) == 0) {
-            listDelNode(list, node);
-            server.dirty++;
-            removed++;
-            if (count > 0 && removed == count) {
-                break;
-            }
+/**
+ * @return NULL 类型不对(wrongtypereply)或者不存在(replyIfMissing, 为 NULL 时不回复), 已经回复过了
+ */
+static robj *zsetLookup(redisClient *c, robj *key, robj *replyIfMissing, robj *wrongtypereply) {
+    dictEntry *de = lookupKeyEntry(c, key);
+    if (de == NULL) {
+        if (replyIfMissing != NULL) {
+            addReply(c, replyIfMissing);
         }
-
-        node = next;
+        return NULL;
+    }
+    robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_ZSET) {
+        addReply(c, wrongtypereply);
+        return NULL;
     }
-    addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", removed));
+    return o;
 }
 
-/* =========================== Sets command ======================= */
-
 /**
- * argv[1]: set name
- * argv[2]: element will added
+ * ZADD key score member
+ * @return 1 新增了 member, 0 更新了 score
  */
-static void saddCommand(redisClient *c) {
-    robj *set;
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
+static void zaddCommand(redisClient *c) {
+    double score;
+    if (!parseDouble(c->argv[2]->ptr, &score)) {
+        addReplySds(c, sdsnew("-ERR value is not a double\r\n"));
+        return;
+    }
+
+    dictEntry *de = lookupKeyEntry(c, c->argv[1]);
+    robj *zobj;
     if (de == NULL) {
-        set = createSetObject();
-        dictAdd(c->dict, c->argv[1], set);
+        if (server.zset_max_ziplist_entries == 0 || stringObjectLen(c->argv[3]) > server.zset_max_ziplist_value) {
+            zobj = createZsetObject();
+        } else {
+            zobj = createZsetZiplistObject();
+        }
+        dictAdd(c->dict, c->argv[1], zobj);
         incrRefCount(c->argv[1]);
     } else {
-        set = dictGetEntryVal(de);
-        if (set->type != REDIS_SET) {
+        zobj = dictGetEntryVal(de);
+        if (zobj->type != REDIS_ZSET) {
             addReply(c, shared.minus2);
             return;
         }
     }
 
-    if (dictAdd(set->ptr, c->argv[2], NULL) == DICT_OK) {
-        incrRefCount(c->argv[2]);
-        server.dirty++;
-        addReply(c, shared.one);
-    } else {
-        addReply(c, shared.zero);
-    }
+    bool added = zsetAdd(zobj, score, c->argv[3]);
+    server.dirty++;
+    addReply(c, added ? shared.one : shared.zero);
 }
 
 /**
- * argv[1]: set name
- * argv[2]: element will be removed
+ * ZREM key member, 删除最后一个元素时 key 也被删除
  */
-static void sremCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
+static void zremCommand(redisClient *c) {
+    robj *zobj = zsetLookup(c, c->argv[1], shared.zero, shared.minus2);
+    if (zobj == NULL) {
+        return;
+    }
+    if (!zsetDel(zobj, c->argv[2])) {
         addReply(c, shared.zero);
         return;
     }
+    if (zsetLength(zobj) == 0) {
+        deleteKey(c->dictid, c->argv[1]);
+    }
+    server.dirty++;
+    addReply(c, shared.one);
+}
 
-    robj *set = dictGetEntryVal(de);
-    if (set->type != REDIS_SET) {
-        addReply(c, shared.minus2);
+/**
+ * ZSCORE key member
+ */
+static void zscoreCommand(redisClient *c) {
+    robj *zobj = zsetLookup(c, c->argv[1], shared.nil, shared.wrongtypeerrbulk);
+    if (zobj == NULL) {
         return;
     }
-
-    if (dictDelete(set->ptr, c->argv[2]) == DICT_OK) {
-        server.dirty++;
-        addReply(c, shared.one);
+    double score;
+    if (zsetScore(zobj, c->argv[2], &score)) {
+        addReplyDouble(c, score);
     } else {
-        addReply(c, shared.zero);
+        addReply(c, shared.nil);
     }
 }
 
 /**
- * argv[1]: set name
- * argv[2]: element
+ * ZRANK key member, 按 score 从小到大从 0 开始
  */
-static void sismemberCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.zero);
+static void zrankCommand(redisClient *c) {
+    robj *zobj = zsetLookup(c, c->argv[1], shared.nil, shared.minus2);
+    if (zobj == NULL) {
         return;
     }
 
-    robj *set = dictGetEntryVal(de);
-    if (set->type != REDIS_SET) {
-        addReply(c, shared.minus2);
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = zobj->ptr;
+        robj *ele = getDecodedObject(c->argv[2]);
+        unsigned char *eptr = ziplistIndex(zl, 0);
+        long rank = 0;
+        while (eptr != NULL && !ziplistCompare(eptr, ele->ptr, sdslen(ele->ptr))) {
+            eptr = ziplistNext(zl, ziplistNext(zl, eptr));
+            rank++;
+        }
+        decrRefCount(ele);
+        if (eptr != NULL) {
+            addReplyLongLong(c, rank);
+        } else {
+            addReply(c, shared.nil);
+        }
         return;
     }
 
-    if (dictFind(set->ptr, c->argv[2]) != NULL) {
-        addReply(c, shared.one);
-    } else {
-        addReply(c, shared.zero);
+    zset *zs = zobj->ptr;
+    robj *ele = getDecodedObject(c->argv[2]);
+    dictEntry *de = dictFind(zs->dict, ele);
+    decrRefCount(ele);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
     }
+    unsigned long rank = zslGetRank(zs->zsl, *(double *) dictGetEntryVal(de), dictGetEntryKey(de));
+    assert(rank != 0);
+    addReplyLongLong(c, rank - 1);
 }
 
 /**
- * 返回 set 的大小
+ * 最后一个可选参数是否是 WITHSCORES
+ * @return REDIS_ERR 有无法识别的参数, 已经回复了错误
  */
-static void scardCommand(redisClient *c) {
-    dictEntry *de = dictFind(c->dict, c->argv[1]);
-    if (de == NULL) {
-        addReply(c, shared.zero);
-        return;
+static int zparseWithScores(redisClient *c, int argc, bool *withscores) {
+    *withscores = false;
+    if (c->argc == argc + 1 && !strcasecmp(c->argv[argc]->ptr, "withscores")) {
+        *withscores = true;
+    } else if (c->argc != argc) {
+        addReply(c, shared.syntaxerrbulk);
+        return REDIS_ERR;
     }
+    return REDIS_OK;
+}
 
-    robj *o = dictGetEntryVal(de);
-    if (o->type != REDIS_SET) {
-        addReply(c, shared.minus2);
+/**
+ * ZRANGE key start end [WITHSCORES], 下标的含义和 LRANGE 一样
+ */
+static void zrangeCommand(redisClient *c) {
+    bool withscores;
+    if (zparseWithScores(c, 4, &withscores) == REDIS_ERR) {
+        return;
+    }
+    robj *zobj = zsetLookup(c, c->argv[1], shared.nil, shared.wrongtypeerrbulk);
+    if (zobj == NULL) {
         return;
     }
 
-    dict *s = o->ptr;
-    addReplySds(c, sdscatprintf(sdsempty(), "%d\r\n", dictGetHashTableUsed(s)));
-}
-
-static int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
-    dict **d1 = (void *) s1;
-    dict **d2 = (void *) s2;
-    return dictGetHashTableUsed(*d1) - dictGetHashTableUsed(*d2);
-}
-
-static void sinterGenericCommand(redisClient *c, robj **setskeys, int setsnum, robj *dstkey) {
-    dict **dv = zmalloc(sizeof(dict*)*setsnum);
-    dictIterator *di;
-    dictEntry *de;
-    robj *lenobj = NULL, *dstset = NULL;
-    int j, cardinality = 0;
+    int llen = zsetLength(zobj);
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    lindexToPositive(&start, &end, llen);
+    if (start > end || start >= llen) {
+        addReply(c, shared.zero);
+        return;
+    }
+    if (end >= llen) {
+        end = llen - 1;
+    }
 
-    if (!dv) oom("sinterCommand");
-    for (j = 0; j < setsnum; j++) {
-        robj *setobj;
-        dictEntry *de;
-        
-        de = dictFind(c->dict,setskeys[j]);
-        if (!de) {
-            zfree(dv);
-            addReply(c,dstkey ? shared.nokeyerr : shared.nil);
-            return;
-        }
-        setobj = dictGetEntryVal(de);
-        if (setobj->type != REDIS_SET) {
-            zfree(dv);
-            addReply(c,dstkey ? shared.wrongtypeerr : shared.wrongtypeerrbulk);
-            return;
+    int rangelen = (end - start) + 1;
+    addReplyLongLong(c, withscores ? rangelen * 2 : rangelen);
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = zobj->ptr;
+        unsigned char *eptr = ziplistIndex(zl, 2 * start);
+        while (rangelen--) {
+            unsigned char *sptr = ziplistNext(zl, eptr);
+            addReplyZiplistEntry(c, eptr);
+            if (withscores) {
+                addReplyDouble(c, zzlGetScore(sptr));
+            }
+            eptr = ziplistNext(zl, sptr);
         }
-        dv[j] = setobj->ptr;
+        return;
     }
-    /* Sort sets from the smallest to largest, this will improve our
-     * algorithm's performace */
-    qsort(dv,setsnum,sizeof(dict*),qsortCompareSetsByCardinality);
 
-    /* The first thing we should output is the total number of elements...
-     * since this is a multi-bulk write, but at this stage we don't know
-     * the intersection set size, so we use a trick, append an empty object
-     * to the output list and save the pointer to later modify it with the
-     * right length */
-    if (!dstkey) {
-        lenobj = createObject(REDIS_STRING,NULL);
-        addReply(c,lenobj);
-        decrRefCount(lenobj);
-    } else {
-        /* If we have a target key where to store the resulting set
-         * create this key with an empty set inside */
-        dstset = createSetObject();
-        dictDelete(c->dict,dstkey);
-        dictAdd(c->dict,dstkey,dstset);
-        incrRefCount(dstkey);
+    // 按 span 直接跳到 start, 之后顺序遍历
+    zskiplistNode *ln = zslGetElementByRank(((zset *) zobj->ptr)->zsl, start + 1);
+    while (rangelen--) {
+        addReplyBulk(c, ln->obj);
+        if (withscores) {
+            addReplyDouble(c, ln->score);
+        }
+        ln = ln->level[0].forward;
     }
+}
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    di = dictGetIterator(dv[0]);
-    if (!di) oom("dictGetIterator");
+/**
+ * ZRANGEBYSCORE key min max [WITHSCORES]
+ */
+static void zrangebyscoreCommand(redisClient *c) {
+    bool withscores;
+    if (zparseWithScores(c, 4, &withscores) == REDIS_ERR) {
+        return;
+    }
+    zrangespec range;
+    if (zslParseRange(c->argv[2], c->argv[3], &range) == REDIS_ERR) {
+        addReplySds(c, sdsnew("-ERR min or max is not a double\r\n"));
+        return;
+    }
+    robj *zobj = zsetLookup(c, c->argv[1], shared.nil, shared.wrongtypeerrbulk);
+    if (zobj == NULL) {
+        return;
+    }
 
-    while((de = dictNext(di)) != NULL) {
-        robj *ele;
+    // 结果的个数要遍历完才知道, 和 SINTER 一样先占个位置
+    robj *lenobj = createObject(REDIS_STRING, NULL);
+    addReply(c, lenobj);
+    decrRefCount(lenobj);
 
-        for (j = 1; j < setsnum; j++)
-            if (dictFind(dv[j],dictGetEntryKey(de)) == NULL) break;
-        if (j != setsnum)
-            continue; /* at least one set does not contain the member */
-        ele = dictGetEntryKey(de);
-        if (!dstkey) {
-            addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",sdslen(ele->ptr)));
-            addReply(c,ele);
-            addReply(c,shared.crlf);
-            cardinality++;
-        } else {
-            dictAdd(dstset->ptr,ele,NULL);
-            incrRefCount(ele);
+    int rangelen = 0;
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = zobj->ptr;
+        unsigned char *eptr = ziplistIndex(zl, 0);
+        while (eptr != NULL) {
+            unsigned char *sptr = ziplistNext(zl, eptr);
+            double score = zzlGetScore(sptr);
+            if (!zslValueLteMax(score, &range)) {
+                break;
+            }
+            if (zslValueGteMin(score, &range)) {
+                addReplyZiplistEntry(c, eptr);
+                if (withscores) {
+                    addReplyDouble(c, score);
+                }
+                rangelen++;
+            }
+            eptr = ziplistNext(zl, sptr);
+        }
+    } else {
+        zskiplistNode *ln = zslFirstInRange(((zset *) zobj->ptr)->zsl, &range);
+        while (ln != NULL && zslValueLteMax(ln->score, &range)) {
+            addReplyBulk(c, ln->obj);
+            if (withscores) {
+                addReplyDouble(c, ln->score);
+            }
+            rangelen++;
+            ln = ln->level[0].forward;
         }
     }
-    dictReleaseIterator(di);
-
-    if (!dstkey)
-        lenobj->ptr = sdscatprintf(sdsempty(),"%d\r\n",cardinality);
-    else
-        addReply(c,shared.ok);
-    zfree(dv);
-}
-
-static void sinterCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    lenobj->ptr = sdscatprintf(sdsempty(), "%d\r\n", withscores ? rangelen * 2 : rangelen);
 }
 
-static void sinterstoreCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+/**
+ * FLUSHDB/FLUSHALL [ASYNC]
+ * @return REDIS_ERR 参数不对, 已经回复了错误
+ */
+static int getFlushAsyncFlag(redisClient *c, bool *async) {
+    *async = false;
+    if (c->argc == 1) {
+        return REDIS_OK;
+    }
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr, "async")) {
+        *async = true;
+        return REDIS_OK;
+    }
+    addReply(c, shared.syntaxerr);
+    return REDIS_ERR;
 }
 
 static void flushdbCommand(redisClient *c) {
-    dictEmpty(c->dict);
+    bool async;
+    if (getFlushAsyncFlag(c, &async) == REDIS_ERR) {
+        return;
+    }
+    if (async) {
+        emptyDbAsync(c->dictid);
+    } else {
+        dictEmpty(c->dict);
+        dictEmpty(server.expires[c->dictid]);
+    }
     addReply(c,shared.ok);
+    // saveDb 会把 dirty 清零, processCommand 就看不出这条命令修改了数据, AOF 中也就不会记录它
+    long long dirty = server.dirty;
     saveDb(server.dbfilename);
+    server.dirty = dirty + 1;
 }
 
 static void flushallCommand(redisClient *c) {
-    emptyDb();
+    bool async;
+    if (getFlushAsyncFlag(c, &async) == REDIS_ERR) {
+        return;
+    }
+    if (async) {
+        for (int j = 0; j < server.dbnum; j++) {
+            emptyDbAsync(j);
+        }
+    } else {
+        emptyDb();
+    }
     addReply(c,shared.ok);
+    long long dirty = server.dirty;
     saveDb(server.dbfilename);
+    server.dirty = dirty + 1;
 }
 
 redisSortOperation *createSortOperation(int type, robj *pattern) {
@@ -2209,10 +6784,12 @@ robj *lookupKeyByPattern(dict *dict, robj *pattern, robj *subst) {
     robj keyobj;
     int prefixlen, sublen, postfixlen;
     dictEntry *de;
-    /* Expoit the internal sds representation to create a sds string allocated on the stack in order to make this function faster */
-    struct {
-        long len;
-        long free;
+    /* Expoit the internal sds representation to create a sds string allocated on the stack in order to make this function faster.
+     * 布局必须和 struct sdshdr16 一致, REDIS_SORTKEY_MAX 不能超过 uint16_t 的范围 */
+    struct __attribute__ ((__packed__)) {
+        uint16_t len;
+        uint16_t alloc;
+        unsigned char flags;
         char buf[REDIS_SORTKEY_MAX+1];
     } keyname;
 
@@ -2231,10 +6808,13 @@ robj *lookupKeyByPattern(dict *dict, robj *pattern, robj *subst) {
     memcpy(keyname.buf+prefixlen+sublen,p+1,postfixlen);
     keyname.buf[prefixlen+sublen+postfixlen] = '\0';
     keyname.len = prefixlen+sublen+postfixlen;
+    keyname.alloc = keyname.len;
+    keyname.flags = SDS_TYPE_16;
 
     keyobj.refcount = 1;
     keyobj.type = REDIS_STRING;
-    keyobj.ptr = ((char*)&keyname)+(sizeof(long)*2);
+    keyobj.encoding = REDIS_ENCODING_RAW;
+    keyobj.ptr = keyname.buf;
 
     de = dictFind(dict,&keyobj);
     // printf("lookup '%s' => %p\n", keyname.buf,de);
@@ -2295,7 +6875,7 @@ static void sortCommand(redisClient *c) {
     redisSortObject *vector; /* Resulting vector to sort */
 
     /* Lookup the key to sort. It must be of the right types */
-    de = dictFind(c->dict,c->argv[1]);
+    de = lookupKeyEntry(c, c->argv[1]);
     if (de == NULL) {
         addReply(c,shared.nokeyerrbulk);
         return;
@@ -2354,138 +6934,869 @@ static void sortCommand(redisClient *c) {
                 REDIS_SORT_DECR,c->argv[j+1]));
             j++;
         } else {
-            decrRefCount(sortval);
-            listRelease(operations);
-            addReply(c,shared.syntaxerrbulk);
-            return;
+            decrRefCount(sortval);
+            listRelease(operations);
+            addReply(c,shared.syntaxerrbulk);
+            return;
+        }
+        j++;
+    }
+
+    /* Load the sorting vector with all the objects to sort */
+    vectorlen = (sortval->type == REDIS_LIST) ?
+        listTypeLength(sortval) :
+        setTypeSize(sortval);
+    vector = zmalloc(sizeof(redisSortObject)*vectorlen);
+    if (!vector) oom("allocating objects vector for SORT");
+    j = 0;
+    if (sortval->type == REDIS_LIST) {
+        /* ziplist 中没有现成的对象, 统一持有一份解码后的引用, 最后释放 */
+        listTypeIterator *li = listTypeInitIterator(sortval,0,REDIS_TAIL);
+        listTypeEntry entry;
+        while(listTypeNext(li,&entry)) {
+            robj *ele = listTypeGet(&entry);
+            vector[j].obj = getDecodedObject(ele);
+            decrRefCount(ele);
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+        }
+        listTypeReleaseIterator(li);
+    } else {
+        /* intset 中同样没有现成的对象, set 的元素也持有一份引用 */
+        setTypeIterator *si = setTypeInitIterator(sortval);
+        robj *ele;
+        while((ele = setTypeNextObject(si)) != NULL) {
+            vector[j].obj = ele;
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+        }
+        setTypeReleaseIterator(si);
+    }
+    assert(j == vectorlen);
+
+    /* Now it's time to load the right scores in the sorting vector */
+    if (dontsort == 0) {
+        for (j = 0; j < vectorlen; j++) {
+            if (sortby) {
+                robj *byval;
+
+                byval = lookupKeyByPattern(c->dict,sortby,vector[j].obj);
+                if (!byval || byval->type != REDIS_STRING) continue;
+                if (alpha) {
+                    vector[j].u.cmpobj = getDecodedObject(byval);
+                } else if (byval->encoding == REDIS_ENCODING_INT) {
+                    vector[j].u.score = (long)byval->ptr;
+                } else {
+                    vector[j].u.score = strtod(byval->ptr,NULL);
+                }
+            } else {
+                if (!alpha) vector[j].u.score = strtod(vector[j].obj->ptr,NULL);
+            }
+        }
+    }
+
+    /* We are ready to sort the vector... perform a bit of sanity check
+     * on the LIMIT option too. We'll use a partial version of quicksort. */
+    start = (limit_start < 0) ? 0 : limit_start;
+    end = (limit_count < 0) ? vectorlen-1 : start+limit_count-1;
+    if (start >= vectorlen) {
+        start = vectorlen-1;
+        end = vectorlen-2;
+    }
+    if (end >= vectorlen) end = vectorlen-1;
+
+    if (dontsort == 0) {
+        server.sort_desc = desc;
+        server.sort_alpha = alpha;
+        server.sort_bypattern = sortby ? 1 : 0;
+        qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
+    }
+
+    /* Send command output to the output buffer, performing the specified
+     * GET/DEL/INCR/DECR operations if any. */
+    outputlen = getop ? getop*(end-start+1) : end-start+1;
+    addReplyLongLong(c,outputlen);
+    for (j = start; j <= end; j++) {
+        listNode *ln = operations->head;
+        if (!getop) {
+            addReplyBulk(c,vector[j].obj);
+        }
+        while(ln) {
+            redisSortOperation *sop = ln->value;
+            robj *val = lookupKeyByPattern(c->dict,sop->pattern,
+                vector[j].obj);
+
+            if (sop->type == REDIS_SORT_GET) {
+                if (!val || val->type != REDIS_STRING) {
+                    addReply(c,shared.minus1);
+                } else {
+                    addReplyBulk(c,val);
+                }
+            } else if (sop->type == REDIS_SORT_DEL) {
+                /* TODO */
+            }
+            ln = ln->next;
+        }
+    }
+
+    /* Cleanup */
+    for (j = 0; j < vectorlen; j++) {
+        if (sortby && alpha && vector[j].u.cmpobj)
+            decrRefCount(vector[j].u.cmpobj);
+        decrRefCount(vector[j].obj);
+    }
+    decrRefCount(sortval);
+    listRelease(operations);
+    zfree(vector);
+}
+
+/* =========================== Active defrag ========================== */
+
+/**
+ * 碎片整理的进度: 正在整理第 defragDbId 个 db 的主 dict(defragExpires 为 false)或 expires,
+ * 下一个 bucket 是 defragCursor
+ */
+static int defragDbId = 0;
+static bool defragExpires = false;
+static unsigned int defragCursor = 0;
+static long long defragStartTime = 0;
+/**
+ * 遍历主 dict 时遇到的大 value 只挪动 robj 本身, key 的名字(sds)记在 defragLaterKeys 中, 内容之后分批整理.
+ * defragLaterCursor 是第一个 key 的 value 中下一个 bucket(quicklist 为节点)的下标
+ */
+static list *defragLaterKeys = NULL;
+static unsigned long defragLaterCursor = 0;
+/** 自上次检查时间以来整理过的 bucket/元素/节点数 */
+static long defragSteps = 0;
+
+static void *activeDefragAlloc(void *ptr) {
+    void *newptr = zmalloc_defrag_alloc(ptr);
+    if (newptr != NULL) {
+        server.stat_active_defrag_hits++;
+    } else {
+        server.stat_active_defrag_misses++;
+    }
+    return newptr;
+}
+
+static sds activeDefragSds(sds s) {
+    int hdrlen = sdsHdrSize(s[-1]);
+    char *newsh = activeDefragAlloc(s - hdrlen);
+    return newsh != NULL ? newsh + hdrlen : NULL;
+}
+
+/**
+ * 挪动字符串对象, EMBSTR 的 robj 和 sds 在同一块内存中, 一起挪动.
+ * 调用者保证 o 只被自己知道的地方引用
+ * @return 新的对象, 没有挪动 robj 时返回 NULL(RAW 的 sds 可能已经被挪动了)
+ */
+static robj *activeDefragStringObject(robj *o) {
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        sds news = activeDefragSds(o->ptr);
+        if (news != NULL) {
+            o->ptr = news;
+        }
+    } else if (o->encoding == REDIS_ENCODING_EMBSTR) {
+        ptrdiff_t offset = (char *) o->ptr - (char *) o;
+        robj *newo = activeDefragAlloc(o);
+        if (newo != NULL) {
+            newo->ptr = (char *) newo + offset;
+        }
+        return newo;
+    }
+    return activeDefragAlloc(o);
+}
+
+/**
+ * set 的 member 和 hash 的 field/value 都只被 dict 引用
+ */
+static void activeDefragObjectEntry(void *privdata, dictEntry *de) {
+    REDIS_NOTUSED(privdata);
+    defragSteps++;
+    robj *o = dictGetEntryKey(de);
+    robj *newo;
+    if (o->refcount == 1 && (newo = activeDefragStringObject(o)) != NULL) {
+        de->key = newo;
+    }
+    o = dictGetEntryVal(de);
+    if (o != NULL && o->refcount == 1 && (newo = activeDefragStringObject(o)) != NULL) {
+        de->val = newo;
+    }
+}
+
+/**
+ * 挪动 dict 的所有内容, entryfn 为 NULL 时只挪动 bucket 数组和 dictEntry
+ * @return 新的 dict, 没有挪动 dict 结构本身时返回 NULL
+ */
+static dict *activeDefragDict(dict *d, dictDefragEntryFunction *entryfn) {
+    unsigned int cursor = 0;
+    do {
+        cursor = dictDefragScan(d, cursor, activeDefragAlloc, entryfn, NULL);
+    } while (cursor != 0);
+    return activeDefragAlloc(d);
+}
+
+/**
+ * 挪动 value 的所有内存. skiplist 的节点和 zset 中 dict 的 key 互相引用, 只挪动 dict 本身
+ * @return 新的对象, 没有挪动 robj 时返回 NULL
+ */
+static robj *activeDefragObject(robj *o) {
+    void *newptr = NULL;
+    if (o->type == REDIS_STRING) {
+        return activeDefragStringObject(o);
+    } else if (o->encoding == REDIS_ENCODING_ZIPLIST || o->encoding == REDIS_ENCODING_INTSET) {
+        newptr = activeDefragAlloc(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDefrag(o->ptr, 0, ULONG_MAX, activeDefragAlloc);
+        newptr = activeDefragAlloc(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        newptr = activeDefragDict(o->ptr, activeDefragObjectEntry);
+    } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+        dict *newdict = activeDefragDict(zs->dict, NULL);
+        if (newdict != NULL) {
+            zs->dict = newdict;
+        }
+        newptr = activeDefragAlloc(zs);
+    }
+    if (newptr != NULL) {
+        o->ptr = newptr;
+    }
+    return activeDefragAlloc(o);
+}
+
+/**
+ * 主 dict 中的 key 同时被 expires 引用, 挪动之后两边都要修正; 被其他地方引用的对象不能挪.
+ * 大 value 只挪动 robj, 内容交给 activeDefragLater
+ */
+static void activeDefragKeyEntry(void *privdata, dictEntry *de) {
+    defragSteps++;
+    dict *expires = server.expires[(long) privdata];
+    robj *key = dictGetEntryKey(de);
+    dictEntry *expirede = NULL;
+    int holders = 1;
+    if (dictGetHashTableUsed(expires) > 0 && (expirede = dictFind(expires, key)) != NULL &&
+        dictGetEntryKey(expirede) == key) {
+        holders++;
+    }
+    robj *newo;
+    if (key->refcount == holders && (newo = activeDefragStringObject(key)) != NULL) {
+        de->key = newo;
+        if (expirede != NULL) {
+            expirede->key = newo;
+        }
+    }
+
+    robj *val = dictGetEntryVal(de);
+    if (val == NULL || val->refcount != 1) {
+        return;
+    }
+    if (val->type != REDIS_STRING && lazyfreeGetFreeEffort(val) > REDIS_DEFRAG_BIG_VALUE) {
+        newo = activeDefragAlloc(val);
+        sds name = sdsdup(((robj *) dictGetEntryKey(de))->ptr);
+        if (name == NULL || listAddNodeTail(defragLaterKeys, name) == NULL) {
+            oom("activeDefragKeyEntry");
+        }
+    } else {
+        newo = activeDefragObject(val);
+    }
+    if (newo != NULL) {
+        de->val = newo;
+    }
+}
+
+static bool activeDefragTimedOut(long long start, long long timelimit) {
+    if (defragSteps < REDIS_DEFRAG_CHECK_STEPS) {
+        return false;
+    }
+    defragSteps = 0;
+    return mstime() - start > timelimit;
+}
+
+/**
+ * 分批整理一个大 value 的内容, 每次整理一个 bucket(quicklist 为一个节点), 从 cursor 开始
+ * @return 下一次开始的位置, 整理完返回 0
+ */
+static unsigned long activeDefragBigValueStep(robj *o, unsigned long cursor) {
+    if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        defragSteps++;
+        cursor = quicklistDefrag(o->ptr, cursor, 1, activeDefragAlloc);
+        if (cursor == 0) {
+            void *newptr = activeDefragAlloc(o->ptr);
+            if (newptr != NULL) {
+                o->ptr = newptr;
+            }
+        }
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        defragSteps++;
+        cursor = dictDefragScan(o->ptr, cursor, activeDefragAlloc, activeDefragObjectEntry, NULL);
+        if (cursor == 0) {
+            void *newptr = activeDefragAlloc(o->ptr);
+            if (newptr != NULL) {
+                o->ptr = newptr;
+            }
+        }
+    } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+        defragSteps++;
+        cursor = dictDefragScan(zs->dict, cursor, activeDefragAlloc, NULL, NULL);
+        if (cursor == 0) {
+            dict *newdict = activeDefragAlloc(zs->dict);
+            if (newdict != NULL) {
+                zs->dict = newdict;
+            }
+            void *newptr = activeDefragAlloc(zs);
+            if (newptr != NULL) {
+                o->ptr = newptr;
+            }
+        }
+    } else {
+        // 转换成了紧凑编码, 已经不是大 value 了
+        return 0;
+    }
+    return cursor;
+}
+
+/**
+ * 整理 defragLaterKeys 中记下的大 value, key 属于第 defragDbId 个 db.
+ * 两次调用之间 key 可能已经被删除或者修改, 每次都按名字重新查找, 已经不存在的跳过
+ * @return false 超过了时间限制, 还没有整理完
+ */
+static bool activeDefragLater(long long start, long long timelimit) {
+    while (listLength(defragLaterKeys) > 0) {
+        listNode *ln = listFirst(defragLaterKeys);
+        robj keyobj = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = listNodeValue(ln)};
+        dictEntry *de = dictFind(server.dict[defragDbId], &keyobj);
+        robj *val = de != NULL ? dictGetEntryVal(de) : NULL;
+        if (val != NULL && val->refcount == 1) {
+            do {
+                defragLaterCursor = activeDefragBigValueStep(val, defragLaterCursor);
+                if (defragLaterCursor != 0 && activeDefragTimedOut(start, timelimit)) {
+                    return false;
+                }
+            } while (defragLaterCursor != 0);
+        }
+        defragLaterCursor = 0;
+        sdsfree(keyobj.ptr);
+        listDelNode(defragLaterKeys, ln);
+        if (activeDefragTimedOut(start, timelimit)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 碎片整理, serverCron 中调用.
+ * 碎片(allocator 占用的页减去分配出去的字节数)超过阈值时开始, 按 bucket 逐个遍历所有 db 的主 dict 和 expires,
+ * 把 allocator 认为值得挪动的 dictEntry、key、value 以及 value 内部的内存挪到利用率更高的页中, 一轮遍历完再重新检查碎片率.
+ * 每次最多花费 serverCron 周期的 active_defrag_cycle_min% ~ active_defrag_cycle_max%, 碎片越多花的时间越多.
+ * BGSAVE 期间不整理, 挪动内存会导致大量写时复制
+ */
+static void activeDefragCycle(void) {
+    if (!server.active_defrag_enabled || hasActiveChildProcess()) {
+        return;
+    }
+    size_t allocated, active, resident;
+    if (!zmalloc_get_allocator_info(&allocated, &active, &resident) || allocated == 0 || active < allocated) {
+        return;
+    }
+    size_t frag_bytes = active - allocated;
+    int frag_pct = (int) (frag_bytes * 100 / allocated);
+    if (!server.active_defrag_running) {
+        if (frag_pct < server.active_defrag_threshold_lower || frag_bytes < server.active_defrag_ignore_bytes) {
+            return;
+        }
+        redisLog(REDIS_NOTICE, "Starting active defrag, frag=%d%%, frag_bytes=%zu", frag_pct, frag_bytes);
+        server.active_defrag_running = true;
+        defragDbId = 0;
+        defragExpires = false;
+        defragCursor = 0;
+        defragStartTime = mstime();
+        if (defragLaterKeys == NULL && (defragLaterKeys = listCreate()) == NULL) {
+            oom("listCreate");
+        }
+        // 上一轮中途被关掉时可能还有没整理完的
+        while (listLength(defragLaterKeys) > 0) {
+            sdsfree(listNodeValue(listFirst(defragLaterKeys)));
+            listDelNode(defragLaterKeys, listFirst(defragLaterKeys));
+        }
+        defragLaterCursor = 0;
+    }
+
+    int cycle = server.active_defrag_cycle_max;
+    int lower = server.active_defrag_threshold_lower, upper = server.active_defrag_threshold_upper;
+    if (frag_pct < upper && upper > lower) {
+        cycle = server.active_defrag_cycle_min +
+                (server.active_defrag_cycle_max - server.active_defrag_cycle_min) * (frag_pct - lower) / (upper - lower);
+    }
+    if (cycle < server.active_defrag_cycle_min) {
+        cycle = server.active_defrag_cycle_min;
+    }
+    // serverCron 的周期是 1 秒
+    long long timelimit = cycle * 1000 / 100;
+    long long start = mstime();
+    defragSteps = 0;
+    while (defragDbId < server.dbnum) {
+        dict *d = defragExpires ? server.expires[defragDbId] : server.dict[defragDbId];
+        dictDefragEntryFunction *entryfn = defragExpires ? NULL : activeDefragKeyEntry;
+        do {
+            // 先整理完上一个 bucket 中的大 value; 主 dict 最后一个 bucket 中的, 在遍历 expires 之前整理
+            if (!activeDefragLater(start, timelimit)) {
+                return;
+            }
+            defragSteps++;
+            defragCursor = dictDefragScan(d, defragCursor, activeDefragAlloc, entryfn, (void *) (long) defragDbId);
+            if (defragCursor != 0 && activeDefragTimedOut(start, timelimit)) {
+                return;
+            }
+        } while (defragCursor != 0);
+        if (!defragExpires) {
+            defragExpires = true;
+        } else {
+            defragExpires = false;
+            defragDbId++;
+        }
+    }
+
+    server.active_defrag_running = false;
+    zmalloc_release_free_memory();
+    redisLog(REDIS_NOTICE, "Active defrag done in %lld ms, hits=%lld, misses=%lld",
+             mstime() - defragStartTime, server.stat_active_defrag_hits, server.stat_active_defrag_misses);
+}
+
+/* =========================== Memory introspection ========================== */
+
+/** MEMORY USAGE 默认对集合类型采样的元素个数 */
+#define REDIS_MEMORY_USAGE_SAMPLES 5
+
+static size_t sdsZmallocSize(sds s) {
+    return zmalloc_size(s - sdsHdrSize(s[-1]));
+}
+
+/**
+ * 字符串对象占用的内存, 共享对象不属于任何人, 不算
+ */
+static size_t stringObjectMemoryUsage(robj *o) {
+    if (o->refcount == REDIS_SHARED_REFCOUNT) {
+        return 0;
+    }
+    size_t bytes = zmalloc_size(o);
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        bytes += sdsZmallocSize(o->ptr);
+    }
+    return bytes;
+}
+
+/**
+ * dict 本身的开销: dict 结构, bucket 数组和所有的 dictEntry, 不包括 key 和 value
+ */
+static size_t dictMemoryOverhead(dict *d) {
+    return zmalloc_size(d) + dictGetHashTableSize(d) * sizeof(dictEntry *) +
+           dictGetHashTableUsed(d) * sizeof(dictEntry);
+}
+
+/**
+ * dict 中 key 和 value 对象占用的内存. samples 不为 0 时只看前 samples 个 entry, 按平均值估算整个 dict
+ */
+static size_t dictObjectsMemoryUsage(dict *d, size_t samples, bool withval) {
+    size_t bytes = 0, seen = 0;
+    dictIterator *it = dictGetIterator(d);
+    if (it == NULL) {
+        oom("dictGetIterator");
+    }
+    dictEntry *de;
+    while ((de = dictNext(it)) != NULL && (samples == 0 || seen < samples)) {
+        bytes += stringObjectMemoryUsage(dictGetEntryKey(de));
+        if (withval) {
+            bytes += stringObjectMemoryUsage(dictGetEntryVal(de));
+        }
+        seen++;
+    }
+    dictReleaseIterator(it);
+    return seen == 0 ? 0 : bytes * dictGetHashTableUsed(d) / seen;
+}
+
+/**
+ * 估算 value 占用的内存, 集合类型按 samples 个元素的平均大小估算, samples 为 0 时精确计算
+ */
+static size_t objectMemoryUsage(robj *o, size_t samples) {
+    if (o->type == REDIS_STRING) {
+        return stringObjectMemoryUsage(o);
+    }
+
+    size_t bytes = zmalloc_size(o);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST || o->encoding == REDIS_ENCODING_INTSET) {
+        bytes += zmalloc_size(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklist *ql = o->ptr;
+        size_t nodes = 0, nodebytes = 0;
+        for (quicklistNode *node = ql->head; node != NULL && (samples == 0 || nodes < samples); node = node->next) {
+            nodebytes += zmalloc_size(node) + zmalloc_size(node->zl);
+            nodes++;
+        }
+        bytes += zmalloc_size(ql);
+        if (nodes > 0) {
+            bytes += nodebytes * ql->len / nodes;
+        }
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        dict *d = o->ptr;
+        bytes += dictMemoryOverhead(d) + dictObjectsMemoryUsage(d, samples, o->type == REDIS_HASH);
+    } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+        // 跳表节点和 dict 共享 member 对象, 只算一次
+        zset *zs = o->ptr;
+        zskiplist *zsl = zs->zsl;
+        size_t nodes = 0, nodebytes = 0;
+        for (zskiplistNode *node = zsl->header->level[0].forward;
+             node != NULL && (samples == 0 || nodes < samples); node = node->level[0].forward) {
+            nodebytes += zmalloc_size(node) + stringObjectMemoryUsage(node->obj);
+            nodes++;
+        }
+        bytes += zmalloc_size(zs) + dictMemoryOverhead(zs->dict) + zmalloc_size(zsl) + zmalloc_size(zsl->header);
+        if (nodes > 0) {
+            bytes += nodebytes * zsl->length / nodes;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * client 占用的内存: client 结构(包括固定的输出缓冲区), querybuf 和 reply 链表
+ */
+static size_t clientMemoryUsage(redisClient *c) {
+    size_t bytes = zmalloc_size(c) + sdsZmallocSize(c->querybuf);
+    listIter *it = listGetIterator(c->reply, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    listNode *node;
+    while ((node = listNextElement(it)) != NULL) {
+        bytes += zmalloc_size(node) + stringObjectMemoryUsage(listNodeValue(node));
+    }
+    listReleaseIterator(it);
+    return bytes + zmalloc_size(c->reply);
+}
+
+/**
+ * MEMORY USAGE <key> [SAMPLES <count>]
+ * key 占用的字节数: dictEntry, key 和 value 对象, 以及过期时间的 dictEntry. SAMPLES 0 表示遍历所有元素
+ */
+static void memoryUsageCommand(redisClient *c) {
+    long long samples = REDIS_MEMORY_USAGE_SAMPLES;
+    if (c->argc == 5 && !strcasecmp(c->argv[3]->ptr, "samples")) {
+        char *eptr;
+        samples = strtoll(c->argv[4]->ptr, &eptr, 10);
+        if (*eptr != '\0' || samples < 0) {
+            addReplySds(c, sdsnew("-ERR samples must be a non-negative integer\r\n"));
+            return;
+        }
+    } else if (c->argc != 3) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
+    dictEntry *de = dictFind(c->dict, c->argv[2]);
+    if (de == NULL || keyIsExpired(c->dictid, c->argv[2])) {
+        addReply(c, shared.nil);
+        return;
+    }
+    size_t bytes = sizeof(dictEntry) + stringObjectMemoryUsage(dictGetEntryKey(de)) +
+                   objectMemoryUsage(dictGetEntryVal(de), samples);
+    if (getExpire(c->dictid, c->argv[2]) != -1) {
+        bytes += sizeof(dictEntry);
+    }
+    addReplyLongLong(c, bytes);
+}
+
+/**
+ * MEMORY STATS
+ * 和 INFO 一样是 key:value 的文本, 把 used_memory 拆开: db 的 hashtable, client 的缓冲区,
+ * slave 的输出缓冲区, 空闲对象池, 剩下的是数据本身
+ */
+static void memoryStatsCommand(redisClient *c) {
+    size_t used = zmalloc_used_memory();
+    size_t overhead = 0;
+    sds info = sdscatprintf(sdsempty(), "total.allocated:%zu\r\n", used);
+
+    for (int j = 0; j < server.dbnum; j++) {
+        dict *d = server.dict[j];
+        dict *expires = server.expires[j];
+        if (dictGetHashTableUsed(d) == 0 && dictGetHashTableUsed(expires) == 0) {
+            continue;
+        }
+        size_t mainht = dictMemoryOverhead(d), expiresht = dictMemoryOverhead(expires);
+        info = sdscatprintf(info,
+            "db.%d.keys:%u\r\n"
+            "db.%d.buckets.main:%u\r\n"
+            "db.%d.buckets.expires:%u\r\n"
+            "db.%d.overhead.hashtable.main:%zu\r\n"
+            "db.%d.overhead.hashtable.expires:%zu\r\n",
+            j, dictGetHashTableUsed(d), j, dictGetHashTableSize(d), j, dictGetHashTableSize(expires),
+            j, mainht, j, expiresht);
+        overhead += mainht + expiresht;
+    }
+
+    size_t normal = 0, slaves = 0;
+    listIter *it = listGetIterator(server.clients, AL_START_HEAD);
+    if (it == NULL) {
+        oom("listGetIterator");
+    }
+    listNode *node;
+    while ((node = listNextElement(it)) != NULL) {
+        redisClient *cl = listNodeValue(node);
+        if (isSlave(cl->flags)) {
+            slaves += clientMemoryUsage(cl);
+        } else {
+            normal += clientMemoryUsage(cl);
         }
-        j++;
     }
+    listReleaseIterator(it);
+    size_t objfreelist = server.objfreelist != NULL ? server.objfreelist_len * zmalloc_size(server.objfreelist) : 0;
+    overhead += normal + slaves + objfreelist;
+
+    size_t dataset = used > overhead ? used - overhead : 0;
+    size_t allocated = 0, active = 0, resident = 0;
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    info = sdscatprintf(info,
+        "clients.normal:%zu\r\n"
+        "clients.slaves:%zu\r\n"
+        "objfreelist:%zu\r\n"
+        "lazyfree.pending_objects:%zu\r\n"
+        "overhead.total:%zu\r\n"
+        "dataset.bytes:%zu\r\n"
+        "dataset.percentage:%.2f\r\n"
+        "allocator.allocated:%zu\r\n"
+        "allocator.active:%zu\r\n"
+        "allocator.resident:%zu\r\n"
+        "rss:%zu\r\n",
+        normal,
+        slaves,
+        objfreelist,
+        __atomic_load_n(&lazyfreePendingObjects, __ATOMIC_RELAXED),
+        overhead,
+        dataset,
+        used ? (double) dataset * 100 / used : 0,
+        allocated,
+        active,
+        resident,
+        zmalloc_get_rss());
+    addReplyLongLong(c, sdslen(info));
+    addReplySds(c, info);
+}
 
-    /* Load the sorting vector with all the objects to sort */
-    vectorlen = (sortval->type == REDIS_LIST) ?
-        listLength((list*)sortval->ptr) :
-        dictGetHashTableUsed((dict*)sortval->ptr);
-    vector = zmalloc(sizeof(redisSortObject)*vectorlen);
-    if (!vector) oom("allocating objects vector for SORT");
-    j = 0;
-    if (sortval->type == REDIS_LIST) {
-        list *list = sortval->ptr;
-        listNode *ln = list->head;
-        while(ln) {
-            robj *ele = ln->value;
-            vector[j].obj = ele;
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            ln = ln->next;
-            j++;
-        }
+static void memoryCommand(redisClient *c) {
+    if (!strcasecmp(c->argv[1]->ptr, "usage") && c->argc >= 3) {
+        memoryUsageCommand(c);
+    } else if (!strcasecmp(c->argv[1]->ptr, "stats") && c->argc == 2) {
+        memoryStatsCommand(c);
     } else {
-        dict *set = sortval->ptr;
-        dictIterator *di;
-        dictEntry *setele;
-
-        di = dictGetIterator(set);
-        if (!di) oom("dictGetIterator");
-        while((setele = dictNext(di)) != NULL) {
-            vector[j].obj = dictGetEntryKey(setele);
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
-        }
-        dictReleaseIterator(di);
+        addReplySds(c, sdsnew("-ERR syntax error, try MEMORY USAGE <key> [SAMPLES <count>] or MEMORY STATS\r\n"));
     }
-    assert(j == vectorlen);
+}
 
-    /* Now it's time to load the right scores in the sorting vector */
-    if (dontsort == 0) {
-        for (j = 0; j < vectorlen; j++) {
-            if (sortby) {
-                robj *byval;
+/* =========================== Maxmemory ========================== */
 
-                byval = lookupKeyByPattern(c->dict,sortby,vector[j].obj);
-                if (!byval || byval->type != REDIS_STRING) continue;
-                if (alpha) {
-                    vector[j].u.cmpobj = byval;
-                    incrRefCount(byval);
-                } else {
-                    vector[j].u.score = strtod(byval->ptr,NULL);
-                }
-            } else {
-                if (!alpha) vector[j].u.score = strtod(vector[j].obj->ptr,NULL);
-            }
+/**
+ * 淘汰候选池, 按 idle 从小到大排列, 越靠后越应该被淘汰.
+ * 每次只随机采样 maxmemory_samples 个 key, 和池中已有的候选比较, 用很小的代价近似全局 LRU/LFU,
+ * 不需要维护一个覆盖所有 key 的链表
+ */
+typedef struct evictionPoolEntry {
+    unsigned long long idle; // LRU: 空闲的毫秒数; LFU: 255 - 访问频率
+    sds key;                 // NULL 表示空位
+    int dbid;
+} evictionPoolEntry;
+
+static evictionPoolEntry EvictionPool[REDIS_EVPOOL_SIZE];
+
+static char *maxmemoryPolicyNames[] = {"noeviction", "allkeys-lru", "allkeys-lfu", "allkeys-random"};
+
+/**
+ * 从 d 中采样, 把比池中候选更该被淘汰的 key 放进池中
+ */
+static void evictionPoolPopulate(int dbid, dict *d) {
+    evictionPoolEntry *pool = EvictionPool;
+    for (int k = 0; k < server.maxmemory_samples; k++) {
+        dictEntry *de = dictGetRandomKey(d);
+        if (de == NULL) {
+            return;
         }
-    }
+        robj *key = dictGetEntryKey(de);
+        robj *val = dictGetEntryVal(de);
+        unsigned long long idle = maxmemoryPolicyIsLFU() ? 255 - LFUDecrAndReturn(val) : estimateObjectIdleTime(val);
 
-    /* We are ready to sort the vector... perform a bit of sanity check
-     * on the LIMIT option too. We'll use a partial version of quicksort. */
-    start = (limit_start < 0) ? 0 : limit_start;
-    end = (limit_count < 0) ? vectorlen-1 : start+limit_count-1;
-    if (start >= vectorlen) {
-        start = vectorlen-1;
-        end = vectorlen-2;
+        int i = 0;
+        while (i < REDIS_EVPOOL_SIZE && pool[i].key != NULL && pool[i].idle < idle) {
+            i++;
+        }
+        if (i == 0 && pool[REDIS_EVPOOL_SIZE - 1].key != NULL) {
+            // 池满了, 而且比池中所有的候选都新
+            continue;
+        } else if (i < REDIS_EVPOOL_SIZE && pool[i].key == NULL) {
+            // 空位, 直接放
+        } else if (pool[REDIS_EVPOOL_SIZE - 1].key == NULL) {
+            // 还有空位, 后面的往右挪一格
+            memmove(pool + i + 1, pool + i, sizeof(pool[0]) * (REDIS_EVPOOL_SIZE - i - 1));
+        } else {
+            // 池满了, 丢掉最不该被淘汰的 pool[0], 前面的往左挪一格
+            i--;
+            sdsfree(pool[0].key);
+            memmove(pool, pool + 1, sizeof(pool[0]) * i);
+        }
+        pool[i].key = sdsdup(key->ptr);
+        pool[i].idle = idle;
+        pool[i].dbid = dbid;
     }
-    if (end >= vectorlen) end = vectorlen-1;
+}
 
-    if (dontsort == 0) {
-        server.sort_desc = desc;
-        server.sort_alpha = alpha;
-        server.sort_bypattern = sortby ? 1 : 0;
-        qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
+/**
+ * 按 maxmemory_policy 选出一个要淘汰的 key
+ * @return 调用方负责释放, NULL 表示没有可以淘汰的 key
+ */
+static sds evictionSelectKey(int *dbid) {
+    if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM) {
+        static int nextdb = 0;
+        for (int j = 0; j < server.dbnum; j++) {
+            int id = (nextdb++) % server.dbnum;
+            dictEntry *de = dictGetRandomKey(server.dict[id]);
+            if (de != NULL) {
+                robj *key = dictGetEntryKey(de);
+                *dbid = id;
+                return sdsdup(key->ptr);
+            }
+        }
+        return NULL;
     }
 
-    /* Send command output to the output buffer, performing the specified
-     * GET/DEL/INCR/DECR operations if any. */
-    outputlen = getop ? getop*(end-start+1) : end-start+1;
-    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",outputlen));
-    for (j = start; j <= end; j++) {
-        listNode *ln = operations->head;
-        if (!getop) {
-            addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",
-                sdslen(vector[j].obj->ptr)));
-            addReply(c,vector[j].obj);
-            addReply(c,shared.crlf);
+    for (;;) {
+        unsigned long total = 0;
+        for (int j = 0; j < server.dbnum; j++) {
+            dict *d = server.dict[j];
+            if (dictGetHashTableUsed(d) > 0) {
+                evictionPoolPopulate(j, d);
+                total += dictGetHashTableUsed(d);
+            }
+        }
+        if (total == 0) {
+            return NULL;
         }
-        while(ln) {
-            redisSortOperation *sop = ln->value;
-            robj *val = lookupKeyByPattern(c->dict,sop->pattern,
-                vector[j].obj);
 
-            if (sop->type == REDIS_SORT_GET) {
-                if (!val || val->type != REDIS_STRING) {
-                    addReply(c,shared.minus1);
-                } else {
-                    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",
-                        sdslen(val->ptr)));
-                    addReply(c,val);
-                    addReply(c,shared.crlf);
-                }
-            } else if (sop->type == REDIS_SORT_DEL) {
-                /* TODO */
+        // 从最该被淘汰的开始, 池中的 key 可能已经被删除了
+        for (int k = REDIS_EVPOOL_SIZE - 1; k >= 0; k--) {
+            evictionPoolEntry *e = &EvictionPool[k];
+            if (e->key == NULL) {
+                continue;
             }
-            ln = ln->next;
+            sds key = e->key;
+            e->key = NULL;
+            robj keyobj = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = key};
+            if (dictFind(server.dict[e->dbid], &keyobj) != NULL) {
+                *dbid = e->dbid;
+                return key;
+            }
+            sdsfree(key);
         }
     }
+}
 
-    /* Cleanup */
-    decrRefCount(sortval);
-    listRelease(operations);
-    for (j = 0; j < vectorlen; j++) {
-        if (sortby && alpha && vector[j].u.cmpobj)
-            decrRefCount(vector[j].u.cmpobj);
+/**
+ * 不算在 maxmemory 中的内存: AOF 缓冲区和 rewrite 缓冲区. 淘汰 key 时 propagateDel 会让它们变大,
+ * 算进去的话淘汰得比需要的多, 算出来的释放量甚至会是负数
+ */
+static size_t freeMemoryGetNotCountedMemory(void) {
+    size_t overhead = sdsZmallocSize(server.aofbuf);
+    // 所有的块和 listNode 大小都相同, 不需要遍历
+    listNode *first = listFirst(server.aof_rewrite_buf_blocks);
+    if (first != NULL) {
+        overhead += listLength(server.aof_rewrite_buf_blocks) * (zmalloc_size(first) + zmalloc_size(listNodeValue(first)));
+    }
+    return overhead;
+}
+
+static size_t freeMemoryGetUsedMemory(void) {
+    size_t used = zmalloc_used_memory(), overhead = freeMemoryGetNotCountedMemory();
+    return used > overhead ? used - overhead : 0;
+}
+
+/**
+ * 内存超过 maxmemory 时按策略淘汰 key, 直到回到 maxmemory 以下
+ * @return REDIS_ERR 策略是 noeviction, 或者已经没有 key 可以淘汰了
+ */
+static int freeMemoryIfNeeded(void) {
+    size_t used = freeMemoryGetUsedMemory();
+    if (used <= server.maxmemory) {
+        return REDIS_OK;
     }
-    zfree(vector);
+    if (server.maxmemory_policy == REDIS_MAXMEMORY_NO_EVICTION) {
+        return REDIS_ERR;
+    }
+
+    long long tofree = used - server.maxmemory;
+    long long freed = 0;
+    while (freed < tofree) {
+        int dbid;
+        sds key = evictionSelectKey(&dbid);
+        if (key == NULL) {
+            return REDIS_ERR;
+        }
+        robj keyobj = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = key};
+        long long delta = freeMemoryGetUsedMemory();
+        propagateDel(dbid, &keyobj);
+        deleteKey(dbid, &keyobj);
+        delta -= (long long) freeMemoryGetUsedMemory();
+        sdsfree(key);
+        freed += delta;
+        server.stat_evictedkeys++;
+        server.dirty++;
+    }
+    return REDIS_OK;
 }
 
 static void infoCommand(redisClient *c) {
     sds info;
     time_t uptime = time(NULL)-server.stat_starttime;
+    size_t rss = zmalloc_get_rss();
+    size_t allocated = 0, active = 0, resident = 0;
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
     
     info = sdscatprintf(sdsempty(),
         "redis_version:%s\r\n"
         "connected_clients:%d\r\n"
         "connected_slaves:%d\r\n"
-        "used_memory:%d\r\n"
+        "used_memory:%zu\r\n"
+        "used_memory_rss:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "mem_allocator:%s\r\n"
+        "allocator_allocated:%zu\r\n"
+        "allocator_active:%zu\r\n"
+        "allocator_resident:%zu\r\n"
+        "allocator_frag_ratio:%.2f\r\n"
+        "maxmemory:%zu\r\n"
+        "maxmemory_policy:%s\r\n"
+        "evicted_keys:%lld\r\n"
+        "expired_keys:%lld\r\n"
+        "lazyfree_pending_objects:%zu\r\n"
+        "lazyfreed_objects:%zu\r\n"
+        "objfreelist_objects:%lu\r\n"
+        "bgsave_in_progress:%d\r\n"
+        "rdb_last_cow_size:%zu\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_current_size:%lld\r\n"
+        "aof_buffer_length:%zu\r\n"
+        "aof_pending_bio_fsync:%llu\r\n"
+        "aof_delayed_fsync:%lld\r\n"
+        "aof_base_size:%lld\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_rewrite_scheduled:%d\r\n"
+        "aof_rewrite_buffer_length:%zu\r\n"
+        "aof_last_rewrite_time_ms:%lld\r\n"
+        "aof_last_bgrewrite_status:%s\r\n"
+        "aof_rewrite_consecutive_failures:%d\r\n"
+        "active_defrag_running:%d\r\n"
+        "active_defrag_hits:%lld\r\n"
+        "active_defrag_misses:%lld\r\n"
         "changes_since_last_save:%lld\r\n"
         "last_save_time:%d\r\n"
         "total_connections_received:%lld\r\n"
@@ -2496,6 +7807,37 @@ static void infoCommand(redisClient *c) {
         listLength(server.clients)-listLength(server.slaves),
         listLength(server.slaves),
         server.usedmemory,
+        rss,
+        server.usedmemory ? (double) rss / server.usedmemory : 0,
+        ZMALLOC_LIB,
+        allocated,
+        active,
+        resident,
+        allocated ? (double) active / allocated : 0,
+        server.maxmemory,
+        maxmemoryPolicyNames[server.maxmemory_policy],
+        server.stat_evictedkeys,
+        server.stat_expiredkeys,
+        __atomic_load_n(&lazyfreePendingObjects, __ATOMIC_RELAXED),
+        __atomic_load_n(&lazyfreedObjects, __ATOMIC_RELAXED),
+        server.objfreelist_len,
+        server.bgsaveinprogress,
+        server.stat_rdb_cow_bytes,
+        server.appendonly,
+        (long long) server.aof_current_size,
+        sdslen(server.aofbuf),
+        bioPendingJobsOfType(BIO_AOF_FSYNC),
+        server.stat_aof_delayed_fsync,
+        (long long) server.aof_rewrite_base_size,
+        server.aof_child_pid != -1,
+        server.aof_rewrite_scheduled,
+        aofRewriteBufferSize(),
+        server.aof_rewrite_time_last,
+        server.aof_lastbgrewrite_status == REDIS_OK ? "ok" : "err",
+        server.aof_rewrite_failures,
+        server.active_defrag_running,
+        server.stat_active_defrag_hits,
+        server.stat_active_defrag_misses,
         server.dirty,
         server.lastsave,
         server.stat_numconnections,
@@ -2503,7 +7845,7 @@ static void infoCommand(redisClient *c) {
         uptime,
         uptime/(3600*24)
     );
-    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",sdslen(info)));
+    addReplyLongLong(c,sdslen(info));
     addReplySds(c,info);
 }
 
@@ -2528,6 +7870,7 @@ static void freeClient(redisClient *c) {
     aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
     sdsfree(c->querybuf);
     freeClientArgv(c);
+    listRelease(c->reply);
     close(c->fd);
 
     listNode *node = listSearchKey(server.clients, c);
@@ -2558,14 +7901,37 @@ static int processCommand(redisClient *c) {
     }
     
     struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
-    if (c == NULL) {
+    if (cmd == NULL) {
         addReplySds(c, sdsnew("-RR unknow command\r\n"));
         resetClient(c);
         return 1;
     } else if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity)) {
-        addReply(c, sdsnew("-ERR wrong number of arguments\r\n"));
+        addReplySds(c, sdsnew("-ERR wrong number of arguments\r\n"));
+        resetClient(c);
+        return 1;
+    }
+
+    // 在执行命令之前先腾出内存, 腾不出来就拒绝可能增加内存的命令, 只读的命令和 DEL 之类的照常执行
+    if (server.maxmemory) {
+        int ret = freeMemoryIfNeeded();
+        if ((cmd->flags & REDIS_CMD_DENYOOM) && ret == REDIS_ERR) {
+            addReplySds(c, sdsnew("-ERR command not allowed when used memory > 'maxmemory'\r\n"));
+            resetClient(c);
+            return 1;
+        }
     }
 
+    // 修改了数据的命令才需要写入 AOF 和发给 slave
+    long long dirty = server.dirty;
+    cmd->proc(c);
+    if (server.appendonly && server.dirty > dirty) {
+        feedAppendOnlyFile(cmd, c->dictid, c->argv, c->argc);
+    }
+    if (listLength(server.slaves) > 0 && server.dirty > dirty) {
+        replicationFeedSlaves(cmd, c->dictid, c->argv, c->argc);
+    }
+    resetClient(c);
+    return 1;
 }
 
 static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -2589,6 +7955,9 @@ static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mas
     }
     if (nread > 0) {
         c->querybuf = sdscatlen(c->querybuf, buf, nread);
+        if (sdslen(c->querybuf) > c->querybuf_peak) {
+            c->querybuf_peak = sdslen(c->querybuf);
+        }
         c->lastinteraction = time(NULL);
     } else {
         return;
@@ -2610,64 +7979,312 @@ static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mas
         }
 }
 
-static int selectDb(redisClient *c, int id) {
-    if (id < 0 || id >= server.dbnum) {
-        return REDIS_ERR;
+static int selectDb(redisClient *c, int id) {
+    if (id < 0 || id >= server.dbnum) {
+        return REDIS_ERR;
+    }
+    c->dict = server.dict[id];
+    c->dictid = id;
+    return REDIS_OK;
+}
+
+/**
+ * 创建 client, 并且会注册 readQueryFromClient 的 file event
+ */
+static redisClient *createClient(int fd) {
+    redisClient *c = zmalloc(sizeof(*c));
+    if (c == NULL) {
+        return NULL;
+    }
+    anetNonBlock(NULL, fd);
+    anetTcpNoDelay(NULL, fd);
+    selectDb(c, 0);
+    c->fd = fd;
+    c->querybuf = sdsempty();
+    c->querybuf_peak = 0;
+    c->argc = 0;
+    c->bulklen = -1;
+    c->sentlen = 0;
+    c->bufpos = 0;
+    c->flags = 0;
+    c->lastinteraction = time(NULL);
+    if ((c->reply = listCreate()) == NULL) {
+        oom("listCreate");
+    }
+    listSetFreeMethod(c->reply, decrRefCount);
+    if (aeCreateFileEvent(server.el, c->fd, AE_READABLE, readQueryFromClient, c, NULL) == AE_ERR) {
+        freeClient(c);
+        return NULL;
+    }
+    if (!listAddNodeTail(server.clients, c)) {
+        oom("listAddNodeTail");
+    }
+    return c;
+}
+
+/**
+ * 把 buf 和 reply list 中的数据写到 client, 先写 buf 再写 list.
+ * 全部写完后删除 AE_WRITABLE 事件
+ */
+static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    REDIS_NOTUSED(el); REDIS_NOTUSED(mask);
+
+    redisClient *c = privdata;
+    int nwritten = 0, totwritten = 0;
+    while (c->bufpos > 0 || listLength(c->reply) > 0) {
+        if (c->bufpos > 0) {
+            nwritten = write(fd, c->buf + c->sentlen, c->bufpos - c->sentlen);
+            if (nwritten <= 0) {
+                break;
+            }
+            c->sentlen += nwritten;
+            totwritten += nwritten;
+            if (c->sentlen == c->bufpos) {
+                c->bufpos = 0;
+                c->sentlen = 0;
+            }
+        } else {
+            robj *o = listNodeValue(listFirst(c->reply));
+            int objlen = sdslen(o->ptr);
+            if (objlen == 0) {
+                listDelNode(c->reply, listFirst(c->reply));
+                continue;
+            }
+            nwritten = write(fd, ((char *) o->ptr) + c->sentlen, objlen - c->sentlen);
+            if (nwritten <= 0) {
+                break;
+            }
+            c->sentlen += nwritten;
+            totwritten += nwritten;
+            if (c->sentlen == objlen) {
+                listDelNode(c->reply, listFirst(c->reply));
+                c->sentlen = 0;
+            }
+        }
+    }
+
+    if (nwritten == -1) {
+        if (errno != EAGAIN) {
+            redisLog(REDIS_DEBUG, "Error writing to client: %s", strerror(errno));
+            freeClient(c);
+            return;
+        }
+    }
+    if (totwritten > 0) {
+        c->lastinteraction = time(NULL);
+    }
+    if (c->bufpos == 0 && listLength(c->reply) == 0) {
+        c->sentlen = 0;
+        aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+    }
+}
+
+/**
+ * 第一次有数据要发送的时候注册 AE_WRITABLE 事件. 加载 AOF 时使用的 client 没有连接, 不需要回复
+ */
+static int prepareClientToWrite(redisClient *c) {
+    // AOF 加载用的假 client 没有连接; master 发来的是复制流, 回复会被 master 当成命令
+    if (c->fd == -1 || (c->flags & REDIS_MASTER)) {
+        return REDIS_ERR;
+    }
+    if (c->bufpos == 0 && listLength(c->reply) == 0 &&
+        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient, c, NULL) == AE_ERR) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 拷贝到 client 的固定输出缓冲区，放不下或者 reply list 不为空时返回 REDIS_ERR
+ */
+static int _addReplyToBuffer(redisClient *c, const char *s, size_t len) {
+    size_t available = sizeof(c->buf) - c->bufpos;
+    if (listLength(c->reply) > 0 || len > available) {
+        return REDIS_ERR;
+    }
+    memcpy(c->buf + c->bufpos, s, len);
+    c->bufpos += len;
+    return REDIS_OK;
+}
+
+/**
+ * list 最后一个对象如果是独占的 raw sds, 并且还没有超过 REDIS_REPLY_CHUNK_BYTES, 就把数据拼接到它后面
+ */
+static robj *replyListGlueTarget(redisClient *c, size_t len) {
+    if (listLength(c->reply) == 0) {
+        return NULL;
+    }
+    robj *tail = listNodeValue(listLast(c->reply));
+    if (tail->ptr != NULL && tail->refcount == 1 && tail->encoding == REDIS_ENCODING_RAW &&
+        sdslen(tail->ptr) + len <= REDIS_REPLY_CHUNK_BYTES) {
+        return tail;
+    }
+    return NULL;
+}
+
+static void _addReplyStringToList(redisClient *c, const char *s, size_t len) {
+    robj *tail = replyListGlueTarget(c, len);
+    if (tail != NULL) {
+        tail->ptr = sdscatlen(tail->ptr, (void *) s, len);
+        return;
+    }
+    // 新建的 chunk 使用 raw 编码，后面的小回复还可以继续拼接上来
+    robj *o = createRawStringObject((char *) s, len);
+    if (listAddNodeTail(c->reply, o) == NULL) {
+        oom("listAddNodeTail");
+    }
+}
+
+/**
+ * 共享对象按引用放进 list; byref 为 true 时(见 addReplyByRef), 放不进一个 chunk 的大对象也按引用放进 list;
+ * 其他对象都拷贝一份.
+ * 引用 db 中的对象要修改它的 refcount, BGSAVE 时会让整页被复制; 而且 db 中的对象(包括集合的成员)
+ * 可能交给后台线程释放, 和主线程同时修改 refcount. 在追加时拷贝, 每个回复只付出一次代价
+ */
+static void _addReplyObjectToList(redisClient *c, robj *obj, bool byref) {
+    if (obj->refcount != REDIS_SHARED_REFCOUNT && (!byref || sdslen(obj->ptr) <= REDIS_REPLY_CHUNK_BYTES)) {
+        _addReplyStringToList(c, obj->ptr, sdslen(obj->ptr));
+        return;
+    }
+    robj *tail = replyListGlueTarget(c, sdslen(obj->ptr));
+    if (tail != NULL) {
+        tail->ptr = sdscatlen(tail->ptr, obj->ptr, sdslen(obj->ptr));
+        return;
+    }
+    if (listAddNodeTail(c->reply, obj) == NULL) {
+        oom("listAddNodeTail");
+    }
+    incrRefCount(obj);
+}
+
+static void addReply(redisClient *c, robj *obj) {
+    if (prepareClientToWrite(c) != REDIS_OK) {
+        return;
+    }
+
+    // ptr 为 NULL 的是先占位、稍后才填内容的长度对象(见 keysCommand), 只能按引用放进 list
+    if (obj->ptr == NULL) {
+        if (listAddNodeTail(c->reply, obj) == NULL) {
+            oom("listAddNodeTail");
+        }
+        incrRefCount(obj);
+        return;
+    }
+
+    if (sdsEncodedObject(obj)) {
+        if (_addReplyToBuffer(c, obj->ptr, sdslen(obj->ptr)) != REDIS_OK) {
+            _addReplyObjectToList(c, obj, false);
+        }
+    } else {
+        // 整数编码的对象直接格式化到栈上，再拷贝到输出缓冲区
+        char buf[32];
+        int len = ll2string(buf, sizeof(buf), (long) obj->ptr);
+        if (_addReplyToBuffer(c, buf, len) != REDIS_OK) {
+            _addReplyStringToList(c, buf, len);
+        }
+    }
+}
+
+/**
+ * 同 addReply, 但是大对象按引用放进 reply 链表, 不拷贝, 多个 client 可以共享同一份内存.
+ * 只能用于不属于 keyspace 的 sds 编码对象(例如 replicationFeedSlaves 为所有 slave 生成的命令),
+ * 这样的对象不会交给后台线程释放, refcount 只在主线程中修改
+ */
+static void addReplyByRef(redisClient *c, robj *obj) {
+    if (prepareClientToWrite(c) != REDIS_OK) {
+        return;
+    }
+    if (_addReplyToBuffer(c, obj->ptr, sdslen(obj->ptr)) != REDIS_OK) {
+        _addReplyObjectToList(c, obj, true);
     }
-    c->dict = server.dict[id];
-    c->dictid = id;
-    return REDIS_OK;
 }
 
 /**
- * 创建 client, 并且会注册 readQueryFromClient 的 file event
+ * s 的所有权转移给 client
  */
-static redisClient *createClient(int fd) {
-    redisClient *c = zmalloc(sizeof(*c));
-    if (c == NULL) {
-        return NULL;
+static void addReplySds(redisClient *c, sds s) {
+    if (prepareClientToWrite(c) != REDIS_OK) {
+        sdsfree(s);
+        return;
     }
-    anetNonBlock(NULL, fd);
-    anetTcpNoDelay(NULL, fd);
-    selectDb(c, 0);
-    c->fd = fd;
-    c->querybuf = sdsempty();
-    c->argc = 0;
-    c->bulklen = -1;
-    c->sentlen = 0;
-    c->flags = 0;
-    c->lastinteraction = time(NULL);
-    if ((c->reply = listCreate()) == NULL) {
-        oom("listCreate");
+    if (_addReplyToBuffer(c, s, sdslen(s)) == REDIS_OK) {
+        sdsfree(s);
+        return;
     }
-    listSetFreeMethod(c->reply, decrRefCount);
-    if (aeCreateFileEvent(server.el, c->fd, AE_READABLE, readQueryFromClient, c, NULL) == AE_ERR) {
-        freeClient(c);
-        return NULL;
+    robj *tail = replyListGlueTarget(c, sdslen(s));
+    if (tail != NULL) {
+        tail->ptr = sdscatlen(tail->ptr, s, sdslen(s));
+        sdsfree(s);
+        return;
     }
-    if (!listAddNodeTail(server.clients, c)) {
+    // s 本身就可以作为一个 chunk, 不需要拷贝
+    robj *o = createObject(REDIS_STRING, s);
+    if (listAddNodeTail(c->reply, o) == NULL) {
         oom("listAddNodeTail");
     }
-    return c;
 }
 
-static void addReply(redisClient *c, robj *obj) {
-    if (listLength(c->reply) == 0 && aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient, c, NULL) == AE_ERR) {
+/**
+ * 拷贝 s 到输出缓冲区
+ */
+static void addReplyString(redisClient *c, const char *s, size_t len) {
+    if (prepareClientToWrite(c) != REDIS_OK) {
         return;
     }
+    if (_addReplyToBuffer(c, s, len) != REDIS_OK) {
+        _addReplyStringToList(c, s, len);
+    }
+}
 
-    if (listAddNodeTail(c->reply, obj) == NULL) {
-        oom("listAddNodeTail");
+/**
+ * 回复 "<ll>\r\n", 整数回复和 bulk 的长度头都是这个格式.
+ * 常用的小数字直接使用共享对象，其余的在栈上格式化，都不需要申请内存
+ */
+static void addReplyLongLong(redisClient *c, long long ll) {
+    if (ll >= 0 && ll < REDIS_SHARED_BULKHDR_LEN) {
+        addReply(c, shared.bulkhdr[ll]);
+        return;
     }
-    incrRefCount(obj);
+    if (prepareClientToWrite(c) != REDIS_OK) {
+        return;
+    }
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf) - 2, ll);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    addReplyString(c, buf, len);
 }
 
-static void addReplySds(redisClient *c, sds s) {
-    robj *o = createObject(REDIS_STRING, s);
-    addReply(c, o);
-    decrRefCount(o);
+/**
+ * bulk 回复的长度头
+ */
+static void addReplyBulkLen(redisClient *c, robj *obj) {
+    addReplyLongLong(c, stringObjectLen(obj));
+}
+
+/**
+ * 完整的 bulk 回复: 长度头, 内容, \r\n
+ */
+static void addReplyBulk(redisClient *c, robj *obj) {
+    addReplyBulkLen(c, obj);
+    addReply(c, obj);
+    addReply(c, shared.crlf);
+}
+
+/**
+ * 内容不在对象中(比如 ziplist 的 entry)时使用, 直接拷贝进输出缓冲区
+ */
+static void addReplyBulkCBuffer(redisClient *c, const void *p, size_t len) {
+    addReplyLongLong(c, len);
+    addReplyString(c, p, len);
+    addReply(c, shared.crlf);
 }
 
+static void addReplyBulkLongLong(redisClient *c, long long ll) {
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), ll);
+    addReplyBulkCBuffer(c, buf, len);
+}
 
 static void closeTimeoutClients() {
     listIter *it = listGetIterator(server.clients, AL_START_HEAD);
@@ -2687,9 +8304,39 @@ static void closeTimeoutClients() {
     listReleaseIterator(it);
 }
 
+/**
+ * 一次大请求之后 querybuf 的容量会一直保留，这里把它还回去:
+ * 1. 容量很大，并且是最近峰值的两倍以上
+ * 2. client 已经空闲了一段时间
+ */
+static void clientsCronResizeQueryBuffer(redisClient *c, time_t now) {
+    size_t querybuf_size = sdsAllocSize(c->querybuf);
+    time_t idletime = now - c->lastinteraction;
+    if ((querybuf_size > REDIS_QUERYBUF_SHRINK_MIN && querybuf_size / (c->querybuf_peak + 1) > 2) ||
+        (querybuf_size > REDIS_QUERYBUF_LEN && idletime > REDIS_QUERYBUF_IDLE_TIME)) {
+        if (sdsavail(c->querybuf) > REDIS_QUERYBUF_LEN) {
+            c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+        }
+    }
+    // 重新开始统计下一个周期的峰值
+    c->querybuf_peak = sdslen(c->querybuf);
+}
+
+static void clientsCron() {
+    time_t now = time(NULL);
+    listNode *node = listFirst(server.clients);
+    while (node != NULL) {
+        clientsCronResizeQueryBuffer(listNodeValue(node), now);
+        node = listNextNode(node);
+    }
+}
 
 static void redisDbResize(int loops) {
     for (int i = 0; i < server.dbnum; i++) {
+        // 缩容同样会改写所有的 entry, 等 BGSAVE/BGREWRITEAOF 结束再做
+        if (hasActiveChildProcess()) {
+            break;
+        }
         int size = dictGetHashTableSize(server.dict[i]);
         int used = dictGetHashTableUsed(server.dict[i]);
         if ((loops%5) == 0 && used > 0) {
@@ -2705,11 +8352,12 @@ static void redisDbResize(int loops) {
 
 /**
  * 1. 更新 usedmemory
- * 2. resize db if needed
+ * 2. resize db if needed, delete expired keys, trim the object free list, defrag
  * 3. log clients number info
  * 4. close timeout clients
- * 5. background save db if needed
- * 6. sync with master if needed
+ * 5. shrink client query buffers
+ * 6. background save db if needed
+ * 7. sync with master if needed
  */
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     REDIS_NOTUSED(eventLoop);
@@ -2718,13 +8366,21 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     // update the global state with the amount of used memory
     server.usedmemory = zmalloc_used_memory();
+    server.lruclock = getLRUClock();
 
     int loops = server.cronloops++;
     redisDbResize(loops);
+    trimObjectFreeList();
+    activeDefragCycle();
+
+    // slave 上的 key 由 master 发来的 DEL 删除
+    if (server.masterhost == NULL) {
+        activeExpireCycle();
+    }
 
     // 打印连接的 clients 数
     if (loops%5 == 0) {
-        redisLog(REDIS_DEBUG, "%d clients connected (%d slaves), %d bytes in use",
+        redisLog(REDIS_DEBUG, "%d clients connected (%d slaves), %zu bytes in use",
         listLength(server.clients) - listLength(server.slaves), listLength(server.slaves), server.usedmemory);
     }
 
@@ -2732,10 +8388,19 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         closeTimeoutClients();
     }
 
+    clientsCron();
+
     if (server.bgsaveinprogress) {
         waitBgsaveFinish();
+    } else if (server.aof_child_pid != -1) {
+        waitRewriteAppendOnlyFileFinish();
     } else {
         bgsaveIfNeed();
+        if (server.aof_rewrite_scheduled) {
+            rewriteAppendOnlyFileBackground();
+        } else {
+            rewriteAppendOnlyFileIfNeed();
+        }
     }
 
     if (server.replstate == REDIS_REPL_CONNECT) {
@@ -2748,6 +8413,17 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     return 1000;
 }
 
+/**
+ * 每轮事件循环等待事件之前调用. 这一轮执行的写命令在这里写入 AOF,
+ * 它们的回复要到下一轮的 AE_WRITABLE 事件才会发给 client, 所以 always 时 client 收到回复前数据已经落盘
+ */
+static void beforeSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+    if (server.appendonly) {
+        flushAppendOnlyFile(false);
+    }
+}
+
 /**
  * 在 seconds 内有 changes 修改就执行保存操作
  */
@@ -2780,6 +8456,40 @@ static void initServerConfig() {
     server.glueoutputbuf = 1;
     server.daemonize = false;
     server.dbfilename = "dump.rdb";
+    server.rdbcompression = 1;
+    server.rdbchecksum = 1;
+    server.rdb_autosync_bytes = REDIS_RDB_AUTOSYNC_BYTES;
+    server.rdb_save_rate_limit = 0;
+    server.appendonly = 0;
+    server.appendfilename = "appendonly.aof";
+    server.appendfsync = REDIS_APPENDFSYNC_EVERYSEC;
+    server.auto_aof_rewrite_perc = REDIS_AUTO_AOF_REWRITE_PERC;
+    server.auto_aof_rewrite_min_size = REDIS_AUTO_AOF_REWRITE_MIN_SIZE;
+    server.list_max_ziplist_entries = REDIS_LIST_MAX_ZIPLIST_ENTRIES;
+    server.list_max_ziplist_value = REDIS_LIST_MAX_ZIPLIST_VALUE;
+    server.list_max_ziplist_size = QUICKLIST_FILL_DEFAULT;
+    server.list_compress_depth = QUICKLIST_COMPRESS_DEFAULT;
+    server.set_max_intset_entries = REDIS_SET_MAX_INTSET_ENTRIES;
+    server.hash_max_ziplist_entries = REDIS_HASH_MAX_ZIPLIST_ENTRIES;
+    server.hash_max_ziplist_value = REDIS_HASH_MAX_ZIPLIST_VALUE;
+    server.zset_max_ziplist_entries = REDIS_ZSET_MAX_ZIPLIST_ENTRIES;
+    server.zset_max_ziplist_value = REDIS_ZSET_MAX_ZIPLIST_VALUE;
+    server.maxmemory = 0;
+    server.maxmemory_policy = REDIS_MAXMEMORY_NO_EVICTION;
+    server.maxmemory_samples = REDIS_MAXMEMORY_SAMPLES;
+    server.lfu_log_factor = REDIS_LFU_LOG_FACTOR;
+    server.lfu_decay_time = REDIS_LFU_DECAY_TIME;
+    server.objfreelist_max = REDIS_OBJFREELIST_MAX;
+    server.lazyfree_lazy_user_del = 0;
+    server.lazyfree_lazy_server_del = 0;
+    server.lazyfree_lazy_expire = 0;
+    server.active_defrag_enabled = 0;
+    server.active_defrag_ignore_bytes = REDIS_DEFRAG_IGNORE_BYTES;
+    server.active_defrag_threshold_lower = REDIS_DEFRAG_THRESHOLD_LOWER;
+    server.active_defrag_threshold_upper = REDIS_DEFRAG_THRESHOLD_UPPER;
+    server.active_defrag_cycle_min = REDIS_DEFRAG_CYCLE_MIN;
+    server.active_defrag_cycle_max = REDIS_DEFRAG_CYCLE_MAX;
+    server.lruclock = getLRUClock();
 
     server.saveparams = NULL;
     ResetServerSaveParams();
@@ -2808,16 +8518,22 @@ static void initServer() {
 
     server.clients = listCreate();
     server.slaves = listCreate();
-    server.objfreelist = listCreate();
+    server.objfreelist = NULL;
+    server.objfreelist_len = 0;
+    server.objfreelist_lowwater = 0;
     createSharedObjects();
     server.el = aeCreateEventLoop();
+    bioInit();
+    crc64Init();
     server.dict = zmalloc(sizeof(dict *) * server.dbnum);
-    if (server.dict == NULL || server.clients == NULL || server.slaves == NULL || server.el == NULL || server.objfreelist == NULL) {
+    server.expires = zmalloc(sizeof(dict *) * server.dbnum);
+    if (server.dict == NULL || server.expires == NULL || server.clients == NULL || server.slaves == NULL || server.el == NULL) {
         oom("server initialization");
     }
     for (int i = 0; i < server.dbnum; i++) {
         server.dict[i] = dictCreate(&hashDictType, NULL);
-        if (server.dict[i] == NULL) {
+        server.expires[i] = dictCreate(&keyptrDictType, NULL);
+        if (server.dict[i] == NULL || server.expires[i] == NULL) {
             oom("dictCreate");
         }
     }
@@ -2835,6 +8551,33 @@ static void initServer() {
     server.usedmemory = 0;
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
+    server.stat_evictedkeys = 0;
+    server.stat_expiredkeys = 0;
+    server.stat_rdb_cow_bytes = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_misses = 0;
+    server.stat_aof_delayed_fsync = 0;
+    server.active_defrag_running = false;
+    server.appendfd = -1;
+    server.appendseldb = -1;
+    server.aofbuf = sdsempty();
+    server.aof_current_size = 0;
+    server.aof_fsync_offset = 0;
+    server.aof_last_fsync = time(NULL);
+    server.aof_flush_postponed_start = 0;
+    server.aof_child_pid = -1;
+    server.aof_rewrite_scheduled = false;
+    if ((server.aof_rewrite_buf_blocks = listCreate()) == NULL) {
+        oom("listCreate");
+    }
+    listSetFreeMethod(server.aof_rewrite_buf_blocks, zfree);
+    server.aof_rewrite_base_size = 0;
+    server.aof_rewrite_time_start = -1;
+    server.aof_rewrite_time_last = -1;
+    server.aof_lastbgrewrite_status = REDIS_OK;
+    server.aof_rewrite_failures = 0;
+    server.aof_rewrite_failed_at = 0;
+    server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
     server.stat_starttime = time(NULL);
     aeCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
 }
@@ -2842,11 +8585,52 @@ static void initServer() {
 static void emptyDb() {
     for (int i = 0; i < server.dbnum; i++) {
         dictEmpty(server.dict[i]);
+        dictEmpty(server.expires[i]);
     }
 }
 
 /* I agree, this is a very rudimental way to load a configuration...
    will improve later if the config gets more complex */
+/**
+ * 解析 "1gb", "100mb", "512k" 这样的内存大小, 没有单位时是字节
+ * @param err 格式错误时置为 1
+ */
+static long long memtoll(const char *p, int *err) {
+    char *end;
+    long long val = strtoll(p, &end, 10);
+    long long mul = 1;
+    *err = 0;
+    if (end == p || val < 0) {
+        *err = 1;
+        return 0;
+    }
+    if (!strcasecmp(end, "") || !strcasecmp(end, "b")) {
+        mul = 1;
+    } else if (!strcasecmp(end, "k") || !strcasecmp(end, "kb")) {
+        mul = 1024;
+    } else if (!strcasecmp(end, "m") || !strcasecmp(end, "mb")) {
+        mul = 1024 * 1024;
+    } else if (!strcasecmp(end, "g") || !strcasecmp(end, "gb")) {
+        mul = 1024LL * 1024 * 1024;
+    } else {
+        *err = 1;
+        return 0;
+    }
+    return val * mul;
+}
+
+/**
+ * @return 1 "yes", 0 "no", -1 其他
+ */
+static int yesnotoi(char *s) {
+    if (!strcasecmp(s, "yes")) {
+        return 1;
+    } else if (!strcasecmp(s, "no")) {
+        return 0;
+    }
+    return -1;
+}
+
 static void loadServerConfig(char *filename) {
     FILE *fp = fopen(filename,"r");
     char buf[REDIS_CONFIGLINE_MAX+1], *err = NULL;
@@ -2937,6 +8721,154 @@ static void loadServerConfig(char *filename) {
             server.masterhost = sdsnew(argv[1]);
             server.masterport = atoi(argv[2]);
             server.replstate = REDIS_REPL_CONNECT;
+        } else if (!strcmp(argv[0],"list-max-ziplist-entries") && argc == 2) {
+            server.list_max_ziplist_entries = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"list-max-ziplist-value") && argc == 2) {
+            server.list_max_ziplist_value = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"list-max-ziplist-size") && argc == 2) {
+            server.list_max_ziplist_size = atoi(argv[1]);
+            if (server.list_max_ziplist_size == 0 || server.list_max_ziplist_size < -5) {
+                err = "Invalid list-max-ziplist-size, must be positive or in [-5, -1]"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"list-compress-depth") && argc == 2) {
+            server.list_compress_depth = atoi(argv[1]);
+            if (server.list_compress_depth < 0) {
+                err = "Invalid list-compress-depth"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"set-max-intset-entries") && argc == 2) {
+            server.set_max_intset_entries = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"hash-max-ziplist-entries") && argc == 2) {
+            server.hash_max_ziplist_entries = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
+            server.hash_max_ziplist_value = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
+            server.zset_max_ziplist_entries = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
+            server.zset_max_ziplist_value = atoi(argv[1]);
+        } else if (!strcmp(argv[0],"maxmemory") && argc == 2) {
+            int memerr;
+            server.maxmemory = memtoll(argv[1], &memerr);
+            if (memerr) {
+                err = "Invalid maxmemory"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"maxmemory-policy") && argc == 2) {
+            sdstolower(argv[1]);
+            int policy = -1;
+            for (int k = 0; k < (int) (sizeof(maxmemoryPolicyNames) / sizeof(char *)); k++) {
+                if (!strcmp(argv[1], maxmemoryPolicyNames[k])) {
+                    policy = k;
+                }
+            }
+            if (policy == -1) {
+                err = "Invalid maxmemory policy"; goto loaderr;
+            }
+            server.maxmemory_policy = policy;
+        } else if (!strcmp(argv[0],"maxmemory-samples") && argc == 2) {
+            server.maxmemory_samples = atoi(argv[1]);
+            if (server.maxmemory_samples <= 0) {
+                err = "maxmemory-samples must be 1 or greater"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"lfu-log-factor") && argc == 2) {
+            server.lfu_log_factor = atoi(argv[1]);
+            if (server.lfu_log_factor < 0) {
+                err = "lfu-log-factor must be 0 or greater"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"lfu-decay-time") && argc == 2) {
+            server.lfu_decay_time = atoi(argv[1]);
+            if (server.lfu_decay_time < 0) {
+                err = "lfu-decay-time must be 0 or greater"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"lazyfree-lazy-user-del") && argc == 2) {
+            if ((server.lazyfree_lazy_user_del = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"lazyfree-lazy-server-del") && argc == 2) {
+            if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"lazyfree-lazy-expire") && argc == 2) {
+            if ((server.lazyfree_lazy_expire = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"activedefrag") && argc == 2) {
+            if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+#ifndef HAVE_DEFRAG
+            if (server.active_defrag_enabled) {
+                err = "active defrag requires jemalloc, this binary was built with USE_JEMALLOC=no or without deps/jemalloc"; goto loaderr;
+            }
+#endif
+        } else if (!strcmp(argv[0],"active-defrag-ignore-bytes") && argc == 2) {
+            int memerr;
+            server.active_defrag_ignore_bytes = memtoll(argv[1], &memerr);
+            if (memerr) {
+                err = "Invalid active-defrag-ignore-bytes"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"active-defrag-threshold-lower") && argc == 2) {
+            server.active_defrag_threshold_lower = atoi(argv[1]);
+            if (server.active_defrag_threshold_lower < 0) {
+                err = "active-defrag-threshold-lower must be 0 or greater"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"active-defrag-threshold-upper") && argc == 2) {
+            server.active_defrag_threshold_upper = atoi(argv[1]);
+            if (server.active_defrag_threshold_upper < 0) {
+                err = "active-defrag-threshold-upper must be 0 or greater"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"active-defrag-cycle-min") && argc == 2) {
+            server.active_defrag_cycle_min = atoi(argv[1]);
+            if (server.active_defrag_cycle_min < 1 || server.active_defrag_cycle_min > 99) {
+                err = "active-defrag-cycle-min must be between 1 and 99"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"active-defrag-cycle-max") && argc == 2) {
+            server.active_defrag_cycle_max = atoi(argv[1]);
+            if (server.active_defrag_cycle_max < 1 || server.active_defrag_cycle_max > 99) {
+                err = "active-defrag-cycle-max must be between 1 and 99"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"rdbcompression") && argc == 2) {
+            if ((server.rdbcompression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"rdbchecksum") && argc == 2) {
+            if ((server.rdbchecksum = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"rdb-autosync-size") && argc == 2) {
+            int memerr;
+            server.rdb_autosync_bytes = memtoll(argv[1], &memerr);
+            if (memerr) {
+                err = "Invalid rdb-autosync-size"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"rdb-save-rate-limit") && argc == 2) {
+            int memerr;
+            server.rdb_save_rate_limit = memtoll(argv[1], &memerr);
+            if (memerr) {
+                err = "Invalid rdb-save-rate-limit"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"appendonly") && argc == 2) {
+            if ((server.appendonly = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"appendfilename") && argc == 2) {
+            server.appendfilename = zstrdup(argv[1]);
+        } else if (!strcmp(argv[0],"appendfsync") && argc == 2) {
+            if (!strcasecmp(argv[1],"no")) server.appendfsync = REDIS_APPENDFSYNC_NO;
+            else if (!strcasecmp(argv[1],"always")) server.appendfsync = REDIS_APPENDFSYNC_ALWAYS;
+            else if (!strcasecmp(argv[1],"everysec")) server.appendfsync = REDIS_APPENDFSYNC_EVERYSEC;
+            else {
+                err = "argument must be 'no', 'always' or 'everysec'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"auto-aof-rewrite-percentage") && argc == 2) {
+            server.auto_aof_rewrite_perc = atoi(argv[1]);
+            if (server.auto_aof_rewrite_perc < 0) {
+                err = "Invalid negative percentage for AOF auto rewrite"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"auto-aof-rewrite-min-size") && argc == 2) {
+            int memerr;
+            server.auto_aof_rewrite_min_size = memtoll(argv[1], &memerr);
+            if (memerr) {
+                err = "Invalid auto-aof-rewrite-min-size"; goto loaderr;
+            }
         } else if (!strcmp(argv[0],"glueoutputbuf") && argc == 2) {
             sdstolower(argv[1]);
             if (!strcmp(argv[1],"yes")) server.glueoutputbuf = 1;
@@ -3019,6 +8951,436 @@ static void daemonize() {
     }
 }
 
+#define EVICT_BENCH_WRITES 1000000
+#define EVICT_BENCH_LIMIT  (32 * 1024 * 1024)
+
+/**
+ * 测试每次写入的淘汰开销: 不限制内存时作为基准, 其余三种策略在 maxmemory 下一直写入, 每次写入前都需要淘汰
+ */
+int mainevictbench() {
+    int policies[] = {REDIS_MAXMEMORY_NO_EVICTION, REDIS_MAXMEMORY_ALLKEYS_LRU,
+                      REDIS_MAXMEMORY_ALLKEYS_LFU, REDIS_MAXMEMORY_ALLKEYS_RANDOM};
+    initServerConfig();
+    server.dbnum = 1;
+    server.slaves = listCreate();
+    server.aofbuf = sdsempty();
+    server.aof_rewrite_buf_blocks = listCreate();
+    createSharedObjects();
+    server.dict = zmalloc(sizeof(dict *));
+    server.expires = zmalloc(sizeof(dict *));
+
+    for (int p = 0; p < (int) (sizeof(policies) / sizeof(int)); p++) {
+        server.dict[0] = dictCreate(&hashDictType, NULL);
+        server.expires[0] = dictCreate(&keyptrDictType, NULL);
+        server.maxmemory_policy = policies[p];
+        server.maxmemory = policies[p] == REDIS_MAXMEMORY_NO_EVICTION ? 0 : zmalloc_used_memory() + EVICT_BENCH_LIMIT;
+        server.stat_evictedkeys = 0;
+
+        long long start = mstime();
+        for (int i = 0; i < EVICT_BENCH_WRITES; i++) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "key:%d", i);
+            if (server.maxmemory && freeMemoryIfNeeded() == REDIS_ERR) {
+                return 1;
+            }
+            robj *key = createStringObject(buf, len);
+            robj *val = createStringObject("value", 5);
+            if (dictAdd(server.dict[0], key, val) == DICT_ERR) {
+                return 1;
+            }
+            if ((i & 0xffff) == 0) {
+                server.lruclock = getLRUClock();
+            }
+        }
+        long long ms = mstime() - start;
+        printf("%-14s %lld ms, %.1f ns/write, evicted %lld, keys %u, used_memory %zu\n",
+               maxmemoryPolicyNames[policies[p]], ms, (double) ms * 1000000 / EVICT_BENCH_WRITES,
+               server.stat_evictedkeys, dictGetHashTableUsed(server.dict[0]), zmalloc_used_memory());
+        dictRelease(server.expires[0]);
+        dictRelease(server.dict[0]);
+    }
+    return 0;
+}
+
+#define OBJPOOL_BENCH_KEYS   10000
+#define OBJPOOL_BENCH_WRITES 5000000
+
+/**
+ * SET 覆盖已有的 key: 每次写入释放旧 value, 新建一个 value.
+ * value 比 EMBSTR 长, 走 createObject, 分别测试开启和关闭 objfreelist 的吞吐
+ */
+int mainobjpoolbench() {
+    char val[64];
+    memset(val, 'x', sizeof(val));
+    initServerConfig();
+    createSharedObjects();
+
+    for (int pool = 1; pool >= 0; pool--) {
+        server.objfreelist_max = pool ? REDIS_OBJFREELIST_MAX : 0;
+        dict *d = dictCreate(&hashDictType, NULL);
+        robj *keys[OBJPOOL_BENCH_KEYS];
+        for (int i = 0; i < OBJPOOL_BENCH_KEYS; i++) {
+            char buf[32];
+            keys[i] = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+        }
+
+        long long start = mstime();
+        for (int i = 0; i < OBJPOOL_BENCH_WRITES; i++) {
+            robj *key = keys[i % OBJPOOL_BENCH_KEYS];
+            robj *o = createStringObject(val, sizeof(val));
+            if (dictAdd(d, key, o) == DICT_OK) {
+                incrRefCount(key);
+            } else {
+                dictReplace(d, key, o);
+            }
+        }
+        long long ms = mstime() - start;
+        printf("objfreelist %-3s %lld ms, %.2f M SET/s, free list %lu objects\n", pool ? "on" : "off", ms,
+               (double) OBJPOOL_BENCH_WRITES / ms / 1000, server.objfreelist_len);
+
+        for (int i = 0; i < OBJPOOL_BENCH_KEYS; i++) {
+            decrRefCount(keys[i]);
+        }
+        dictRelease(d);
+        // 清空 free list, 两轮从同样的状态开始
+        server.objfreelist_lowwater = server.objfreelist_len * 2;
+        trimObjectFreeList();
+    }
+    return 0;
+}
+
+#define DEFRAG_BENCH_KEYS 1000000
+#define DEFRAG_BENCH_BIG_FIELDS 500000
+
+/**
+ * 写入 1M 个 key 和一个 500K 个 field 的 hash 后删除 80%, 制造碎片, 然后跑碎片整理,
+ * 对比整理前后的 RSS, 检查剩下的数据, 并打印单次整理花费的最长时间(大 hash 不应该一次整理完)
+ */
+int mainactivedefragbench() {
+    char val[128];
+    memset(val, 'v', sizeof(val));
+    initServerConfig();
+    server.dbnum = 1;
+    server.aof_child_pid = -1;
+    server.slaves = listCreate();
+    server.clients = listCreate();
+    createSharedObjects();
+    server.dict = zmalloc(sizeof(dict *));
+    server.expires = zmalloc(sizeof(dict *));
+    server.dict[0] = dictCreate(&hashDictType, NULL);
+    server.expires[0] = dictCreate(&keyptrDictType, NULL);
+    for (int i = 0; i < DEFRAG_BENCH_KEYS; i++) {
+        char buf[32];
+        robj *key = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+        robj *o;
+        if (i % 10 == 0) {
+            o = createQuicklistObject();
+            for (int j = 0; j < 8; j++) {
+                quicklistPushTail(o->ptr, val, 16 + j);
+            }
+        } else {
+            o = createStringObject(val, 16 + i % 100);
+        }
+        dictAdd(server.dict[0], key, o);
+        if (i % 3 == 0) {
+            setExpire(0, key, time(NULL) + 3600);
+        }
+    }
+    robj *bighash = createHashObject();
+    dictAdd(server.dict[0], createStringObject("bighash", 7), bighash);
+    for (int i = 0; i < DEFRAG_BENCH_BIG_FIELDS; i++) {
+        char buf[32];
+        robj *field = createStringObject(buf, snprintf(buf, sizeof(buf), "field:%d", i));
+        robj *value = createStringObject(val, 16 + i % 100);
+        hashTypeSet(bighash, field, value);
+        decrRefCount(field);
+        decrRefCount(value);
+    }
+    for (int i = 0; i < DEFRAG_BENCH_KEYS; i++) {
+        if (i % 5 != 0) {
+            char buf[32];
+            robj key = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1};
+            key.ptr = sdsnewlen(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+            deleteKey(0, &key);
+            sdsfree(key.ptr);
+        }
+        if (i < DEFRAG_BENCH_BIG_FIELDS && i % 5 != 0) {
+            char buf[32];
+            robj field = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1};
+            field.ptr = sdsnewlen(buf, snprintf(buf, sizeof(buf), "field:%d", i));
+            hashTypeDelete(bighash, &field);
+            sdsfree(field.ptr);
+        }
+    }
+    trimObjectFreeList();
+    trimObjectFreeList();
+    zmalloc_release_free_memory();
+
+    size_t allocated, active, resident;
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    fprintf(stderr, "before: used %zu MB, allocator active %zu MB, rss %zu MB\n",
+            zmalloc_used_memory() / (1024 * 1024), active / (1024 * 1024), zmalloc_get_rss() / (1024 * 1024));
+
+    server.active_defrag_enabled = 1;
+    server.active_defrag_ignore_bytes = 0;
+    long long start = mstime(), longest = 0;
+    int cycles = 0;
+    do {
+        long long cyclestart = mstime();
+        activeDefragCycle();
+        if (mstime() - cyclestart > longest) {
+            longest = mstime() - cyclestart;
+        }
+        cycles++;
+    } while (server.active_defrag_running);
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    fprintf(stderr, "after %d cycles, %lld ms, %lld hits, %lld misses: used %zu MB, allocator active %zu MB, rss %zu MB\n",
+            cycles, mstime() - start, server.stat_active_defrag_hits, server.stat_active_defrag_misses,
+            zmalloc_used_memory() / (1024 * 1024), active / (1024 * 1024), zmalloc_get_rss() / (1024 * 1024));
+    fprintf(stderr, "longest cycle %lld ms\n", longest);
+
+    // robj 本身也可能被挪动了, 重新查找
+    robj bigkey = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = sdsnew("bighash")};
+    bighash = dictGetEntryVal(dictFind(server.dict[0], &bigkey));
+    sdsfree(bigkey.ptr);
+    if (hashTypeLength(bighash) != DEFRAG_BENCH_BIG_FIELDS / 5) {
+        fprintf(stderr, "bighash corrupted\n");
+        return 1;
+    }
+    for (int i = 0; i < DEFRAG_BENCH_BIG_FIELDS; i += 5) {
+        char buf[32];
+        robj field = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1};
+        field.ptr = sdsnewlen(buf, snprintf(buf, sizeof(buf), "field:%d", i));
+        robj *value = hashTypeGetObject(bighash, &field);
+        bool ok = value != NULL && stringObjectLen(value) == (size_t) (16 + i % 100);
+        if (value != NULL) {
+            decrRefCount(value);
+        }
+        sdsfree(field.ptr);
+        if (!ok) {
+            fprintf(stderr, "bighash field:%d corrupted\n", i);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < DEFRAG_BENCH_KEYS; i += 5) {
+        char buf[32];
+        robj key = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1};
+        key.ptr = sdsnewlen(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+        dictEntry *de = dictFind(server.dict[0], &key);
+        robj *o = de != NULL ? dictGetEntryVal(de) : NULL;
+        bool ok = o != NULL && (i % 3 != 0 || getExpire(0, &key) != -1);
+        if (ok && o->type == REDIS_STRING) {
+            ok = sdslen(o->ptr) == (size_t) (16 + i % 100) && memcmp(o->ptr, val, sdslen(o->ptr)) == 0;
+        } else if (ok) {
+            ok = quicklistCount((quicklist *) o->ptr) == 8;
+        }
+        sdsfree(key.ptr);
+        if (!ok) {
+            fprintf(stderr, "key:%d corrupted\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define COW_BENCH_KEYS   1000000
+#define COW_BENCH_BATCH  10000
+
+/**
+ * BGSAVE 期间持续覆盖写随机的 key, 测量父进程 RSS 的峰值和子进程中被写时复制的内存
+ */
+int mainbgsavecowbench() {
+    char val[64];
+    memset(val, 'x', sizeof(val));
+    initServerConfig();
+    server.dbnum = 1;
+    server.fd = -1;
+    server.slaves = listCreate();
+    server.clients = listCreate();
+    server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
+    createSharedObjects();
+    crc64Init();
+    server.dict = zmalloc(sizeof(dict *));
+    server.expires = zmalloc(sizeof(dict *));
+    server.dict[0] = dictCreate(&hashDictType, NULL);
+    server.expires[0] = dictCreate(&keyptrDictType, NULL);
+    for (int i = 0; i < COW_BENCH_KEYS; i++) {
+        char buf[32];
+        robj *key = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+        dictAdd(server.dict[0], key, createStringObject(val, sizeof(val)));
+    }
+
+    size_t before = zmalloc_get_rss();
+    size_t peak = before;
+    long long writes = 0;
+    long long start = mstime();
+    if (saveDbBackground("cowbench.rdb") == REDIS_ERR) {
+        return 1;
+    }
+    while (server.bgsaveinprogress) {
+        for (int i = 0; i < COW_BENCH_BATCH; i++) {
+            char buf[32];
+            robj *key = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", rand() % COW_BENCH_KEYS));
+            dictReplace(server.dict[0], key, createStringObject(val, sizeof(val)));
+            decrRefCount(key);
+        }
+        writes += COW_BENCH_BATCH;
+        size_t rss = zmalloc_get_rss();
+        if (rss > peak) {
+            peak = rss;
+        }
+        waitBgsaveFinish();
+    }
+    printf("BGSAVE %lld ms, %lld writes, rss before %zu MB, parent peak rss %zu MB, child copy-on-write %zu MB\n",
+           mstime() - start, writes, before / (1024 * 1024), peak / (1024 * 1024),
+           server.stat_rdb_cow_bytes / (1024 * 1024));
+    unlink("cowbench.rdb");
+    return 0;
+}
+
+#define AOF_REWRITE_BENCH_KEYS   10000000
+#define AOF_REWRITE_BENCH_BATCH  1000
+
+/**
+ * BGREWRITEAOF 期间持续写入随机的 key, 测量 rewrite 花费的时间,
+ * 父进程每批写命令的最大延迟(包括写入 rewrite 缓冲区)以及最后追加 rewrite 缓冲区的耗时
+ */
+int mainaofrewritebench() {
+    char val[64];
+    memset(val, 'x', sizeof(val));
+    initServerConfig();
+    server.dbnum = 1;
+    server.fd = -1;
+    server.appendonly = 1;
+    server.appendfilename = "aofbench.aof";
+    server.slaves = listCreate();
+    server.clients = listCreate();
+    server.aofbuf = sdsempty();
+    server.aof_child_pid = -1;
+    server.aof_rewrite_buf_blocks = listCreate();
+    listSetFreeMethod(server.aof_rewrite_buf_blocks, zfree);
+    server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
+    createSharedObjects();
+    bioInit();
+    server.dict = zmalloc(sizeof(dict *));
+    server.expires = zmalloc(sizeof(dict *));
+    server.dict[0] = dictCreate(&hashDictType, NULL);
+    server.expires[0] = dictCreate(&keyptrDictType, NULL);
+    for (int i = 0; i < AOF_REWRITE_BENCH_KEYS; i++) {
+        char buf[32];
+        robj *key = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+        dictAdd(server.dict[0], key, createStringObject(val, sizeof(val)));
+    }
+    unlink(server.appendfilename);
+    openAppendOnlyFile();
+
+    struct redisCommand *setcmd = lookupCommand("set");
+    long long writes = 0, maxlatency = 0;
+    if (rewriteAppendOnlyFileBackground() == REDIS_ERR) {
+        return 1;
+    }
+    while (server.aof_child_pid != -1) {
+        long long batchstart = ustime();
+        for (int i = 0; i < AOF_REWRITE_BENCH_BATCH; i++) {
+            char buf[32];
+            robj *argv[3];
+            argv[0] = createStringObject("set", 3);
+            argv[1] = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", rand() % AOF_REWRITE_BENCH_KEYS));
+            argv[2] = createStringObject(val, sizeof(val));
+            incrRefCount(argv[2]);
+            dictReplace(server.dict[0], argv[1], argv[2]);
+            feedAppendOnlyFile(setcmd, 0, argv, 3);
+            decrRefCount(argv[0]);
+            decrRefCount(argv[1]);
+            decrRefCount(argv[2]);
+        }
+        flushAppendOnlyFile(false);
+        writes += AOF_REWRITE_BENCH_BATCH;
+        long long latency = ustime() - batchstart;
+        if (latency > maxlatency) {
+            maxlatency = latency;
+        }
+        size_t diff = aofRewriteBufferSize();
+        long long donestart = mstime();
+        waitRewriteAppendOnlyFileFinish();
+        if (server.aof_child_pid == -1) {
+            printf("BGREWRITEAOF %lld ms, %lld writes, max latency of %d writes %lld us, "
+                   "diff %zu MB flushed in %lld ms, rewritten AOF %lld MB\n",
+                   server.aof_rewrite_time_last, writes, AOF_REWRITE_BENCH_BATCH, maxlatency,
+                   diff / (1024 * 1024), mstime() - donestart, (long long) server.aof_current_size / (1024 * 1024));
+        }
+    }
+    unlink(server.appendfilename);
+    return 0;
+}
+
+#define RDB_BENCH_KEYS  1000000
+
+/**
+ * 数据集: 整数值, 重复内容较多的 64 字节值, 每 100 个 key 一个 list 和 hash.
+ * 分别在 rdbcompression 开/关时测量 dump 文件大小和 save/load 的耗时
+ */
+int mainrdbbench() {
+    initServerConfig();
+    server.dbnum = 1;
+    server.fd = -1;
+    server.slaves = listCreate();
+    server.clients = listCreate();
+    server.child_info_pipe[0] = server.child_info_pipe[1] = -1;
+    createSharedObjects();
+    crc64Init();
+    server.dict = zmalloc(sizeof(dict *));
+    server.expires = zmalloc(sizeof(dict *));
+    server.dict[0] = dictCreate(&hashDictType, NULL);
+    server.expires[0] = dictCreate(&keyptrDictType, NULL);
+
+    for (int compression = 1; compression >= 0; compression--) {
+        for (int i = 0; i < RDB_BENCH_KEYS; i++) {
+            char buf[32], val[64];
+            robj *key = createStringObject(buf, snprintf(buf, sizeof(buf), "key:%d", i));
+            if (i % 100 == 0) {
+                robj *o = (i % 200 == 0) ? createQuicklistObject() : createHashObject();
+                dictAdd(server.dict[0], key, o);
+                for (int j = 0; j < 50; j++) {
+                    robj *ele = createStringObject(buf, snprintf(buf, sizeof(buf), "field:%d", j));
+                    if (o->type == REDIS_LIST) {
+                        listTypePush(o, ele, REDIS_TAIL);
+                    } else {
+                        hashTypeSet(o, ele, ele);
+                    }
+                    decrRefCount(ele);
+                }
+            } else if (i % 2 == 0) {
+                dictAdd(server.dict[0], key, createStringObject(buf, snprintf(buf, sizeof(buf), "%d", rand())));
+            } else {
+                int len = snprintf(val, sizeof(val), "user:%d:", i);
+                memset(val + len, 'a' + i % 26, sizeof(val) - len);
+                dictAdd(server.dict[0], key, createStringObject(val, sizeof(val)));
+            }
+        }
+        server.rdbcompression = compression;
+        long long start = mstime();
+        if (saveDb("rdbbench.rdb") == REDIS_ERR) {
+            return 1;
+        }
+        long long savetime = mstime() - start;
+        struct stat sb;
+        stat("rdbbench.rdb", &sb);
+        emptyDb();
+        start = mstime();
+        if (loadDb("rdbbench.rdb") == REDIS_ERR) {
+            return 1;
+        }
+        printf("rdbcompression %s: %lld keys, file %lld KB, save %lld ms, load %lld ms\n",
+               compression ? "yes" : "no", (long long) dictGetHashTableUsed(server.dict[0]), (long long) sb.st_size / 1024,
+               savetime, mstime() - start);
+        emptyDb();
+    }
+    unlink("rdbbench.rdb");
+    return 0;
+}
+
 int main(int argc, char **argv) {
     // 1. 初始化、加载 server config
     initServerConfig();
@@ -3037,8 +9399,13 @@ int main(int argc, char **argv) {
     }
     redisLog(REDIS_NOTICE, "Server started, Redis version " REDIS_VERSION);
 
-    // 3. 加载之前的数据
-    if (loadDb(server.dbfilename) == REDIS_OK) {
+    // 3. 加载之前的数据, 开启了 AOF 时 AOF 中的数据更新
+    if (server.appendonly) {
+        if (loadAppendOnlyFile(server.appendfilename) == REDIS_OK) {
+            redisLog(REDIS_NOTICE, "DB loaded from append only file");
+        }
+        openAppendOnlyFile();
+    } else if (loadDb(server.dbfilename) == REDIS_OK) {
         redisLog(REDIS_NOTICE, "DB loaded from disk");
     }
 
@@ -3049,6 +9416,7 @@ int main(int argc, char **argv) {
     redisLog(REDIS_NOTICE, "The server is now ready to accept connections");
     
     // 5. 启动
+    aeSetBeforeSleepProc(server.el, beforeSleep);
     aeMain(server.el);
 
     // 6. 删除
@@ -12,8 +12,41 @@ static void sdsOomAbort(void) {
     abort();
 }
 
-static struct sdshdr *header(sds s) {
-    return (void*)(s - sizeof(struct sdshdr));
+int sdsHdrSize(char type) {
+    switch (type & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  return sizeof(struct sdshdr8);
+        case SDS_TYPE_16: return sizeof(struct sdshdr16);
+        case SDS_TYPE_32: return sizeof(struct sdshdr32);
+        case SDS_TYPE_64: return sizeof(struct sdshdr64);
+    }
+    return 0;
+}
+
+/**
+ * 能放下 string_size 的最小 header 类型
+ */
+static char sdsReqType(size_t string_size) {
+    if (string_size < 1 << 8) {
+        return SDS_TYPE_8;
+    }
+    if (string_size < 1 << 16) {
+        return SDS_TYPE_16;
+    }
+    if (string_size < 1ll << 32) {
+        return SDS_TYPE_32;
+    }
+    return SDS_TYPE_64;
+}
+
+/**
+ * 在 sh 上初始化类型为 type 的 header, 返回 buf 的起始地址
+ */
+static sds sdsInitHdr(void *sh, char type, size_t len, size_t alloc) {
+    sds s = (char *) sh + sdsHdrSize(type);
+    s[-1] = type;
+    sdssetlen(s, len);
+    sdssetalloc(s, alloc);
+    return s;
 }
 
 /**
@@ -23,23 +56,23 @@ static struct sdshdr *header(sds s) {
  * @return 没有剩余空间的 sds 
  */
 sds sdsnewlen(const void *init, size_t initlen) {
-    struct sdshdr *sh = zmalloc(sizeof(struct sdshdr) + initlen + 1);
+    char type = sdsReqType(initlen);
+    void *sh = zmalloc(sdsHdrSize(type) + initlen + 1);
     // Notice: 为了代码简洁，这里没有判断 SDS_ABORT_ON_OOM 是否定义，而是直接终止
     if (sh == NULL) {
         sdsOomAbort();
     }
-    sh->len = initlen;
-    sh->free = 0;
+    sds s = sdsInitHdr(sh, type, initlen, initlen);
     if (initlen > 0) {
         if (init != NULL) {
             // memcpy 函数一定会拷贝 initlen 个字节
-            memcpy(sh->buf, init, initlen);
+            memcpy(s, init, initlen);
         } else {
-            memset(sh->buf, 0, initlen);
+            memset(s, 0, initlen);
         }
     }
-    sh->buf[initlen] = '\0';
-    return (char *)sh->buf;
+    s[initlen] = '\0';
+    return s;
 }
 
 sds sdsempty(void) {
@@ -55,30 +88,20 @@ sds sdsdup(sds s) {
     return sdsnewlen(s, sdslen(s));
 }
 
-size_t sdslen(const sds s) {
-    return header(s)->len;
-}
-
-size_t sdsavail(sds s) {
-    return header(s)->free;
-}
-
 void sdsfree(sds s) {
     if (s != NULL) {
-        zfree(s - sizeof(struct sdshdr));
+        zfree(s - sdsHdrSize(s[-1]));
     }
 }
 
 void sdsupdatelen(sds s) {
-    struct sdshdr *sh = header(s);
     // 注意这里调用的是标准库的 strlen
-    int reallen = strlen(s);
-    sh->free += (sh->len - reallen);
-    sh->len = reallen;
+    sdssetlen(s, strlen(s));
 }
 
 /**
  * 确保 s 中至少还有 addlen 的剩余空间，如果不够的话就 resize.
+ * 新长度小于 SDS_MAX_PREALLOC 时翻倍，否则只多分配 SDS_MAX_PREALLOC
  * Notice: addlen 不包括结果的 '\0'
  */
 static sds sdsMakeRoomFor(sds s, size_t addlen) {
@@ -88,14 +111,68 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     }
 
     size_t len = sdslen(s);
-    struct sdshdr *sh = (void *) (s - sizeof(struct sdshdr));
-    size_t newlen = (len + addlen) * 2;
-    struct sdshdr *newsh = zrealloc(sh, sizeof(struct sdshdr) + newlen + 1);
-    if (newsh == NULL) {
-        sdsOomAbort();
+    char oldtype = s[-1] & SDS_TYPE_MASK;
+    void *sh = s - sdsHdrSize(oldtype);
+    size_t newlen = len + addlen;
+    if (newlen < SDS_MAX_PREALLOC) {
+        newlen *= 2;
+    } else {
+        newlen += SDS_MAX_PREALLOC;
     }
-    newsh->free = newlen - len;
-    return newsh->buf;
+
+    char type = sdsReqType(newlen);
+    int hdrlen = sdsHdrSize(type);
+    if (type == oldtype) {
+        void *newsh = zrealloc(sh, hdrlen + newlen + 1);
+        if (newsh == NULL) {
+            sdsOomAbort();
+        }
+        s = (char *) newsh + hdrlen;
+    } else {
+        // header 的大小变了, buf 要整体后移，只能重新申请再拷贝
+        void *newsh = zmalloc(hdrlen + newlen + 1);
+        if (newsh == NULL) {
+            sdsOomAbort();
+        }
+        memcpy((char *) newsh + hdrlen, s, len + 1);
+        zfree(sh);
+        s = sdsInitHdr(newsh, type, len, newlen);
+    }
+    sdssetalloc(s, newlen);
+    return s;
+}
+
+sds sdsRemoveFreeSpace(sds s) {
+    if (sdsavail(s) == 0) {
+        return s;
+    }
+
+    size_t len = sdslen(s);
+    char oldtype = s[-1] & SDS_TYPE_MASK;
+    void *sh = s - sdsHdrSize(oldtype);
+    char type = sdsReqType(len);
+    int hdrlen = sdsHdrSize(type);
+    if (type == oldtype) {
+        void *newsh = zrealloc(sh, hdrlen + len + 1);
+        if (newsh == NULL) {
+            sdsOomAbort();
+        }
+        s = (char *) newsh + hdrlen;
+    } else {
+        void *newsh = zmalloc(hdrlen + len + 1);
+        if (newsh == NULL) {
+            sdsOomAbort();
+        }
+        memcpy((char *) newsh + hdrlen, s, len + 1);
+        zfree(sh);
+        s = sdsInitHdr(newsh, type, len, len);
+    }
+    sdssetalloc(s, len);
+    return s;
+}
+
+size_t sdsAllocSize(sds s) {
+    return sdsHdrSize(s[-1]) + sdsalloc(s) + 1;
 }
 
 /**
@@ -105,10 +182,8 @@ sds sdscatlen(sds s, void *t, size_t len) {
     size_t curlen = sdslen(s);
     s = sdsMakeRoomFor(s, len);
     // 在我们的设定中，s 不可能为 NULL，否则就 abort 了
-    struct sdshdr *sh = (void *)(s - sizeof(struct sdshdr));
     memcpy(s+curlen, t, len);
-    sh->len = curlen + len;
-    sh->free = sh->free - len;
+    sdssetlen(s, curlen + len);
     s[curlen+len] = '\0';
     return s;
 }
@@ -150,17 +225,12 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
  * 用 t 来覆盖 s 的已有内容
  */
 sds sdscpylen(sds s, char *t, size_t len) {
-    struct sdshdr *sh = header(s);
-    size_t totlen = sh->free + sh->len;
-    if (totlen < len) {
-        s = sdsMakeRoomFor(s, len-totlen);
-        sh = header(s);
-        totlen = sh->free + sh->len;
+    if (sdsalloc(s) < len) {
+        s = sdsMakeRoomFor(s, len - sdslen(s));
     }
     memcpy(s, t, len);
     s[len] = '\0';
-    sh->len = len;
-    sh->free = totlen - len;
+    sdssetlen(s, len);
     return s;
 }
 
@@ -184,14 +254,12 @@ sds sdstrim(sds s, const char *cset) {
         ep--;
     }
     size_t len = sp > ep ? 0 : (ep-sp) + 1;
-    struct sdshdr *sh = header(s);
-    if (sh->buf != sp) {
+    if (s != sp) {
         // 保留 sp ep 之间的数据
-        memmove(sh->buf, sp, len);
+        memmove(s, sp, len);
     }
-    sh->buf[len] = '\0';
-    sh->free = sh->free + (sh->len - len);
-    sh->len = len;
+    s[len] = '\0';
+    sdssetlen(s, len);
     return s;
 }
 
@@ -234,13 +302,11 @@ sds sdsrange(sds s, long start, long end) {
         start = 0;
     }
 
-    struct sdshdr *sh = header(s);
     if (start != 0) {
-        memmove(sh->buf, sh->buf + start, newlen);
+        memmove(s, s + start, newlen);
     }
-    sh->buf[newlen] = 0;
-    sh->free = sh->free + (sh->len - newlen);
-    sh->len = newlen;
+    s[newlen] = 0;
+    sdssetlen(s, newlen);
     return s;
 }
 
@@ -336,7 +402,7 @@ int main5() {
     sds *array = sdssplitlen(t, strlen(t), "_", 1, &count);
     printf("count: %d\n", count);
     for (int i = 0; i < count; i++) {
-        printf("\t%ld, %s\n", header(array[i])->len, array[i]);
+        printf("\t%zu, %s\n", sdslen(array[i]), array[i]);
     }
 
     count = 0;
@@ -344,7 +410,7 @@ int main5() {
     array = sdssplitlen(t, strlen(t), "_@", 2, &count);
     printf("count: %d\n", count);
     for (int i = 0; i < count; i++) {
-        printf("\t%ld, %s\n", header(array[i])->len, array[i]);
+        printf("\t%zu, %s\n", sdslen(array[i]), array[i]);
     }
 
     return 0;
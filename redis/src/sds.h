@@ -2,21 +2,62 @@
 #define _SDS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 typedef char* sds;
 
 /**
- * buf 的占用空间: len + free + 1, +1 是因为最后要添加一个 '\0'
+ * 根据字符串长度选择不同宽度的 header, 短字符串只需要 3 个字节的 header.
+ * buf 的占用空间: alloc + 1, +1 是因为最后要添加一个 '\0'
+ * len:   已使用的长度
+ * alloc: buf 的容量，不包括 header 和 '\0'
+ * flags: 低 3 位表示 header 的类型, 紧挨着 buf, 所以总是可以通过 s[-1] 拿到
+ *
+ * packed 是为了去掉对齐的 padding, 保证 flags 后面紧跟着 buf
  */
-struct sdshdr{
-    long len;
-    long free;
+struct __attribute__ ((__packed__)) sdshdr8 {
+    uint8_t len;
+    uint8_t alloc;
+    unsigned char flags;
     /**
-     * 柔性数组，buf字段不占用空间，它不计算在sizeof内， 比如给这个结构体申请了 sizeof(sdshdr) + n 个字节，
+     * 柔性数组，buf字段不占用空间，它不计算在sizeof内， 比如给这个结构体申请了 sizeof(sdshdr8) + n 个字节，
      * 后面的n个字节就是buf可以用来存储的空间
      */
     char buf[];
 };
+struct __attribute__ ((__packed__)) sdshdr16 {
+    uint16_t len;
+    uint16_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+struct __attribute__ ((__packed__)) sdshdr32 {
+    uint32_t len;
+    uint32_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+struct __attribute__ ((__packed__)) sdshdr64 {
+    uint64_t len;
+    uint64_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+
+/**
+ * 扩容时小于这个长度的翻倍，超过的每次只多分配这么多，避免大字符串浪费一倍的内存
+ */
+#define SDS_MAX_PREALLOC (1024 * 1024)
+
+#define SDS_TYPE_8  0
+#define SDS_TYPE_16 1
+#define SDS_TYPE_32 2
+#define SDS_TYPE_64 3
+#define SDS_TYPE_MASK 7
+
+/** 通过 sds 拿到对应类型的 header 指针 */
+#define SDS_HDR_VAR(T, s) struct sdshdr##T *sh = (void *)((s) - (sizeof(struct sdshdr##T)))
+#define SDS_HDR(T, s) ((struct sdshdr##T *)((s) - (sizeof(struct sdshdr##T))))
 
 /**
  * 创建大小为 initlen 的sds，如果 init 不为空，则把 init 中 initlen 个字节拷贝到新创建的 sds 中.
@@ -30,13 +71,80 @@ sds sdsnew(const char *init);
 sds sdsempty();
 sds sdsdup(const sds s);
 
-/** 下面两个函数分别返回 sdshdr 的 len 和 free 字段 */
-size_t sdslen(const sds s);
-size_t sdsavail(sds s);
+/** 下面两个函数分别返回 sds 的长度和剩余空间, 调用非常频繁所以放在头文件中 inline */
+static inline size_t sdslen(const sds s) {
+    unsigned char flags = s[-1];
+    switch (flags & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  return SDS_HDR(8, s)->len;
+        case SDS_TYPE_16: return SDS_HDR(16, s)->len;
+        case SDS_TYPE_32: return SDS_HDR(32, s)->len;
+        case SDS_TYPE_64: return SDS_HDR(64, s)->len;
+    }
+    return 0;
+}
+
+static inline size_t sdsavail(const sds s) {
+    unsigned char flags = s[-1];
+    switch (flags & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  { SDS_HDR_VAR(8, s);  return sh->alloc - sh->len; }
+        case SDS_TYPE_16: { SDS_HDR_VAR(16, s); return sh->alloc - sh->len; }
+        case SDS_TYPE_32: { SDS_HDR_VAR(32, s); return sh->alloc - sh->len; }
+        case SDS_TYPE_64: { SDS_HDR_VAR(64, s); return sh->alloc - sh->len; }
+    }
+    return 0;
+}
+
+/**
+ * buf 的容量 (len + avail)
+ */
+static inline size_t sdsalloc(const sds s) {
+    unsigned char flags = s[-1];
+    switch (flags & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  return SDS_HDR(8, s)->alloc;
+        case SDS_TYPE_16: return SDS_HDR(16, s)->alloc;
+        case SDS_TYPE_32: return SDS_HDR(32, s)->alloc;
+        case SDS_TYPE_64: return SDS_HDR(64, s)->alloc;
+    }
+    return 0;
+}
+
+static inline void sdssetlen(sds s, size_t newlen) {
+    unsigned char flags = s[-1];
+    switch (flags & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  SDS_HDR(8, s)->len = newlen; break;
+        case SDS_TYPE_16: SDS_HDR(16, s)->len = newlen; break;
+        case SDS_TYPE_32: SDS_HDR(32, s)->len = newlen; break;
+        case SDS_TYPE_64: SDS_HDR(64, s)->len = newlen; break;
+    }
+}
+
+static inline void sdssetalloc(sds s, size_t newalloc) {
+    unsigned char flags = s[-1];
+    switch (flags & SDS_TYPE_MASK) {
+        case SDS_TYPE_8:  SDS_HDR(8, s)->alloc = newalloc; break;
+        case SDS_TYPE_16: SDS_HDR(16, s)->alloc = newalloc; break;
+        case SDS_TYPE_32: SDS_HDR(32, s)->alloc = newalloc; break;
+        case SDS_TYPE_64: SDS_HDR(64, s)->alloc = newalloc; break;
+    }
+}
+
+/** header 的大小 */
+int sdsHdrSize(char type);
 
 /** 释放sds */
 void sdsfree(sds s);
 
+/**
+ * 释放 s 的剩余空间，header 也会换成能放下 len 的最小类型.
+ * 调用之后 s 可能会变，需要使用返回值
+ */
+sds sdsRemoveFreeSpace(sds s);
+
+/**
+ * s 实际占用的内存: header + buf + '\0'
+ */
+size_t sdsAllocSize(sds s);
+
 /**
  * 调用标准库的 strlen 来计算 buf 真正的长度，
  * 使用这个长度来更新 header 的 len 和 free
@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include "zmalloc.h"
+#include "ziplist.h"
+
+/**
+ * 内存布局:
+ *     <zlbytes><zltail><zllen><entry><entry>...<zlend>
+ *     zlbytes uint32_t: 整个 ziplist 占用的字节数, resize 时不需要再遍历
+ *     zltail  uint32_t: 最后一个 entry 的偏移量, 尾部 push/pop 是 O(1)
+ *     zllen   uint16_t: entry 的个数, 等于 UINT16_MAX 时需要遍历才能知道
+ *     zlend   uint8_t:  固定为 255
+ *
+ * entry 的布局:
+ *     <prevlen><encoding><content>
+ *     prevlen:  前一个 entry 的长度, 小于 254 用 1 个字节, 否则 254 + 4 个字节, 用于从后往前遍历
+ *     encoding: 00pppppp                    长度不超过 63 的字符串
+ *               01pppppp|qqqqqqqq           长度不超过 16383 的字符串, 14 bit 大端
+ *               10000000|4 bytes            更长的字符串, 32 bit 大端
+ *               11000000                    int16_t
+ *               11010000                    int32_t
+ *               11100000                    int64_t
+ *               11110000                    24 bit 有符号整数
+ *               11111110                    int8_t
+ *               1111xxxx                    xxxx 在 [0001, 1101] 之间, 直接表示 [0, 12], 没有 content
+ */
+
+#define ZIP_END 255
+#define ZIP_BIG_PREVLEN 254
+
+#define ZIP_STR_MASK 0xc0
+#define ZIP_STR_06B (0 << 6)
+#define ZIP_STR_14B (1 << 6)
+#define ZIP_STR_32B (2 << 6)
+#define ZIP_INT_16B (0xc0 | 0 << 4)
+#define ZIP_INT_32B (0xc0 | 1 << 4)
+#define ZIP_INT_64B (0xc0 | 2 << 4)
+#define ZIP_INT_24B (0xc0 | 3 << 4)
+#define ZIP_INT_8B 0xfe
+
+#define ZIP_INT_IMM_MASK 0x0f
+#define ZIP_INT_IMM_MIN 0xf1 // 11110001
+#define ZIP_INT_IMM_MAX 0xfd // 11111101
+
+#define INT24_MAX 0x7fffff
+#define INT24_MIN (-INT24_MAX - 1)
+
+#define ZIP_IS_STR(enc) (((enc) & ZIP_STR_MASK) < ZIP_STR_MASK)
+
+#define ZIPLIST_BYTES(zl)       (*((uint32_t *) (zl)))
+#define ZIPLIST_TAIL_OFFSET(zl) (*((uint32_t *) ((zl) + sizeof(uint32_t))))
+#define ZIPLIST_LENGTH(zl)      (*((uint16_t *) ((zl) + sizeof(uint32_t) * 2)))
+#define ZIPLIST_HEADER_SIZE     (sizeof(uint32_t) * 2 + sizeof(uint16_t))
+#define ZIPLIST_END_SIZE        (sizeof(uint8_t))
+#define ZIPLIST_ENTRY_HEAD(zl)  ((zl) + ZIPLIST_HEADER_SIZE)
+#define ZIPLIST_ENTRY_TAIL(zl)  ((zl) + ZIPLIST_TAIL_OFFSET(zl))
+#define ZIPLIST_ENTRY_END(zl)   ((zl) + ZIPLIST_BYTES(zl) - 1)
+
+/** zllen 饱和之后就不再维护了 */
+#define ZIPLIST_INCR_LENGTH(zl, incr) { \
+    if (ZIPLIST_LENGTH(zl) < UINT16_MAX) { \
+        ZIPLIST_LENGTH(zl) += (incr); \
+    } \
+}
+
+/**
+ * 解码后的 entry, 只在函数内部临时使用
+ */
+typedef struct zlentry {
+    unsigned int prevrawlensize; // prevlen 占用的字节数
+    unsigned int prevrawlen;     // 前一个 entry 的长度
+    unsigned int lensize;        // encoding 占用的字节数
+    unsigned int len;            // content 的字节数
+    unsigned int headersize;     // prevrawlensize + lensize
+    unsigned char encoding;
+    unsigned char *p;            // entry 的起始位置
+} zlentry;
+
+/**
+ * 整数编码的 content 占用的字节数
+ */
+static unsigned int zipIntSize(unsigned char encoding) {
+    switch (encoding) {
+        case ZIP_INT_8B:  return 1;
+        case ZIP_INT_16B: return 2;
+        case ZIP_INT_24B: return 3;
+        case ZIP_INT_32B: return 4;
+        case ZIP_INT_64B: return 8;
+    }
+    // 立即数没有 content
+    return 0;
+}
+
+/**
+ * 把 encoding 写入 p, p 为 NULL 时只计算需要的字节数
+ * @param rawlen 字符串的长度, 整数编码时忽略
+ */
+static unsigned int zipStoreEntryEncoding(unsigned char *p, unsigned char encoding, unsigned int rawlen) {
+    unsigned char len = 1, buf[5];
+
+    if (ZIP_IS_STR(encoding)) {
+        if (rawlen <= 0x3f) {
+            buf[0] = ZIP_STR_06B | rawlen;
+        } else if (rawlen <= 0x3fff) {
+            len += 1;
+            buf[0] = ZIP_STR_14B | ((rawlen >> 8) & 0x3f);
+            buf[1] = rawlen & 0xff;
+        } else {
+            len += 4;
+            buf[0] = ZIP_STR_32B;
+            buf[1] = (rawlen >> 24) & 0xff;
+            buf[2] = (rawlen >> 16) & 0xff;
+            buf[3] = (rawlen >> 8) & 0xff;
+            buf[4] = rawlen & 0xff;
+        }
+    } else {
+        buf[0] = encoding;
+    }
+
+    if (p != NULL) {
+        memcpy(p, buf, len);
+    }
+    return len;
+}
+
+static void zipDecodeEntryEncoding(unsigned char *p, unsigned char *encoding, unsigned int *lensize, unsigned int *len) {
+    *encoding = p[0];
+    if (*encoding < ZIP_STR_MASK) {
+        *encoding &= ZIP_STR_MASK;
+    }
+
+    if (*encoding == ZIP_STR_06B) {
+        *lensize = 1;
+        *len = p[0] & 0x3f;
+    } else if (*encoding == ZIP_STR_14B) {
+        *lensize = 2;
+        *len = ((p[0] & 0x3f) << 8) | p[1];
+    } else if (*encoding == ZIP_STR_32B) {
+        *lensize = 5;
+        *len = ((uint32_t) p[1] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 8) | p[4];
+    } else {
+        *lensize = 1;
+        *len = zipIntSize(*encoding);
+    }
+}
+
+/**
+ * 强制使用 5 个字节存储 prevlen, 用于避免连锁更新时 entry 反复收缩
+ */
+static unsigned int zipStorePrevEntryLengthLarge(unsigned char *p, unsigned int len) {
+    if (p != NULL) {
+        p[0] = ZIP_BIG_PREVLEN;
+        memcpy(p + 1, &len, sizeof(len));
+    }
+    return 1 + sizeof(len);
+}
+
+/**
+ * 把 prevlen 写入 p, p 为 NULL 时只计算需要的字节数
+ */
+static unsigned int zipStorePrevEntryLength(unsigned char *p, unsigned int len) {
+    if (len < ZIP_BIG_PREVLEN) {
+        if (p != NULL) {
+            p[0] = len;
+        }
+        return 1;
+    }
+    return zipStorePrevEntryLengthLarge(p, len);
+}
+
+static void zipDecodePrevlen(unsigned char *p, unsigned int *prevlensize, unsigned int *prevlen) {
+    if (p[0] < ZIP_BIG_PREVLEN) {
+        *prevlensize = 1;
+        *prevlen = p[0];
+    } else {
+        *prevlensize = 5;
+        memcpy(prevlen, p + 1, 4);
+    }
+}
+
+/**
+ * p 的 prevlen 要改成 len 时, 需要增加(正数)或减少(负数)的字节数
+ */
+static int zipPrevLenByteDiff(unsigned char *p, unsigned int len) {
+    unsigned int prevlensize, prevlen;
+    zipDecodePrevlen(p, &prevlensize, &prevlen);
+    return zipStorePrevEntryLength(NULL, len) - prevlensize;
+}
+
+static void zipEntry(unsigned char *p, zlentry *e) {
+    zipDecodePrevlen(p, &e->prevrawlensize, &e->prevrawlen);
+    zipDecodeEntryEncoding(p + e->prevrawlensize, &e->encoding, &e->lensize, &e->len);
+    e->headersize = e->prevrawlensize + e->lensize;
+    e->p = p;
+}
+
+/**
+ * p 指向的 entry 占用的总字节数
+ */
+static unsigned int zipRawEntryLength(unsigned char *p) {
+    zlentry e;
+    zipEntry(p, &e);
+    return e.headersize + e.len;
+}
+
+/**
+ * 严格的把字符串解析成 long long: 不允许前导 0, '+', 空白, 也不能溢出.
+ * 这样整数编码的 entry 读回来之后和原来的字符串完全一样
+ */
+static bool zipStringToLongLong(unsigned char *s, unsigned int slen, long long *value) {
+    unsigned char *p = s;
+    unsigned int plen = 0;
+    bool negative = false;
+    unsigned long long v;
+
+    if (slen == 0) {
+        return false;
+    }
+    if (slen == 1 && p[0] == '0') {
+        *value = 0;
+        return true;
+    }
+
+    if (p[0] == '-') {
+        negative = true;
+        p++;
+        plen++;
+        if (plen == slen) {
+            return false;
+        }
+    }
+
+    if (p[0] >= '1' && p[0] <= '9') {
+        v = p[0] - '0';
+        p++;
+        plen++;
+    } else {
+        return false;
+    }
+
+    while (plen < slen && p[0] >= '0' && p[0] <= '9') {
+        if (v > (ULLONG_MAX / 10)) {
+            return false;
+        }
+        v *= 10;
+        if (v > (ULLONG_MAX - (p[0] - '0'))) {
+            return false;
+        }
+        v += p[0] - '0';
+        p++;
+        plen++;
+    }
+
+    if (plen < slen) {
+        return false;
+    }
+
+    if (negative) {
+        if (v > ((unsigned long long) (-(LLONG_MIN + 1)) + 1)) {
+            return false;
+        }
+        *value = -v;
+    } else {
+        if (v > LLONG_MAX) {
+            return false;
+        }
+        *value = v;
+    }
+    return true;
+}
+
+/**
+ * 尝试把 s 编码成整数, 成功时返回能放下 *v 的最小编码
+ */
+static bool zipTryEncoding(unsigned char *s, unsigned int slen, long long *v, unsigned char *encoding) {
+    long long value;
+
+    // 超过 32 个字符不可能是 long long
+    if (slen >= 32 || slen == 0) {
+        return false;
+    }
+    if (!zipStringToLongLong(s, slen, &value)) {
+        return false;
+    }
+
+    if (value >= 0 && value <= 12) {
+        *encoding = ZIP_INT_IMM_MIN + value;
+    } else if (value >= INT8_MIN && value <= INT8_MAX) {
+        *encoding = ZIP_INT_8B;
+    } else if (value >= INT16_MIN && value <= INT16_MAX) {
+        *encoding = ZIP_INT_16B;
+    } else if (value >= INT24_MIN && value <= INT24_MAX) {
+        *encoding = ZIP_INT_24B;
+    } else if (value >= INT32_MIN && value <= INT32_MAX) {
+        *encoding = ZIP_INT_32B;
+    } else {
+        *encoding = ZIP_INT_64B;
+    }
+    *v = value;
+    return true;
+}
+
+static void zipSaveInteger(unsigned char *p, long long value, unsigned char encoding) {
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+
+    if (encoding == ZIP_INT_8B) {
+        ((int8_t *) p)[0] = (int8_t) value;
+    } else if (encoding == ZIP_INT_16B) {
+        i16 = value;
+        memcpy(p, &i16, sizeof(i16));
+    } else if (encoding == ZIP_INT_24B) {
+        // 取 int32 的高 3 个字节, 读的时候再右移回来, 符号位就保留下来了
+        i32 = value << 8;
+        memcpy(p, ((uint8_t *) &i32) + 1, sizeof(i32) - sizeof(uint8_t));
+    } else if (encoding == ZIP_INT_32B) {
+        i32 = value;
+        memcpy(p, &i32, sizeof(i32));
+    } else if (encoding == ZIP_INT_64B) {
+        i64 = value;
+        memcpy(p, &i64, sizeof(i64));
+    } else {
+        // 立即数编码在 encoding 中, 不需要写 content
+        assert(encoding >= ZIP_INT_IMM_MIN && encoding <= ZIP_INT_IMM_MAX);
+    }
+}
+
+static long long zipLoadInteger(unsigned char *p, unsigned char encoding) {
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+
+    if (encoding == ZIP_INT_8B) {
+        return ((int8_t *) p)[0];
+    } else if (encoding == ZIP_INT_16B) {
+        memcpy(&i16, p, sizeof(i16));
+        return i16;
+    } else if (encoding == ZIP_INT_24B) {
+        i32 = 0;
+        memcpy(((uint8_t *) &i32) + 1, p, sizeof(i32) - sizeof(uint8_t));
+        return i32 >> 8;
+    } else if (encoding == ZIP_INT_32B) {
+        memcpy(&i32, p, sizeof(i32));
+        return i32;
+    } else if (encoding == ZIP_INT_64B) {
+        memcpy(&i64, p, sizeof(i64));
+        return i64;
+    }
+    assert(encoding >= ZIP_INT_IMM_MIN && encoding <= ZIP_INT_IMM_MAX);
+    return (encoding & ZIP_INT_IMM_MASK) - 1;
+}
+
+unsigned char *ziplistNew(void) {
+    unsigned int bytes = ZIPLIST_HEADER_SIZE + ZIPLIST_END_SIZE;
+    unsigned char *zl = zmalloc(bytes);
+    if (zl == NULL) {
+        return NULL;
+    }
+    ZIPLIST_BYTES(zl) = bytes;
+    ZIPLIST_TAIL_OFFSET(zl) = ZIPLIST_HEADER_SIZE;
+    ZIPLIST_LENGTH(zl) = 0;
+    zl[bytes - 1] = ZIP_END;
+    return zl;
+}
+
+static unsigned char *ziplistResize(unsigned char *zl, unsigned int len) {
+    zl = zrealloc(zl, len);
+    if (zl == NULL) {
+        fprintf(stderr, "ziplist: Out Of Memory\n");
+        abort();
+    }
+    ZIPLIST_BYTES(zl) = len;
+    zl[len - 1] = ZIP_END;
+    return zl;
+}
+
+/**
+ * p 的长度变了之后, 后一个 entry 的 prevlen 可能需要从 1 个字节扩成 5 个字节,
+ * 这又会让后一个 entry 变长，一直传递下去. 只扩不缩, 缩小的情况强制保留 5 个字节
+ */
+static unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
+    size_t curlen = ZIPLIST_BYTES(zl), rawlen, rawlensize;
+    size_t offset, noffset, extra;
+    unsigned char *np;
+    zlentry cur, next;
+
+    while (p[0] != ZIP_END) {
+        zipEntry(p, &cur);
+        rawlen = cur.headersize + cur.len;
+        rawlensize = zipStorePrevEntryLength(NULL, rawlen);
+
+        if (p[rawlen] == ZIP_END) {
+            break;
+        }
+        zipEntry(p + rawlen, &next);
+
+        if (next.prevrawlen == rawlen) {
+            break;
+        }
+
+        if (next.prevrawlensize < rawlensize) {
+            offset = p - zl;
+            extra = rawlensize - next.prevrawlensize;
+            zl = ziplistResize(zl, curlen + extra);
+            p = zl + offset;
+
+            np = p + rawlen;
+            noffset = np - zl;
+
+            // next 是最后一个 entry 时, 它自己变长不影响 tail offset
+            if ((zl + ZIPLIST_TAIL_OFFSET(zl)) != np) {
+                ZIPLIST_TAIL_OFFSET(zl) += extra;
+            }
+
+            memmove(np + rawlensize, np + next.prevrawlensize, curlen - noffset - next.prevrawlensize - 1);
+            zipStorePrevEntryLength(np, rawlen);
+
+            p += rawlen;
+            curlen += extra;
+        } else {
+            if (next.prevrawlensize > rawlensize) {
+                zipStorePrevEntryLengthLarge(p + rawlen, rawlen);
+            } else {
+                zipStorePrevEntryLength(p + rawlen, rawlen);
+            }
+            break;
+        }
+    }
+    return zl;
+}
+
+/**
+ * 从 p 开始删除 num 个 entry
+ */
+static unsigned char *__ziplistDelete(unsigned char *zl, unsigned char *p, unsigned int num) {
+    unsigned int i, totlen, deleted = 0;
+    size_t offset;
+    int nextdiff = 0;
+    zlentry first, tail;
+
+    zipEntry(p, &first);
+    for (i = 0; p[0] != ZIP_END && i < num; i++) {
+        p += zipRawEntryLength(p);
+        deleted++;
+    }
+
+    totlen = p - first.p;
+    if (totlen == 0) {
+        return zl;
+    }
+
+    if (p[0] != ZIP_END) {
+        // 后面的 entry 的 prevlen 改成被删除的第一个 entry 的 prevlen, 占用的字节数可能变化
+        nextdiff = zipPrevLenByteDiff(p, first.prevrawlen);
+        p -= nextdiff;
+        zipStorePrevEntryLength(p, first.prevrawlen);
+
+        ZIPLIST_TAIL_OFFSET(zl) -= totlen;
+        zipEntry(p, &tail);
+        if (p[tail.headersize + tail.len] != ZIP_END) {
+            ZIPLIST_TAIL_OFFSET(zl) += nextdiff;
+        }
+
+        memmove(first.p, p, ZIPLIST_BYTES(zl) - (p - zl) - 1);
+    } else {
+        // 删到了结尾, 前一个 entry 成为新的 tail
+        ZIPLIST_TAIL_OFFSET(zl) = (first.p - zl) - first.prevrawlen;
+    }
+
+    offset = first.p - zl;
+    zl = ziplistResize(zl, ZIPLIST_BYTES(zl) - totlen + nextdiff);
+    ZIPLIST_INCR_LENGTH(zl, -deleted);
+    p = zl + offset;
+
+    if (nextdiff != 0) {
+        zl = __ziplistCascadeUpdate(zl, p);
+    }
+    return zl;
+}
+
+/**
+ * 在 p 的位置插入 s, 原来 p 及之后的 entry 后移
+ */
+static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    size_t curlen = ZIPLIST_BYTES(zl), reqlen;
+    unsigned int prevlensize, prevlen = 0;
+    size_t offset;
+    int nextdiff = 0;
+    unsigned char encoding = 0;
+    long long value = 0;
+    zlentry tail;
+    bool forcelarge = false;
+
+    if (p[0] != ZIP_END) {
+        zipDecodePrevlen(p, &prevlensize, &prevlen);
+    } else {
+        unsigned char *ptail = ZIPLIST_ENTRY_TAIL(zl);
+        if (ptail[0] != ZIP_END) {
+            prevlen = zipRawEntryLength(ptail);
+        }
+    }
+
+    if (zipTryEncoding(s, slen, &value, &encoding)) {
+        reqlen = zipIntSize(encoding);
+    } else {
+        // encoding 为 0 表示字符串, 具体用几个字节由 zipStoreEntryEncoding 根据长度决定
+        reqlen = slen;
+    }
+    reqlen += zipStorePrevEntryLength(NULL, prevlen);
+    reqlen += zipStoreEntryEncoding(NULL, encoding, slen);
+
+    nextdiff = (p[0] != ZIP_END) ? zipPrevLenByteDiff(p, reqlen) : 0;
+    // 新 entry 比 4 个字节还短时整体会缩小, resize 会先截断掉尾部的数据, 所以这里不缩
+    if (nextdiff == -4 && reqlen < 4) {
+        nextdiff = 0;
+        forcelarge = true;
+    }
+
+    offset = p - zl;
+    zl = ziplistResize(zl, curlen + reqlen + nextdiff);
+    p = zl + offset;
+
+    if (p[0] != ZIP_END) {
+        memmove(p + reqlen, p - nextdiff, curlen - offset - 1 + nextdiff);
+        if (forcelarge) {
+            zipStorePrevEntryLengthLarge(p + reqlen, reqlen);
+        } else {
+            zipStorePrevEntryLength(p + reqlen, reqlen);
+        }
+
+        ZIPLIST_TAIL_OFFSET(zl) += reqlen;
+        zipEntry(p + reqlen, &tail);
+        if (p[reqlen + tail.headersize + tail.len] != ZIP_END) {
+            ZIPLIST_TAIL_OFFSET(zl) += nextdiff;
+        }
+    } else {
+        ZIPLIST_TAIL_OFFSET(zl) = p - zl;
+    }
+
+    if (nextdiff != 0) {
+        offset = p - zl;
+        zl = __ziplistCascadeUpdate(zl, p + reqlen);
+        p = zl + offset;
+    }
+
+    p += zipStorePrevEntryLength(p, prevlen);
+    p += zipStoreEntryEncoding(p, encoding, slen);
+    if (ZIP_IS_STR(encoding)) {
+        memcpy(p, s, slen);
+    } else {
+        zipSaveInteger(p, value, encoding);
+    }
+    ZIPLIST_INCR_LENGTH(zl, 1);
+    return zl;
+}
+
+unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int slen, int where) {
+    unsigned char *p = (where == ZIPLIST_HEAD) ? ZIPLIST_ENTRY_HEAD(zl) : ZIPLIST_ENTRY_END(zl);
+    return __ziplistInsert(zl, p, s, slen);
+}
+
+unsigned char *ziplistIndex(unsigned char *zl, int index) {
+    unsigned char *p;
+    unsigned int prevlensize, prevlen = 0;
+
+    if (index < 0) {
+        index = (-index) - 1;
+        p = ZIPLIST_ENTRY_TAIL(zl);
+        if (p[0] != ZIP_END) {
+            zipDecodePrevlen(p, &prevlensize, &prevlen);
+            while (prevlen > 0 && index--) {
+                p -= prevlen;
+                zipDecodePrevlen(p, &prevlensize, &prevlen);
+            }
+        }
+    } else {
+        p = ZIPLIST_ENTRY_HEAD(zl);
+        while (p[0] != ZIP_END && index--) {
+            p += zipRawEntryLength(p);
+        }
+    }
+    return (p[0] == ZIP_END || index > 0) ? NULL : p;
+}
+
+unsigned char *ziplistNext(unsigned char *zl, unsigned char *p) {
+    (void) zl;
+    if (p[0] == ZIP_END) {
+        return NULL;
+    }
+    p += zipRawEntryLength(p);
+    if (p[0] == ZIP_END) {
+        return NULL;
+    }
+    return p;
+}
+
+unsigned char *ziplistPrev(unsigned char *zl, unsigned char *p) {
+    unsigned int prevlensize, prevlen = 0;
+
+    if (p[0] == ZIP_END) {
+        p = ZIPLIST_ENTRY_TAIL(zl);
+        return (p[0] == ZIP_END) ? NULL : p;
+    }
+    if (p == ZIPLIST_ENTRY_HEAD(zl)) {
+        return NULL;
+    }
+    zipDecodePrevlen(p, &prevlensize, &prevlen);
+    assert(prevlen > 0);
+    return p - prevlen;
+}
+
+bool ziplistGet(unsigned char *p, unsigned char **sstr, unsigned int *slen, long long *sval) {
+    zlentry entry;
+    if (p == NULL || p[0] == ZIP_END) {
+        return false;
+    }
+    if (sstr != NULL) {
+        *sstr = NULL;
+    }
+
+    zipEntry(p, &entry);
+    if (ZIP_IS_STR(entry.encoding)) {
+        if (sstr != NULL) {
+            *slen = entry.len;
+            *sstr = p + entry.headersize;
+        }
+    } else {
+        if (sval != NULL) {
+            *sval = zipLoadInteger(p + entry.headersize, entry.encoding);
+        }
+    }
+    return true;
+}
+
+unsigned char *ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    return __ziplistInsert(zl, p, s, slen);
+}
+
+unsigned char *ziplistDelete(unsigned char *zl, unsigned char **p) {
+    size_t offset = *p - zl;
+    zl = __ziplistDelete(zl, *p, 1);
+    *p = zl + offset;
+    return zl;
+}
+
+unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num) {
+    unsigned char *p = ziplistIndex(zl, index);
+    return (p == NULL) ? zl : __ziplistDelete(zl, p, num);
+}
+
+unsigned char *ziplistReplace(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    size_t offset = p - zl;
+    zl = __ziplistDelete(zl, p, 1);
+    return __ziplistInsert(zl, zl + offset, s, slen);
+}
+
+bool ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int slen) {
+    zlentry entry;
+    unsigned char sencoding;
+    long long zval, sval;
+    if (p[0] == ZIP_END) {
+        return false;
+    }
+
+    zipEntry(p, &entry);
+    if (ZIP_IS_STR(entry.encoding)) {
+        return entry.len == slen && memcmp(p + entry.headersize, sstr, slen) == 0;
+    }
+    if (zipTryEncoding(sstr, slen, &sval, &sencoding)) {
+        zval = zipLoadInteger(p + entry.headersize, entry.encoding);
+        return zval == sval;
+    }
+    return false;
+}
+
+unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    unsigned char vencoding = 0;
+    long long vll = 0;
+    // vstr 只在第一次遇到整数 entry 时解析一次, 0 未解析, 1 是整数, 2 不是整数
+    int vparsed = 0;
+
+    while (p[0] != ZIP_END) {
+        zlentry e;
+        zipEntry(p, &e);
+        unsigned char *q = p + e.headersize;
+
+        if (skipcnt == 0) {
+            if (ZIP_IS_STR(e.encoding)) {
+                if (e.len == vlen && memcmp(q, vstr, vlen) == 0) {
+                    return p;
+                }
+            } else {
+                if (vparsed == 0) {
+                    vparsed = zipTryEncoding(vstr, vlen, &vll, &vencoding) ? 1 : 2;
+                }
+                if (vparsed == 1 && zipLoadInteger(q, e.encoding) == vll) {
+                    return p;
+                }
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = q + e.len;
+    }
+    return NULL;
+}
+
+unsigned int ziplistLen(unsigned char *zl) {
+    unsigned int len = 0;
+    if (ZIPLIST_LENGTH(zl) < UINT16_MAX) {
+        return ZIPLIST_LENGTH(zl);
+    }
+
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl);
+    while (*p != ZIP_END) {
+        p += zipRawEntryLength(p);
+        len++;
+    }
+    if (len < UINT16_MAX) {
+        ZIPLIST_LENGTH(zl) = len;
+    }
+    return len;
+}
+
+size_t ziplistBlobLen(unsigned char *zl) {
+    return ZIPLIST_BYTES(zl);
+}
+
+// for test
+static void ziplistRepr(unsigned char *zl) {
+    unsigned char *p = ziplistIndex(zl, 0);
+    unsigned char *sval;
+    unsigned int slen;
+    long long lval;
+    printf("{bytes %u, len %u, tail %u}\n", ZIPLIST_BYTES(zl), ziplistLen(zl), ZIPLIST_TAIL_OFFSET(zl));
+    while (ziplistGet(p, &sval, &slen, &lval)) {
+        if (sval != NULL) {
+            printf("\t[str] %.*s\n", slen, sval);
+        } else {
+            printf("\t[int] %lld\n", lval);
+        }
+        p = ziplistNext(zl, p);
+    }
+}
+
+int mainziplist() {
+    unsigned char *zl = ziplistNew();
+    zl = ziplistPush(zl, (unsigned char *) "foo", 3, ZIPLIST_TAIL);
+    zl = ziplistPush(zl, (unsigned char *) "quux", 4, ZIPLIST_TAIL);
+    zl = ziplistPush(zl, (unsigned char *) "hello", 5, ZIPLIST_HEAD);
+    zl = ziplistPush(zl, (unsigned char *) "1024", 4, ZIPLIST_TAIL);
+    zl = ziplistPush(zl, (unsigned char *) "-7", 2, ZIPLIST_TAIL);
+    ziplistRepr(zl);
+
+    unsigned char *p = ziplistFind(ziplistIndex(zl, 0), (unsigned char *) "1024", 4, 0);
+    zl = ziplistDelete(zl, &p);
+    zl = ziplistDeleteRange(zl, 0, 1);
+    ziplistRepr(zl);
+    zfree(zl);
+    return 0;
+}
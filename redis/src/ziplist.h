@@ -0,0 +1,82 @@
+#ifndef _ZIPLIST_H_
+#define _ZIPLIST_H_
+
+#include <stdbool.h>
+
+/**
+ * ziplist: 把一组小的字符串/整数紧凑的存放在一块连续内存中.
+ * 每个 entry 只有 prevlen 和 encoding 两个变长的头部，整数直接以二进制存储，
+ * 省掉了 listNode 的两个指针以及每个元素的 robj 和 sds header.
+ *
+ * 代价是插入和删除需要 memmove, 所以只适合元素少且短的场景
+ */
+
+#define ZIPLIST_HEAD 0
+#define ZIPLIST_TAIL 1
+
+unsigned char *ziplistNew(void);
+
+/**
+ * 在头部或尾部添加一个元素, 可以解析成整数的字符串会以整数编码存储
+ * @param where ZIPLIST_HEAD or ZIPLIST_TAIL
+ * @return 新的 ziplist, 旧的指针可能已经失效
+ */
+unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int slen, int where);
+
+/**
+ * 返回第 index 个 entry 的指针, index 为负数表示从尾部往前数
+ * @return NULL if out of range
+ */
+unsigned char *ziplistIndex(unsigned char *zl, int index);
+
+/**
+ * @return p 的下一个/上一个 entry, 没有了返回 NULL
+ */
+unsigned char *ziplistNext(unsigned char *zl, unsigned char *p);
+unsigned char *ziplistPrev(unsigned char *zl, unsigned char *p);
+
+/**
+ * 读取 p 指向的 entry. 字符串编码时 *sval 和 *slen 有效, 整数编码时 *sval 为 NULL, 值在 *lval 中
+ * @return false if p is NULL or the end of ziplist
+ */
+bool ziplistGet(unsigned char *p, unsigned char **sval, unsigned int *slen, long long *lval);
+
+/**
+ * 在 p 之前插入一个元素
+ */
+unsigned char *ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen);
+
+/**
+ * 删除 *p 指向的 entry, 删除后 *p 指向原来的下一个 entry, 方便边遍历边删除
+ */
+unsigned char *ziplistDelete(unsigned char *zl, unsigned char **p);
+
+/**
+ * 从第 index 个 entry 开始删除 num 个
+ */
+unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num);
+
+/**
+ * 把 p 指向的 entry 替换成 s
+ */
+unsigned char *ziplistReplace(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen);
+
+/**
+ * p 指向的 entry 是否和 s 相等, 整数编码的 entry 会先把 s 解析成整数再比较
+ */
+bool ziplistCompare(unsigned char *p, unsigned char *s, unsigned int slen);
+
+/**
+ * 从 p 开始查找等于 vstr 的 entry, 每比较一个 entry 后跳过 skip 个(用于 field/value 交替存放的场景)
+ * @return NULL if not found
+ */
+unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int vlen, unsigned int skip);
+
+unsigned int ziplistLen(unsigned char *zl);
+
+/**
+ * ziplist 占用的总字节数
+ */
+size_t ziplistBlobLen(unsigned char *zl);
+
+#endif
@@ -1,19 +1,78 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "zmalloc.h"
 
-static size_t used_memory = 0;
+/**
+ * 拿不到 allocator 的 size 时, 额外申请 sizeof(size_t) 的内存用来保存本次申请的大小
+ */
+#ifdef HAVE_MALLOC_SIZE
+#define PREFIX_SIZE 0
+#else
+#define PREFIX_SIZE sizeof(size_t)
+#endif
 
 /**
- * 额外申请 sizeof(size_t) 的内存 用来保存本次申请的大小
+ * used_memory 按线程分片: 每个线程第一次分配内存时领一个 slot, 之后只更新自己的 slot,
+ * 每个 slot 独占一个 cache line, 多个线程同时分配内存时不会互相把对方的 cache line 踢掉.
+ * 读的时候把所有 slot 加起来.
+ *
+ * 线程数超过 slot 数时会有多个线程共享一个 slot, 所以更新仍然要用原子操作, 但只需要 relaxed.
+ * 一个线程申请的内存可能被另一个线程释放, 单个 slot 的值会 "变成负数",
+ * 无符号数回绕之后加起来的总和仍然是对的
  */
+#define ZMALLOC_CACHE_LINE 64
+#define ZMALLOC_USED_MEMORY_SLOTS 64
+
+typedef struct usedMemorySlot {
+    size_t used;
+    char padding[ZMALLOC_CACHE_LINE - sizeof(size_t)];
+} __attribute__((aligned(ZMALLOC_CACHE_LINE))) usedMemorySlot;
+
+static usedMemorySlot used_memory[ZMALLOC_USED_MEMORY_SLOTS];
+static unsigned int next_used_memory_slot = 0;
+static __thread int thread_used_memory_slot = -1;
+
+static inline size_t *currentUsedMemory(void) {
+    if (thread_used_memory_slot < 0) {
+        unsigned int slot = __atomic_fetch_add(&next_used_memory_slot, 1, __ATOMIC_RELAXED);
+        thread_used_memory_slot = slot % ZMALLOC_USED_MEMORY_SLOTS;
+    }
+    return &used_memory[thread_used_memory_slot].used;
+}
+
+static inline void updateStatAlloc(size_t n) {
+    __atomic_fetch_add(currentUsedMemory(), n, __ATOMIC_RELAXED);
+}
+
+static inline void updateStatFree(size_t n) {
+    __atomic_fetch_sub(currentUsedMemory(), n, __ATOMIC_RELAXED);
+}
+
+#ifndef HAVE_MALLOC_SIZE
+size_t zmalloc_size(void *ptr) {
+    void *realptr = (char *) ptr - PREFIX_SIZE;
+    return *((size_t *) realptr) + PREFIX_SIZE;
+}
+#endif
+
 void *zmalloc(size_t size) {
-    size_t cap = size + sizeof(size_t);
-    void *ptr = malloc(cap);
-    // todo: 这里不需要判断 ptr 是否为 NULL 吗
-    *((size_t*) ptr) = size;
-    used_memory += cap;
-    return ptr + sizeof(size_t);
+    void *ptr = malloc(size + PREFIX_SIZE);
+    if (ptr == NULL) {
+        return NULL;
+    }
+#ifdef HAVE_MALLOC_SIZE
+    updateStatAlloc(zmalloc_size(ptr));
+    return ptr;
+#else
+    *((size_t *) ptr) = size;
+    updateStatAlloc(size + PREFIX_SIZE);
+    return (char *) ptr + PREFIX_SIZE;
+#endif
 }
 
 /**
@@ -24,19 +83,30 @@ void *zrealloc(void *ptr, size_t size) {
         return zmalloc(size);
     }
 
-    void *realptr = ptr - sizeof(size_t);
+#ifdef HAVE_MALLOC_SIZE
+    size_t oldsize = zmalloc_size(ptr);
+    void *newptr = realloc(ptr, size);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    updateStatFree(oldsize);
+    updateStatAlloc(zmalloc_size(newptr));
+    return newptr;
+#else
+    void *realptr = (char *) ptr - PREFIX_SIZE;
     // 获取申请 ptr 时的大小
-    size_t oldsize = *((size_t*) realptr);
-    void *newptr = realloc(realptr, size + sizeof(size_t));
+    size_t oldsize = *((size_t *) realptr);
+    void *newptr = realloc(realptr, size + PREFIX_SIZE);
     if (newptr == NULL) {
         return NULL;
     }
 
-    *((size_t*) newptr) = size;
-    used_memory -= oldsize;
-    // 这里不需要再加 sizeof(size_t), 因此在申请 ptr 时已经加过了
-    used_memory += size;
-    return newptr + sizeof(size_t);
+    *((size_t *) newptr) = size;
+    // 不需要再算 PREFIX_SIZE, 申请 ptr 时已经加过了
+    updateStatFree(oldsize);
+    updateStatAlloc(size);
+    return (char *) newptr + PREFIX_SIZE;
+#endif
 }
 
 void zfree(void *ptr) {
@@ -44,10 +114,14 @@ void zfree(void *ptr) {
         return;
     }
 
-    void *realptr = ptr - sizeof(size_t);
-    size_t oldsize = *((size_t*)realptr);
-    used_memory -= oldsize + sizeof(size_t);
+#ifdef HAVE_MALLOC_SIZE
+    updateStatFree(zmalloc_size(ptr));
+    free(ptr);
+#else
+    void *realptr = (char *) ptr - PREFIX_SIZE;
+    updateStatFree(zmalloc_size(ptr));
     free(realptr);
+#endif
 }
 
 char *zstrdup(const char *s) {
@@ -59,25 +133,250 @@ char *zstrdup(const char *s) {
 }
 
 size_t zmalloc_used_memory(void) {
-    return used_memory;
+    size_t total = 0;
+    for (int i = 0; i < ZMALLOC_USED_MEMORY_SLOTS; i++) {
+        total += __atomic_load_n(&used_memory[i].used, __ATOMIC_RELAXED);
+    }
+    return total;
 }
 
-static size_t ptrSize(void *ptr) {
-    if (ptr == NULL) {
+size_t zmalloc_get_private_dirty(long pid) {
+#if defined(__linux__)
+    char path[64];
+    // smaps_rollup 已经汇总好了, 老内核上没有这个文件, 退回去遍历 smaps
+    const char *files[] = {"smaps_rollup", "smaps"};
+    FILE *fp = NULL;
+    for (int i = 0; i < 2 && fp == NULL; i++) {
+        if (pid == -1) {
+            snprintf(path, sizeof(path), "/proc/self/%s", files[i]);
+        } else {
+            snprintf(path, sizeof(path), "/proc/%ld/%s", pid, files[i]);
+        }
+        fp = fopen(path, "r");
+    }
+    if (fp == NULL) {
         return 0;
     }
+    char line[1024];
+    size_t bytes = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "Private_Dirty:", 14) == 0) {
+            bytes += strtoull(line + 14, NULL, 10) * 1024;
+        }
+    }
+    fclose(fp);
+    return bytes;
+#else
+    (void) pid;
+    return 0;
+#endif
+}
+
+/**
+ * /proc/self/stat 的第 24 个字段是 RSS 的页数
+ */
+size_t zmalloc_get_rss(void) {
+#if defined(__linux__)
+    FILE *fp = fopen("/proc/self/stat", "r");
+    if (fp == NULL) {
+        return zmalloc_used_memory();
+    }
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    // 第 2 个字段是 (comm), 里面可能有空格, 从最后一个 ')' 之后开始数
+    char *p = strrchr(buf, ')');
+    if (p == NULL) {
+        return zmalloc_used_memory();
+    }
+    int field = 2;
+    while (*p != '\0' && field < 24) {
+        if (*p++ == ' ') {
+            field++;
+        }
+    }
+    if (field != 24) {
+        return zmalloc_used_memory();
+    }
+    return strtoull(p, NULL, 10) * sysconf(_SC_PAGESIZE);
+#else
+    return zmalloc_used_memory();
+#endif
+}
+
+#if defined(USE_JEMALLOC)
+
+bool zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident) {
+    // 统计数据是 epoch 时的快照, 先刷新一下
+    uint64_t epoch = 1;
+    size_t sz = sizeof(epoch);
+    mallctl("epoch", &epoch, &sz, &epoch, sz);
+
+    sz = sizeof(size_t);
+    *allocated = *active = *resident = 0;
+    mallctl("stats.allocated", allocated, &sz, NULL, 0);
+    mallctl("stats.active", active, &sz, NULL, 0);
+    mallctl("stats.resident", resident, &sz, NULL, 0);
+    return true;
+}
+
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+
+/**
+ * glibc 没有 resident 的统计, 用 arena + mmap 的大小近似
+ */
+bool zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident) {
+    struct mallinfo2 mi = mallinfo2();
+    *allocated = mi.uordblks + mi.hblkhd;
+    *active = mi.arena + mi.hblkhd;
+    *resident = *active;
+    return true;
+}
+
+#else
+
+bool zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident) {
+    *allocated = *active = *resident = 0;
+    return false;
+}
+
+#endif
+
+#if defined(USE_JEMALLOC)
+
+/**
+ * experimental.utilization.query 的输出(jemalloc 5.2+), 描述 ptr 所在的 slab
+ */
+typedef struct extentUtilization {
+    size_t nfree;       // slab 中空闲的 region 数
+    size_t nregs;       // slab 中 region 的总数
+    size_t size;        // slab 的字节数
+    size_t bin_nfree;   // 同一个 size class 所有 slab 中空闲的 region 数
+    size_t bin_nregs;   // 同一个 size class 所有 slab 中 region 的总数
+    void *slabcur_addr; // 当前正在分配的 slab
+} extentUtilization;
+
+/**
+ * ptr 所在 slab 的利用率不高于这个 size class 的平均水平时才值得挪走.
+ * 满的 slab 和正在分配的 slab 挪了也空不出来, 大块内存独占 extent, 没有碎片
+ */
+static bool zmalloc_defrag_hint(void *ptr) {
+    extentUtilization util;
+    size_t sz = sizeof(util);
+    if (mallctl("experimental.utilization.query", &util, &sz, &ptr, sizeof(ptr)) != 0) {
+        return false;
+    }
+    if (util.nregs <= 1 || util.nfree == 0) {
+        return false;
+    }
+    char *slabcur = util.slabcur_addr;
+    if (slabcur != NULL && (char *) ptr >= slabcur && (char *) ptr < slabcur + util.size) {
+        return false;
+    }
+    return util.nfree * util.bin_nregs >= util.bin_nfree * util.nregs;
+}
 
-    return *((size_t*) (ptr - sizeof(size_t)));
+void *zmalloc_defrag_alloc(void *ptr) {
+    if (!zmalloc_defrag_hint(ptr)) {
+        return NULL;
+    }
+    // 绕过 tcache, 否则拿到的多半是刚释放的那块, 释放的旧内存也不会马上回到 slab 中
+    size_t size = zmalloc_size(ptr);
+    void *newptr = mallocx(size, MALLOCX_TCACHE_NONE);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    memcpy(newptr, ptr, size);
+    updateStatAlloc(zmalloc_size(newptr));
+    updateStatFree(size);
+    dallocx(ptr, MALLOCX_TCACHE_NONE);
+    return newptr;
 }
 
+void zmalloc_release_free_memory(void) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "arena.%d.purge", MALLCTL_ARENAS_ALL);
+    mallctl(cmd, NULL, NULL, NULL, 0);
+}
+
+#else
+
+/**
+ * 其他 allocator 不知道 ptr 所在页的利用率, 新申请的内存可能落在另一个同样稀疏的页上, 挪了也没用
+ */
+void *zmalloc_defrag_alloc(void *ptr) {
+    (void) ptr;
+    return NULL;
+}
+
+void zmalloc_release_free_memory(void) {
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+#endif
+
 // for test
 int main2() {
     void *p = zmalloc(8);
-    printf("Point address: %p, size: %zu\n", p, ptrSize(p));
+    printf("Point address: %p, size: %zu\n", p, zmalloc_size(p));
     *((int*)p) = 1024;
     printf("Value: %d\n", *((int*)p));
 
     zfree(p);
 
+    size_t allocated, active, resident;
+    if (zmalloc_get_allocator_info(&allocated, &active, &resident)) {
+        printf("allocator %s: allocated %zu, active %zu, resident %zu, rss %zu\n",
+               ZMALLOC_LIB, allocated, active, resident, zmalloc_get_rss());
+    }
+    return 0;
+}
+
+#define ZMALLOC_BENCH_OPS 2000000
+#define ZMALLOC_BENCH_BATCH 64
+
+static void *zmallocBenchThread(void *arg) {
+    unsigned int seed = (unsigned int) (size_t) arg;
+    void *ptrs[ZMALLOC_BENCH_BATCH];
+    for (int i = 0; i < ZMALLOC_BENCH_OPS / ZMALLOC_BENCH_BATCH; i++) {
+        for (int j = 0; j < ZMALLOC_BENCH_BATCH; j++) {
+            ptrs[j] = zmalloc(16 + rand_r(&seed) % 256);
+        }
+        for (int j = 0; j < ZMALLOC_BENCH_BATCH; j++) {
+            zfree(ptrs[j]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 多线程分配/释放的吞吐, 以及结束后 used_memory 是否回到初始值
+ */
+int mainzmallocbench() {
+    size_t before = zmalloc_used_memory();
+    for (int nthreads = 1; nthreads <= 16; nthreads *= 2) {
+        pthread_t tids[16];
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        for (int i = 0; i < nthreads; i++) {
+            pthread_create(&tids[i], NULL, zmallocBenchThread, (void *) (size_t) (i + 1));
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        gettimeofday(&end, NULL);
+
+        long long us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+        double mops = (double) nthreads * ZMALLOC_BENCH_OPS * 2 / us;
+        printf("%2d threads: %lld ms, %.2f M zmalloc+zfree/s, used_memory %zu (expected %zu)\n",
+               nthreads, us / 1000, mops, zmalloc_used_memory(), before);
+        if (zmalloc_used_memory() != before) {
+            return 1;
+        }
+    }
     return 0;
 }
@@ -1,14 +1,70 @@
 #ifndef _ZMALLOC_H
 #define _ZMALLOC_H
 
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * allocator 能告诉我们一块内存实际有多大时(malloc_usable_size), 不再在每块内存前面放 size_t,
+ * used_memory 统计的也是 allocator 实际分出去的大小, 而不是申请的大小.
+ * Linux 上默认静态链接 deps/jemalloc 下随源码分发的 jemalloc, make USE_JEMALLOC=no 时使用 libc malloc
+ */
+#if defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#define ZMALLOC_LIB "jemalloc"
+#define HAVE_MALLOC_SIZE 1
+#define HAVE_DEFRAG 1
+#define zmalloc_size(p) malloc_usable_size(p)
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#define ZMALLOC_LIB "libc"
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_usable_size(p)
+#else
+#define ZMALLOC_LIB "libc"
+size_t zmalloc_size(void *ptr);
+#endif
+
 void *zmalloc(size_t size);
 
 void *zrealloc(void *ptr, size_t size);
 
-void *zfree(void *ptr);
+void zfree(void *ptr);
 
 char *zstrdup(const char *s);
 
 size_t zmalloc_used_memory(void);
 
-#endif
\ No newline at end of file
+/**
+ * 进程的 RSS, 拿不到时返回 zmalloc_used_memory()
+ */
+size_t zmalloc_get_rss(void);
+
+/**
+ * pid 进程所有映射的 Private_Dirty 之和(字节), pid 为 -1 表示当前进程.
+ * fork 出来的子进程中, 这就是被写时复制的内存. 拿不到时返回 0
+ */
+size_t zmalloc_get_private_dirty(long pid);
+
+/**
+ * allocator 自己的统计
+ * allocated: 分配给应用的字节数
+ * active:    allocator 为此占用的页(包括页内的碎片)
+ * resident:  allocator 占用的物理内存(包括元数据和还没有还给系统的空闲页)
+ * @return false 当前的 allocator 不支持
+ */
+bool zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+
+/**
+ * 碎片整理: allocator 认为 ptr 值得挪动时, 申请一块新内存把内容拷过去并释放 ptr.
+ * 需要 allocator 提供 ptr 所在页的利用率, 只有 jemalloc 支持(HAVE_DEFRAG), 其他 allocator 总是返回 NULL
+ * @return 新的地址, 调用者负责修正所有指向 ptr 的指针; 不需要挪动时返回 NULL, ptr 保持不变
+ */
+void *zmalloc_defrag_alloc(void *ptr);
+
+/**
+ * 把 allocator 中空闲的页还给操作系统
+ */
+void zmalloc_release_free_memory(void);
+
+#endif